@@ -0,0 +1,245 @@
+/*---[Bench.cpp]-----------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::bench::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+// Self
+#include "Bench.h"
+
+namespace knorba {
+namespace bench {
+
+//\/ Samples /\////////////////////////////////////////////////////////////////
+
+// --- (DE)CONSTRUCTORS --- //
+
+  /**
+   * Constructor.
+   *
+   * @param capacity Number of samples to reserve room for.
+   */
+
+  Samples::Samples(int capacity) {
+    _values.reserve(capacity);
+    _isSorted = true;
+  }
+
+
+// --- METHODS --- //
+
+  /**
+   * Adds a sample.
+   */
+
+  void Samples::add(kf_int64_t nanos) {
+    _values.push_back(nanos);
+    _isSorted = false;
+  }
+
+
+  /**
+   * Adds all samples of the given set.
+   */
+
+  void Samples::add(const Samples& other) {
+    _values.insert(_values.end(), other._values.begin(), other._values.end());
+    _isSorted = false;
+  }
+
+
+  /**
+   * Returns the number of samples.
+   */
+
+  int Samples::getCount() const {
+    return (int)_values.size();
+  }
+
+
+  /**
+   * Returns the smallest sample not exceeded by the given fraction of all
+   * samples, e.g. 0.99 for the 99th percentile. Returns 0 if there is no
+   * sample.
+   */
+
+  kf_int64_t Samples::getPercentile(double p) {
+    if(_values.empty()) {
+      return 0;
+    }
+
+    if(!_isSorted) {
+      sort(_values.begin(), _values.end());
+      _isSorted = true;
+    }
+
+    int n = (int)_values.size();
+    int index = (int)(p * n + 0.999999) - 1;
+    if(index < 0) {
+      index = 0;
+    } else if(index >= n) {
+      index = n - 1;
+    }
+
+    return _values[index];
+  }
+
+
+//\/ Reporting /\//////////////////////////////////////////////////////////////
+
+  static bool _isJson = false;
+
+
+  /**
+   * Selects the output format of report(). By default results are printed
+   * as a table; if set, as one JSON object per line.
+   */
+
+  void setJsonOutput(bool value) {
+    _isJson = value;
+  }
+
+
+  static void printResult(const string& name, const string& param,
+      kf_int64_t nOps, kf_int64_t nanos, Samples* latencies, kf_int64_t nLost)
+  {
+    double nsPerOp = nOps == 0 ? 0 : (double)nanos / (double)nOps;
+    double opsPerSec = nanos == 0 ? 0 : 1e9 * (double)nOps / (double)nanos;
+
+    if(_isJson) {
+      printf("{\"name\": \"%s\", \"param\": \"%s\", \"ops\": %lld, "
+          "\"ns\": %lld, \"ns_per_op\": %.2f, \"ops_per_sec\": %.0f",
+          name.c_str(), param.c_str(), (long long)nOps, (long long)nanos,
+          nsPerOp, opsPerSec);
+
+      if(latencies != NULL) {
+        printf(", \"p50_ns\": %lld, \"p99_ns\": %lld, \"p999_ns\": %lld, "
+            "\"lost\": %lld",
+            (long long)latencies->getPercentile(0.5),
+            (long long)latencies->getPercentile(0.99),
+            (long long)latencies->getPercentile(0.999),
+            (long long)nLost);
+      }
+
+      printf("}\n");
+    } else {
+      printf("%-24s %-16s %12lld ops %10.2f ns/op %14.0f ops/s",
+          name.c_str(), param.c_str(), (long long)nOps, nsPerOp, opsPerSec);
+
+      if(latencies != NULL) {
+        printf("  p50 %9lld  p99 %9lld  p999 %9lld ns",
+            (long long)latencies->getPercentile(0.5),
+            (long long)latencies->getPercentile(0.99),
+            (long long)latencies->getPercentile(0.999));
+        if(nLost > 0) {
+          printf("  %lld lost", (long long)nLost);
+        }
+      }
+
+      printf("\n");
+    }
+
+    fflush(stdout);
+  }
+
+
+  /**
+   * Prints the result of a benchmark.
+   *
+   * @param name Name of the benchmark.
+   * @param param Parameters the benchmark was run with.
+   * @param nOps Number of operations performed.
+   * @param nanos Total time taken, in nanoseconds.
+   */
+
+  void report(const string& name, const string& param, kf_int64_t nOps,
+      kf_int64_t nanos)
+  {
+    printResult(name, param, nOps, nanos, NULL, 0);
+  }
+
+
+  /**
+   * Prints the result of a benchmark, along with the 50th, 99th and 99.9th
+   * percentiles of the given latencies.
+   *
+   * @param name Name of the benchmark.
+   * @param param Parameters the benchmark was run with.
+   * @param nOps Number of operations performed.
+   * @param nanos Total time taken, in nanoseconds.
+   * @param latencies Latency of each operation.
+   * @param nLost Number of messages sent but never received.
+   */
+
+  void report(const string& name, const string& param, kf_int64_t nOps,
+      kf_int64_t nanos, Samples& latencies, kf_int64_t nLost)
+  {
+    printResult(name, param, nOps, nanos, &latencies, nLost);
+  }
+
+} // namespace bench
+} // namespace knorba
+
+
+/**
+ * Usage: knorba-bench [--json] [dispatch] [messaging] [type]
+ *
+ * Runs the given suites, or all of them if none is given.
+ */
+
+int main(int argc, char** argv) {
+  bool isDispatch = false;
+  bool isMessaging = false;
+  bool isType = false;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--json") == 0) {
+      knorba::bench::setJsonOutput(true);
+    } else if(strcmp(argv[i], "dispatch") == 0) {
+      isDispatch = true;
+    } else if(strcmp(argv[i], "messaging") == 0) {
+      isMessaging = true;
+    } else if(strcmp(argv[i], "type") == 0) {
+      isType = true;
+    } else {
+      fprintf(stderr, "Usage: %s [--json] [dispatch] [messaging] [type]\n",
+          argv[0]);
+      return 1;
+    }
+  }
+
+  if(!isDispatch && !isMessaging && !isType) {
+    isDispatch = true;
+    isMessaging = true;
+    isType = true;
+  }
+
+  if(isDispatch) {
+    knorba::bench::runDispatchBench();
+  }
+
+  if(isMessaging) {
+    knorba::bench::runMessagingBench();
+  }
+
+  if(isType) {
+    knorba::bench::runTypeBench();
+  }
+
+  return 0;
+}
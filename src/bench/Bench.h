@@ -0,0 +1,89 @@
+/*---[Bench.h]-------------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::bench::*
+ |  Implements: knorba::bench::getTimeInNanoseconds()
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_BENCH_BENCH_H
+#define KNORBA_BENCH_BENCH_H
+
+// Std
+#include <time.h>
+#include <string>
+#include <vector>
+
+// KFoundation
+#include <kfoundation/definitions.h>
+
+namespace knorba {
+namespace bench {
+
+  using namespace std;
+  using namespace kfoundation;
+
+
+  /**
+   * Returns monotonic time in nanoseconds.
+   */
+
+  inline kf_int64_t getTimeInNanoseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (kf_int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+
+
+  /**
+   * Collects latency samples, in nanoseconds, and computes percentiles over
+   * them. Not thread-safe; use one per thread and merge them with add().
+   */
+
+  class Samples {
+
+  // --- FIELDS --- //
+
+    private: vector<kf_int64_t> _values;
+    private: bool _isSorted;
+
+
+  // --- (DE)CONSTRUCTORS --- //
+
+    public: Samples(int capacity = 0);
+
+
+  // --- METHODS --- //
+
+    public: void add(kf_int64_t nanos);
+    public: void add(const Samples& other);
+    public: int getCount() const;
+    public: kf_int64_t getPercentile(double p);
+
+  };
+
+
+  void setJsonOutput(bool value);
+
+  void report(const string& name, const string& param, kf_int64_t nOps,
+      kf_int64_t nanos);
+
+  void report(const string& name, const string& param, kf_int64_t nOps,
+      kf_int64_t nanos, Samples& latencies, kf_int64_t nLost = 0);
+
+  void runDispatchBench();
+  void runMessagingBench();
+  void runTypeBench();
+
+} // namespace bench
+} // namespace knorba
+
+#endif /* defined(KNORBA_BENCH_BENCH_H) */
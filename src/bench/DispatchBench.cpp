@@ -0,0 +1,265 @@
+/*---[DispatchBench.cpp]---------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::bench::runDispatchBench()
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Int.h>
+
+// Internal
+#include <knorba/Agent.h>
+#include <knorba/LocalRuntime.h>
+#include <knorba/Message.h>
+#include <knorba/Protocol.h>
+#include <knorba/type/KLongint.h>
+#include <knorba/type/KString.h>
+#include "NullRuntime.h"
+
+// Self
+#include "Bench.h"
+
+#define N_OPCODES_PER_PROTOCOL 8
+#define N_LOOKUPS 4000000
+#define N_DELIVERIES 400000
+
+namespace knorba {
+namespace bench {
+
+  static const SPtr<KString> OP_START = KS("bench.dispatch.start");
+
+
+  /**
+   * Protocol with a number of opcodes that do nothing. If given a Samples,
+   * records the latency of each message, which should carry the time it was
+   * sent.
+   */
+
+  class BenchProtocol : public Protocol {
+    public: Samples* latencies;
+    public: int nReceived;
+    public: kf_int64_t last;
+    public: BenchProtocol(Agent* owner, int index);
+    public: void handle(PPtr<Message> msg);
+  };
+
+
+  BenchProtocol::BenchProtocol(Agent* owner, int index)
+  : Protocol(owner)
+  {
+    latencies = NULL;
+    nReceived = 0;
+    last = 0;
+
+    for(int i = 0; i < N_OPCODES_PER_PROTOCOL; i++) {
+      registerHandler((phandler_t)&BenchProtocol::handle,
+          KS("bench.p" + Int::toString(index) + ".op" + Int::toString(i)));
+    }
+  }
+
+
+  void BenchProtocol::handle(PPtr<Message> msg) {
+    if(latencies != NULL) {
+      last = getTimeInNanoseconds();
+      latencies->add(last - msg->getLongintPayload());
+      nReceived++;
+    }
+  }
+
+
+  /**
+   * Passive agent to attach protocols to. Also exposes the dispatch table
+   * lookup, to be timed while the agent does not run.
+   */
+
+  class ProtocolHost : public Agent {
+    public: ProtocolHost(Runtime& rt, const k_guid_t& guid);
+    public: void prepare();
+    public: bool lookup(const k_longint_t hash);
+  };
+
+
+  ProtocolHost::ProtocolHost(Runtime& rt, const k_guid_t& guid)
+  : Agent(rt, guid)
+  {
+    setPassive();
+  }
+
+
+  void ProtocolHost::prepare() {
+    buildDispatchTable();
+  }
+
+
+  bool ProtocolHost::lookup(const k_longint_t hash) {
+    return hasHandlerForOpcodeHash(hash);
+  }
+
+
+  /**
+   * Sends messages with the opcodes of the first protocol to the given
+   * agent on start, as fast as it can.
+   */
+
+  class OpcodeSource : public Agent {
+    public: k_guid_t target;
+    public: OpcodeSource(Runtime& rt, const k_guid_t& guid);
+    public: void onStart(PPtr<Message> msg);
+  };
+
+
+  OpcodeSource::OpcodeSource(Runtime& rt, const k_guid_t& guid)
+  : Agent(rt, guid)
+  {
+    registerHandler((handler_t)&OpcodeSource::onStart, OP_START);
+  }
+
+
+  void OpcodeSource::onStart(PPtr<Message> msg) {
+    Ptr<KString> opcodes[N_OPCODES_PER_PROTOCOL];
+    for(int i = 0; i < N_OPCODES_PER_PROTOCOL; i++) {
+      opcodes[i] = KS("bench.p0.op" + Int::toString(i));
+    }
+
+    for(int i = 0; i < N_DELIVERIES; i++) {
+      send(target, opcodes[i % N_OPCODES_PER_PROTOCOL],
+          new KLongint(getTimeInNanoseconds()));
+    }
+
+    quit();
+  }
+
+
+  /**
+   * Looks up the given opcode the way Agent did before the dispatch table:
+   * the agent's own handlers first, then protocols, latest first.
+   */
+
+  static bool walkProtocols(vector<BenchProtocol*>& protocols,
+      const k_longint_t hash)
+  {
+    for(int i = (int)protocols.size() - 1; i >= 0; i--) {
+      if(protocols[i]->getHandlerForOpcodeHash(hash) != NULL
+          || protocols[i]->getBatchHandlerForOpcodeHash(hash) != NULL)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+
+  static void benchDispatch(int nProtocols) {
+    NullRuntime rt;
+    k_guid_t guid;
+    memset(&guid, 0, sizeof(k_guid_t));
+    ProtocolHost* agent = new ProtocolHost(rt, guid);
+
+    vector<BenchProtocol*> protocols;
+    for(int i = 0; i < nProtocols; i++) {
+      protocols.push_back(new BenchProtocol(agent, i));
+    }
+
+    // Opcodes of the first protocol are the worst case for the walk.
+    k_longint_t hashes[N_OPCODES_PER_PROTOCOL];
+    for(int i = 0; i < N_OPCODES_PER_PROTOCOL; i++) {
+      hashes[i] = KS("bench.p0.op" + Int::toString(i))->getHashCode();
+    }
+
+    string param = Int::toString(nProtocols) + " protocols";
+    int nFound = 0;
+
+    kf_int64_t begin = getTimeInNanoseconds();
+    for(int i = 0; i < N_LOOKUPS; i++) {
+      nFound += walkProtocols(protocols,
+          hashes[i % N_OPCODES_PER_PROTOCOL]) ? 1 : 0;
+    }
+    report("dispatch.walk", param, N_LOOKUPS, getTimeInNanoseconds() - begin);
+
+    agent->prepare();
+    begin = getTimeInNanoseconds();
+    for(int i = 0; i < N_LOOKUPS; i++) {
+      nFound += agent->lookup(
+          hashes[i % N_OPCODES_PER_PROTOCOL]) ? 1 : 0;
+    }
+    report("dispatch.table", param, N_LOOKUPS,
+        getTimeInNanoseconds() - begin);
+
+    if(nFound != 2 * N_LOOKUPS) {
+      printf("dispatch: %d lookups failed\n", 2 * N_LOOKUPS - nFound);
+    }
+
+    for(int i = nProtocols - 1; i >= 0; i--) {
+      delete protocols[i];
+    }
+    delete agent;
+  }
+
+
+  /**
+   * Delivers messages end to end, through a LocalRuntime, to an agent with
+   * the given number of protocols.
+   */
+
+  static void benchDelivery(int nProtocols) {
+    LocalRuntime rt;
+    OpcodeSource* source = rt.createAgent<OpcodeSource>("source");
+    ProtocolHost* host = rt.createAgent<ProtocolHost>("host");
+    source->target = host->getGuid();
+
+    Samples latencies(N_DELIVERIES);
+    vector<BenchProtocol*> protocols;
+    for(int i = 0; i < nProtocols; i++) {
+      protocols.push_back(new BenchProtocol(host, i));
+    }
+    protocols[0]->latencies = &latencies;
+
+    kf_int64_t begin = getTimeInNanoseconds();
+    rt.send(rt.getGuid(), source->getGuid(), OP_START->getHashCode(),
+        KValue::NOTHING, -1);
+    rt.run();
+
+    report("dispatch.deliver", Int::toString(nProtocols) + " protocols",
+        protocols[0]->nReceived, protocols[0]->last - begin, latencies,
+        N_DELIVERIES - protocols[0]->nReceived);
+
+    for(int i = nProtocols - 1; i >= 0; i--) {
+      delete protocols[i];
+    }
+  }
+
+
+  /**
+   * Measures the cost of finding the handler for an incoming message with
+   * 1, 10 and 50 protocols registered, by itself and as part of delivering
+   * the message.
+   */
+
+  void runDispatchBench() {
+    benchDispatch(1);
+    benchDispatch(10);
+    benchDispatch(50);
+
+    benchDelivery(1);
+    benchDelivery(10);
+    benchDelivery(50);
+  }
+
+} // namespace bench
+} // namespace knorba
@@ -0,0 +1,454 @@
+/*---[MessagingBench.cpp]--------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::bench::runMessagingBench()
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <vector>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Int.h>
+
+// Internal
+#include <knorba/Agent.h>
+#include <knorba/ClusterEmulator.h>
+#include <knorba/Group.h>
+#include <knorba/LocalRuntime.h>
+#include <knorba/Message.h>
+#include <knorba/type/KLongint.h>
+#include <knorba/type/KString.h>
+
+// Self
+#include "Bench.h"
+
+#define N_ROUNDS 100000
+#define N_TSEND_ROUNDS 50000
+#define N_FAN_MESSAGES 400000
+#define N_QUEUE_FULL_MESSAGES 100000
+#define SLOW_HANDLER_NANOS 2000
+
+namespace knorba {
+namespace bench {
+
+  static const SPtr<KString> OP_START = KS("bench.start");
+  static const SPtr<KString> OP_PING  = KS("bench.ping");
+  static const SPtr<KString> OP_PONG  = KS("bench.pong");
+  static const SPtr<KString> OP_DATA  = KS("bench.data");
+
+
+  /**
+   * Responds to each ping with a pong carrying the same payload.
+   */
+
+  class Echo : public Agent {
+    public: Echo(Runtime& rt, const k_guid_t& guid);
+    public: void onPing(PPtr<Message> msg);
+  };
+
+
+  Echo::Echo(Runtime& rt, const k_guid_t& guid)
+  : Agent(rt, guid)
+  {
+    registerHandler((handler_t)&Echo::onPing, OP_PING);
+    setPassive();
+  }
+
+
+  void Echo::onPing(PPtr<Message> msg) {
+    respond(msg, OP_PONG, new KLongint(msg->getLongintPayload()));
+  }
+
+
+  /**
+   * Sends a ping on start and on each pong, until the given number of
+   * rounds is reached. Each ping carries the time it was sent.
+   */
+
+  class Pinger : public Agent {
+    public: k_guid_t peer;
+    public: int nRounds;
+    public: int nDone;
+    public: kf_int64_t begin;
+    public: kf_int64_t end;
+    public: Samples latencies;
+    public: Pinger(Runtime& rt, const k_guid_t& guid);
+    public: void onStart(PPtr<Message> msg);
+    public: void onPong(PPtr<Message> msg);
+  };
+
+
+  Pinger::Pinger(Runtime& rt, const k_guid_t& guid)
+  : Agent(rt, guid),
+    latencies(N_ROUNDS)
+  {
+    registerHandler((handler_t)&Pinger::onStart, OP_START);
+    registerHandler((handler_t)&Pinger::onPong, OP_PONG);
+    nRounds = 0;
+    nDone = 0;
+    begin = 0;
+    end = 0;
+  }
+
+
+  void Pinger::onStart(PPtr<Message> msg) {
+    begin = getTimeInNanoseconds();
+    send(peer, OP_PING, new KLongint(begin));
+  }
+
+
+  void Pinger::onPong(PPtr<Message> msg) {
+    kf_int64_t now = getTimeInNanoseconds();
+    latencies.add(now - msg->getLongintPayload());
+
+    if(++nDone == nRounds) {
+      end = now;
+      quit();
+      return;
+    }
+
+    send(peer, OP_PING, new KLongint(now));
+  }
+
+
+  /**
+   * Sends pings with tsend() in a loop.
+   */
+
+  class TPinger : public Agent {
+    public: k_guid_t peer;
+    public: int nRounds;
+    public: int nDone;
+    public: kf_int64_t begin;
+    public: kf_int64_t end;
+    public: Samples latencies;
+    public: TPinger(Runtime& rt, const k_guid_t& guid);
+    public: void onStart(PPtr<Message> msg);
+  };
+
+
+  TPinger::TPinger(Runtime& rt, const k_guid_t& guid)
+  : Agent(rt, guid),
+    latencies(N_TSEND_ROUNDS)
+  {
+    registerHandler((handler_t)&TPinger::onStart, OP_START);
+    nRounds = 0;
+    nDone = 0;
+    begin = 0;
+    end = 0;
+  }
+
+
+  void TPinger::onStart(PPtr<Message> msg) {
+    begin = getTimeInNanoseconds();
+    for(int i = 0; i < nRounds; i++) {
+      kf_int64_t t = getTimeInNanoseconds();
+      Ptr<Message> response = tsend(peer, OP_PING, new KLongint(t));
+      if(!response.isNull()) {
+        latencies.add(getTimeInNanoseconds() - t);
+        nDone++;
+      }
+    }
+    end = getTimeInNanoseconds();
+    quit();
+  }
+
+
+  /**
+   * Sends the given number of messages to the given group on start, as fast
+   * as it can. Each message carries the time it was sent.
+   */
+
+  class Source : public Agent {
+    public: Ptr<Group> targets;
+    public: int nMessages;
+    public: Source(Runtime& rt, const k_guid_t& guid);
+    public: void onStart(PPtr<Message> msg);
+  };
+
+
+  Source::Source(Runtime& rt, const k_guid_t& guid)
+  : Agent(rt, guid)
+  {
+    registerHandler((handler_t)&Source::onStart, OP_START);
+    nMessages = 0;
+  }
+
+
+  void Source::onStart(PPtr<Message> msg) {
+    for(int i = 0; i < nMessages; i++) {
+      send(targets.AS(Group), OP_DATA,
+          new KLongint(getTimeInNanoseconds()));
+    }
+    quit();
+  }
+
+
+  /**
+   * Records the latency of each message it receives, optionally spending
+   * the given time on each. Passive, unless told how many messages to
+   * expect, in which case it quits once all have arrived.
+   */
+
+  class Sink : public Agent {
+    public: int nReceived;
+    public: kf_int64_t last;
+    public: kf_int64_t delay;
+    public: int nExpected;
+    public: Samples latencies;
+    public: Sink(Runtime& rt, const k_guid_t& guid);
+    public: void setPolicy(Mailbox::overflow_policy_t policy, int size);
+    public: void expect(int n);
+    public: void onData(PPtr<Message> msg);
+  };
+
+
+  Sink::Sink(Runtime& rt, const k_guid_t& guid)
+  : Agent(rt, guid)
+  {
+    registerHandler((handler_t)&Sink::onData, OP_DATA);
+    setPassive();
+    nReceived = 0;
+    last = 0;
+    delay = 0;
+    nExpected = 0;
+  }
+
+
+  void Sink::setPolicy(Mailbox::overflow_policy_t policy, int size) {
+    setQueueSize(size, size);
+    setOverflowPolicy(policy, Mailbox::DEFAULT_BLOCK_TIMEOUT);
+  }
+
+
+  void Sink::expect(int n) {
+    nExpected = n;
+    setPassive(false);
+  }
+
+
+  void Sink::onData(PPtr<Message> msg) {
+    kf_int64_t now = getTimeInNanoseconds();
+    latencies.add(now - msg->getLongintPayload());
+    nReceived++;
+
+    if(delay > 0) {
+      while(getTimeInNanoseconds() - now < delay) {
+        // Busy
+      }
+      now = getTimeInNanoseconds();
+    }
+
+    last = now;
+
+    if(nReceived == nExpected) {
+      quit();
+    }
+  }
+
+
+  static void benchPingPong() {
+    LocalRuntime rt;
+    Pinger* pinger = rt.createAgent<Pinger>("pinger");
+    Echo* echo = rt.createAgent<Echo>("echo");
+    pinger->peer = echo->getGuid();
+    pinger->nRounds = N_ROUNDS;
+
+    rt.send(rt.getGuid(), pinger->getGuid(), OP_START->getHashCode(),
+        KValue::NOTHING, -1);
+    rt.run();
+
+    report("messaging.pingpong", "unicast", pinger->nDone,
+        pinger->end - pinger->begin, pinger->latencies,
+        N_ROUNDS - pinger->nDone);
+  }
+
+
+  static void benchTsend() {
+    LocalRuntime rt;
+    TPinger* pinger = rt.createAgent<TPinger>("pinger");
+    Echo* echo = rt.createAgent<Echo>("echo");
+    pinger->peer = echo->getGuid();
+    pinger->nRounds = N_TSEND_ROUNDS;
+
+    rt.send(rt.getGuid(), pinger->getGuid(), OP_START->getHashCode(),
+        KValue::NOTHING, -1);
+    rt.run();
+
+    report("messaging.tsend", "round-trip", pinger->nDone,
+        pinger->end - pinger->begin, pinger->latencies,
+        N_TSEND_ROUNDS - pinger->nDone);
+  }
+
+
+  /**
+   * Runs the given sources, waits for all of them to quit, and reports the
+   * throughput and latency observed by the given sinks.
+   */
+
+  static void runSources(LocalRuntime& rt, const string& name,
+      const string& param, vector<Source*>& sources, vector<Sink*>& sinks,
+      kf_int64_t nExpected)
+  {
+    kf_int64_t begin = getTimeInNanoseconds();
+    for(int i = 0; i < (int)sources.size(); i++) {
+      rt.send(rt.getGuid(), sources[i]->getGuid(), OP_START->getHashCode(),
+          KValue::NOTHING, -1);
+    }
+    rt.run();
+
+    Samples latencies((int)nExpected);
+    kf_int64_t nReceived = 0;
+    kf_int64_t end = begin;
+    for(int i = 0; i < (int)sinks.size(); i++) {
+      latencies.add(sinks[i]->latencies);
+      nReceived += sinks[i]->nReceived;
+      if(sinks[i]->last > end) {
+        end = sinks[i]->last;
+      }
+    }
+
+    report(name, param, nReceived, end - begin, latencies,
+        nExpected - nReceived);
+  }
+
+
+  /**
+   * One source multicasts to a group of the given size.
+   */
+
+  static void benchFanOut(int nSinks) {
+    LocalRuntime rt;
+    Source* source = rt.createAgent<Source>("source");
+    source->targets = new Group();
+    source->nMessages = N_FAN_MESSAGES / nSinks;
+
+    vector<Sink*> sinks;
+    for(int i = 0; i < nSinks; i++) {
+      Sink* sink = rt.createAgent<Sink>("sink" + Int::toString(i));
+      source->targets->add(sink->getGuid());
+      sinks.push_back(sink);
+    }
+
+    vector<Source*> sources(1, source);
+    runSources(rt, "messaging.fanout", "group " + Int::toString(nSinks),
+        sources, sinks, (kf_int64_t)source->nMessages * nSinks);
+  }
+
+
+  /**
+   * One source multicasts to a group spread over the nodes of a
+   * ClusterEmulator. Each message crosses to each other node as one frame.
+   * Sinks wait for all messages, since those still in transit when the
+   * source quits would otherwise be dropped.
+   */
+
+  static void benchClusterFanOut(int nSinks, int nNodes) {
+    ClusterEmulator rt(nNodes, true);
+    Source* source = rt.createAgent<Source>("source");
+    source->targets = new Group();
+    source->nMessages = N_FAN_MESSAGES / nSinks;
+
+    vector<Sink*> sinks;
+    for(int i = 0; i < nSinks; i++) {
+      Sink* sink = rt.createAgent<Sink>("sink" + Int::toString(i),
+          i % nNodes);
+      sink->expect(source->nMessages);
+      source->targets->add(sink->getGuid());
+      sinks.push_back(sink);
+    }
+
+    vector<Source*> sources(1, source);
+    runSources(rt, "messaging.cluster-fanout", "group "
+        + Int::toString(nSinks) + " on " + Int::toString(nNodes) + " nodes",
+        sources, sinks, (kf_int64_t)source->nMessages * nSinks);
+  }
+
+
+  /**
+   * The given number of sources send to a single sink.
+   */
+
+  static void benchFanIn(int nSources) {
+    LocalRuntime rt;
+    Sink* sink = rt.createAgent<Sink>("sink");
+    Ptr<Group> targets = new Group();
+    targets->add(sink->getGuid());
+
+    vector<Source*> sources;
+    for(int i = 0; i < nSources; i++) {
+      Source* source = rt.createAgent<Source>("source" + Int::toString(i));
+      source->targets = targets;
+      source->nMessages = N_FAN_MESSAGES / nSources;
+      sources.push_back(source);
+    }
+
+    vector<Sink*> sinks(1, sink);
+    runSources(rt, "messaging.fanin", Int::toString(nSources) + " senders",
+        sources, sinks, (kf_int64_t)sources[0]->nMessages * nSources);
+  }
+
+
+  /**
+   * A source floods a slow sink with a small queue, under the given
+   * overflow policy.
+   */
+
+  static void benchQueueFull(Mailbox::overflow_policy_t policy,
+      const string& param)
+  {
+    LocalRuntime rt;
+    Source* source = rt.createAgent<Source>("source");
+    Sink* sink = rt.createAgent<Sink>("sink");
+    sink->setPolicy(policy, 64);
+    sink->delay = SLOW_HANDLER_NANOS;
+    source->targets = new Group();
+    source->targets->add(sink->getGuid());
+    source->nMessages = N_QUEUE_FULL_MESSAGES;
+
+    vector<Source*> sources(1, source);
+    vector<Sink*> sinks(1, sink);
+    runSources(rt, "messaging.queuefull", param, sources, sinks,
+        N_QUEUE_FULL_MESSAGES);
+  }
+
+
+  /**
+   * Measures latency and throughput of messages between agents running on
+   * a LocalRuntime: unicast ping-pong, tsend() round-trip, fan-out to and
+   * fan-in from groups of 1, 8 and 64 agents, fan-out to 1000 agents on 16
+   * emulated nodes, and flooding a slow agent under each overflow policy.
+   */
+
+  void runMessagingBench() {
+    benchPingPong();
+    benchTsend();
+
+    benchFanOut(1);
+    benchFanOut(8);
+    benchFanOut(64);
+    benchClusterFanOut(1000, 16);
+
+    benchFanIn(1);
+    benchFanIn(8);
+    benchFanIn(64);
+
+    benchQueueFull(Mailbox::BLOCK, "block");
+    benchQueueFull(Mailbox::DROP_OLDEST, "drop-oldest");
+    benchQueueFull(Mailbox::DROP_NEWEST, "drop-newest");
+    benchQueueFull(Mailbox::THROTTLE, "throttle");
+  }
+
+} // namespace bench
+} // namespace knorba
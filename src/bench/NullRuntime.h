@@ -0,0 +1,156 @@
+/*---[NullRuntime.h]-------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::bench::NullRuntime::*
+ |  Implements: knorba::bench::NullRuntime::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_BENCH_NULLRUNTIME_H
+#define KNORBA_BENCH_NULLRUNTIME_H
+
+// Std
+#include <cstring>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Path.h>
+
+// Internal
+#include <knorba/Runtime.h>
+#include <knorba/type/KType.h>
+#include <knorba/type/KString.h>
+
+namespace knorba {
+namespace bench {
+
+  /**
+   * Runtime that drops all messages. Enough to construct agents and exercise
+   * code paths that do not involve other agents.
+   */
+
+  class NullRuntime : public Runtime {
+
+  // --- FIELDS --- //
+
+    private: k_guid_t _guid;
+    private: string _name;
+
+
+  // --- (DE)CONSTRUCTORS --- //
+
+    public: NullRuntime()
+    : _name("bench")
+    {
+      memset(&_guid, 0, sizeof(k_guid_t));
+    }
+
+
+  // --- METHODS --- //
+
+    public: const k_guid_t& getGuid() const {
+      return _guid;
+    }
+
+    public: void registerType(PPtr<KType> type) {
+      // Nothing;
+    }
+
+    public: PPtr<KType> getTypeByHash(const k_longint_t hash) const {
+      return PPtr<KType>();
+    }
+
+    public: const k_guid_t& getConsoleGuid() const {
+      return _guid;
+    }
+
+    public: const string& getAppName() const {
+      return _name;
+    }
+
+    public: k_integer_t getNodeCount() const {
+      return 1;
+    }
+
+    public: bool isHead() const {
+      return true;
+    }
+
+    public: void signalQuit() {
+      // Nothing;
+    }
+
+    public: PPtr<Path> getResourcePathForAgent(const Agent* itself) const {
+      return PPtr<Path>();
+    }
+
+    public: PPtr<Path> getDataPathForAgent(const Agent* itself) const {
+      return PPtr<Path>();
+    }
+
+    public: const string& getClassNameForAgent(const Agent* itself) const {
+      return _name;
+    }
+
+    public: const string& getAliasForAgent(const Agent* itself) const {
+      return _name;
+    }
+
+    public: const k_guid_t& getAgentGuidByAlias(const string& alias) const {
+      return _guid;
+    }
+
+    public: void registerMessageFormat(PPtr<KString> opcode,
+        PPtr<KType> payloadType)
+    {
+      // Nothing;
+    }
+
+    public: PPtr<KType> getMessageFormatByHash(const k_longint_t hash) const {
+      return PPtr<KType>();
+    }
+
+    public: PPtr<KString> getMessageOpCodeForHash(const k_longint_t hash)
+        const
+    {
+      return PPtr<KString>();
+    }
+
+    public: void send(const k_guid_t& sender, const k_guid_t& receiver,
+        const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+    {
+      // Nothing;
+    }
+
+    public: void send(const k_guid_t& sender, PPtr<Group> receivers,
+        const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+    {
+      // Nothing;
+    }
+
+    public: void sendToAll(const k_guid_t& sender, const k_longint_t opcode,
+        PPtr<KValue> content, const k_integer_t tid)
+    {
+      // Nothing;
+    }
+
+    public: void sendToLocals(const k_guid_t& sender,
+        const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+    {
+      // Nothing;
+    }
+
+  };
+
+} // namespace bench
+} // namespace knorba
+
+#endif /* defined(KNORBA_BENCH_NULLRUNTIME_H) */
@@ -0,0 +1,315 @@
+/*---[TypeBench.cpp]-------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::bench::runTypeBench()
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <cstdio>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Int.h>
+#include <kfoundation/RangeIterator.h>
+#include <kfoundation/BufferInputStream.h>
+#include <kfoundation/BufferOutputStream.h>
+
+// Internal
+#include <knorba/LocalRuntime.h>
+#include <knorba/type/KAny.h>
+#include <knorba/type/KGrid.h>
+#include <knorba/type/KGridType.h>
+#include <knorba/type/KLongint.h>
+#include <knorba/type/KRaw.h>
+#include <knorba/type/KRecord.h>
+#include <knorba/type/KRecordType.h>
+#include <knorba/type/KString.h>
+
+// Self
+#include "Bench.h"
+
+#define N_RECORDS 200000
+#define N_ACCESSES 4000000
+#define N_GRID_CELLS (1 << 20)
+#define N_STRING_OCTETS (64 << 20)
+#define N_ROUND_TRIPS 200000
+#define BLOB_SIZE 16
+
+namespace knorba {
+namespace bench {
+
+  /** Keeps the compiler from dropping the results of the measured loops. */
+  static volatile k_longint_t _sink = 0;
+
+
+  /**
+   * A record with constant-size fields only. The first two fields are the
+   * same in both layouts so that the same accessors can be used on either.
+   */
+
+  static Ptr<KRecordType> makeStaticType() {
+    Ptr<KRecordType> t = new KRecordType("bench.Particle");
+    t->addField("x", KType::REAL)
+     ->addField("id", KType::INTEGER)
+     ->addField("y", KType::REAL)
+     ->addField("z", KType::REAL)
+     ->addField("time", KType::LONGINT)
+     ->addField("flags", KType::OCTET);
+    return t;
+  }
+
+
+  /**
+   * A record with a string and a raw field, which are stored out of line.
+   */
+
+  static Ptr<KRecordType> makeDynamicType() {
+    Ptr<KRecordType> t = new KRecordType("bench.Labeled");
+    t->addField("x", KType::REAL)
+     ->addField("id", KType::INTEGER)
+     ->addField("name", KType::STRING)
+     ->addField("blob", KType::RAW);
+    return t;
+  }
+
+
+  static string getLayoutName(PPtr<KRecordType> type) {
+    return type->hasDynamicFields() ? "dynamic" : "static";
+  }
+
+
+  /**
+   * Sets all fields of the given record, using the given number to make up
+   * their values.
+   */
+
+  static void fill(PPtr<KRecord> record, int n) {
+    record->setReal(0, (k_real_t)n);
+    record->setInteger(1, n);
+
+    if(record->getType().AS(KRecordType)->hasDynamicFields()) {
+      k_octet_t blob[BLOB_SIZE];
+      for(int i = 0; i < BLOB_SIZE; i++) {
+        blob[i] = (k_octet_t)(n + i);
+      }
+      record->field<KString>(2)->set("cell " + Int::toString(n));
+      record->field<KRaw>(3)->set(blob, BLOB_SIZE);
+    } else {
+      record->setReal(2, (k_real_t)n / 2);
+      record->setReal(3, (k_real_t)n / 4);
+      record->setLongint(4, n);
+      record->setOctet(5, (k_octet_t)n);
+    }
+  }
+
+
+  static void benchRecordNew(PPtr<KRecordType> type) {
+    kf_int64_t begin = getTimeInNanoseconds();
+    for(int i = 0; i < N_RECORDS; i++) {
+      Ptr<KRecord> record = new KRecord(type);
+      _sink += record->getInteger(1);
+    }
+    report("type.record.new", getLayoutName(type), N_RECORDS,
+        getTimeInNanoseconds() - begin);
+  }
+
+
+  /**
+   * Sets and gets a field by index, then by name. Each operation is one set
+   * followed by one get.
+   */
+
+  static void benchRecordAccess(PPtr<KRecordType> type) {
+    Ptr<KRecord> record = new KRecord(type);
+    fill(record, 0);
+    string layout = getLayoutName(type);
+
+    kf_int64_t begin = getTimeInNanoseconds();
+    for(int i = 0; i < N_ACCESSES; i++) {
+      record->setInteger(1, i);
+      _sink += record->getInteger(1);
+    }
+    report("type.record.index", layout, N_ACCESSES,
+        getTimeInNanoseconds() - begin);
+
+    begin = getTimeInNanoseconds();
+    for(int i = 0; i < N_ACCESSES; i++) {
+      record->setInteger("id", i);
+      _sink += record->getInteger("id");
+    }
+    report("type.record.name", layout, N_ACCESSES,
+        getTimeInNanoseconds() - begin);
+  }
+
+
+  /**
+   * Encodes, decodes, copies and assigns square grids of the given side,
+   * repeating each often enough to touch about N_GRID_CELLS cells.
+   */
+
+  static void benchGrid(PPtr<KRecordType> type, int side) {
+    Ptr<KGridType> gridType = new KGridType(type, 2);
+    Tuple2D dims(side, side);
+    Tuple2D origin(0, 0);
+    int nCells = side * side;
+    int nRepeats = N_GRID_CELLS / nCells;
+    if(nRepeats < 1) {
+      nRepeats = 1;
+    }
+    kf_int64_t nOps = (kf_int64_t)nRepeats * nCells;
+    string param = Int::toString(side) + "x" + Int::toString(side) + " "
+        + getLayoutName(type);
+
+    Ptr<KGridBasic> grid = new KGridBasic(gridType, dims);
+    Ptr<KRecord> cell = new KRecord(grid.AS(KGrid));
+    int n = 0;
+    for(RangeIterator i(grid->getRange()); i.hasMore(); i.next()) {
+      fill(grid->at(i, cell), n++);
+    }
+
+    Ptr<BufferOutputStream> output = new BufferOutputStream(
+        (kf_int32_t)grid->getTotalSizeInOctets());
+
+    kf_int64_t begin = getTimeInNanoseconds();
+    for(int i = 0; i < nRepeats; i++) {
+      output->reset();
+      grid->writeToBinaryStream(output.AS(OutputStream));
+    }
+    report("type.grid.write", param, nOps, getTimeInNanoseconds() - begin);
+
+    Ptr<KGridBasic> copy = new KGridBasic(gridType);
+    begin = getTimeInNanoseconds();
+    for(int i = 0; i < nRepeats; i++) {
+      Ptr<BufferInputStream> input = new BufferInputStream(output->getData(),
+          output->getSize(), false);
+      copy->readFromBinaryStream(input.AS(InputStream));
+    }
+    report("type.grid.read", param, nOps, getTimeInNanoseconds() - begin);
+
+    Ptr<KGridBasic> target = new KGridBasic(gridType, dims, true);
+    begin = getTimeInNanoseconds();
+    for(int i = 0; i < nRepeats; i++) {
+      target->copyFrom(grid.AS(KGrid), origin, origin, dims);
+    }
+    report("type.grid.copyFrom", param, nOps,
+        getTimeInNanoseconds() - begin);
+
+    begin = getTimeInNanoseconds();
+    for(int i = 0; i < nRepeats; i++) {
+      target->set(grid.AS(KValue));
+    }
+    report("type.grid.set", param, nOps, getTimeInNanoseconds() - begin);
+
+    target->at(Tuple2D(side - 1, side - 1), cell);
+    _sink += cell->getInteger(1);
+  }
+
+
+  /**
+   * Creates strings of the given length, then hashes their contents. Both
+   * are repeated often enough to process about N_STRING_OCTETS octets.
+   */
+
+  static void benchString(int length) {
+    string str(length, 'k');
+    int nOps = N_STRING_OCTETS / length;
+    if(nOps > N_RECORDS * 10) {
+      nOps = N_RECORDS * 10;
+    }
+    string param = Int::toString(length) + " octets";
+
+    kf_int64_t begin = getTimeInNanoseconds();
+    for(int i = 0; i < nOps; i++) {
+      Ptr<KString> s = new KString(str);
+      _sink += s->getHashCode();
+    }
+    report("type.string.new", param, nOps, getTimeInNanoseconds() - begin);
+
+    begin = getTimeInNanoseconds();
+    for(int i = 0; i < nOps; i++) {
+      _sink += KString::generateHashFor((const k_octet_t*)str.data(),
+          length);
+    }
+    report("type.string.hash", param, nOps, getTimeInNanoseconds() - begin);
+  }
+
+
+  /**
+   * Wraps the given value in a KAny, encodes it and decodes it back.
+   */
+
+  static void benchAny(Runtime& rt, PPtr<KValue> value, const string& param) {
+    Ptr<KAny> any = new KAny(value);
+    Ptr<BufferOutputStream> output = new BufferOutputStream(
+        (kf_int32_t)any->getTotalSizeInOctets());
+
+    kf_int64_t begin = getTimeInNanoseconds();
+    for(int i = 0; i < N_ROUND_TRIPS; i++) {
+      output->reset();
+      any->writeToBinaryStream(output.AS(OutputStream));
+
+      Ptr<KAny> decoded = new KAny();
+      decoded->setRuntime(rt);
+      Ptr<BufferInputStream> input = new BufferInputStream(output->getData(),
+          output->getSize(), false);
+      decoded->readFromBinaryStream(input.AS(InputStream));
+      _sink += decoded->getValue()->getTotalSizeInOctets();
+    }
+    report("type.any.roundtrip", param, N_ROUND_TRIPS,
+        getTimeInNanoseconds() - begin);
+  }
+
+
+  /**
+   * Measures the cost of the type system on the paths that encode and
+   * decode payloads: record construction and field access, grid encoding,
+   * decoding, copying and assignment, string construction and hashing, and
+   * KAny round-trips. Records are measured with both a static-only and a
+   * dynamic-field layout.
+   */
+
+  void runTypeBench() {
+    Ptr<KRecordType> types[2];
+    types[0] = makeStaticType();
+    types[1] = makeDynamicType();
+
+    for(int i = 0; i < 2; i++) {
+      benchRecordNew(types[i]);
+      benchRecordAccess(types[i]);
+    }
+
+    for(int i = 0; i < 2; i++) {
+      benchGrid(types[i], 8);
+      benchGrid(types[i], 64);
+      benchGrid(types[i], 256);
+    }
+
+    benchString(8);
+    benchString(64);
+    benchString(1024);
+
+    LocalRuntime rt;
+    rt.registerType(types[0].AS(KType));
+    rt.registerType(types[1].AS(KType));
+
+    benchAny(rt, new KLongint(42), "longint");
+    benchAny(rt, new KString(string(64, 'k')), "string");
+    for(int i = 0; i < 2; i++) {
+      Ptr<KRecord> record = new KRecord(types[i]);
+      fill(record, 42);
+      benchAny(rt, record.AS(KValue), "record " + getLayoutName(types[i]));
+    }
+  }
+
+} // namespace bench
+} // namespace knorba
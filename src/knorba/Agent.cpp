@@ -16,6 +16,8 @@
 
 // Std
 #include <cstdlib>
+#include <vector>
+#include <errno.h>
 
 // KFoundation
 #include <kfoundation/Ptr.h>
@@ -27,6 +29,7 @@
 #include "MessageSet.h"
 #include "Group.h"
 #include "Runtime.h"
+#include "Tracer.h"
 #include "type/KType.h"
 #include "type/KRecord.h"
 #include "type/KString.h"
@@ -39,7 +42,15 @@
 #undef ADLOG
 #define ADLOG(X) KF_NOP
 
-#define N_MAX_OPEN_TRANSACTIONS 10
+// Initial size of the open transactions table. Must be a power of two.
+#define INITIAL_TRANSACTION_TABLE_SIZE 16
+
+// Minimum size of the dispatch table. Must be a power of two.
+#define INITIAL_DISPATCH_TABLE_SIZE 16
+
+// Maximum number of messages processed each time the agent is run, before
+// giving other agents a turn.
+#define N_MAX_MESSAGES_PER_RUN 32
 
 namespace knorba {
   
@@ -50,13 +61,22 @@ namespace knorba {
   Agent::TransactionRecord::TransactionRecord() {
     _count = 0;
     _transactionId = -1;
-    _isOpen = false;
+    _index = -1;
+    _handler = NULL;
+    _partialHandler = NULL;
+    _nDelivered = 0;
+    _deadline = 0;
+    _isReady = false;
+    _isQueued = false;
     _responses = new MessageSet();
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
   }
   
   
   Agent::TransactionRecord::~TransactionRecord() {
-    // Nothing;
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
   }
   
   
@@ -70,27 +90,27 @@ namespace knorba {
     _count = 0;
     _transactionId = -1;
     _responses = new MessageSet();
-    _isOpen = false;
+    _index = -1;
+    _handler = NULL;
+    _partialHandler = NULL;
+    _nDelivered = 0;
+    _deadline = 0;
+    _isReady = false;
+    _isQueued = false;
   }
   
 
-//\/ Agent::MessageThread /\///////////////////////////////////////////////////
+//\/ Agent::MessageTask /\/////////////////////////////////////////////////////
   
-  Agent::MessageThread::MessageThread(Agent* owner, int rank)
-  : Thread(owner->getAlias() + " message handler " + Int::toString(rank)),
-    _owner(owner)
+  Agent::MessageTask::MessageTask(Agent* owner)
+  : _owner(owner)
   {
     // Nothing;
   }
   
   
-  void Agent::MessageThread::run() {
-    _owner->messageProcessor();
-  }
-  
-  
-  int Agent::MessageThread::getRank() {
-    return _rank;
+  bool Agent::MessageTask::run() {
+    return _owner->processMessages();
   }
   
   
@@ -116,6 +136,9 @@ namespace knorba {
   /** Default queue size. */
   const int Agent::DEFAULT_QUEUE_SIZE;
 
+  /** Default maximum queue size. */
+  const int Agent::DEFAULT_MAX_QUEUE_SIZE;
+
   /** Opcode for connect request message */
   const SPtr<KString> Agent::OP_CONNECT = KS("knorba.agent.connect");
 
@@ -124,6 +147,12 @@ namespace knorba {
 
   /** Opcode for NG message [response] message */
   const SPtr<KString> Agent::OP_NG      = KS("knorba.agent.ng");
+
+  /** Opcode for metrics request message, see AgentMetrics */
+  const SPtr<KString> Agent::OP_GET_METRICS = KS("knorba.agent.get-metrics");
+
+  /** Opcode for metrics [response] message, see AgentMetrics */
+  const SPtr<KString> Agent::OP_METRICS     = KS("knorba.agent.metrics");
   
   
 // --- (DE)CONSTRUCTOR --- //
@@ -134,42 +163,56 @@ namespace knorba {
    *
    * @param rt Reference to runtime access API
    * @param guid The GUID allocated by runtime for this agent.
-   * @param queueSize The maximum number of message can be kept in the queue
-   *        at any given time. Default value is 16.
+   * @param queueSize The initial capacity of the message queue. The queue grows
+   *        when it is full and shrinks back when it is idle. Default value is
+   *        16. Rounded up to the nearest power of two.
+   * @param maxQueueSize The maximum number of messages that can be kept in
+   *        the queue at any given time, in all priority lanes together.
+   *        Default value is 1024.
    */
   
-  Agent::Agent(Runtime& rt, const k_guid_t& guid, int queueSize)
+  Agent::Agent(Runtime& rt, const k_guid_t& guid, int queueSize,
+      int maxQueueSize)
   : _runtime(rt),
-    _newMessageCond(true),
-    _transactionCond(true),
-    _transactionMutex(true),
-    _queueMutex(true)
+    _mailbox(queueSize, maxQueueSize),
+    _scheduler(&Scheduler::getDefault()),
+    _task(this),
+    _transactionMutex(true)
   {
     _guid = guid;
     _isAutoExit = false;
     _quitFlag = false;
     _isFinalized = false;
-    _queueSize = queueSize;
-    _queueHead = 0;
-    _queueTail = 0;
-    _queueCount = 0;
-    _topThread = 0;
-    _nRunningThreads = 0;
-    
-    _openTransactions = new ManagedArray<TransactionRecord>();
-    for(int i = 0; i < N_MAX_OPEN_TRANSACTIONS; i++) {
-      Ptr<TransactionRecord> rec = new TransactionRecord();
-      rec->_index = i;
-      _openTransactions->push(rec);
-    }
+    _isRunning = false;
+    pthread_mutex_init(&_quitMutex, NULL);
+    pthread_cond_init(&_quitCond, NULL);
+    _nBlockedHandlers = 0;
+    _batchSize = 1;
+    _dispatchTable = NULL;
+    _dispatchTableSize = 0;
+    _isDispatchTableValid = false;
+    _priorityTable = NULL;
+    _retiredPriorityTables = NULL;
     
-    _messageQueue = new ManagedArray<Message>();
-    _messageQueue->setSize(_queueSize);
+    _transactionPool = new ManagedArray<TransactionRecord>();
+    _openTransactionsSize = INITIAL_TRANSACTION_TABLE_SIZE;
+    _openTransactions = new PPtr<TransactionRecord>[_openTransactionsSize];
+    _nOpenTransactions = 0;
+    _nextDeadline = 0;
+    _armedDeadline = 0;
+    _nAsyncTransactions = 0;
     
-    _messageQueueHelper = new Array<HandlerRecord>();
-    _messageQueueHelper->setSize(_queueSize);
+    // Transaction ids are unique per agent, but responses are told apart
+    // from requests only by id. Start each agent at a different point, so
+    // that requests from other agents rarely carry an id open here.
+    _nextTransactionId = (k_integer_t)(((unsigned int)guid.lid * 2654435761u)
+        ^ ((unsigned int)(unsigned short)guid.nodeRank << 16)
+        ^ ((unsigned int)(unsigned short)guid.key)) & 0x7FFFFFFF;
     
-    registerHandler(&Agent::handleOpConnect, OP_CONNECT);
+    registerHandler(&Agent::handleOpConnect, OP_CONNECT,
+        Mailbox::PRIORITY_HIGH);
+    registerHandler(&Agent::handleOpGetMetrics, OP_GET_METRICS,
+        Mailbox::PRIORITY_HIGH);
 
     LOG << "(O) Agent \"" << getAlias() << "\", GUID: " << guid << EL;
   }
@@ -181,7 +224,7 @@ namespace knorba {
    */
   
   Agent::~Agent() {
-    if(isAlive() || _nRunningThreads > 0) {
+    if(isAlive()) {
       log(Logger::ERR) << "Being destructed while alive." << EL;
     }
     
@@ -189,9 +232,30 @@ namespace knorba {
       ALOG_WRN << "Agent being destructed wile finalizing. Waiting for "
           "finalization to complete ..." << EL;
       
+      pthread_mutex_lock(&_quitMutex);
       while(!_isFinalized) {
-        System::sleep(100);
+        pthread_cond_wait(&_quitCond, &_quitMutex);
       }
+      pthread_mutex_unlock(&_quitMutex);
+    }
+    
+    _isRunning = false;
+    _scheduler->cancel(&_task);
+    _scheduler->join(&_task);
+    pthread_cond_destroy(&_quitCond);
+    pthread_mutex_destroy(&_quitMutex);
+    delete[] _openTransactions;
+    delete[] _dispatchTable;
+    
+    if(_priorityTable != NULL) {
+      _priorityTable->nextRetired = _retiredPriorityTables;
+      _retiredPriorityTables = _priorityTable;
+    }
+    while(_retiredPriorityTables != NULL) {
+      PriorityTable* next = _retiredPriorityTables->nextRetired;
+      delete[] _retiredPriorityTables->entries;
+      delete _retiredPriorityTables;
+      _retiredPriorityTables = next;
     }
     
     LOG << "(X) Agent \"" << getAlias() << "\", GUID: " << _guid << EL;
@@ -203,232 +267,935 @@ namespace knorba {
   
 // Message handling //
   
-  void Agent::messageProcessor() {
-    _nRunningThreads++;
-    _topThread++;
-    int thisThread = _topThread;
-    
-    if(thisThread > 1) {
-      _newMessageCond.release();
+  /**
+   * Called by the scheduler to process the messages in the queue. Processes
+   * up to a fixed number of messages, so that other agents get their turn.
+   *
+   * @return true if there are more messages to process.
+   */
+  
+  bool Agent::processMessages() {
+    if(__atomic_load_n(&_nAsyncTransactions, __ATOMIC_SEQ_CST) > 0
+        && _isRunning && !completeTransactions())
+    {
+      quit();
+      return false;
     }
     
-    ALOG << "Thread " << thisThread << " in." << EL;
+    _metrics.sampleQueueDepth(_mailbox.getCount());
     
-    int  msecsToWait = 1;
-    bool exitFlag = false;
-    
-    while(!exitFlag) {
-      msecsToWait = 1;
+    for(int i = 0; i < N_MAX_MESSAGES_PER_RUN && _isRunning; i++) {
+      PPtr<Message> msg = _mailbox.pop();
       
-      while(_queueCount == 0 && !exitFlag) {
-        _newMessageCond.block(System::getCurrentTimeInMiliseconds() + msecsToWait);
-        msecsToWait = 1000;
-        exitFlag = (thisThread != _topThread) || _quitFlag;
+      if(msg.isNull()) {
+        _mailbox.trim();
+        return false;
       }
       
-      while(_queueCount > 0) {
-        _queueMutex.lock();
-        PPtr<Message> msg = _messageQueue->at(_queueTail);
-        HandlerRecord& hr = _messageQueueHelper->at(_queueTail);
-        _messageQueue->at(_queueTail) = NULL;
-        
-        ADLOG("queue(" << _queueTail << ") >> " << msg->headerToString(_runtime));
+      bool isOk;
+      if(_batchSize > 1) {
+        isOk = dispatchBatch(msg);
+      } else {
+        isOk = dispatch(msg);
+      }
+      
+      if(!isOk) {
+        quit();
+        return false;
+      }
+    }
+    
+    return _isRunning && !_mailbox.isEmpty();
+  }
+  
+  
+  /**
+   * Called before blocking the current thread. If called by a handler, lets
+   * the scheduler run the following messages on another thread meanwhile.
+   *
+   * @return The value to pass to endBlocking().
+   */
+  
+  bool Agent::beginBlocking() {
+    bool isBlocking = _scheduler->block(&_task);
+    if(isBlocking) {
+      __atomic_add_fetch(&_nBlockedHandlers, 1, __ATOMIC_SEQ_CST);
+    }
+    return isBlocking;
+  }
+  
+  
+  /**
+   * Called after the current thread is unblocked. Waits until no other
+   * handler of this agent is running.
+   *
+   * @param isBlocking The value returned by beginBlocking().
+   */
+  
+  void Agent::endBlocking(bool isBlocking) {
+    if(isBlocking) {
+      _scheduler->resume(&_task);
+      __atomic_sub_fetch(&_nBlockedHandlers, 1, __ATOMIC_SEQ_CST);
+    }
+  }
+  
+  
+  /**
+   * Rebuilds the dispatch table from the handlers of this agent and its
+   * protocols. The table is an open-addressing hash table, at most half full,
+   * with one entry for each opcode. Handlers of the agent take precedence
+   * over those of protocols, and protocols registered later take precedence
+   * over those registered earlier.
+   *
+   * Called before the next message after a change, on the thread running
+   * this agent's handlers. Subclasses may call it up front, while no
+   * message is being handled, to avoid the delay.
+   */
+  
+  void Agent::buildDispatchTable() {
+    int n = (int)(_handlers.size() + _batchHandlers.size());
+    if(!_protocols.isNull()) {
+      for(int i = _protocols->getSize() - 1; i >= 0; i--) {
+        Protocol* p = _protocols->at(i);
+        n += (int)(p->_handlerMap.size() + p->_batchHandlerMap.size());
+      }
+    }
+    
+    int size = INITIAL_DISPATCH_TABLE_SIZE;
+    while(size < 2 * n) {
+      size *= 2;
+    }
+    
+    if(size != _dispatchTableSize) {
+      delete[] _dispatchTable;
+      _dispatchTable = new DispatchEntry[size];
+      _dispatchTableSize = size;
+    }
+    
+    for(int i = 0; i < size; i++) {
+      _dispatchTable[i].isUsed = false;
+    }
+    
+    HandlerRecord hr;
+    
+    if(!_protocols.isNull()) {
+      for(int i = 0; i < _protocols->getSize(); i++) {
+        Protocol* p = _protocols->at(i);
+        hr.protocol = p;
+        hr.handler = NULL;
+        hr.batchHandler = NULL;
         
-        _queueTail++;
-        if(_queueTail == _queueSize) {
-          _queueTail = 0;
+        hr.pbatchHandler = NULL;
+        for(Protocol::map_t::iterator it = p->_handlerMap.begin();
+            it != p->_handlerMap.end(); it++)
+        {
+          hr.phandler = it->second;
+          putDispatchEntry(it->first, hr);
         }
-        _queueCount--;
-        _queueMutex.unlock();
         
-        // BEGIN handle message
+        hr.phandler = NULL;
+        for(Protocol::batch_map_t::iterator it = p->_batchHandlerMap.begin();
+            it != p->_batchHandlerMap.end(); it++)
+        {
+          hr.pbatchHandler = it->second;
+          putDispatchEntry(it->first, hr);
+        }
+      }
+    }
+    
+    hr.protocol = NULL;
+    hr.phandler = NULL;
+    hr.pbatchHandler = NULL;
+    
+    hr.batchHandler = NULL;
+    for(HandlerMap_t::iterator it = _handlers.begin(); it != _handlers.end();
+        it++)
+    {
+      hr.handler = it->second;
+      putDispatchEntry(it->first, hr);
+    }
+    
+    hr.handler = NULL;
+    for(BatchHandlerMap_t::iterator it = _batchHandlers.begin();
+        it != _batchHandlers.end(); it++)
+    {
+      hr.batchHandler = it->second;
+      putDispatchEntry(it->first, hr);
+    }
+    
+    _isDispatchTableValid = true;
+  }
+  
+  
+  /**
+   * Returns the index of the dispatch table entry for the given opcode hash,
+   * or of the empty entry where it should be inserted.
+   */
+  
+  inline int Agent::probeDispatchTable(const k_longint_t hash) const {
+    int mask = _dispatchTableSize - 1;
+    unsigned long long h = (unsigned long long)hash;
+    int i = (int)(h ^ (h >> 32)) & mask;
+    while(_dispatchTable[i].isUsed && _dispatchTable[i].hash != hash) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+  
+  
+  void Agent::putDispatchEntry(const k_longint_t hash, const HandlerRecord& hr)
+  {
+    DispatchEntry& e = _dispatchTable[probeDispatchTable(hash)];
+    e.isUsed = true;
+    e.hash = hash;
+    e.record = hr;
+    e.record.handlerTime = _metrics.getHandlerTime(hash);
+  }
+  
+  
+  /**
+   * FOR INTERNAL USE. Called when a handler or a protocol is added or removed,
+   * so that the dispatch table is rebuilt before the next message.
+   */
+  
+  void Agent::invalidateDispatchTable() {
+    _isDispatchTableValid = false;
+  }
+  
+  
+  bool Agent::findHandler(const k_longint_t hash, HandlerRecord& hr) {
+    if(!_isDispatchTableValid) {
+      buildDispatchTable();
+    }
+    
+    const DispatchEntry& e = _dispatchTable[probeDispatchTable(hash)];
+    if(!e.isUsed) {
+      return false;
+    }
+    
+    hr = e.record;
+    return true;
+  }
+  
+  
+  /**
+   * Checks if there is a handler for the given opcode, either in this agent
+   * or in one of its protocols. Rebuilds the dispatch table if it is out of
+   * date, so call it only from the thread running this agent's handlers.
+   */
+  
+  bool Agent::hasHandlerForOpcodeHash(const k_longint_t hash) {
+    HandlerRecord hr;
+    return findHandler(hash, hr);
+  }
+  
+  
+  /**
+   * Passes the given message to its handler, and releases it. A message with
+   * a batch handler is passed as a set of one.
+   *
+   * @return false if the handler has thrown an exception.
+   */
+  
+  bool Agent::dispatch(PPtr<Message> msg) {
+    ADLOG("queue >> " << msg->headerToString(_runtime));
+    
+    HandlerRecord hr;
+    bool isOk = true;
+    kf_int64_t begin = AgentMetrics::getTime();
+    
+    if(msg->getEnqueueTime() > 0) {
+      _metrics.getQueueTime().add(begin - msg->getEnqueueTime());
+    }
+    
+    Tracer::trace(Tracer::DEQUEUE, begin, _guid, msg->getSender(),
+        msg->getOpcodeHash(), msg->getTransactionId(),
+        msg->getEnqueueTime());
+    
+    if(findHandler(msg->getOpcodeHash(), hr)) {
+      if(hr.batchHandler != NULL || hr.pbatchHandler != NULL) {
+        Ptr<MessageSet> msgs = new MessageSet();
+        msgs->add(msg);
+        isOk = dispatch(msgs, hr);
+      } else {
+        Tracer::trace(Tracer::HANDLER_BEGIN, begin, _guid, msg->getSender(),
+            msg->getOpcodeHash(), msg->getTransactionId(), 1);
         try {
           if(NOT_NULL(hr.protocol)) {
             (hr.protocol->*hr.phandler)(msg);
           } else {
             (this->*hr.handler)(msg);
           }
+          kf_int64_t end = AgentMetrics::getTime();
+          hr.handlerTime->add(end - begin);
+          Tracer::trace(Tracer::HANDLER_END, end, _guid, msg->getSender(),
+              msg->getOpcodeHash(), msg->getTransactionId(), 1);
+          ADLOG("Message processed: " << msg->headerToString(_runtime));
         } catch(KFException& e) {
           ALOG_ERR << "Quitting because of an exception: " << e << EL;
-          msg.release();
-          quit();
+          isOk = false;
+        }
+      }
+    }
+    
+    msg.release();
+    return isOk;
+  }
+  
+  
+  /**
+   * Passes the given set of messages to the batch handler in the given
+   * record.
+   *
+   * @return false if the handler has thrown an exception.
+   */
+  
+  bool Agent::dispatch(PPtr<MessageSet> msgs, HandlerRecord& hr) {
+    PPtr<Message> first = msgs->get(0);
+    kf_int64_t begin = AgentMetrics::getTime();
+    Tracer::trace(Tracer::HANDLER_BEGIN, begin, _guid, first->getSender(),
+        first->getOpcodeHash(), -1, msgs->getSize());
+    try {
+      if(NOT_NULL(hr.protocol)) {
+        (hr.protocol->*hr.pbatchHandler)(msgs);
+      } else {
+        (this->*hr.batchHandler)(msgs);
+      }
+      kf_int64_t end = AgentMetrics::getTime();
+      hr.handlerTime->add(end - begin);
+      Tracer::trace(Tracer::HANDLER_END, end, _guid, first->getSender(),
+          first->getOpcodeHash(), -1, msgs->getSize());
+      ADLOG("Batch of " << msgs->getSize() << " processed.");
+    } catch(KFException& e) {
+      ALOG_ERR << "Quitting because of an exception: " << e << EL;
+      return false;
+    }
+    
+    return true;
+  }
+  
+  
+  /**
+   * Takes up to getBatchSize() - 1 more messages from the queue, and
+   * dispatches them along with the given one. Messages with a batch handler
+   * are grouped by opcode, and each group is dispatched at the position of
+   * its first message. All messages are released.
+   *
+   * The batch is kept on the stack of the call rather than in the agent,
+   * since a handler that blocks lets another thread run the agent, and
+   * dispatch the next batch, before this one is done.
+   *
+   * @return false if a handler has thrown an exception.
+   */
+  
+  bool Agent::dispatchBatch(PPtr<Message> first) {
+    int size = _batchSize;
+    vector< PPtr<Message> > batch;
+    batch.reserve(size);
+    batch.push_back(first);
+    
+    while((int)batch.size() < size) {
+      PPtr<Message> msg = _mailbox.pop();
+      if(msg.isNull()) {
+        break;
+      }
+      batch.push_back(msg);
+    }
+    
+    int n = (int)batch.size();
+    
+    bool isOk = true;
+    for(int i = 0; i < n && isOk; i++) {
+      if(batch[i].isNull()) {
+        continue;
+      }
+      
+      k_longint_t hash = batch[i]->getOpcodeHash();
+      HandlerRecord hr;
+      
+      if(!findHandler(hash, hr)
+          || (hr.batchHandler == NULL && hr.pbatchHandler == NULL))
+      {
+        isOk = dispatch(batch[i]);
+        batch[i] = NULL;
+        continue;
+      }
+      
+      Ptr<MessageSet> msgs = new MessageSet();
+      kf_int64_t now = AgentMetrics::getTime();
+      for(int j = i; j < n; j++) {
+        if(batch[j].isNull() || batch[j]->getOpcodeHash() != hash) {
+          continue;
+        }
+        ADLOG("queue >> " << batch[j]->headerToString(_runtime));
+        if(batch[j]->getEnqueueTime() > 0) {
+          _metrics.getQueueTime().add(now - batch[j]->getEnqueueTime());
+        }
+        Tracer::trace(Tracer::DEQUEUE, now, _guid, batch[j]->getSender(),
+            hash, batch[j]->getTransactionId(),
+            batch[j]->getEnqueueTime());
+        msgs->add(batch[j]);
+        batch[j].release();
+        batch[j] = NULL;
+      }
+      
+      isOk = dispatch(msgs, hr);
+    }
+    
+    for(int i = 0; i < n; i++) {
+      if(!batch[i].isNull()) {
+        batch[i].release();
+        batch[i] = NULL;
+      }
+    }
+    
+    return isOk;
+  }
+  
+  
+  /**
+   * Doubles the size of the open transactions table. Entries are indexed by
+   * the low bits of their transaction id, so two entries that do not collide
+   * in the old table do not collide in the new one either. Should be called
+   * with _transactionMutex locked.
+   */
+  
+  void Agent::growTransactionTable() {
+    int size = _openTransactionsSize * 2;
+    PPtr<TransactionRecord>* table = new PPtr<TransactionRecord>[size];
+    
+    for(int i = 0; i < _openTransactionsSize; i++) {
+      PPtr<TransactionRecord> rec = _openTransactions[i];
+      if(!rec.isNull()) {
+        rec->_index = rec->_transactionId & (size - 1);
+        table[rec->_index] = rec;
+      }
+    }
+    
+    delete[] _openTransactions;
+    _openTransactions = table;
+    _openTransactionsSize = size;
+  }
+  
+  
+  /**
+   * Opens a transaction with a new id. Records are taken from a pool, and
+   * placed in a table indexed by their id, so that opening a transaction and
+   * matching a response to it both take constant time.
+   *
+   * @param count Number of expected responses.
+   * @param handler Response handler, if the transaction is asynchronous.
+   * @param msecs Timeout of an asynchronous transaction, or -1 for none.
+   * @param partialHandler Handler for each response of an asynchronous
+   *        transaction, if any.
+   */
+  
+  PPtr<Agent::TransactionRecord> Agent::startTransaction(int count,
+      response_handler_t handler, int msecs, handler_t partialHandler)
+  {
+    PPtr<TransactionRecord> record;
+    kf_int64_t deadline = 0;
+    bool isReady = count == 0;
+    
+    if(handler != NULL && msecs > 0) {
+      deadline = System::getCurrentTimeInMiliseconds() + msecs;
+    }
+    
+    _transactionMutex.lock();
+    
+    if(2 * (_nOpenTransactions + 1) > _openTransactionsSize) {
+      growTransactionTable();
+    }
+    
+    // Skip ids whose slot is taken by a long running transaction.
+    int mask = _openTransactionsSize - 1;
+    k_integer_t tid;
+    do {
+      tid = _nextTransactionId;
+      _nextTransactionId = (_nextTransactionId + 1) & 0x7FFFFFFF;
+    } while(!_openTransactions[tid & mask].isNull());
+    
+    if(_idleTransactions.isNull()) {
+      Ptr<TransactionRecord> rec = new TransactionRecord();
+      _transactionPool->push(rec);
+      record = rec;
+    } else {
+      record = _idleTransactions;
+      _idleTransactions = record->_next;
+      record->_next = NULL;
+    }
+    
+    record->_transactionId = tid;
+    record->_index = tid & mask;
+    record->_count = count;
+    record->_handler = handler;
+    record->_partialHandler = partialHandler;
+    record->_deadline = deadline;
+    record->_isReady = isReady;
+    
+    _openTransactions[record->_index] = record;
+    _nOpenTransactions++;
+    
+    if(isReady && handler != NULL) {
+      queueTransaction(record);
+    } else if(deadline > 0 && (_nextDeadline == 0 || deadline < _nextDeadline))
+    {
+      _nextDeadline = deadline;
+      if(_armedDeadline == 0 || _nextDeadline < _armedDeadline) {
+        armTimer();
+      }
+    }
+    
+    _transactionMutex.unlock();
+    
+    _metrics.countTransaction();
+    Tracer::trace(Tracer::TRANSACTION_OPEN, AgentMetrics::getTime(), _guid,
+        KGuid::zero(), 0, tid, count);
+    
+    if(handler != NULL) {
+      __atomic_add_fetch(&_nAsyncTransactions, 1, __ATOMIC_SEQ_CST);
+      if(isReady) {
+        _scheduler->submit(&_task);
+      }
+    }
+    
+    ADLOG("BEGIN transaction(" << tid << "@" << record->_index << ")");
+    
+    return record;
+  }
+  
+  
+  /**
+   * Closes the given transaction and returns its record to the pool. Should
+   * be called with _transactionMutex locked.
+   */
+  
+  void Agent::endTransaction(PPtr<TransactionRecord> trans) {
+    Tracer::trace(Tracer::TRANSACTION_CLOSE, AgentMetrics::getTime(), _guid,
+        KGuid::zero(), 0, trans->_transactionId,
+        trans->_responses->getSize());
+    _openTransactions[trans->_index] = NULL;
+    _nOpenTransactions--;
+    if(_nOpenTransactions == 0 && _armedDeadline > 0) {
+      _nextDeadline = 0;
+      armTimer();
+    }
+    trans->reset();
+    trans->_next = _idleTransactions;
+    _idleTransactions = trans;
+  }
+  
+  
+  /**
+   * Blocks until the given synchronous transaction completes, the given
+   * timeout expires, or the agent quits.
+   */
+  
+  void Agent::wait(PPtr<Agent::TransactionRecord> trans, int msecs) {
+    bool isBlocking = beginBlocking();
+    
+    struct timespec ts;
+    if(msecs > 0) {
+      kf_int64_t then = System::getCurrentTimeInMiliseconds() + msecs;
+      ts.tv_sec = (time_t)(then / 1000);
+      ts.tv_nsec = (long)(then % 1000) * 1000000;
+    }
+    
+    pthread_mutex_lock(&trans->_mutex);
+    while(!trans->_isReady && !_quitFlag) {
+      ADLOG("WAITING transaction(" << trans->_transactionId << ")");
+      if(msecs > 0) {
+        if(pthread_cond_timedwait(&trans->_cond, &trans->_mutex, &ts)
+            == ETIMEDOUT)
+        {
+          if(!trans->_isReady) {
+            _metrics.countTimeout();
+          }
           break;
         }
+      } else {
+        pthread_cond_wait(&trans->_cond, &trans->_mutex);
+      }
+    }
+    pthread_mutex_unlock(&trans->_mutex);
+    
+    endBlocking(isBlocking);
+    
+    ADLOG("END transaction(" << trans->_transactionId << "@" << trans->_index
+          << ")");
+  }
+  
+  
+  /**
+   * Wakes up all handlers waiting for a synchronous transaction. Called when
+   * the agent quits.
+   */
+  
+  void Agent::wakeTransactions() {
+    _transactionMutex.lock();
+    for(int i = 0; i < _openTransactionsSize; i++) {
+      PPtr<TransactionRecord> rec = _openTransactions[i];
+      if(!rec.isNull() && rec->_handler == NULL) {
+        pthread_mutex_lock(&rec->_mutex);
+        pthread_cond_broadcast(&rec->_cond);
+        pthread_mutex_unlock(&rec->_mutex);
+      }
+    }
+    _transactionMutex.unlock();
+  }
+  
+  
+  /**
+   * Puts the given asynchronous transaction on the list of those to be
+   * handled by completeTransactions(), unless it already is. Should be called
+   * with _transactionMutex locked.
+   *
+   * @return true if the transaction was not already queued.
+   */
+  
+  bool Agent::queueTransaction(PPtr<TransactionRecord> trans) {
+    if(trans->_isQueued) {
+      return false;
+    }
+    trans->_isQueued = true;
+    trans->_next = _pendingTransactions;
+    _pendingTransactions = trans;
+    return true;
+  }
+  
+  
+  /**
+   * Makes the scheduler run this agent at _nextDeadline, or never if it is
+   * zero, replacing the timer set before. Each agent keeps at most one timer,
+   * which is moved only when the next deadline changes. Should be called
+   * with _transactionMutex locked.
+   */
+  
+  void Agent::armTimer() {
+    _scheduler->cancel(&_task);
+    _armedDeadline = _nextDeadline;
+    if(_armedDeadline > 0) {
+      _scheduler->submitAt(&_task, _armedDeadline);
+    }
+  }
+  
+  
+  /**
+   * Closes asynchronous transactions that are complete or expired, and calls
+   * their response handlers. Called on the agent's message context.
+   *
+   * @return false if a handler has thrown an exception.
+   */
+  
+  bool Agent::completeTransactions() {
+    kf_int64_t now = System::getCurrentTimeInMiliseconds();
+    
+    _transactionMutex.lock();
+    if(_nextDeadline > 0 && _nextDeadline <= now) {
+      _nextDeadline = 0;
+      for(int i = 0; i < _openTransactionsSize; i++) {
+        PPtr<TransactionRecord> rec = _openTransactions[i];
+        if(rec.isNull() || rec->_handler == NULL || rec->_isReady
+            || rec->_deadline == 0)
+        {
+          continue;
+        }
+        if(rec->_deadline <= now) {
+          rec->_isReady = true;
+          queueTransaction(rec);
+          _metrics.countTimeout();
+        } else if(_nextDeadline == 0 || rec->_deadline < _nextDeadline) {
+          _nextDeadline = rec->_deadline;
+        }
+      }
+      armTimer();
+    }
+    _transactionMutex.unlock();
+    
+    while(true) {
+      _transactionMutex.lock();
+      PPtr<TransactionRecord> rec = _pendingTransactions;
+      if(!rec.isNull()) {
+        _pendingTransactions = rec->_next;
+        rec->_next = NULL;
+      }
+      _transactionMutex.unlock();
+      
+      if(rec.isNull()) {
+        return true;
+      }
+      
+      // The record stays queued while its responses are being delivered,
+      // so that new ones are picked up below instead of queueing it again.
+      while(true) {
+        handler_t partialHandler = NULL;
+        response_handler_t handler = NULL;
+        Ptr<Message> response;
+        Ptr<MessageSet> responses;
         
-        ADLOG("Message processed: " << msg->headerToString(_runtime));
+        _transactionMutex.lock();
+        if(rec->_partialHandler != NULL
+            && rec->_nDelivered < rec->_responses->getSize())
+        {
+          partialHandler = rec->_partialHandler;
+          response = rec->_responses->get(rec->_nDelivered).retain();
+          rec->_nDelivered++;
+        } else if(rec->_isReady) {
+          ADLOG("END transaction(" << rec->_transactionId << "@"
+                << rec->_index << ")");
+          handler = rec->_handler;
+          responses = rec->_responses.retain();
+          endTransaction(rec);
+          __atomic_sub_fetch(&_nAsyncTransactions, 1, __ATOMIC_SEQ_CST);
+        } else {
+          rec->_isQueued = false;
+        }
+        _transactionMutex.unlock();
         
-        msg.release();
-        // END handle message
+        try {
+          if(partialHandler != NULL) {
+            (this->*partialHandler)(response);
+            continue;
+          }
+          if(handler != NULL) {
+            (this->*handler)(responses);
+          }
+        } catch(KFException& e) {
+          ALOG_ERR << "Quitting because of an exception: " << e << EL;
+          return false;
+        }
         
+        break;
+      }
+    }
+  }
+  
+  
+  /**
+   * FOR INTERNAL USE. Called by runtime to deliver a message to this agent.
+   * The agent takes over the reference passed by the runtime, unless the
+   * message is rejected.
+   *
+   * @param msg The message to deliver.
+   * @return `false` if the queue is full and the overflow policy is
+   *         Mailbox::THROTTLE, in which case the runtime keeps the message
+   *         and should retry when getCredits() is positive, or with
+   *         retryMessage().
+   */
+  
+  bool Agent::processMessage(PPtr<Message> msg) {
+    if(msg->getSender() == _guid) {
+      ALOG_ERR << "Received message from self: "
+          << msg->headerToString(_runtime) << EL;
+    }
+    
+    bool handledAsTransaction = false;
+    bool isQueued = false;
+    
+    if(msg->getTransactionId() != -1) {
+      int tid = msg->getTransactionId();
+      
+      _transactionMutex.lock();
+      PPtr<TransactionRecord> rec
+          = _openTransactions[tid & (_openTransactionsSize - 1)];
+      if(!rec.isNull() && rec->_transactionId == tid) {
+        ADLOG(msg->headerToString(_runtime) << " >> transaction(" << tid
+              << "@" << rec->_index << ")");
+        
+        rec->_responses->add(msg);
+        bool isComplete = !rec->_isReady
+            && rec->_count == rec->_responses->getSize();
+        
+        if(rec->_handler == NULL) {
+          if(isComplete) {
+            pthread_mutex_lock(&rec->_mutex);
+            rec->_isReady = true;
+            pthread_cond_signal(&rec->_cond);
+            pthread_mutex_unlock(&rec->_mutex);
+          }
+        } else if(isComplete || rec->_partialHandler != NULL) {
+          rec->_isReady = rec->_isReady || isComplete;
+          isQueued = queueTransaction(rec);
+        }
         
-        exitFlag = (thisThread != _topThread) || _quitFlag;
+        handledAsTransaction = true;
+      }
+      _transactionMutex.unlock();
+    }
+    
+    if(handledAsTransaction) {
+      if(isQueued && _isRunning) {
+        _scheduler->submit(&_task);
+      }
+      return true;
+    }
+    
+    ADLOG(msg->headerToString(_runtime) << " >> queue");
+    
+    Mailbox::priority_t priority = getOpcodePriority(msg->getOpcodeHash());
+    msg->setEnqueueTime(AgentMetrics::getTime());
+    Tracer::trace(Tracer::ENQUEUE, msg->getEnqueueTime(), _guid,
+        msg->getSender(), msg->getOpcodeHash(), msg->getTransactionId(),
+        msg->getEnqueueTime());
+    if(!_mailbox.push(msg, priority)) {
+      // The delivering thread may be a worker, which would keep this agent
+      // from making room while it waits.
+      bool isWaiting = _mailbox.getOverflowPolicy() == Mailbox::BLOCK
+          && _scheduler->beginWait();
+
+      bool isOffered = _mailbox.offer(msg, priority);
+
+      if(isWaiting) {
+        _scheduler->endWait();
       }
-    } // while(!exitFlag)
+
+      if(!isOffered) {
+        return false;
+      }
+    }
     
-    ALOG << "Thread " << thisThread << " out." << EL;
+    if(_isRunning) {
+      _scheduler->submit(&_task);
+    }
     
-    _nRunningThreads--;
-    if(_nRunningThreads == 0) {
-      ADLOG("Last thread out.");
+    return true;
+  } // bool Agent::processMessage()
+  
+  
+  /**
+   * FOR INTERNAL USE. Called by runtime to deliver again a message rejected
+   * by processMessage(). Waits for room in the message queue, up to the
+   * timeout given to setOverflowPolicy(). The agent takes over the reference
+   * passed by the runtime, unless the time is up.
+   *
+   * @param msg The message rejected by processMessage().
+   * @return `false` if the queue is still full, in which case the runtime
+   *         keeps the message, and should drop it.
+   */
+  
+  bool Agent::retryMessage(PPtr<Message> msg) {
+    Mailbox::priority_t priority = getOpcodePriority(msg->getOpcodeHash());
+    
+    bool isWaiting = _scheduler->beginWait();
+    bool isPushed = _mailbox.retry(msg, priority);
+    if(isWaiting) {
+      _scheduler->endWait();
+    }
+    
+    if(isPushed && _isRunning) {
+      _scheduler->submit(&_task);
+    }
+    
+    return isPushed;
+  }
+  
+  
+  /**
+   * Sets the action to take when a message arrives while the message queue
+   * is full. Default is Mailbox::BLOCK with 1000ms timeout, which blocks the
+   * delivering thread until there is room in the queue, and drops the message
+   * if the timeout expires.
+   *
+   * @param policy The overflow policy.
+   * @param msecs Maximum time to block the delivering thread under
+   *        Mailbox::BLOCK policy, in milliseconds.
+   * @see Mailbox
+   */
+  
+  void Agent::setOverflowPolicy(Mailbox::overflow_policy_t policy, int msecs) {
+    _mailbox.setOverflowPolicy(policy, msecs);
+  }
+  
+  
+  /**
+   * Returns the current overflow policy.
+   */
+  
+  Mailbox::overflow_policy_t Agent::getOverflowPolicy() const {
+    return _mailbox.getOverflowPolicy();
+  }
+  
+  
+  /**
+   * Returns the number of messages that can be delivered to this agent
+   * before its message queue is full. Under Mailbox::THROTTLE policy, runtime
+   * should hold messages for this agent when this method returns 0.
+   */
+  
+  int Agent::getCredits() const {
+    return _mailbox.getCredits();
+  }
+  
+  
+  /**
+   * FOR INTERNAL USE. Changes the initial and maximum size of the message
+   * queue. Used by AgentLoader to apply per-class queue sizes.
+   *
+   * @param size Initial capacity of the queue.
+   * @param maxSize Maximum number of messages that can be kept in the queue,
+   *        in all priority lanes together.
+   */
+  
+  void Agent::setQueueSize(int size, int maxSize) {
+    _mailbox.setCapacity(size, maxSize);
+  }
+
+
+  /**
+   * Sets the maximum number of messages taken from the queue at once. Batch
+   * handlers receive all messages of the same opcode among them together.
+   * Default value is 1, which disables batching. Should be called in the
+   * constructor, before the agent starts receiving messages.
+   *
+   * @param size Maximum number of messages in each batch.
+   * @see registerBatchHandler()
+   */
+
+  void Agent::setBatchSize(int size) {
+    if(size < 1) {
+      throw KFException("Invalid batch size: " + Int(size));
     }
+
+    _batchSize = size;
+  }
+
+
+  /**
+   * Returns the maximum number of messages taken from the queue at once.
+   */
+
+  int Agent::getBatchSize() const {
+    return _batchSize;
   }
+
   
+  /**
+   * Returns the number of times each overflow policy has been applied on
+   * the message queue of this agent.
+   */
   
-  PPtr<Agent::TransactionRecord> Agent::startTransaction(
-      k_integer_t tid, int count)
-  {
-    PPtr<TransactionRecord> record;
-    
-    KF_SYNCHRONIZED(_transactionMutex,
-      for(int i = 0; i < N_MAX_OPEN_TRANSACTIONS; i++) {
-        if(!_openTransactions->at(i)->_isOpen) {
-          record = _openTransactions->at(i);
-          record->_isOpen = true;
-          record->_transactionId = tid;
-          record->_count = count;
-          break;
-        }
-      }
-    ) // KF_SYNCHRONIZED
-    
-    if(record.isNull()) {
-      throw KFException("Too many open transactions.");
-    }
-    
-    ADLOG("BEGIN transaction(" << tid << "@" << record->_index << ")");
-    
-    return record;
+  const Mailbox::Counters& Agent::getMailboxCounters() const {
+    return _mailbox.getCounters();
   }
   
   
-  void Agent::wait(PPtr<Agent::TransactionRecord> trans, int msecs) {
-    if(_topMessageThread->isTheCurrentThread()) {
-      _topMessageThread = new MessageThread(this, _nRunningThreads + 1);
-      _topMessageThread->start();
-    }
-
-    int count = trans->_count;
-    
-    int s = 0;
-    KF_SYNCHRONIZED(_transactionMutex,
-      s = trans->_responses->getSize();
-    )
-    
-    if(msecs > 0) {
-      
-      kf_int64_t now = System::getCurrentTimeInMiliseconds();
-      kf_int64_t then = now + msecs;
-      
-      while(now < then && s < count) {
-        _transactionCond.block(then);
-        now = System::getCurrentTimeInMiliseconds();
-        KF_SYNCHRONIZED(_transactionMutex,
-          s = trans->_responses->getSize();
-        )
-      }
-      
-    } else {
-      
-      while(s < count && !_quitFlag) {
-        _transactionCond.block(System::getCurrentTimeInMiliseconds() + 200);
-        ADLOG("WAITING transaction(" << trans->_transactionId << ")"
-              << " nResponses: " << trans->_responses->getSize());
-        KF_SYNCHRONIZED(_transactionMutex,
-          s = trans->_responses->getSize();
-        )
-      }
-      
-    }
-    
-    ADLOG("END transaction(" << trans->_transactionId << "@" << trans->_index
-          << ")");
+  /**
+   * Returns the number of messages waiting in the message queue.
+   */
+  
+  int Agent::getQueueDepth() const {
+    return _mailbox.getCount();
   }
   
   
-  void Agent::processMessage(PPtr<Message> msg) {
-    if(msg->getSender() == _guid) {
-      ALOG_ERR << "Received message from self: "
-          << msg->headerToString(_runtime) << EL;
-    }
-    
-    bool handledAsTransaction = false;
-    
-    if(msg->getTransactionId() != -1) {
-      int tid = msg->getTransactionId();
-      
-      _transactionMutex.lock();
-      for(int i = 0; i < N_MAX_OPEN_TRANSACTIONS; i++) {
-        if(_openTransactions->at(i)->_transactionId == tid) {
-          
-          PPtr<TransactionRecord> rec = _openTransactions->at(i);
-          
-          ADLOG(msg->headerToString(_runtime) << " >> transaction(" << tid
-                << "@" << rec->_index << ")");
-          
-          rec->_responses->add(msg);
-          if(rec->_count == rec->_responses->getSize()) {
-            _transactionCond.releaseAll();
-          }
-          handledAsTransaction = true;
-          break;
-        }
-      }
-      _transactionMutex.unlock();
-    }
-    
-    if(!handledAsTransaction) {
-      if(_queueCount == _queueSize)
-      {
-        ALOG_WRN << "Message queue is full." << EL;
-        int tries = 0;
-        while(_queueCount == _queueSize && tries < 100) {
-          System::sleep(10);
-          tries++;
-        }
-        ALOG_WRN << "Delayed " << tries * 10 << "ms" << EL;
-        if(tries == 100) {
-          ALOG_ERR << "Time out expired for a full queue. Quitting." << EL;
-          quit();
-        }
-      }
-      
-      HandlerRecord hr;
-      
-      k_longint_t hash = msg->getOpcodeHash();
-      hr.handler = getHandlerForOpcodeHash(hash);
-      hr.protocol = NULL;
-      bool isUnhandled = (hr.handler == NULL);
-      
-      if(isUnhandled && !_protocols.isNull()) {
-        for(int i = _protocols->getSize() - 1; i >= 0 && isUnhandled; i--) {
-          hr.protocol = _protocols->at(i);
-          hr.phandler = hr.protocol->getHandlerForOpcodeHash(hash);
-          isUnhandled = (hr.phandler == NULL);
-        }
-      }
-      
-      if(!isUnhandled) {
-        ADLOG(msg->headerToString(_runtime) << " >> queue(" << _queueHead << ")");
-        
-        KF_SYNCHRONIZED(_queueMutex,
-          _messageQueueHelper->at(_queueHead) = hr;
-          _messageQueue->at(_queueHead) = msg;
-          _queueHead++;
-          if(_queueHead == _queueSize) {
-            _queueHead = 0;
-          }
-          _queueCount++;
-        ) // KF_SYNCHRONIZED
-        
-        _newMessageCond.release();
-      }
-      
-      if(isUnhandled) {
-        msg.release();
-      }
-      
-    }// if(!handledAsTransaction)
-  } // void Agent::processMessage()
+  /**
+   * Returns the runtime statistics of this agent. The returned object can be
+   * read from any thread while the agent is running.
+   */
+  
+  const AgentMetrics& Agent::getMetrics() const {
+    return _metrics;
+  }
 
 
   
@@ -444,13 +1211,13 @@ namespace knorba {
       return;
     }
     
-    _topMessageThread = new MessageThread(this, _nRunningThreads + 1);
-    _topMessageThread->start();
+    _isRunning = true;
+    _scheduler->submit(&_task);
   }
   
   
   /**
-   * Runs the finalizer thread, which stops the message processor thread and
+   * Runs the finalizer thread, which stops processing messages and
    * runs the finalize() method. If successful, informs the runtime, which
    * will release resources consumed by this agent.
    */
@@ -488,19 +1255,29 @@ namespace knorba {
   
   
   /**
-   * Pauses the current thread while making sure the message processor thread
-   * is always running.
+   * Pauses the current thread while making sure messages are processed
+   * meanwhile. Returns early if the agent quits.
    *
    * @param msecs Amount of time to sleep, measured in milliseconds.
    */
   
   void Agent::sleep(int msecs) {
-    if(_topMessageThread->isTheCurrentThread()) {
-      _topMessageThread = new MessageThread(this, _nRunningThreads + 1);
-      _topMessageThread->start();
+    bool isBlocking = beginBlocking();
+    
+    kf_int64_t then = System::getCurrentTimeInMiliseconds() + msecs;
+    struct timespec ts;
+    ts.tv_sec = (time_t)(then / 1000);
+    ts.tv_nsec = (long)(then % 1000) * 1000000;
+    
+    pthread_mutex_lock(&_quitMutex);
+    while(!_quitFlag) {
+      if(pthread_cond_timedwait(&_quitCond, &_quitMutex, &ts) == ETIMEDOUT) {
+        break;
+      }
     }
+    pthread_mutex_unlock(&_quitMutex);
     
-    System::sleep(msecs);
+    endBlocking(isBlocking);
   }
 
 
@@ -512,23 +1289,154 @@ namespace knorba {
    *
    * @param h Pointer to handler method
    * @param opcode The opcode that activates the given handler
+   * @param priority Priority class of messages with the given opcode
+   */
+  
+  void Agent::registerHandler(handler_t h, PPtr<KString> opcode,
+      Mailbox::priority_t priority)
+  {
+    k_longint_t hash = opcode->getHashCode();
+    _batchHandlers.erase(hash);
+    _handlers[hash] = h;
+    setOpcodePriority(opcode, priority);
+    invalidateDispatchTable();
+  }
+  
+  
+  /**
+   * Registers a batch handler for the given opcode. The handler receives all
+   * messages with the given opcode that are taken from the queue at once.
+   * Replaces any handler previously registered for the same opcode.
+   *
+   * @param h Pointer to batch handler method
+   * @param opcode The opcode that activates the given handler
+   * @param priority Priority class of messages with the given opcode
+   * @see setBatchSize()
+   */
+  
+  void Agent::registerBatchHandler(batch_handler_t h, PPtr<KString> opcode,
+      Mailbox::priority_t priority)
+  {
+    k_longint_t hash = opcode->getHashCode();
+    _handlers.erase(hash);
+    _batchHandlers[hash] = h;
+    setOpcodePriority(opcode, priority);
+    invalidateDispatchTable();
+  }
+  
+  
+  /**
+   * Returns the index of the entry for the given opcode hash in the given
+   * priority table, or of the empty entry where it should be inserted.
+   */
+  
+  int Agent::probePriorityTable(const PriorityTable* t,
+      const k_longint_t hash)
+  {
+    int mask = t->size - 1;
+    unsigned long long h = (unsigned long long)hash;
+    int i = (int)(h ^ (h >> 32)) & mask;
+    while(t->entries[i].isUsed && t->entries[i].hash != hash) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+  
+  
+  /**
+   * Replaces the priority table read by getOpcodePriority() with a new one
+   * built from _priorities. The old table is kept until this agent is
+   * deleted, as a delivering thread may still be reading it. Priorities are
+   * set a few times per opcode at most, so these add up to little.
    */
   
-  void Agent::registerHandler(handler_t h, PPtr<KString> opcode) {
-    _handlers[opcode->getHashCode()] = h;
+  void Agent::publishPriorities() {
+    PriorityTable* t = NULL;
+    
+    if(!_priorities.empty()) {
+      int size = 8;
+      while(size < 2 * (int)_priorities.size()) {
+        size *= 2;
+      }
+      
+      t = new PriorityTable();
+      t->entries = new PriorityTable::Entry[size];
+      t->size = size;
+      t->nextRetired = NULL;
+      for(int i = 0; i < size; i++) {
+        t->entries[i].isUsed = false;
+      }
+      
+      for(PriorityMap_t::iterator it = _priorities.begin();
+          it != _priorities.end(); it++)
+      {
+        PriorityTable::Entry& e = t->entries[probePriorityTable(t, it->first)];
+        e.isUsed = true;
+        e.hash = it->first;
+        e.priority = it->second;
+      }
+    }
+    
+    PriorityTable* old = __atomic_exchange_n(&_priorityTable, t,
+        __ATOMIC_ACQ_REL);
+    if(old != NULL) {
+      old->nextRetired = _retiredPriorityTables;
+      _retiredPriorityTables = old;
+    }
   }
   
   
-  Agent::handler_t Agent::getHandlerForOpcodeHash(const k_longint_t hash) {
-    HandlerMap_t::iterator it = _handlers.find(hash);
-    if(it == _handlers.end()) {
-      return NULL;
+  /**
+   * Sets the priority class of messages with the given opcode. Also used by
+   * Protocol to set the priority of its opcodes. Safe to call while other
+   * threads deliver messages to this agent, but not concurrently with other
+   * registrations.
+   *
+   * @param opcode The opcode to set the priority for
+   * @param priority The priority class
+   */
+  
+  void Agent::setOpcodePriority(PPtr<KString> opcode,
+      Mailbox::priority_t priority)
+  {
+    k_longint_t hash = opcode->getHashCode();
+    PriorityMap_t::iterator it = _priorities.find(hash);
+    if(priority == Mailbox::PRIORITY_NORMAL) {
+      if(it == _priorities.end()) {
+        return;
+      }
+      _priorities.erase(it);
     } else {
-      return it->second;
+      if(it != _priorities.end() && it->second == priority) {
+        return;
+      }
+      _priorities[hash] = priority;
     }
+    
+    publishPriorities();
   }
-
-
+  
+  
+  /**
+   * Returns the priority class of messages with the given opcode hash. Does
+   * not lock, and can be called from any thread.
+   */
+  
+  Mailbox::priority_t Agent::getOpcodePriority(const k_longint_t hash) const {
+    const PriorityTable* t = __atomic_load_n(&_priorityTable,
+        __ATOMIC_ACQUIRE);
+    if(t == NULL) {
+      return Mailbox::PRIORITY_NORMAL;
+    }
+    
+    const PriorityTable::Entry& e = t->entries[probePriorityTable(t, hash)];
+    if(!e.isUsed) {
+      return Mailbox::PRIORITY_NORMAL;
+    }
+    return e.priority;
+  }
+  
+  
   /**
    * FOR INTERNAL USE. Do not call directly. Activates support for the given
    * protocol in this agent.
@@ -540,6 +1448,7 @@ namespace knorba {
     }
     
     _protocols->push(protocol);
+    invalidateDispatchTable();
   }
 
 
@@ -549,7 +1458,8 @@ namespace knorba {
    */
   
   void Agent::unregisterProtocol(Protocol* p) {
-    if(_quitFlag) {
+    // Protocols are still needed while finalizing.
+    if(_quitFlag && !_isFinalized) {
       return;
     }
     
@@ -562,40 +1472,12 @@ namespace knorba {
         _protocols->remove(i);
       }
     }
-  }
-  
-  
-// Peers //
-  
-  int Agent::getRoleIndexByMember(const k_guid_t& guid) const {
-    if(_connections.isNull()) {
-      return -1;
-    }
-    
-    for(int i = _connections->getSize() - 1; i >= 0; i--) {
-      if(_connections->at(i)->targets->containts(guid)) {
-        return i;
-      }
-    }
     
-    return -1;
+    invalidateDispatchTable();
   }
   
   
-  int Agent::getRoleIndexByName(PPtr<KString> role) const {
-    if(_connections.isNull()) {
-      return -1;
-    }
-    
-    for(int i = _connections->getSize() - 1; i >= 0; i--) {
-      if(_connections->at(i)->role->equals(role)) {
-        return i;
-      }
-    }
-    
-    return -1;
-  }
-  
+// Peers //
   
   /**
    * Adds a peer with the given GUID to the given role.
@@ -605,25 +1487,9 @@ namespace knorba {
    */
   
   void Agent::addPeer(PPtr<KString> role, const k_guid_t& guid) {
-    int index = getRoleIndexByName(role);
-    if(index < 0) {
-      if(_connections.isNull()) {
-        _connections = new ManagedArray<Connection>();
-        _allPeers = new Group();
-      }
-      
-      Ptr<Connection> c = new Connection();
-      c->role = role;
-      c->targets = new Group();
-      c->targets->add(guid);
-      _connections->push(c);
-    } else {
-      _connections->at(index)->targets->add(guid);
+    if(_peers.add(role, guid)) {
+      ALOG << "Peer added with role \"" << *role << "\": " << guid << EL;
     }
-    
-    ALOG << "Peer added with role \"" << *role << "\": " << guid << EL;
-    
-    _allPeers->add(guid);
   }
   
   
@@ -633,21 +1499,17 @@ namespace knorba {
    * successfully without making any changes.
    *
    * @note A remote agent can be assigned to multiple roles. In that case, it
-   *       should be removed from each role one at a time.
+   *       should be removed from each role one at a time, and remains a peer
+   *       until it is removed from the last one.
    *
    * @param role The role the peer to be removed from.
    * @param guid The GUID of the peer to be removed.
    */
   
   void Agent::removePeer(PPtr<KString> role, const k_guid_t& guid) {
-    int index = getRoleIndexByName(role);
-    if(index >= 0) {
-      _connections->at(index)->targets->remove(guid);
-      _allPeers->remove(guid);
+    if(_peers.remove(role, guid)) {
+      ALOG << "Peer removed from role \"" << *role << "\": " << guid << EL;
     }
-    
-    ALOG << "Peer removed from role \"" << *_connections->at(index)->role
-        << "\": " << guid << EL;
   }
   
   
@@ -659,41 +1521,35 @@ namespace knorba {
    */
   
   void Agent::removeAllPeers(PPtr<KString> role) {
-    int index = getRoleIndexByName(role);
-    if(index >= 0) {
-      ALOG << "All peers with role \"" << *_connections->at(index)->role
-        << "\" are removed :" << *_connections->at(index)->targets << EL;
-      _connections->remove(index);
+    Ptr<Group> removed = _peers.removeRole(role);
+    if(!removed.isNull()) {
+      ALOG << "All peers with role \"" << *role << "\" are removed :"
+          << *removed << EL;
     }
   }
   
   
   /**
-   * Removes all peers that share the same AppId as in the given GUID.
+   * Removes all peers that share the same AppId and node rank as the given
+   * GUID, e.g. when that node fails, and calls handlePeerDisconnected() for
+   * each role of each peer removed. Takes time proportional to the number of
+   * peers removed.
    *
-   * @param guid The AppID part of this GUID will be matched against all peers
-   *        of this agent.
+   * @param guid The AppID and node rank of this GUID will be matched against
+   *        all peers of this agent.
    */
   
   void Agent::removeAllPeersWithMatchingAppId(const k_guid_t& guid) {
-    if(_connections.isNull()) {
-      return;
-    }
+    vector<PeerRegistry::Removal> removed;
+    _peers.removeNode(guid, removed);
     
-    for(int i = _connections->getSize() - 1; i >= 0; i--) {
-      PPtr<Connection> c = _connections->at(i);
-      PPtr<Group> g = c->targets;
-      for(int j = g->getCount() - 1; j >= 0; j--) {
-        if(KGuid::areOnTheSameNode(g->get(j), guid)) {
-          c->targets->remove(guid);
-          _allPeers->remove(guid);
-          
-          ALOG << "Peer removed from role \"" << *c->role << "\": " << guid
-              << EL;
-          
-          handlePeerDisconnected(c->role, guid);
-        }
-      }
+    for(vector<PeerRegistry::Removal>::iterator i = removed.begin();
+        i != removed.end(); i++)
+    {
+      ALOG << "Peer removed from role \"" << *i->role << "\": " << i->guid
+          << EL;
+      
+      handlePeerDisconnected(i->role, i->guid);
     }
   }
   
@@ -703,26 +1559,22 @@ namespace knorba {
    */
   
   bool Agent::isPeer(const k_guid_t& guid) const {
-    if(_allPeers.isNull() || _quitFlag) {
+    if(_quitFlag) {
       return false;
     }
     
-    return _allPeers->containts(guid);
+    return _peers.contains(guid);
   }
   
   
   /**
    * Returns the role of the peer with the given GUID. Returns NULL if the given
-   * GUID does not belong to a peer.
+   * GUID does not belong to a peer. If the peer has more than one role, the
+   * one it was given first is returned.
    */
   
-  PPtr<KString> Agent::getRole(const k_guid_t& guid) const
-  {
-    int index = getRoleIndexByMember(guid);
-    if(index < 0) {
-      return NULL;
-    }
-    return _connections->at(index)->role;
+  PPtr<KString> Agent::getRole(const k_guid_t& guid) const {
+    return _peers.getRole(guid);
   }
   
   
@@ -732,11 +1584,11 @@ namespace knorba {
    */
   
   PPtr<Group> Agent::getPeers(PPtr<KString> role) const {
-    int index = getRoleIndexByName(role);
-    if(index < 0) {
+    PPtr<Group> members = _peers.getMembers(role);
+    if(members.isNull()) {
       return Group::empty_group();
     }
-    return _connections->at(index)->targets;
+    return members;
   }
   
   
@@ -745,7 +1597,7 @@ namespace knorba {
    */
   
   PPtr<Group> Agent::getAllPeers() const {
-    return _allPeers;
+    return _peers.getAll();
   }
   
 
@@ -769,6 +1621,12 @@ namespace knorba {
   /**
    * Sends a multicast message to a group of agents.
    *
+   * All local receivers get the same, frozen instance of the content.
+   * Freezing a large content before sending saves the one copy the runtime
+   * would otherwise make of it; a 64MB grid sent to 16 agents then occupies
+   * 64MB in total. Receivers that want to change it should use
+   * KValue::copy().
+   *
    * @param receivers Group of receiver agents.
    * @param opcode The opcode of the message.
    * @param content The content of the message.
@@ -792,11 +1650,11 @@ namespace knorba {
   void Agent::send(PPtr<KString> role, PPtr<KString> opcode,
       PPtr<KValue> content)
   {
-    int index = getRoleIndexByName(role);
-    if(index == -1) {
+    PPtr<Group> targets = _peers.getMembers(role);
+    if(targets.isNull()) {
       return;
     }
-    send(_connections->at(index)->targets, opcode, content);
+    send(targets, opcode, content);
   }
   
   
@@ -847,6 +1705,13 @@ namespace knorba {
   }
   
   
+  void Agent::sendMove(const k_guid_t& receiver, PPtr<KString> opcode,
+      PPtr<KValue> content, const k_integer_t tid)
+  {
+    _runtime.sendMove(_guid, receiver, opcode->getHashCode(), content, tid);
+  }
+  
+  
   /**
    * Blocking unicast send. 
    * Sends a message to a remote agent and blocks the current thread
@@ -866,8 +1731,8 @@ namespace knorba {
   Ptr<Message> Agent::tsend(const k_guid_t receiver, PPtr<KString> opcode,
       PPtr<KValue> content, k_integer_t timeout)
   {
-    k_integer_t tid = rand();
-    PPtr<TransactionRecord> trans = startTransaction(tid, 1);
+    PPtr<TransactionRecord> trans = startTransaction(1);
+    k_integer_t tid = trans->_transactionId;
     _runtime.send(_guid, receiver, opcode->getHashCode(), content, tid);
     wait(trans, timeout);
     
@@ -877,7 +1742,7 @@ namespace knorba {
     if(!trans->_responses->isEmpty()) {
       response = trans->_responses->get(0).retain();
     }
-    trans->reset();
+    endTransaction(trans);
     _transactionMutex.unlock();
     
     return response.retain();
@@ -903,14 +1768,14 @@ namespace knorba {
   Ptr<MessageSet> Agent::tsend(PPtr<Group> receivers,
       PPtr<KString> opcode, PPtr<KValue> content, k_integer_t timeout)
   {
-    k_integer_t tid = rand();
-    PPtr<TransactionRecord> trans = startTransaction(tid, receivers->getCount());
+    PPtr<TransactionRecord> trans = startTransaction(receivers->getCount());
+    k_integer_t tid = trans->_transactionId;
     _runtime.send(_guid, receivers, opcode->getHashCode(), content, tid);
     wait(trans, timeout);
     
     _transactionMutex.lock();
     Ptr<MessageSet> responses = trans->_responses.retain();
-    trans->reset();
+    endTransaction(trans);
     _transactionMutex.unlock();
     
     return responses.retain();
@@ -937,12 +1802,12 @@ namespace knorba {
   Ptr<MessageSet> Agent::tsend(PPtr<KString> receivers, PPtr<KString> opcode,
       PPtr<KValue> content, k_integer_t timeout)
   {
-    int index = getRoleIndexByName(receivers);
-    if(index == -1) {
+    PPtr<Group> targets = _peers.getMembers(receivers);
+    if(targets.isNull()) {
       return new MessageSet();
     }
     
-    return tsend(_connections->at(index)->targets, opcode, content, timeout);
+    return tsend(targets, opcode, content, timeout);
   }
   
   
@@ -964,20 +1829,127 @@ namespace knorba {
     if(timeout <= 0) {
       throw KFException("Illegal value for timeout: " + Int(timeout));
     }
-    k_integer_t tid = rand();
-    PPtr<TransactionRecord> trans = startTransaction(tid, 999999);
+    PPtr<TransactionRecord> trans = startTransaction(999999);
+    k_integer_t tid = trans->_transactionId;
     _runtime.sendToLocals(_guid, opcode->getHashCode(), content, tid);
     wait(trans, timeout);
     
     _transactionMutex.lock();
     Ptr<MessageSet> responses = trans->_responses.retain();
-    trans->reset();
+    endTransaction(trans);
     _transactionMutex.unlock();
     
     return responses.retain();
   }
   
   
+  /**
+   * Non-blocking transactional send.
+   * Sends a message to a remote agent and returns immediately. The given
+   * handler is called on this agent's message context when the message is
+   * responded or the given timeout expires, whichever happens sooner.
+   *
+   * @param receiver GUID of the receiving agent.
+   * @param opcode Message opcode.
+   * @param content Message content.
+   * @param handler Called with the response, if any.
+   * @param timeout Expressed in milliseconds. If set to -1 (default value),
+   *        the handler is called only when a response is received.
+   */
+  
+  void Agent::tsendAsync(const k_guid_t receiver, PPtr<KString> opcode,
+      PPtr<KValue> content, response_handler_t handler, k_integer_t timeout)
+  {
+    k_integer_t tid = startTransaction(1, handler, timeout)->_transactionId;
+    _runtime.send(_guid, receiver, opcode->getHashCode(), content, tid);
+  }
+  
+  
+  /**
+   * Non-blocking multicast transactional send.
+   * Sends a message to a group of remote agents and returns immediately. The
+   * given handler is called on this agent's message context when all targets
+   * respond or the given timeout expires, whichever happens sooner.
+   *
+   * @param receivers Group of receiver agents.
+   * @param opcode Message opcode.
+   * @param content Message content.
+   * @param handler Called with all responses received.
+   * @param timeout Expressed in milliseconds. If set to -1 (default value),
+   *        the handler is called only when all targets respond.
+   * @param partialHandler Optional. Called with each response as soon as it
+   *        is received, before `handler`.
+   */
+  
+  void Agent::tsendAsync(PPtr<Group> receivers, PPtr<KString> opcode,
+      PPtr<KValue> content, response_handler_t handler, k_integer_t timeout,
+      handler_t partialHandler)
+  {
+    k_integer_t tid = startTransaction(receivers->getCount(), handler,
+        timeout, partialHandler)->_transactionId;
+    _runtime.send(_guid, receivers, opcode->getHashCode(), content, tid);
+  }
+  
+  
+  /**
+   * Non-blocking multicast transactional send to peers.
+   * Sends a message to all remote agents with the given role and returns
+   * immediately. The given handler is called on this agent's message context
+   * when all targets respond or the given timeout expires, whichever happens
+   * sooner.
+   *
+   * @param receivers The role of receiver peers.
+   * @param opcode Message opcode.
+   * @param content Message content.
+   * @param handler Called with all responses received.
+   * @param timeout Expressed in milliseconds. If set to -1 (default value),
+   *        the handler is called only when all targets respond.
+   * @param partialHandler Optional. Called with each response as soon as it
+   *        is received, before `handler`.
+   */
+  
+  void Agent::tsendAsync(PPtr<KString> receivers, PPtr<KString> opcode,
+      PPtr<KValue> content, response_handler_t handler, k_integer_t timeout,
+      handler_t partialHandler)
+  {
+    PPtr<Group> targets = _peers.getMembers(receivers);
+    if(targets.isNull()) {
+      startTransaction(0, handler, timeout);
+      return;
+    }
+    
+    tsendAsync(targets, opcode, content, handler, timeout, partialHandler);
+  }
+  
+  
+  /**
+   * Non-blocking transactional local broadcast.
+   * Sends a message to all local agents and returns immediately. The given
+   * handler is called on this agent's message context when the given
+   * timeout expires.
+   *
+   * @param opcode Message opcode.
+   * @param content Message content.
+   * @param handler Called with all responses received.
+   * @param timeout Expressed in milliseconds. The amount of time to wait for
+   *                responses.
+   * @param partialHandler Optional. Called with each response as soon as it
+   *        is received, before `handler`.
+   */
+  
+  void Agent::tsendToLocalsAsync(PPtr<KString> opcode, PPtr<KValue> content,
+      response_handler_t handler, k_integer_t timeout,
+      handler_t partialHandler)
+  {
+    if(timeout <= 0) {
+      throw KFException("Illegal value for timeout: " + Int(timeout));
+    }
+    k_integer_t tid = startTransaction(999999, handler, timeout,
+        partialHandler)->_transactionId;
+    _runtime.sendToLocals(_guid, opcode->getHashCode(), content, tid);
+  }
+  
+  
   
 // Etc. //
 
@@ -1019,6 +1991,13 @@ namespace knorba {
   }
   
   
+  void Agent::handleOpGetMetrics(PPtr<Message> msg) {
+    Ptr<KRecord> metrics = _metrics.toRecord(_mailbox.getCount(),
+        _mailbox.getCounters().nOverflows);
+    respond(msg, OP_METRICS, metrics.AS(KValue));
+  }
+  
+  
 // Virtual Methods //
     
   /**
@@ -1062,17 +2041,23 @@ namespace knorba {
   
   /**
    * Override to perform additional tasks when agent is finalizing.
-   * Stops the message processor thread.
+   * Stops processing messages.
    *
    * @see isAlive()
    * @see Protocol::finalize()
    */
   void Agent::finalize() {
+    pthread_mutex_lock(&_quitMutex);
     _quitFlag = true;
+    pthread_cond_broadcast(&_quitCond);
+    pthread_mutex_unlock(&_quitMutex);
+    wakeTransactions();
     
+    // The task stays active for as long as there are messages to process,
+    // so joining it returns as soon as the mailbox is drained.
     int nAttempts = 0;
-    while(_queueHead != _queueTail) {
-      System::sleep(100);
+    while(!_mailbox.isEmpty() && _isRunning) {
+      _scheduler->join(&_task, 100);
       if(nAttempts == 10) {
         ALOG_WRN << "Taking too much time to finalize. There are unhandled "
             "messages in the queue." << EL;
@@ -1086,8 +2071,12 @@ namespace knorba {
       }
     }
     
-    _newMessageCond.release();
-    _transactionCond.release();
+    _isRunning = false;
+    
+    _transactionMutex.lock();
+    _nextDeadline = 0;
+    armTimer();
+    _transactionMutex.unlock();
     
     while(isAlive()) {
       System::sleep(100);
@@ -1097,7 +2086,10 @@ namespace knorba {
       nAttempts++;
     }
     
+    pthread_mutex_lock(&_quitMutex);
     _isFinalized = true;
+    pthread_cond_broadcast(&_quitCond);
+    pthread_mutex_unlock(&_quitMutex);
     
     _runtime.signalQuit();
   }
@@ -1114,10 +2106,8 @@ namespace knorba {
    */
 
   bool Agent::isAlive() {
-    if(!_topMessageThread.isNull()) {
-      if(_topMessageThread->isRunning()) {
-        return true;
-      }
+    if(_isRunning || _scheduler->isActive(&_task)) {
+      return true;
     }
     
     if(_protocols.isValid()) {
@@ -1128,7 +2118,7 @@ namespace knorba {
       }
     }
     
-    if(_nRunningThreads > 0) {
+    if(_nBlockedHandlers > 0) {
       return true;
     }
     
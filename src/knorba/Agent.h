@@ -19,6 +19,7 @@
 
 // Std
 #include <map>
+#include <pthread.h>
 
 // KFoundation
 #include <kfoundation/Array.h>
@@ -29,8 +30,12 @@
 
 // Internal
 #include "Message.h"
+#include "Mailbox.h"
+#include "Scheduler.h"
 #include "Runtime.h"
 #include "Protocol.h"
+#include "AgentMetrics.h"
+#include "PeerRegistry.h"
 #include "type/definitions.h"
 
 #define ALOG log()
@@ -103,10 +108,18 @@ namespace knorba {
    * first, no two handlers can manipulate the same data at the same time.
    * But if also means that if a handler takes too much time to process a
    * message, it may cause congestion and eventually overload in the message
-   * queue. However, you may use blocking tsendXXX methods safely as they
-   * internally assure continues execution of message thread, while waiting.
+   * queue. What happens when the queue is full is determined by the overflow
+   * policy of the agent, see setOverflowPolicy().
+   * However, you may use blocking tsendXXX methods safely as they
+   * internally assure continues processing of messages, while waiting.
    * Use Agent::sleep() instead of System::sleep() or std::sleep().
    *
+   * Agents do not own threads. Messages are processed by the worker threads
+   * of the shared Scheduler, which runs an agent whenever its queue is not
+   * empty. While a handler is blocked in tsendXXX or sleep(), the following
+   * messages are processed on other workers, and the blocked handler
+   * continues only after the one running at that moment returns.
+   *
    * To communicate with other agents, use sendXXX and tsendXXX methods.
    * Because of asynchronous nature of KnoRBA, primitive send operations are
    * non-blocking. However, you have the option to block the sender agent
@@ -117,7 +130,70 @@ namespace knorba {
    * by invocking Message::needsResponse(), and if it is respond using
    * Agent::respond() method.
    *
+   * tsendAsync() and tsendToLocalsAsync() open a transaction without blocking.
+   * Instead, they take a response handler with the signiture
+   *
+   *     void MyAgent::responseHandlerName(PPtr<MessageSet> responses)
+   *
+   * which is called once, like any other handler, when all targets respond
+   * or the timeout expires. In the latter case, `responses` contains only
+   * the responses received so far. Multicast variants optionally take a
+   * second, ordinary handler, which is called with each response as soon as
+   * it arrives, so that large groups can be processed incrementally.
+   *
    * 
+   * Batched Dispatch
+   * ================
+   *
+   * Agents that receive many messages of the same kind can amortize the
+   * per-message work by handling them in batches. Register a handler with
+   *
+   *     void MyAgent::batchHandlerName(PPtr<MessageSet> msgs)
+   *
+   * signiture using registerBatchHandler(), and enable batching by calling
+   * setBatchSize() in the constructor:
+   *
+   *     MyAgent::MyAgent(Runtime& rt, k_guid_t& guid)
+   *     : Agent(rt, guid)
+   *     {
+   *         registerBatchHandler((batch_handler_t)&MyAgent::batchHandlerName,
+   *             OP_CODE);
+   *         setBatchSize(500);
+   *     }
+   *
+   * Then each time the message thread wakes up, it takes up to the given
+   * number of messages from the queue, and all messages with the same opcode
+   * are passed to the batch handler at once, in the order they are received.
+   * The batch is handled at the position of its first message, that is,
+   * before messages with other opcodes that arrived in between. Without
+   * batching, batch handlers receive one message at a time.
+   *
+   *
+   * Message Priorities
+   * ==================
+   *
+   * Control messages should not wait in the queue behind bulk data. A
+   * priority class can be given to each opcode when registering its handler:
+   *
+   *     registerHandler((handler_t)&MyAgent::handlerName, OP_CODE,
+   *         Mailbox::PRIORITY_HIGH);
+   *
+   * Each priority class has a separate lane in the message queue. Messages
+   * of the same class are processed in the order they are received, while
+   * a high priority message can overtake normal and low priority ones. See
+   * Mailbox for the scheduling between lanes.
+   *
+   *
+   * Metrics
+   * =======
+   *
+   * Each agent keeps statistics about its message queue, handlers and
+   * transactions, see AgentMetrics. Read them with getMetrics(), or ask a
+   * running agent for them by sending Agent::OP_GET_METRICS; it responds
+   * with Agent::OP_METRICS carrying a record of type
+   * AgentMetrics::metrics_t().
+   *
+   *
    * Peer Management
    * ===============
    * 
@@ -132,6 +208,10 @@ namespace knorba {
    * removeAllPeers(), removeAllPeersWithMatchingAppId(), isPeer(), getRole(), 
    * getPeers(), and getAllPeers().
    *
+   * Peers are kept in a PeerRegistry, indexed by role, by GUID, and by node,
+   * so sending to a role and cleaning up after a failed node do not scan all
+   * peers.
+   *
    *
    * Passive Agents
    * ==============
@@ -152,15 +232,32 @@ namespace knorba {
 
     /** Pointer to handler method */
     public:  typedef void (Agent::*handler_t)(PPtr<Message>);
+    
+    /** Pointer to batch handler method */
+    public:  typedef void (Agent::*batch_handler_t)(PPtr<MessageSet>);
+    
+    /** Pointer to transaction response handler method */
+    public:  typedef void (Agent::*response_handler_t)(PPtr<MessageSet>);
+    
     private: typedef map<k_longint_t, handler_t> HandlerMap_t;
+    private: typedef map<k_longint_t, batch_handler_t> BatchHandlerMap_t;
+    private: typedef map<k_longint_t, Mailbox::priority_t> PriorityMap_t;
     
     
     private: struct TransactionRecord : public ManagedObject {
       k_integer_t     _transactionId;
       Ptr<MessageSet> _responses;
       int             _count;
-      bool            _isOpen;
       int             _index;
+      response_handler_t _handler;
+      handler_t       _partialHandler;
+      int             _nDelivered;
+      kf_int64_t      _deadline;
+      bool            _isReady;
+      bool            _isQueued;
+      PPtr<TransactionRecord> _next;
+      pthread_mutex_t _mutex;
+      pthread_cond_t  _cond;
       
       TransactionRecord();
       ~TransactionRecord();
@@ -172,22 +269,42 @@ namespace knorba {
     private: struct HandlerRecord {
       public: Protocol* protocol;
       public: Protocol::phandler_t phandler;
+      public: Protocol::pbatch_handler_t pbatchHandler;
       public: handler_t handler;
+      public: batch_handler_t batchHandler;
+      public: AgentMetrics::Histogram* handlerTime;
     };
     
     
-    private: class Connection : public ManagedObject {
-      public: Ptr<KString> role;
-      public: Ptr<Group> targets;
+    private: struct DispatchEntry {
+      public: bool isUsed;
+      public: k_longint_t hash;
+      public: HandlerRecord record;
     };
     
     
-    private: class MessageThread : public Thread {
+    /**
+     * An immutable copy of the opcode priorities, read without locking by
+     * the threads that deliver messages to this agent.
+     */
+    
+    private: struct PriorityTable {
+      public: struct Entry {
+        bool isUsed;
+        k_longint_t hash;
+        Mailbox::priority_t priority;
+      };
+      
+      public: Entry* entries;
+      public: int size;
+      public: PriorityTable* nextRetired;
+    };
+    
+    
+    private: class MessageTask : public Scheduler::Task {
       private: Agent* _owner;
-      private: int _rank;
-      public: MessageThread(Agent* owner, int _rank);
-      public: void run();
-      public: int getRank();
+      public: MessageTask(Agent* owner);
+      public: bool run();
     };
     
     
@@ -196,17 +313,17 @@ namespace knorba {
       public: FinalizerThread(Agent* owner);
       public: void run();
     };
-    
-    
-    private: typedef map<k_longint_t, Connection> ConnectionMap_t;
 
     
   // --- STATIC FIELDS --- //
     
     public: static const int DEFAULT_QUEUE_SIZE = 16;
+    public: static const int DEFAULT_MAX_QUEUE_SIZE = 1024;
     public: static const SPtr<KString> OP_CONNECT;
     public: static const SPtr<KString> OP_ACK;
     public: static const SPtr<KString> OP_NG;
+    public: static const SPtr<KString> OP_GET_METRICS;
+    public: static const SPtr<KString> OP_METRICS;
     
     
   // --- FIELDS --- //
@@ -217,38 +334,55 @@ namespace knorba {
     private: Runtime& _runtime;
     
     // Message Queue //
-    private: Ptr< ManagedArray<Message> > _messageQueue;
-    private: Ptr< Array<HandlerRecord> > _messageQueueHelper;
-    private: Ptr< ManagedArray<TransactionRecord> > _openTransactions;
-    private: int _queueSize;
-    private: int _queueHead;
-    private: int _queueTail;
-    private: int _queueCount;
+    private: Mailbox _mailbox;
+    private: int _batchSize;
+    
+    // Transactions //
+    private: Ptr< ManagedArray<TransactionRecord> > _transactionPool;
+    private: PPtr<TransactionRecord>  _idleTransactions;
+    private: PPtr<TransactionRecord>* _openTransactions;
+    private: int _openTransactionsSize;
+    private: int _nOpenTransactions;
+    private: k_integer_t _nextTransactionId;
+    private: PPtr<TransactionRecord> _pendingTransactions;
+    private: kf_int64_t _nextDeadline;
+    private: kf_int64_t _armedDeadline;
+    private: volatile int _nAsyncTransactions;
 
     // Concurrency //
-    private: Ptr<Thread> _topMessageThread;
-    private: Condition _newMessageCond;
-    private: Condition _transactionCond;
+    private: Scheduler*  _scheduler;
+    private: MessageTask _task;
     private: Mutex     _transactionMutex;
-    private: Mutex     _queueMutex;
-    private: bool      _quitFlag;
-    private: bool      _isFinalized;
-    private: int       _topThread;
-    private: int       _nRunningThreads;
+    private: volatile bool _quitFlag;
+    private: volatile bool _isFinalized;
+    private: pthread_mutex_t _quitMutex;
+    private: pthread_cond_t  _quitCond;
+    private: volatile bool _isRunning;
+    private: volatile int  _nBlockedHandlers;
     
     // Message Handling //
     private: Ptr< Array<Protocol*> > _protocols;
-    private: HandlerMap_t     _handlers;
+    private: HandlerMap_t      _handlers;
+    private: BatchHandlerMap_t _batchHandlers;
+    private: PriorityMap_t     _priorities;
+    private: PriorityTable* volatile _priorityTable;
+    private: PriorityTable*    _retiredPriorityTables;
+    private: DispatchEntry*    _dispatchTable;
+    private: int               _dispatchTableSize;
+    private: bool              _isDispatchTableValid;
 
     // Peers //
-    private: Ptr<Group> _allPeers;
-    private: Ptr< ManagedArray<Connection> > _connections;
+    private: PeerRegistry _peers;
+
+    // Metrics //
+    private: AgentMetrics _metrics;
     
     
   // --- (DE)CONSTRUCTORS --- //
     
     public: Agent(Runtime& rt, const k_guid_t& guid,
-        int queueSize = DEFAULT_QUEUE_SIZE);
+        int queueSize = DEFAULT_QUEUE_SIZE,
+        int maxQueueSize = DEFAULT_MAX_QUEUE_SIZE);
     
     public: virtual ~Agent();
     
@@ -256,10 +390,41 @@ namespace knorba {
   // --- METHODS --- //
     
     // Message handling //
-    private  : void messageProcessor();
-    private  : PPtr<TransactionRecord> startTransaction(k_integer_t tid, int count);
+    private  : bool processMessages();
+    private  : bool beginBlocking();
+    private  : void endBlocking(bool isBlocking);
+    protected: void buildDispatchTable();
+    private  : inline int probeDispatchTable(const k_longint_t hash) const;
+    private  : void putDispatchEntry(const k_longint_t hash,
+        const HandlerRecord& hr);
+    public   : void invalidateDispatchTable();
+    private  : bool findHandler(const k_longint_t hash, HandlerRecord& hr);
+    protected: bool hasHandlerForOpcodeHash(const k_longint_t hash);
+    private  : bool dispatch(PPtr<Message> msg);
+    private  : bool dispatch(PPtr<MessageSet> msgs, HandlerRecord& hr);
+    private  : bool dispatchBatch(PPtr<Message> first);
+    private  : void growTransactionTable();
+    private  : PPtr<TransactionRecord> startTransaction(int count,
+        response_handler_t handler = NULL, int msecs = -1,
+        handler_t partialHandler = NULL);
+    private  : void endTransaction(PPtr<TransactionRecord> trans);
     private  : void wait(PPtr<TransactionRecord> trans, int msecs);
-    public   : void processMessage(PPtr<Message> msg);
+    private  : void wakeTransactions();
+    private  : bool queueTransaction(PPtr<TransactionRecord> trans);
+    private  : void armTimer();
+    private  : bool completeTransactions();
+    public   : bool processMessage(PPtr<Message> msg);
+    public   : bool retryMessage(PPtr<Message> msg);
+    protected: void setOverflowPolicy(Mailbox::overflow_policy_t policy,
+        int msecs = Mailbox::DEFAULT_BLOCK_TIMEOUT);
+    public   : Mailbox::overflow_policy_t getOverflowPolicy() const;
+    public   : int  getCredits() const;
+    public   : void setQueueSize(int size, int maxSize);
+    protected: void setBatchSize(int size);
+    public   : int  getBatchSize() const;
+    public   : const Mailbox::Counters& getMailboxCounters() const;
+    public   : int  getQueueDepth() const;
+    public   : const AgentMetrics& getMetrics() const;
     
     // Lifecycle //
     public   : void run();
@@ -269,14 +434,22 @@ namespace knorba {
     protected: void sleep(int msecs);
     
     // Handlers and protocols//
-    protected: void registerHandler(handler_t h, const PPtr<KString> opcode);
-    private  : handler_t getHandlerForOpcodeHash(const k_longint_t hash);
+    protected: void registerHandler(handler_t h, const PPtr<KString> opcode,
+        Mailbox::priority_t priority = Mailbox::PRIORITY_NORMAL);
+    protected: void registerBatchHandler(batch_handler_t h,
+        const PPtr<KString> opcode,
+        Mailbox::priority_t priority = Mailbox::PRIORITY_NORMAL);
+    private  : static int probePriorityTable(const PriorityTable* t,
+        const k_longint_t hash);
+    private  : void publishPriorities();
+    public   : void setOpcodePriority(const PPtr<KString> opcode,
+        Mailbox::priority_t priority);
+    public   : Mailbox::priority_t getOpcodePriority(const k_longint_t hash)
+        const;
     public   : void registerProtocol(Protocol* protocol);
     public   : void unregisterProtocol(Protocol* protocol);
     
     // Peers //
-    private  : int  getRoleIndexByMember(const k_guid_t& guid) const;
-    private  : int  getRoleIndexByName(PPtr<KString> role) const;
     public   : void addPeer(PPtr<KString> role, const k_guid_t& guid);
     public   : void removePeer(PPtr<KString> role, const k_guid_t& guid);
     public   : void removeAllPeers(PPtr<KString> role);
@@ -304,6 +477,17 @@ namespace knorba {
     public: void respond(PPtr<Message> msg, PPtr<KString> opcode,
         PPtr<KValue> content);
     
+    private: void sendMove(const k_guid_t& receiver, PPtr<KString> opcode,
+        PPtr<KValue> content, const k_integer_t tid);
+    
+    public: template<typename T>
+      inline void sendMove(const k_guid_t receiver, PPtr<KString> opcode,
+          Ptr<T>& content);
+    
+    public: template<typename T>
+      inline void respondMove(PPtr<Message> msg, PPtr<KString> opcode,
+          Ptr<T>& content);
+    
     public: Ptr<Message> tsend(const k_guid_t receiver, PPtr<KString> opcode,
         PPtr<KValue> content, k_integer_t timeout = -1);
     
@@ -319,6 +503,22 @@ namespace knorba {
     public: Ptr<MessageSet> tsendToAll(PPtr<KString> opcode,
         PPtr<KValue> content, k_integer_t timeout);
     
+    public: void tsendAsync(const k_guid_t receiver, PPtr<KString> opcode,
+        PPtr<KValue> content, response_handler_t handler,
+        k_integer_t timeout = -1);
+    
+    public: void tsendAsync(PPtr<Group> receivers, PPtr<KString> opcode,
+        PPtr<KValue> content, response_handler_t handler,
+        k_integer_t timeout = -1, handler_t partialHandler = NULL);
+    
+    public: void tsendAsync(PPtr<KString> receivers, PPtr<KString> opcode,
+        PPtr<KValue> content, response_handler_t handler,
+        k_integer_t timeout = -1, handler_t partialHandler = NULL);
+    
+    public: void tsendToLocalsAsync(PPtr<KString> opcode,
+        PPtr<KValue> content, response_handler_t handler,
+        k_integer_t timeout, handler_t partialHandler = NULL);
+    
     // Etc. //
     public : const k_guid_t& getGuid() const;
     public : Logger::Stream& log(const Logger::level_t level = Logger::L3) const;
@@ -327,6 +527,7 @@ namespace knorba {
     public : inline const string& getAlias() const;
     public : Runtime& getRuntime();
     private: void handleOpConnect(PPtr<Message> msg);
+    private: void handleOpGetMetrics(PPtr<Message> msg);
     
     // Virtual methods //
     public: virtual void handlePeerConnectionRequest(PPtr<KString> role, const k_guid_t& guid);
@@ -359,6 +560,46 @@ namespace knorba {
     return _runtime.getDataPathForAgent(this);
   }
   
+  
+  /**
+   * Sends a message to another agent, handing over the given content. If
+   * the receiver is local, it gets the very same object without it being
+   * copied or serialized. Use this to pass large buffers along a pipeline
+   * of agents. `content` is set to null on return, and the caller should
+   * hold no other reference to it.
+   *
+   * @param receiver The GUID of the receiver agent.
+   * @param opcode The opcode of the message.
+   * @param content The content of the message.
+   */
+  
+  template<typename T>
+  inline void Agent::sendMove(const k_guid_t receiver, PPtr<KString> opcode,
+      Ptr<T>& content)
+  {
+    sendMove(receiver, opcode, content.AS(KValue), -1);
+    content = NULL;
+  }
+  
+  
+  /**
+   * Responds to the given message, handing over the given content. See
+   * sendMove().
+   *
+   * @param msg The message to respond to.
+   * @param opcode The opcode of the response.
+   * @param content The content of the response.
+   */
+  
+  template<typename T>
+  inline void Agent::respondMove(PPtr<Message> msg, PPtr<KString> opcode,
+      Ptr<T>& content)
+  {
+    sendMove(msg->getSender(), opcode, content.AS(KValue),
+        msg->getTransactionId());
+    content = NULL;
+  }
+  
 } // namespace knorba
 
 #endif /* defined(KNORBA_AGENT) */
\ No newline at end of file
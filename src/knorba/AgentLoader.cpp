@@ -19,6 +19,7 @@
 
 // Internal
 #include "Runtime.h"
+#include "Agent.h"
 
 // Self
 #include "AgentLoader.h"
@@ -38,11 +39,32 @@ namespace knorba {
   {
     _name = name;
     _resources = resources;
+    _queueSize = 0;
+    _maxQueueSize = 0;
   }
   
   
 // --- METHODS --- //
 
+  /**
+   * Instantiates a new agent using instantiate(), and applies the queue size
+   * set for this class of agents, if any. This is the method for runtimes to
+   * call; instantiate() alone leaves the settings of this loader out.
+   *
+   * @param rt Reference to runtime.
+   * @param guid The GUID allocated for the new agent.
+   * @see setQueueSize()
+   */
+  
+  Agent* AgentLoader::load(Runtime& rt, const k_guid_t& guid) {
+    Agent* agent = instantiate(rt, guid);
+    if(agent != NULL && _queueSize > 0) {
+      agent->setQueueSize(_queueSize, _maxQueueSize);
+    }
+    return agent;
+  }
+  
+
   /** Returns the agent class name for this loader */
 
   const string& AgentLoader::getClassName() const {
@@ -57,10 +79,45 @@ namespace knorba {
   }
   
   
+  /**
+   * Sets the message queue size for all agents instantiated by load(). Has
+   * no effect on agents made by calling instantiate() directly. Use for
+   * classes of agents that receive bursts of messages.
+   *
+   * @param size Initial capacity of the message queue.
+   * @param maxSize Maximum number of messages that can be kept in the queue.
+   * @see Agent::Agent()
+   */
+  
+  void AgentLoader::setQueueSize(int size, int maxSize) {
+    _queueSize = size;
+    _maxQueueSize = maxSize;
+  }
+  
+  
+  /** Returns the initial message queue size, or 0 if not set. */
+  
+  int AgentLoader::getQueueSize() const {
+    return _queueSize;
+  }
+  
+  
+  /** Returns the maximum message queue size, or 0 if not set. */
+  
+  int AgentLoader::getMaxQueueSize() const {
+    return _maxQueueSize;
+  }
+  
+  
   void AgentLoader::serialize(PPtr<ObjectSerializer> serializer) const {
     serializer->object("AgentLoader")
       ->attribute("class", _name);
     
+    if(_queueSize > 0) {
+      serializer->attribute("queueSize", _queueSize)
+        ->attribute("maxQueueSize", _maxQueueSize);
+    }
+    
     if(!_resources.isNull()) {
       serializer->attribute("resources", _resources->getString());
     }
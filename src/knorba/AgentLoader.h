@@ -39,6 +39,11 @@ namespace knorba {
    * libraries, this tool can be used to help ARE to instantiate new agents of 
    * a particular type.
    *
+   * Subclasses implement instantiate(), but runtimes should create agents
+   * by calling load(), which calls instantiate() and then applies the
+   * settings of this loader, such as setQueueSize(). Settings are ignored
+   * for agents made by calling instantiate() directly.
+   *
    * @headerfile AgentLoader.h <knorba/AgentLoader.h>
    */
 
@@ -48,6 +53,8 @@ namespace knorba {
     
     private: string _name;
     private: Ptr<Path> _resources;
+    private: int _queueSize;
+    private: int _maxQueueSize;
     
     
   // --- (DE)CONSTRUCTORS --- //
@@ -60,8 +67,12 @@ namespace knorba {
     public: virtual void init(Runtime& rt) = 0;
     public: virtual Agent* instantiate(Runtime& rt, const k_guid_t& guid) = 0;
     
+    public: Agent* load(Runtime& rt, const k_guid_t& guid);
     public: const string& getClassName() const;
     public: PPtr<Path> getPathToResources() const;
+    public: void setQueueSize(int size, int maxSize);
+    public: int getQueueSize() const;
+    public: int getMaxQueueSize() const;
     
     // Inherited from SerializingStreamer
     public: virtual void serialize(PPtr<ObjectSerializer> serializer) const;
@@ -0,0 +1,457 @@
+/*---[AgentMetrics.cpp]----------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::AgentMetrics::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Tuple.h>
+
+// Internal
+#include "Agent.h"
+#include "Runtime.h"
+#include "type/KGrid.h"
+#include "type/KGridType.h"
+#include "type/KRecord.h"
+#include "type/KRecordType.h"
+
+// Self
+#include "AgentMetrics.h"
+
+namespace knorba {
+
+//\/ AgentMetrics::Histogram /\////////////////////////////////////////////////
+
+  const int AgentMetrics::Histogram::N_BUCKETS;
+
+
+  AgentMetrics::Histogram::Histogram() {
+    reset();
+  }
+
+
+  /**
+   * Adds a sample. Should be called by one thread at a time.
+   *
+   * @param nanos The sample, in nanoseconds.
+   */
+
+  void AgentMetrics::Histogram::add(kf_int64_t nanos) {
+    int i = 0;
+    if(nanos > 0) {
+      i = 64 - __builtin_clzll((unsigned long long)nanos);
+      if(i >= N_BUCKETS) {
+        i = N_BUCKETS - 1;
+      }
+    } else {
+      nanos = 0;
+    }
+
+    __atomic_store_n(&_buckets[i], _buckets[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&_sum, _sum + nanos, __ATOMIC_RELAXED);
+    if(nanos > _max) {
+      __atomic_store_n(&_max, nanos, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&_count, _count + 1, __ATOMIC_RELEASE);
+  }
+
+
+  /**
+   * Removes all samples.
+   */
+
+  void AgentMetrics::Histogram::reset() {
+    for(int i = 0; i < N_BUCKETS; i++) {
+      _buckets[i] = 0;
+    }
+    _count = 0;
+    _sum = 0;
+    _max = 0;
+  }
+
+
+  /**
+   * Returns the number of samples.
+   */
+
+  k_longint_t AgentMetrics::Histogram::getCount() const {
+    return __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+  }
+
+
+  /**
+   * Returns the sum of all samples, in nanoseconds.
+   */
+
+  k_longint_t AgentMetrics::Histogram::getSum() const {
+    return __atomic_load_n(&_sum, __ATOMIC_RELAXED);
+  }
+
+
+  /**
+   * Returns the largest sample, in nanoseconds.
+   */
+
+  k_longint_t AgentMetrics::Histogram::getMax() const {
+    return __atomic_load_n(&_max, __ATOMIC_RELAXED);
+  }
+
+
+  /**
+   * Returns the number of samples in the bucket at the given index.
+   */
+
+  k_longint_t AgentMetrics::Histogram::getBucket(int index) const {
+    return __atomic_load_n(&_buckets[index], __ATOMIC_RELAXED);
+  }
+
+
+  /**
+   * Returns an upper bound for the value not exceeded by the given fraction
+   * of the samples, e.g. 0.99 for the 99th percentile. The result is the
+   * upper limit of the bucket the percentile falls in, or the largest sample
+   * if that is smaller. Returns 0 if there is no sample.
+   */
+
+  k_longint_t AgentMetrics::Histogram::getPercentile(double p) const {
+    k_longint_t n = getCount();
+    if(n == 0) {
+      return 0;
+    }
+
+    k_longint_t rank = (k_longint_t)(p * n + 0.999999);
+    if(rank < 1) {
+      rank = 1;
+    }
+
+    k_longint_t max = getMax();
+    k_longint_t sum = 0;
+    for(int i = 0; i < N_BUCKETS; i++) {
+      sum += getBucket(i);
+      if(sum >= rank) {
+        if(i == 0) {
+          return 0;
+        }
+        k_longint_t limit = ((k_longint_t)1 << i) - 1;
+        return limit < max ? limit : max;
+      }
+    }
+
+    return max;
+  }
+
+
+  /**
+   * Writes a summary of this histogram to the given record, which should be
+   * of type histogram_t().
+   */
+
+  void AgentMetrics::Histogram::toRecord(PPtr<KRecord> record) const {
+    record->setLongint(HISTOGRAM_T_COUNT, getCount());
+    record->setLongint(HISTOGRAM_T_TOTAL, getSum());
+    record->setLongint(HISTOGRAM_T_MAX, getMax());
+    record->setLongint(HISTOGRAM_T_P50, getPercentile(0.5));
+    record->setLongint(HISTOGRAM_T_P90, getPercentile(0.9));
+    record->setLongint(HISTOGRAM_T_P99, getPercentile(0.99));
+  }
+
+
+//\/ AgentMetrics /\///////////////////////////////////////////////////////////
+
+// --- STATIC FIELDS --- //
+
+  SPtr<KRecordType> AgentMetrics::HISTOGRAM_T;
+  SPtr<KRecordType> AgentMetrics::OPCODE_T;
+  SPtr<KRecordType> AgentMetrics::METRICS_T;
+
+
+// --- STATIC METHODS --- //
+
+  /**
+   * Type of the summary of a histogram: number of samples, their total,
+   * and the largest one, 50th, 90th and 99th percentiles, all in
+   * nanoseconds.
+   */
+
+  PPtr<KRecordType> AgentMetrics::histogram_t() {
+    if(HISTOGRAM_T.isNull()) {
+      HISTOGRAM_T = new KRecordType("knorba.agent.Histogram");
+      HISTOGRAM_T->addField(/* 0 */ "count", KType::LONGINT)
+          ->addField(/* 1 */ "total", KType::LONGINT)
+          ->addField(/* 2 */ "max", KType::LONGINT)
+          ->addField(/* 3 */ "p50", KType::LONGINT)
+          ->addField(/* 4 */ "p90", KType::LONGINT)
+          ->addField(/* 5 */ "p99", KType::LONGINT);
+      HISTOGRAM_T.setSelfDestruct();
+    }
+
+    return HISTOGRAM_T;
+  }
+
+
+  /**
+   * Type of the metrics of an opcode: its hash, and the time spent in its
+   * handler.
+   */
+
+  PPtr<KRecordType> AgentMetrics::opcode_t() {
+    if(OPCODE_T.isNull()) {
+      OPCODE_T = new KRecordType("knorba.agent.OpcodeMetrics");
+      OPCODE_T->addField(/* 0 */ "opcode", KType::LONGINT)
+          ->addField(/* 1 */ "time", histogram_t().AS(KType));
+      OPCODE_T.setSelfDestruct();
+    }
+
+    return OPCODE_T;
+  }
+
+
+  /**
+   * Type of the record returned by toRecord(), and carried by
+   * Agent::OP_METRICS.
+   */
+
+  PPtr<KRecordType> AgentMetrics::metrics_t() {
+    if(METRICS_T.isNull()) {
+      METRICS_T = new KRecordType("knorba.agent.Metrics");
+      METRICS_T->addField(/* 0 */ "queueDepth", KType::INTEGER)
+          ->addField(/* 1 */ "maxQueueDepth", KType::INTEGER)
+          ->addField(/* 2 */ "nQueueFull", KType::LONGINT)
+          ->addField(/* 3 */ "nTransactions", KType::LONGINT)
+          ->addField(/* 4 */ "nTimeouts", KType::LONGINT)
+          ->addField(/* 5 */ "queueTime", histogram_t().AS(KType))
+          ->addField(/* 6 */ "opcodes",
+              opcode_t()->makeGridType(1).AS(KType));
+      METRICS_T.setSelfDestruct();
+    }
+
+    return METRICS_T;
+  }
+
+
+  /**
+   * Registers the message formats used to query metrics with the given
+   * runtime.
+   */
+
+  void AgentMetrics::init(Runtime& rt) {
+    rt.registerMessageFormat(Agent::OP_GET_METRICS, KType::NOTHING);
+    rt.registerMessageFormat(Agent::OP_METRICS, metrics_t().AS(KType));
+  }
+
+
+// --- (DE)CONSTRUCTORS --- //
+
+  AgentMetrics::AgentMetrics() {
+    _maxQueueDepth = 0;
+    _nTransactions = 0;
+    _nTimeouts = 0;
+    pthread_mutex_init(&_mutex, NULL);
+  }
+
+
+  AgentMetrics::~AgentMetrics() {
+    for(map<k_longint_t, Histogram*>::iterator it = _handlerTimes.begin();
+        it != _handlerTimes.end(); it++)
+    {
+      delete it->second;
+    }
+    pthread_mutex_destroy(&_mutex);
+  }
+
+
+// --- METHODS --- //
+
+  /**
+   * Raises the high-water mark of the queue depth to the given value, if it
+   * is lower.
+   */
+
+  void AgentMetrics::sampleQueueDepth(int depth) {
+    int max = __atomic_load_n(&_maxQueueDepth, __ATOMIC_RELAXED);
+    while(depth > max) {
+      if(__atomic_compare_exchange_n(&_maxQueueDepth, &max, depth, true,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        break;
+      }
+    }
+  }
+
+
+  /**
+   * Counts a transaction being opened.
+   */
+
+  void AgentMetrics::countTransaction() {
+    __atomic_add_fetch(&_nTransactions, 1, __ATOMIC_RELAXED);
+  }
+
+
+  /**
+   * Counts a transaction timing out before all responses arrive.
+   */
+
+  void AgentMetrics::countTimeout() {
+    __atomic_add_fetch(&_nTimeouts, 1, __ATOMIC_RELAXED);
+  }
+
+
+  /**
+   * Returns the histogram of the time messages wait in the queue.
+   */
+
+  AgentMetrics::Histogram& AgentMetrics::getQueueTime() {
+    return _queueTime;
+  }
+
+
+  /**
+   * Returns the histogram of the time spent in the handler of the given
+   * opcode, creating it if there is none. The histogram lives as long as
+   * this object.
+   */
+
+  AgentMetrics::Histogram* AgentMetrics::getHandlerTime(
+      k_longint_t opcodeHash)
+  {
+    pthread_mutex_lock(&_mutex);
+    Histogram*& h = _handlerTimes[opcodeHash];
+    if(h == NULL) {
+      h = new Histogram();
+    }
+    Histogram* result = h;
+    pthread_mutex_unlock(&_mutex);
+    return result;
+  }
+
+
+  /**
+   * Returns the largest queue depth seen so far.
+   */
+
+  int AgentMetrics::getMaxQueueDepth() const {
+    return __atomic_load_n(&_maxQueueDepth, __ATOMIC_RELAXED);
+  }
+
+
+  /**
+   * Returns the number of transactions opened so far.
+   */
+
+  k_longint_t AgentMetrics::getNumberOfTransactions() const {
+    return __atomic_load_n(&_nTransactions, __ATOMIC_RELAXED);
+  }
+
+
+  /**
+   * Returns the number of transactions that timed out so far.
+   */
+
+  k_longint_t AgentMetrics::getNumberOfTimeouts() const {
+    return __atomic_load_n(&_nTimeouts, __ATOMIC_RELAXED);
+  }
+
+
+  /**
+   * Returns the histogram of the time messages wait in the queue.
+   */
+
+  const AgentMetrics::Histogram& AgentMetrics::getQueueTime() const {
+    return _queueTime;
+  }
+
+
+  /**
+   * Returns the histogram of the time spent in the handler of the given
+   * opcode, or NULL if no handler has been registered for it.
+   */
+
+  const AgentMetrics::Histogram* AgentMetrics::findHandlerTime(
+      k_longint_t opcodeHash) const
+  {
+    const Histogram* result = NULL;
+    pthread_mutex_lock(&_mutex);
+    map<k_longint_t, Histogram*>::const_iterator it
+        = _handlerTimes.find(opcodeHash);
+    if(it != _handlerTimes.end()) {
+      result = it->second;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return result;
+  }
+
+
+  /**
+   * Fills the given vector with the hashes of the opcodes that have a
+   * histogram, in ascending order.
+   */
+
+  void AgentMetrics::getOpcodeHashes(vector<k_longint_t>& hashes) const {
+    hashes.clear();
+    pthread_mutex_lock(&_mutex);
+    for(map<k_longint_t, Histogram*>::const_iterator it
+        = _handlerTimes.begin(); it != _handlerTimes.end(); it++)
+    {
+      hashes.push_back(it->first);
+    }
+    pthread_mutex_unlock(&_mutex);
+  }
+
+
+  /**
+   * Returns a snapshot of these metrics as a record of type metrics_t().
+   * Opcodes whose handler has never run are left out.
+   *
+   * @param queueDepth The current depth of the message queue.
+   * @param nQueueFull The number of messages that found the queue full.
+   */
+
+  Ptr<KRecord> AgentMetrics::toRecord(int queueDepth, k_longint_t nQueueFull)
+      const
+  {
+    Ptr<KRecord> record = new KRecord(metrics_t());
+    record->setInteger(METRICS_T_QUEUE_DEPTH, queueDepth);
+    record->setInteger(METRICS_T_MAX_QUEUE_DEPTH, getMaxQueueDepth());
+    record->setLongint(METRICS_T_N_QUEUE_FULL, nQueueFull);
+    record->setLongint(METRICS_T_N_TRANSACTIONS, getNumberOfTransactions());
+    record->setLongint(METRICS_T_N_TIMEOUTS, getNumberOfTimeouts());
+    _queueTime.toRecord(record->getRecord(METRICS_T_QUEUE_TIME));
+
+    vector<k_longint_t> hashes;
+    vector<const Histogram*> times;
+    pthread_mutex_lock(&_mutex);
+    for(map<k_longint_t, Histogram*>::const_iterator it
+        = _handlerTimes.begin(); it != _handlerTimes.end(); it++)
+    {
+      if(it->second->getCount() > 0) {
+        hashes.push_back(it->first);
+        times.push_back(it->second);
+      }
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    PPtr<KGrid> opcodes = record->field<KGrid>(METRICS_T_OPCODES);
+    opcodes->resetWithSize(Tuple1D((int)hashes.size()));
+    Ptr<KRecord> wrapper = new KRecord(opcodes);
+    for(int i = 0; i < (int)hashes.size(); i++) {
+      opcodes->at(Tuple1D(i), wrapper);
+      wrapper->setLongint(OPCODE_T_OPCODE, hashes[i]);
+      times[i]->toRecord(wrapper->getRecord(OPCODE_T_TIME));
+    }
+
+    return record;
+  }
+
+} // namespace knorba
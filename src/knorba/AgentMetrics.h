@@ -0,0 +1,193 @@
+/*---[AgentMetrics.h]------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::AgentMetrics::*
+ |  Implements: knorba::AgentMetrics::getTime()
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_AGENTMETRICS_H
+#define KNORBA_AGENTMETRICS_H
+
+// Std
+#include <map>
+#include <vector>
+#include <time.h>
+#include <pthread.h>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+
+// Internal
+#include "type/definitions.h"
+
+namespace knorba {
+
+  namespace type {
+    class KRecord;
+    class KRecordType;
+  }
+
+  class Runtime;
+
+  using namespace std;
+  using namespace kfoundation;
+  using namespace knorba::type;
+
+
+  /**
+   * Runtime statistics of an agent. Each agent keeps one, see
+   * Agent::getMetrics(). Metrics are always on; recording a message costs
+   * three reads of the monotonic clock and a few stores.
+   *
+   * The following are kept:
+   *
+   * - Depth of the message queue. The high-water mark is sampled each time
+   *   the agent starts processing messages, so a burst that comes and goes
+   *   between two runs is not seen.
+   * - Time each message waits in the queue, from delivery to the start of
+   *   its handler. Responses to transactions do not go through the queue and
+   *   are not counted.
+   * - Time spent in the handler of each opcode. A batch handler is counted
+   *   once per call.
+   * - Number of transactions opened, and of those that timed out.
+   * - Number of messages that found the queue full. See
+   *   Mailbox::Counters for what happened to them.
+   *
+   * Times are kept in histograms whose buckets are powers of two
+   * nanoseconds, so percentiles are accurate within a factor of two.
+   *
+   * Histograms are written only on the message context of the agent, which
+   * runs one handler at a time, so recording takes no atomic operation.
+   * They can be read from any thread; a reader may see a sample counted in
+   * one field but not yet in another.
+   *
+   * Other agents, e.g. a monitor, can ask an agent for its metrics with
+   * Agent::OP_GET_METRICS. The response carries the record built by
+   * toRecord(). Call init() to register its format with the runtime.
+   *
+   * @headerfile AgentMetrics.h <knorba/AgentMetrics.h>
+   */
+
+  class AgentMetrics {
+
+  // --- NESTED TYPES --- //
+
+    /**
+     * Histogram of times in nanoseconds. Bucket `i` counts the times `t`
+     * with `2^(i-1) <= t < 2^i`, and bucket 0 counts zeros.
+     */
+
+    public: class Histogram {
+
+      public: static const int N_BUCKETS = 48;
+
+      private: volatile k_longint_t _buckets[N_BUCKETS];
+      private: volatile k_longint_t _count;
+      private: volatile k_longint_t _sum;
+      private: volatile k_longint_t _max;
+
+      public: Histogram();
+      public: void add(kf_int64_t nanos);
+      public: void reset();
+      public: k_longint_t getCount() const;
+      public: k_longint_t getSum() const;
+      public: k_longint_t getMax() const;
+      public: k_longint_t getBucket(int index) const;
+      public: k_longint_t getPercentile(double p) const;
+      public: void toRecord(PPtr<KRecord> record) const;
+
+    };
+
+
+  // --- STATIC FIELDS --- //
+
+    private: static SPtr<KRecordType> HISTOGRAM_T;
+    public: static const k_octet_t HISTOGRAM_T_COUNT = 0;
+    public: static const k_octet_t HISTOGRAM_T_TOTAL = 1;
+    public: static const k_octet_t HISTOGRAM_T_MAX   = 2;
+    public: static const k_octet_t HISTOGRAM_T_P50   = 3;
+    public: static const k_octet_t HISTOGRAM_T_P90   = 4;
+    public: static const k_octet_t HISTOGRAM_T_P99   = 5;
+
+    private: static SPtr<KRecordType> OPCODE_T;
+    public: static const k_octet_t OPCODE_T_OPCODE = 0;
+    public: static const k_octet_t OPCODE_T_TIME   = 1;
+
+    private: static SPtr<KRecordType> METRICS_T;
+    public: static const k_octet_t METRICS_T_QUEUE_DEPTH     = 0;
+    public: static const k_octet_t METRICS_T_MAX_QUEUE_DEPTH = 1;
+    public: static const k_octet_t METRICS_T_N_QUEUE_FULL    = 2;
+    public: static const k_octet_t METRICS_T_N_TRANSACTIONS  = 3;
+    public: static const k_octet_t METRICS_T_N_TIMEOUTS      = 4;
+    public: static const k_octet_t METRICS_T_QUEUE_TIME      = 5;
+    public: static const k_octet_t METRICS_T_OPCODES         = 6;
+
+
+  // --- FIELDS --- //
+
+    private: volatile int _maxQueueDepth;
+    private: volatile k_longint_t _nTransactions;
+    private: volatile k_longint_t _nTimeouts;
+    private: Histogram _queueTime;
+    private: map<k_longint_t, Histogram*> _handlerTimes;
+    private: mutable pthread_mutex_t _mutex;
+
+
+  // --- STATIC METHODS --- //
+
+    public: static inline kf_int64_t getTime();
+    public: static PPtr<KRecordType> histogram_t();
+    public: static PPtr<KRecordType> opcode_t();
+    public: static PPtr<KRecordType> metrics_t();
+    public: static void init(Runtime& rt);
+
+
+  // --- (DE)CONSTRUCTORS --- //
+
+    public: AgentMetrics();
+    private: AgentMetrics(const AgentMetrics&);
+    public: ~AgentMetrics();
+
+
+  // --- METHODS --- //
+
+    private: AgentMetrics& operator=(const AgentMetrics&);
+    public: void sampleQueueDepth(int depth);
+    public: void countTransaction();
+    public: void countTimeout();
+    public: Histogram& getQueueTime();
+    public: Histogram* getHandlerTime(k_longint_t opcodeHash);
+    public: int getMaxQueueDepth() const;
+    public: k_longint_t getNumberOfTransactions() const;
+    public: k_longint_t getNumberOfTimeouts() const;
+    public: const Histogram& getQueueTime() const;
+    public: const Histogram* findHandlerTime(k_longint_t opcodeHash) const;
+    public: void getOpcodeHashes(vector<k_longint_t>& hashes) const;
+    public: Ptr<KRecord> toRecord(int queueDepth, k_longint_t nQueueFull)
+        const;
+
+  };
+
+
+  /**
+   * Returns monotonic time in nanoseconds, the time base of all histograms.
+   */
+
+  inline kf_int64_t AgentMetrics::getTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (kf_int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+
+} // namespace knorba
+
+#endif /* defined(KNORBA_AGENTMETRICS_H) */
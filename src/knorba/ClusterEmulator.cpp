@@ -0,0 +1,603 @@
+/*---[ClusterEmulator.cpp]-------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::ClusterEmulator::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+// KFoundation
+#include <kfoundation/Int.h>
+
+// Internal
+#include "type/KValue.h"
+#include "Agent.h"
+#include "Message.h"
+#include "Scheduler.h"
+
+// Self
+#include "ClusterEmulator.h"
+
+namespace knorba {
+
+//\/ ClusterEmulator::LinkModel /\/////////////////////////////////////////////
+
+  /**
+   * Constructor. The default model has no latency, no jitter and unlimited
+   * bandwidth.
+   */
+
+  ClusterEmulator::LinkModel::LinkModel()
+  : latency(0),
+    bandwidth(0),
+    jitter(0),
+    jitterModel(UNIFORM)
+  {
+    // Nothing;
+  }
+
+
+//\/ ClusterEmulator::Node /\//////////////////////////////////////////////////
+
+  ClusterEmulator::Node::Node(ClusterEmulator& owner, k_integer_t rank)
+  : _owner(owner),
+    _rank(rank)
+  {
+    _guid = owner.getGuid();
+    _guid.nodeRank = (kf_int16_t)rank;
+  }
+
+
+  ClusterEmulator::Node::~Node() {
+    // Nothing;
+  }
+
+
+  const k_guid_t& ClusterEmulator::Node::getGuid() const {
+    return _guid;
+  }
+
+
+  void ClusterEmulator::Node::registerType(PPtr<KType> type) {
+    _owner.registerType(type);
+  }
+
+
+  PPtr<KType> ClusterEmulator::Node::getTypeByHash(const k_longint_t hash)
+      const
+  {
+    return _owner.getTypeByHash(hash);
+  }
+
+
+  const k_guid_t& ClusterEmulator::Node::getConsoleGuid() const {
+    return _owner.getConsoleGuid();
+  }
+
+
+  const string& ClusterEmulator::Node::getAppName() const {
+    return _owner.getAppName();
+  }
+
+
+  k_integer_t ClusterEmulator::Node::getNodeCount() const {
+    return _owner.getNodeCount();
+  }
+
+
+  /** Node 0 is the head. */
+  bool ClusterEmulator::Node::isHead() const {
+    return _rank == 0;
+  }
+
+
+  void ClusterEmulator::Node::signalQuit() {
+    _owner.signalQuit();
+  }
+
+
+  PPtr<Path> ClusterEmulator::Node::getResourcePathForAgent(
+      const Agent* itself) const
+  {
+    return _owner.getResourcePathForAgent(itself);
+  }
+
+
+  PPtr<Path> ClusterEmulator::Node::getDataPathForAgent(const Agent* itself)
+      const
+  {
+    return _owner.getDataPathForAgent(itself);
+  }
+
+
+  const string& ClusterEmulator::Node::getClassNameForAgent(
+      const Agent* itself) const
+  {
+    return _owner.getClassNameForAgent(itself);
+  }
+
+
+  const string& ClusterEmulator::Node::getAliasForAgent(const Agent* itself)
+      const
+  {
+    return _owner.getAliasForAgent(itself);
+  }
+
+
+  const k_guid_t& ClusterEmulator::Node::getAgentGuidByAlias(
+      const string& alias) const
+  {
+    return _owner.getAgentGuidByAlias(alias);
+  }
+
+
+  void ClusterEmulator::Node::registerMessageFormat(PPtr<KString> opcode,
+      PPtr<KType> payloadType)
+  {
+    _owner.registerMessageFormat(opcode, payloadType);
+  }
+
+
+  PPtr<KType> ClusterEmulator::Node::getMessageFormatByHash(
+      const k_longint_t hash) const
+  {
+    return _owner.getMessageFormatByHash(hash);
+  }
+
+
+  PPtr<KString> ClusterEmulator::Node::getMessageOpCodeForHash(
+      const k_longint_t hash) const
+  {
+    return _owner.getMessageOpCodeForHash(hash);
+  }
+
+
+  void ClusterEmulator::Node::send(const k_guid_t& sender,
+      const k_guid_t& receiver, const k_longint_t opcode,
+      PPtr<KValue> content, const k_integer_t tid)
+  {
+    _owner.send(sender, receiver, opcode, content, tid);
+  }
+
+
+  void ClusterEmulator::Node::send(const k_guid_t& sender,
+      PPtr<Group> receivers, const k_longint_t opcode, PPtr<KValue> content,
+      const k_integer_t tid)
+  {
+    _owner.send(sender, receivers, opcode, content, tid);
+  }
+
+
+  void ClusterEmulator::Node::sendToAll(const k_guid_t& sender,
+      const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+  {
+    _owner.sendToAll(sender, opcode, content, tid);
+  }
+
+
+  void ClusterEmulator::Node::sendToLocals(const k_guid_t& sender,
+      const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+  {
+    _owner.sendToLocals(sender, opcode, content, tid);
+  }
+
+
+  void ClusterEmulator::Node::sendMove(const k_guid_t& sender,
+      const k_guid_t& receiver, const k_longint_t opcode,
+      PPtr<KValue> content, const k_integer_t tid)
+  {
+    _owner.sendMove(sender, receiver, opcode, content, tid);
+  }
+
+
+//\/ ClusterEmulator::Event /\/////////////////////////////////////////////////
+
+  /**
+   * Inverted, so that the earliest event is on top of the heap.
+   */
+
+  bool ClusterEmulator::Event::operator<(const Event& other) const {
+    return time > other.time || (time == other.time && seq > other.seq);
+  }
+
+
+//\/ ClusterEmulator /\////////////////////////////////////////////////////////
+
+// --- STATIC FIELDS --- //
+
+  const int ClusterEmulator::HEADER_SIZE;
+  const int ClusterEmulator::RECEIVER_SIZE;
+  const int ClusterEmulator::STOP_CHECK_INTERVAL;
+
+
+// --- STATIC METHODS --- //
+
+  /**
+   * Returns the real time in microseconds, on the same clock used by
+   * pthread_cond_timedwait().
+   */
+
+  kf_int64_t ClusterEmulator::getRealTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (kf_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+
+  /**
+   * Advances the given xorshift* state, and returns a number uniformly
+   * distributed in [0, 1).
+   */
+
+  double ClusterEmulator::nextRandom(kf_uint64_t& state) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (double)((state * 2685821657736338717ULL) >> 11)
+        / 9007199254740992.0;
+  }
+
+
+  void* ClusterEmulator::courierMain(void* owner) {
+    ((ClusterEmulator*)owner)->runCourier();
+    return NULL;
+  }
+
+
+// --- (DE)CONSTRUCTORS --- //
+
+  /**
+   * Constructor.
+   *
+   * @param nNodes The number of nodes to emulate.
+   * @param virtualClock Whether to use a virtual clock instead of the real
+   *        one.
+   * @param seed Seed for the jitter generators.
+   * @param appName The name to be returned by getAppName().
+   * @param capacity The maximum number of agents.
+   */
+
+  ClusterEmulator::ClusterEmulator(k_integer_t nNodes, bool virtualClock,
+      kf_int64_t seed, const string& appName, int capacity)
+  : LocalRuntime(nNodes, appName, capacity)
+  {
+    _nodes = new Node*[nNodes];
+    for(int i = 0; i < nNodes; i++) {
+      _nodes[i] = new Node(*this, i);
+    }
+
+    int nLinks = nNodes * nNodes;
+    _links = new Link[nLinks];
+    for(int i = 0; i < nLinks; i++) {
+      Link& link = _links[i];
+      link.busyUntil = 0;
+      link.lastArrival = 0;
+      link.seed = (kf_uint64_t)seed + (i + 1) * 0x9E3779B97F4A7C15ULL;
+      if(link.seed == 0) {
+        link.seed = 1;
+      }
+    }
+
+    _isVirtual = virtualClock;
+    _startTime = getRealTime();
+    _clock = 0;
+
+    _nForwarded = 0;
+    _nFrames = 0;
+    _stopFlag = false;
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+
+    pthread_create(&_courier, NULL, &ClusterEmulator::courierMain, this);
+  }
+
+
+  /**
+   * Deconstructor. Messages still in transit are dropped. Deletes all
+   * agents.
+   */
+
+  ClusterEmulator::~ClusterEmulator() {
+    __atomic_store_n(&_stopFlag, true, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&_mutex);
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+
+    pthread_join(_courier, NULL);
+
+    _events.clear();
+    deleteAgents();
+
+    for(int i = 0; i < getNodeCount(); i++) {
+      delete _nodes[i];
+    }
+    delete[] _nodes;
+    delete[] _links;
+
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+  }
+
+
+// --- METHODS --- //
+
+  /**
+   * Returns the emulated time in microseconds.
+   */
+
+  kf_int64_t ClusterEmulator::now() const {
+    if(_isVirtual) {
+      return __atomic_load_n(&_clock, __ATOMIC_ACQUIRE);
+    }
+    return getRealTime() - _startTime;
+  }
+
+
+  kf_int64_t ClusterEmulator::drawJitter(Link& link) {
+    kf_int64_t jitter = link.model.jitter;
+    if(jitter <= 0) {
+      return 0;
+    }
+
+    double u = nextRandom(link.seed);
+    if(link.model.jitterModel == LinkModel::EXPONENTIAL) {
+      return (kf_int64_t)(-jitter * log(1.0 - u));
+    }
+    return (kf_int64_t)(u * (jitter + 1));
+  }
+
+
+  /**
+   * Blocks until the Scheduler runs out of work, to let the handlers of the
+   * messages just delivered finish, and whatever they send in turn reach
+   * forward(). Wakes up every STOP_CHECK_INTERVAL milliseconds to see if
+   * the emulator is stopping.
+   *
+   * @return `false` if the emulator is stopping.
+   */
+
+  bool ClusterEmulator::waitForIdle() {
+    Scheduler& scheduler = Scheduler::getDefault();
+    while(!scheduler.waitForIdle(STOP_CHECK_INTERVAL)) {
+      if(__atomic_load_n(&_stopFlag, __ATOMIC_ACQUIRE)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+
+  /**
+   * Body of the courier thread. Delivers the messages in transit in the
+   * order of their arrival time, once that time is reached.
+   */
+
+  void ClusterEmulator::runCourier() {
+    pthread_mutex_lock(&_mutex);
+
+    while(!__atomic_load_n(&_stopFlag, __ATOMIC_ACQUIRE)) {
+      if(_events.empty()) {
+        pthread_cond_wait(&_cond, &_mutex);
+        continue;
+      }
+
+      kf_int64_t then = _events[0].time;
+
+      if(_isVirtual) {
+        if(then > _clock) {
+          pthread_mutex_unlock(&_mutex);
+          bool isIdle = waitForIdle();
+          pthread_mutex_lock(&_mutex);
+
+          // Something earlier may have been sent in the meantime.
+          if(isIdle && _events[0].time > _clock) {
+            __atomic_store_n(&_clock, _events[0].time, __ATOMIC_RELEASE);
+          }
+          continue;
+        }
+      } else {
+        kf_int64_t time = _startTime + then;
+        if(time > getRealTime()) {
+          struct timespec ts;
+          ts.tv_sec = (time_t)(time / 1000000);
+          ts.tv_nsec = (long)(time % 1000000) * 1000;
+          pthread_cond_timedwait(&_cond, &_mutex, &ts);
+          continue;
+        }
+      }
+
+      pop_heap(_events.begin(), _events.end());
+      Event event = _events.back();
+      _events.pop_back();
+
+      pthread_mutex_unlock(&_mutex);
+      fanOut(event.frame);
+      event.frame = NULL;
+      pthread_mutex_lock(&_mutex);
+    }
+
+    pthread_mutex_unlock(&_mutex);
+  }
+
+
+  /**
+   * Returns the runtime representing the given node.
+   */
+
+  Runtime& ClusterEmulator::getRuntimeForNode(k_integer_t node) {
+    return *_nodes[node];
+  }
+
+
+  /**
+   * Puts the given frame on the link between the sender's node and the
+   * receivers', to be fanned out by the courier thread when it arrives.
+   */
+
+  void ClusterEmulator::forward(PPtr<Frame> frame) {
+    int from = frame->sender.nodeRank;
+    int to = frame->nodeRank;
+    int nReceivers = (int)frame->receivers.size();
+    kf_int64_t size = HEADER_SIZE + (nReceivers - 1) * RECEIVER_SIZE
+        + frame->payload->getTotalSizeInOctets();
+
+    pthread_mutex_lock(&_mutex);
+
+    if(__atomic_load_n(&_stopFlag, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_unlock(&_mutex);
+      return;
+    }
+
+    Link& link = _links[from * getNodeCount() + to];
+
+    kf_int64_t time = now();
+    if(link.busyUntil > time) {
+      time = link.busyUntil;
+    }
+
+    if(link.model.bandwidth > 0) {
+      time += (kf_int64_t)(size * 1e6 / link.model.bandwidth);
+    }
+
+    link.busyUntil = time;
+
+    time += link.model.latency + drawJitter(link);
+    if(time < link.lastArrival) {
+      time = link.lastArrival;
+    }
+
+    link.lastArrival = time;
+
+    Event event;
+    event.time = time;
+    event.seq = _nFrames++;
+    _nForwarded += nReceivers;
+    event.frame = frame;
+    _events.push_back(event);
+    push_heap(_events.begin(), _events.end());
+
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+  }
+
+
+  /**
+   * Sets the model of all links.
+   */
+
+  void ClusterEmulator::setLinkModel(const LinkModel& model) {
+    pthread_mutex_lock(&_mutex);
+    int nLinks = getNodeCount() * getNodeCount();
+    for(int i = 0; i < nLinks; i++) {
+      _links[i].model = model;
+    }
+    pthread_mutex_unlock(&_mutex);
+  }
+
+
+  /**
+   * Sets the model of the link from one node to another. Links are one-way;
+   * the link in the opposite direction is not affected.
+   *
+   * @param from Rank of the sending node.
+   * @param to Rank of the receiving node.
+   * @param model The model to set.
+   */
+
+  void ClusterEmulator::setLinkModel(k_integer_t from, k_integer_t to,
+      const LinkModel& model)
+  {
+    k_integer_t nNodes = getNodeCount();
+    if(from < 0 || from >= nNodes || to < 0 || to >= nNodes) {
+      throw KFException("Node rank should be between 0 and "
+          + Int::toString(nNodes - 1) + ". Given: " + Int::toString(from)
+          + " -> " + Int::toString(to));
+    }
+
+    pthread_mutex_lock(&_mutex);
+    _links[from * nNodes + to].model = model;
+    pthread_mutex_unlock(&_mutex);
+  }
+
+
+  /**
+   * Returns the model of the link from one node to another.
+   *
+   * @param from Rank of the sending node.
+   * @param to Rank of the receiving node.
+   */
+
+  const ClusterEmulator::LinkModel& ClusterEmulator::getLinkModel(
+      k_integer_t from, k_integer_t to) const
+  {
+    k_integer_t nNodes = getNodeCount();
+    if(from < 0 || from >= nNodes || to < 0 || to >= nNodes) {
+      throw KFException("Node rank should be between 0 and "
+          + Int::toString(nNodes - 1) + ". Given: " + Int::toString(from)
+          + " -> " + Int::toString(to));
+    }
+
+    return _links[from * nNodes + to].model;
+  }
+
+
+  /**
+   * Checks if this emulator runs on a virtual clock.
+   */
+
+  bool ClusterEmulator::isVirtualClock() const {
+    return _isVirtual;
+  }
+
+
+  /**
+   * Returns the emulated time in microseconds since the emulator was
+   * constructed.
+   */
+
+  kf_int64_t ClusterEmulator::getTime() const {
+    return now();
+  }
+
+
+  /**
+   * Returns the number of messages forwarded between nodes so far, counting
+   * a multicast message once for each receiver.
+   */
+
+  kf_int64_t ClusterEmulator::getNumberOfForwardedMessages() const {
+    pthread_mutex_lock(&_mutex);
+    kf_int64_t n = _nForwarded;
+    pthread_mutex_unlock(&_mutex);
+    return n;
+  }
+
+
+  /**
+   * Returns the number of frames forwarded between nodes so far. A
+   * multicast message makes one frame for each node it reaches other than
+   * the sender's.
+   */
+
+  kf_int64_t ClusterEmulator::getNumberOfForwardedFrames() const {
+    pthread_mutex_lock(&_mutex);
+    kf_int64_t n = _nFrames;
+    pthread_mutex_unlock(&_mutex);
+    return n;
+  }
+
+} // namespace knorba
@@ -0,0 +1,242 @@
+/*---[ClusterEmulator.h]---------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::ClusterEmulator::*
+ |  Implements: -
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_CLUSTEREMULATOR_H
+#define KNORBA_CLUSTEREMULATOR_H
+
+// Std
+#include <vector>
+#include <pthread.h>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+
+// Internal
+#include "LocalRuntime.h"
+
+namespace knorba {
+
+  using namespace std;
+  using namespace kfoundation;
+
+
+  /**
+   * LocalRuntime that emulates the network between the nodes of a cluster.
+   * Each node is seen by its agents as a separate ARE, with its own GUID,
+   * node rank and isHead() result.
+   *
+   * Messages between agents on the same node are delivered right away.
+   * Messages between nodes travel over a link, one for each ordered pair of
+   * nodes, whose behaviour is described by a LinkModel. A message starts
+   * transmitting when the link is done with the previous ones, takes
+   * `size / bandwidth` to transmit, and arrives after `latency` plus a random
+   * jitter. Messages over the same link arrive in the order they were sent.
+   * A multicast message travels to each node as a single frame, whose size
+   * counts the payload once and each receiver GUID, so the links see the
+   * traffic of a runtime that fans out on the receiving side.
+   *
+   *     ClusterEmulator rt(64, true);
+   *     ClusterEmulator::LinkModel model;
+   *     model.latency = 5;
+   *     model.bandwidth = 1e9;
+   *     rt.setLinkModel(model);
+   *
+   * In virtual-clock mode, time does not pass by itself. getTime() jumps to
+   * the arrival time of the next message whenever the Scheduler runs out of
+   * work, so a run takes only as long as the computation, and the order of
+   * arrivals depends on the models and the seed only. Note that agents
+   * blocked in tsend() count as out of work, and that timeouts still use the
+   * real clock. In real-time mode, messages arrive at their emulated time on
+   * the real clock.
+   *
+   * Jitter is drawn from a separate generator for each link, seeded from the
+   * given seed, so that a run can be repeated.
+   *
+   * @headerfile ClusterEmulator.h <knorba/ClusterEmulator.h>
+   */
+
+  class ClusterEmulator : public LocalRuntime {
+
+  // --- NESTED TYPES --- //
+
+    /**
+     * Describes the behaviour of a link between two nodes.
+     */
+
+    public: struct LinkModel {
+      enum JitterModel {
+        UNIFORM,    ///< Jitter is uniform between 0 and `jitter`.
+        EXPONENTIAL ///< Jitter is exponential with `jitter` as the mean.
+      };
+
+      /** Time to travel the link, in microseconds. */
+      kf_int64_t latency;
+
+      /** Octets per second, or 0 for unlimited. */
+      double bandwidth;
+
+      /** Magnitude of random delay added to the latency, in microseconds. */
+      kf_int64_t jitter;
+
+      /** Distribution of the random delay. */
+      JitterModel jitterModel;
+
+      LinkModel();
+    };
+
+
+    private: class Node : public Runtime {
+      private: ClusterEmulator& _owner;
+      private: k_guid_t _guid;
+      private: k_integer_t _rank;
+
+      public: Node(ClusterEmulator& owner, k_integer_t rank);
+      public: virtual ~Node();
+      public: const k_guid_t& getGuid() const;
+      public: void registerType(PPtr<KType> type);
+      public: PPtr<KType> getTypeByHash(const k_longint_t hash) const;
+      public: const k_guid_t& getConsoleGuid() const;
+      public: const string& getAppName() const;
+      public: k_integer_t getNodeCount() const;
+      public: bool isHead() const;
+      public: void signalQuit();
+      public: PPtr<Path> getResourcePathForAgent(const Agent* itself) const;
+      public: PPtr<Path> getDataPathForAgent(const Agent* itself) const;
+      public: const string& getClassNameForAgent(const Agent* itself) const;
+      public: const string& getAliasForAgent(const Agent* itself) const;
+      public: const k_guid_t& getAgentGuidByAlias(const string& alias) const;
+
+      public: void registerMessageFormat(PPtr<KString> opcode,
+          PPtr<KType> payloadType);
+
+      public: PPtr<KType> getMessageFormatByHash(const k_longint_t hash)
+          const;
+
+      public: PPtr<KString> getMessageOpCodeForHash(const k_longint_t hash)
+          const;
+
+      public: void send(const k_guid_t& sender, const k_guid_t& receiver,
+          const k_longint_t opcode, PPtr<KValue> content,
+          const k_integer_t tid);
+
+      public: void send(const k_guid_t& sender, PPtr<Group> receivers,
+          const k_longint_t opcode, PPtr<KValue> content,
+          const k_integer_t tid);
+
+      public: void sendToAll(const k_guid_t& sender,
+          const k_longint_t opcode, PPtr<KValue> content,
+          const k_integer_t tid);
+
+      public: void sendToLocals(const k_guid_t& sender,
+          const k_longint_t opcode, PPtr<KValue> content,
+          const k_integer_t tid);
+
+      public: void sendMove(const k_guid_t& sender, const k_guid_t& receiver,
+          const k_longint_t opcode, PPtr<KValue> content,
+          const k_integer_t tid);
+    };
+
+
+    private: struct Link {
+      LinkModel  model;
+      kf_int64_t busyUntil;
+      kf_int64_t lastArrival;
+      kf_uint64_t seed;
+    };
+
+
+    private: struct Event {
+      kf_int64_t   time;
+      kf_int64_t   seq;
+      Ptr<Frame>   frame;
+      bool operator<(const Event& other) const;
+    };
+
+
+  // --- STATIC FIELDS --- //
+
+    /** Octets added to the payload size of each message for its header. */
+    public: static const int HEADER_SIZE = 40;
+
+    /** Octets added to a frame for each receiver after the first. */
+    public: static const int RECEIVER_SIZE = 16;
+
+    private: static const int STOP_CHECK_INTERVAL = 100;
+
+
+  // --- FIELDS --- //
+
+    private: Node** _nodes;
+    private: Link* _links;
+    private: bool _isVirtual;
+    private: kf_int64_t _startTime;
+    private: volatile kf_int64_t _clock;
+
+    // Events //
+    private: vector<Event> _events;
+    private: kf_int64_t _nForwarded;
+    private: kf_int64_t _nFrames;
+    private: volatile bool _stopFlag;
+    private: pthread_t _courier;
+    private: mutable pthread_mutex_t _mutex;
+    private: pthread_cond_t _cond;
+
+
+  // --- STATIC METHODS --- //
+
+    private: static kf_int64_t getRealTime();
+    private: static double nextRandom(kf_uint64_t& state);
+    private: static void* courierMain(void* owner);
+
+
+  // --- (DE)CONSTRUCTORS --- //
+
+    public: ClusterEmulator(k_integer_t nNodes, bool virtualClock = false,
+        kf_int64_t seed = 1, const string& appName = "emulator",
+        int capacity = DEFAULT_CAPACITY);
+
+    private: ClusterEmulator(const ClusterEmulator&);
+    public: ~ClusterEmulator();
+
+
+  // --- METHODS --- //
+
+    private: ClusterEmulator& operator=(const ClusterEmulator&);
+    private: kf_int64_t now() const;
+    private: kf_int64_t drawJitter(Link& link);
+    private: bool waitForIdle();
+    private: void runCourier();
+
+    protected: Runtime& getRuntimeForNode(k_integer_t node);
+    protected: void forward(PPtr<Frame> frame);
+
+    public: void setLinkModel(const LinkModel& model);
+    public: void setLinkModel(k_integer_t from, k_integer_t to,
+        const LinkModel& model);
+
+    public: const LinkModel& getLinkModel(k_integer_t from, k_integer_t to)
+        const;
+
+    public: bool isVirtualClock() const;
+    public: kf_int64_t getTime() const;
+    public: kf_int64_t getNumberOfForwardedMessages() const;
+    public: kf_int64_t getNumberOfForwardedFrames() const;
+
+  };
+
+} // namespace knorba
+
+#endif /* defined(KNORBA_CLUSTEREMULATOR_H) */
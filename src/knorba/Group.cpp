@@ -14,20 +14,90 @@
  |
  *//////////////////////////////////////////////////////////////////////////////
 
+// Std
+#include <cstring>
 
 // KFoundation
 #include <kfoundation/Ptr.h>
+#include <kfoundation/Int.h>
 #include <kfoundation/Logger.h>
-#include <kfoundation/Mutex.h>
-#include <kfoundation/Array.h>
+#include <kfoundation/IndexOutOfBoundException.h>
 
 // Internal
 #include "type/KGuid.h"
 
+// Self
 #include "Group.h"
 
 namespace knorba {
-  
+
+//\/ Group::Snapshot /\//////////////////////////////////////////////////////////
+
+  /**
+   * Takes a snapshot of the given group. Does not block.
+   */
+
+  Group::Snapshot::Snapshot(const Group& group)
+  : _group(group)
+  {
+    _parity = group.enter();
+    _version = __atomic_load_n(&group._version, __ATOMIC_SEQ_CST);
+    _count = _version == NULL ? 0
+        : __atomic_load_n(&_version->count, __ATOMIC_ACQUIRE);
+  }
+
+
+  /**
+   * Releases this snapshot. The last reader to leave deletes the versions
+   * retired while it was reading, unless a writer holds the group.
+   */
+
+  Group::Snapshot::~Snapshot() {
+    if(_group.leave(_parity)) {
+      _group.tryReclaim();
+    }
+  }
+
+
+  /**
+   * Returns the number of GUIDs in this snapshot.
+   */
+
+  int Group::Snapshot::getCount() const {
+    return _count;
+  }
+
+
+  /**
+   * Returns the GUID at the given index. The reference is valid as long as
+   * this snapshot is.
+   */
+
+  const k_guid_t& Group::Snapshot::get(int index) const {
+    return _version->members[index];
+  }
+
+
+  /**
+   * Checks if this snapshot contains the given GUID.
+   */
+
+  bool Group::Snapshot::containts(const k_guid_t& guid) const {
+    return find(_version, _count, guid);
+  }
+
+
+  /**
+   * Checks if this snapshot is empty.
+   */
+
+  bool Group::Snapshot::isEmpty() const {
+    return _count == 0;
+  }
+
+
+//\/ Group /\///////////////////////////////////////////////////////////////////
+
 // --- STATIC FIELDS --- //
   
   SPtr<Group> Group::EMPTY_GROUP;
@@ -35,6 +105,122 @@ namespace knorba {
   
 // --- STATIC METHODS --- //
 
+  Group::Version* Group::createVersion(int capacity) {
+    if(capacity < 4) {
+      capacity = 4;
+    }
+
+    int nSlots = 8;
+    while(nSlots < 2 * capacity) {
+      nSlots *= 2;
+    }
+
+    Version* v = new Version();
+    v->members = new k_guid_t[capacity];
+    v->capacity = capacity;
+    v->count = 0;
+    v->slots = new int[nSlots];
+    v->nSlots = nSlots;
+    v->nextRetired = NULL;
+    v->isDrained[0] = false;
+    v->isDrained[1] = false;
+    memset((void*)v->slots, 0, nSlots * sizeof(int));
+
+    return v;
+  }
+
+
+  /**
+   * Returns an unpublished copy of the given version, with the same
+   * capacity.
+   */
+
+  Group::Version* Group::copyVersion(const Version* v) {
+    Version* copy = createVersion(v->capacity);
+    memcpy(copy->members, v->members, v->count * sizeof(k_guid_t));
+    memcpy((void*)copy->slots, (const void*)v->slots,
+        v->nSlots * sizeof(int));
+    copy->count = v->count;
+    return copy;
+  }
+
+
+  void Group::deleteVersion(Version* v) {
+    delete[] v->members;
+    delete[] v->slots;
+    delete v;
+  }
+
+
+  /**
+   * Checks if the given GUID is among the first `count` members of the
+   * given version. Safe to call while a writer appends to it.
+   */
+
+  bool Group::find(const Version* v, int count, const k_guid_t& guid) {
+    if(v == NULL || count == 0) {
+      return false;
+    }
+
+    int mask = v->nSlots - 1;
+    int i = (int)KGuid::generateHashFor(guid) & mask;
+    while(true) {
+      int slot = __atomic_load_n(&v->slots[i], __ATOMIC_ACQUIRE);
+      if(slot == 0) {
+        return false;
+      }
+      if(memcmp(&v->members[slot - 1], &guid, sizeof(k_guid_t)) == 0) {
+        return slot <= count;
+      }
+      i = (i + 1) & mask;
+    }
+  }
+
+
+  /**
+   * Returns the index of the given GUID in the given version, or -1 if it
+   * is not there. Should be called with _mutex locked.
+   */
+
+  int Group::indexOf(const Version* v, const k_guid_t& guid) {
+    if(v == NULL) {
+      return -1;
+    }
+
+    int mask = v->nSlots - 1;
+    int i = (int)KGuid::generateHashFor(guid) & mask;
+    while(v->slots[i] != 0) {
+      if(memcmp(&v->members[v->slots[i] - 1], &guid, sizeof(k_guid_t)) == 0)
+      {
+        return v->slots[i] - 1;
+      }
+      i = (i + 1) & mask;
+    }
+    return -1;
+  }
+
+
+  /**
+   * Appends the given GUID to the given version, which should have room for
+   * it and not contain it already. The member is written before it is
+   * indexed, and indexed before it is counted, so that readers never see a
+   * partial entry.
+   */
+
+  void Group::append(Version* v, const k_guid_t& guid) {
+    int mask = v->nSlots - 1;
+    int i = (int)KGuid::generateHashFor(guid) & mask;
+    while(v->slots[i] != 0) {
+      i = (i + 1) & mask;
+    }
+
+    int n = v->count;
+    v->members[n] = guid;
+    __atomic_store_n(&v->slots[i], n + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&v->count, n + 1, __ATOMIC_RELEASE);
+  }
+
+
   /**
    * Returns a constant empty group.
    */
@@ -53,14 +239,196 @@ namespace knorba {
    * Constructs an empty group.
    */
 
-  Group::Group()
-  : _mutex(true)
-  {
-    // Nothing
+  Group::Group() {
+    _version = NULL;
+    _epoch = 0;
+    _nReaders[0] = 0;
+    _nReaders[1] = 0;
+    _retired = NULL;
+    pthread_mutex_init(&_mutex, NULL);
+  }
+
+
+  /**
+   * Deconstructor.
+   */
+
+  Group::~Group() {
+    if(_version != NULL) {
+      deleteVersion(_version);
+    }
+
+    while(_retired != NULL) {
+      Version* next = _retired->nextRetired;
+      deleteVersion(_retired);
+      _retired = next;
+    }
+
+    pthread_mutex_destroy(&_mutex);
   }
 
   
 // --- METHODS --- //
+
+  /**
+   * Marks the calling thread as reading this group. Versions retired after
+   * this call are not deleted until leave() is called.
+   *
+   * @return The value to pass to leave().
+   */
+
+  int Group::enter() const {
+    int parity = __atomic_load_n(&_epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&_nReaders[parity], 1, __ATOMIC_SEQ_CST);
+    return parity;
+  }
+
+
+  /**
+   * Marks the calling thread as done reading this group.
+   *
+   * @param parity The value returned by enter().
+   * @return `true` if the calling thread was the last reader of its epoch.
+   */
+
+  bool Group::leave(int parity) const {
+    return __atomic_sub_fetch(&_nReaders[parity], 1, __ATOMIC_SEQ_CST) == 0;
+  }
+
+
+  void Group::lock() const {
+    pthread_mutex_lock(&_mutex);
+  }
+
+
+  /**
+   * Deletes what retired versions it can, then lets the next writer in.
+   */
+
+  void Group::unlock() const {
+    if(_retired != NULL) {
+      reclaim();
+    }
+    pthread_mutex_unlock(&_mutex);
+  }
+
+
+  /**
+   * Deletes the retired versions that no reader can be looking at, if any,
+   * without waiting for the mutex. If a writer holds it, that writer
+   * reclaims on its way out.
+   */
+
+  void Group::tryReclaim() const {
+    if(__atomic_load_n(&_retired, __ATOMIC_ACQUIRE) == NULL) {
+      return;
+    }
+
+    if(pthread_mutex_trylock(&_mutex) == 0) {
+      reclaim();
+      pthread_mutex_unlock(&_mutex);
+    }
+  }
+
+
+  /**
+   * Replaces the current version with the given one, and retires the old
+   * one. Should be called with _mutex locked; unlock() then deletes the
+   * versions no longer in use.
+   *
+   * Readers register with one of two counters, chosen by the parity of
+   * _epoch. Each publish flips the epoch, so that new readers use the other
+   * counter and the one in use before drains.
+   */
+
+  void Group::publish(Version* v) {
+    Version* old = _version;
+    __atomic_store_n(&_version, v, __ATOMIC_SEQ_CST);
+
+    if(old != NULL) {
+      old->nextRetired = _retired;
+      __atomic_store_n(&_retired, old, __ATOMIC_RELEASE);
+    }
+
+    __atomic_add_fetch(&_epoch, 1, __ATOMIC_SEQ_CST);
+  }
+
+
+  /**
+   * Deletes the retired versions that no reader can be looking at. A reader
+   * that may have seen a version was registered before it was retired, so
+   * once each counter has been seen at zero after the version was retired,
+   * the version is unreachable. Should be called with _mutex locked.
+   */
+
+  void Group::reclaim() const {
+    bool isDrained0 = __atomic_load_n(&_nReaders[0], __ATOMIC_SEQ_CST) == 0;
+    bool isDrained1 = __atomic_load_n(&_nReaders[1], __ATOMIC_SEQ_CST) == 0;
+
+    Version* volatile* p = &_retired;
+    while(*p != NULL) {
+      Version* v = *p;
+      v->isDrained[0] = v->isDrained[0] || isDrained0;
+      v->isDrained[1] = v->isDrained[1] || isDrained1;
+      if(v->isDrained[0] && v->isDrained[1]) {
+        __atomic_store_n(p, v->nextRetired, __ATOMIC_RELEASE);
+        deleteVersion(v);
+      } else {
+        p = &v->nextRetired;
+      }
+    }
+  }
+
+
+  /**
+   * Publishes a copy of the current version with the given capacity. Should
+   * be called with _mutex locked.
+   */
+
+  void Group::grow(int capacity) {
+    Version* v = createVersion(capacity);
+    if(_version != NULL) {
+      for(int i = 0; i < _version->count; i++) {
+        append(v, _version->members[i]);
+      }
+    }
+    publish(v);
+  }
+
+
+  /**
+   * Adds the given GUID, if it is not already added. Should be called with
+   * _mutex locked.
+   */
+
+  void Group::addUnlocked(const k_guid_t& guid) {
+    if(_version != NULL && find(_version, _version->count, guid)) {
+      return;
+    }
+
+    if(_version == NULL || _version->count == _version->capacity) {
+      grow(_version == NULL ? 4 : _version->capacity * 2);
+    }
+
+    append(_version, guid);
+  }
+
+
+  /**
+   * Makes room for the given number of members, so that a large group can be
+   * built without copying. This method is thread safe.
+   *
+   * @param capacity The number of members expected.
+   */
+
+  void Group::reserve(int capacity) {
+    lock();
+    if(_version == NULL || capacity > _version->capacity) {
+      grow(capacity);
+    }
+    unlock();
+  }
+
   
   /**
    * Adds a new GUID, if it is not already added. This method is thread safe.
@@ -69,11 +437,9 @@ namespace knorba {
    */
 
   void Group::add(const k_guid_t& guid) {
-    KF_SYNCHRONIZED(_mutex,
-      if(!containts(guid)) {
-        _members.push(guid);
-      }
-    )
+    lock();
+    addUnlocked(guid);
+    unlock();
   }
 
 
@@ -85,38 +451,133 @@ namespace knorba {
    */
 
   void Group::add(PPtr<Group> group) {
-    KF_SYNCHRONIZED(_mutex,
-      for(int i = group->_members.getSize() - 1; i >= 0; i--) {
-        _members.push(group->_members.at(i));
+    Snapshot others(*group);
+    if(others.isEmpty()) {
+      return;
+    }
+
+    lock();
+    int count = _version == NULL ? 0 : _version->count;
+    int capacity = _version == NULL ? 4 : _version->capacity;
+    if(count + others.getCount() > capacity) {
+      while(capacity < count + others.getCount()) {
+        capacity *= 2;
       }
-    )
+      grow(capacity);
+    }
+
+    for(int i = 0; i < others.getCount(); i++) {
+      addUnlocked(others.get(i));
+    }
+    unlock();
   }
   
 
   /**
-   * Removes a GUID from this group, if it exists. This method is thread safe.
+   * Removes a GUID from this group, if it exists. The last member is moved
+   * into its place. This method is thread safe.
    *
    * @param guid The GUID to remove.
    */
 
   void Group::remove(const k_guid_t& guid) {
-    KF_SYNCHRONIZED(_mutex,
-      int index = _members.indexOf(guid);
-      if(index >= 0) {
-        _members.remove(index);
+    lock();
+    if(_version != NULL && find(_version, _version->count, guid)) {
+      Version* v = copyVersion(_version);
+      int mask = v->nSlots - 1;
+      int slot = (int)KGuid::generateHashFor(guid) & mask;
+      while(memcmp(&v->members[v->slots[slot] - 1], &guid,
+          sizeof(k_guid_t)) != 0)
+      {
+        slot = (slot + 1) & mask;
       }
-    )
+
+      // Fill the gap with the last member.
+      int index = v->slots[slot] - 1;
+      int last = v->count - 1;
+      if(index != last) {
+        int i = (int)KGuid::generateHashFor(v->members[last]) & mask;
+        while(v->slots[i] != last + 1) {
+          i = (i + 1) & mask;
+        }
+        v->slots[i] = index + 1;
+        v->members[index] = v->members[last];
+      }
+      v->count = last;
+
+      // Shift back the entries that probed past the removed one.
+      int i = slot;
+      int j = slot;
+      while(true) {
+        j = (j + 1) & mask;
+        if(v->slots[j] == 0) {
+          break;
+        }
+        int home = (int)KGuid::generateHashFor(v->members[v->slots[j] - 1])
+            & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)) {
+          v->slots[i] = v->slots[j];
+          i = j;
+        }
+      }
+      v->slots[i] = 0;
+
+      publish(v);
+    }
+    unlock();
   }
   
 
+  /**
+   * Removes the given GUIDs from this group, those that exist. Publishes one
+   * new version for all of them, so it takes time proportional to the size
+   * of the group plus the number of GUIDs given, rather than their product.
+   * The remaining members keep their order. This method is thread safe.
+   *
+   * @param guids The GUIDs to remove.
+   */
+
+  void Group::remove(const vector<k_guid_t>& guids) {
+    lock();
+    if(_version != NULL && !guids.empty()) {
+      vector<bool> isRemoved(_version->count, false);
+      int nRemoved = 0;
+      for(vector<k_guid_t>::const_iterator i = guids.begin();
+          i != guids.end(); i++)
+      {
+        int index = indexOf(_version, *i);
+        if(index >= 0 && !isRemoved[index]) {
+          isRemoved[index] = true;
+          nRemoved++;
+        }
+      }
+
+      if(nRemoved == _version->count) {
+        publish(NULL);
+      } else if(nRemoved > 0) {
+        Version* v = createVersion(_version->capacity);
+        for(int i = 0; i < _version->count; i++) {
+          if(!isRemoved[i]) {
+            append(v, _version->members[i]);
+          }
+        }
+        publish(v);
+      }
+    }
+    unlock();
+  }
+
+
   /**
    * Removes all GUIDs in this group. This method is thread safe.
    */
 
   void Group::clear() {
-    KF_SYNCHRONIZED(_mutex,
-      _members.clear();
-    )
+    lock();
+    if(_version != NULL) {
+      publish(NULL);
+    }
+    unlock();
   }
 
 
@@ -125,7 +586,8 @@ namespace knorba {
    */
   
   int Group::getCount() const {
-    return _members.getSize();
+    Snapshot members(*this);
+    return members.getCount();
   }
   
 
@@ -133,8 +595,13 @@ namespace knorba {
    * Returns the GUID at the given index.
    */
 
-  const k_guid_t& Group::get(int index) const {
-    return _members.at(index);
+  k_guid_t Group::get(int index) const {
+    Snapshot members(*this);
+    if(index < 0 || index >= members.getCount()) {
+      throw IndexOutOfBoundException("Asked for member " + Int(index)
+          + " of group of size " + Int(members.getCount()));
+    }
+    return members.get(index);
   }
 
 
@@ -143,7 +610,8 @@ namespace knorba {
    */
   
   bool Group::containts(const k_guid_t& guid) const {
-    return _members.indexOf(guid) >= 0;
+    Snapshot members(*this);
+    return members.containts(guid);
   }
 
 
@@ -152,7 +620,23 @@ namespace knorba {
    */
   
   bool Group::isEmpty() const {
-    return _members.isEmpty();
+    return getCount() == 0;
+  }
+
+
+  /**
+   * Returns the number of old versions not yet deleted, because a reader
+   * could still be looking at them.
+   */
+
+  int Group::getNumberOfRetiredVersions() const {
+    pthread_mutex_lock(&_mutex);
+    int n = 0;
+    for(const Version* v = _retired; v != NULL; v = v->nextRetired) {
+      n++;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return n;
   }
   
   
@@ -161,9 +645,10 @@ namespace knorba {
            ->member("members")
            ->collection();
     
+    Snapshot members(*this);
     Ptr<KGuid> value = new KGuid();
-    for(int i = 0; i < _members.getSize(); i++) {
-      value->set(_members.at(i));
+    for(int i = 0; i < members.getCount(); i++) {
+      value->set(members.get(i));
       builder->object<KGuid>(value);
     }
     
@@ -17,15 +17,20 @@
 #ifndef KNORBA_GROUP_H
 #define KNORBA_GROUP_H
 
+// Std
+#include <vector>
+#include <pthread.h>
+
 // KFoundation
-#include <kfoundation/Array.h>
-#include <kfoundation/Mutex.h>
+#include <kfoundation/ManagedObject.h>
+#include <kfoundation/SerializingStreamer.h>
 
 // Internal
 #include "type/definitions.h"
 
 namespace knorba {
   
+  using namespace std;
   using namespace kfoundation;
   using namespace knorba::type;
 
@@ -33,10 +38,83 @@ namespace knorba {
    * Represents a group of agents by their GUIDs. add() methods prevent GUIDs
    * to be duplicate.
    *
+   * Members are kept in a dense array, in the order they are added, and
+   * indexed by an open-addressing hash table, so that add() and containts()
+   * take constant time regardless of the size of the group.
+   *
+   * Groups are read far more often than they are changed, e.g. a group of
+   * peers is iterated by each multicast send while peers connect and
+   * disconnect only once in a while. Readers therefore take no lock. Use a
+   * Snapshot to iterate:
+   *
+   *     Group::Snapshot members(*group);
+   *     for(int i = 0; i < members.getCount(); i++) {
+   *       doSomething(members.get(i));
+   *     }
+   *
+   * A snapshot sees the group as it was when the snapshot was taken, no
+   * matter how the group changes in the mean time. Writers are serialized by
+   * a mutex. add() appends in place whenever there is room, without
+   * disturbing readers. remove(), clear() and growing the group build a new
+   * version and publish it. remove() copies the current version, which
+   * takes time proportional to the size of the group, and moves the last
+   * member into the place of the removed one; remove() of a list of GUIDs
+   * builds a single version for all of them, keeping the order of the rest.
+   * Old versions are deleted once
+   * no reader that could have seen them is left, by the last reader to go or
+   * by the next writer, whichever gets the mutex first.
+   *
+   * getCount(), get() and containts() on the group itself look at its
+   * latest version, and are meant for one-off queries. Indices are not
+   * stable across remove(), so iterate over a Snapshot instead.
+   *
    * @headerfile Group.h <knorba/Group.h>
    */
 
   class Group : public ManagedObject, public SerializingStreamer {
+
+  // --- NESTED TYPES --- //
+
+    /**
+     * An immutable version of the members. Members are only appended to
+     * a published version, so a prefix of it never changes.
+     */
+
+    private: struct Version {
+      k_guid_t*    members;
+      int          capacity;
+      volatile int count;
+      volatile int* slots;
+      int          nSlots;
+      Version*     nextRetired;
+      bool         isDrained[2];
+    };
+
+
+    /**
+     * Lock-free read access to the members of a group at a point in time.
+     * Keep it on the stack and short-lived; versions of the group retired
+     * while a snapshot is alive cannot be deleted.
+     */
+
+    public: class Snapshot {
+      private: const Group& _group;
+      private: const Version* _version;
+      private: int _count;
+      private: int _parity;
+
+      public: Snapshot(const Group& group);
+      private: Snapshot(const Snapshot&);
+      public: ~Snapshot();
+      private: Snapshot& operator=(const Snapshot&);
+      public: int getCount() const;
+      public: const k_guid_t& get(int index) const;
+      public: bool containts(const k_guid_t& guid) const;
+      public: bool isEmpty() const;
+    };
+
+    friend class Snapshot;
+
   
   // --- STATIC FIELDS --- //
     
@@ -45,30 +123,55 @@ namespace knorba {
     
   // --- FIELDS --- //
     
-    private: Array<k_guid_t> _members;
-    private: Mutex _mutex;
+    private: Version* volatile _version;
+    private: volatile int _epoch;
+    private: mutable volatile int _nReaders[2];
+    private: mutable Version* volatile _retired;
+    private: mutable pthread_mutex_t _mutex;
     
     
   // --- STATIC METHODS --- //
 
+    private: static Version* createVersion(int capacity);
+    private: static Version* copyVersion(const Version* v);
+    private: static void deleteVersion(Version* v);
+    private: static bool find(const Version* v, int count,
+        const k_guid_t& guid);
+    private: static int indexOf(const Version* v, const k_guid_t& guid);
+    private: static void append(Version* v, const k_guid_t& guid);
     public: static SPtr<Group> empty_group();
     
   
   // --- (DE)CONSTRUCTOR --- //
     
     public: Group();
+    private: Group(const Group&);
+    public: ~Group();
 
     
   // --- METHODS --- //
     
+    private: Group& operator=(const Group&);
+    private: int enter() const;
+    private: bool leave(int parity) const;
+    private: void lock() const;
+    private: void unlock() const;
+    private: void tryReclaim() const;
+    private: void publish(Version* v);
+    private: void reclaim() const;
+    private: void grow(int capacity);
+    private: void addUnlocked(const k_guid_t& guid);
+    public: void reserve(int capacity);
     public: void add(const k_guid_t& guid);
     public: void add(PPtr<Group> group);
     public: void remove(const k_guid_t& guid);
+    public: void remove(const vector<k_guid_t>& guids);
     public: void clear();
     public: int getCount() const;
-    public: const k_guid_t& get(int index) const;
+    public: k_guid_t get(int index) const;
     public: bool containts(const k_guid_t& guid) const;
     public: bool isEmpty() const;
+    public: int getNumberOfRetiredVersions() const;
     
     // From SerializingStreamer
     public: void serialize(PPtr<ObjectSerializer> buidler) const;
@@ -0,0 +1,659 @@
+/*---[LocalRuntime.cpp]----------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::LocalRuntime::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <cstring>
+
+// KFoundation
+#include <kfoundation/Int.h>
+#include <kfoundation/Logger.h>
+#include <kfoundation/Path.h>
+
+// Internal
+#include "type/KType.h"
+#include "type/KGuid.h"
+#include "type/KString.h"
+#include "Agent.h"
+#include "Group.h"
+#include "Message.h"
+#include "MulticastPlan.h"
+
+// Self
+#include "LocalRuntime.h"
+
+namespace knorba {
+
+// --- STATIC FIELDS --- //
+
+  const int LocalRuntime::DEFAULT_CAPACITY;
+
+
+// --- (DE)CONSTRUCTORS --- //
+
+  /**
+   * Constructor.
+   *
+   * @param nNodes The number of nodes to simulate.
+   * @param appName The name to be returned by getAppName().
+   * @param capacity The maximum number of agents.
+   */
+
+  LocalRuntime::LocalRuntime(k_integer_t nNodes, const string& appName,
+      int capacity)
+  : _appName(appName)
+  {
+    if(nNodes < 1) {
+      throw KFException("Number of nodes should be at least 1. Given: "
+          + Int::toString(nNodes));
+    }
+
+    _nNodes = nNodes;
+
+    _guid = KGuid::zero();
+    k_longint_t appId = KString::generateHashFor(appName);
+    memcpy(_guid.appId, &appId, sizeof(k_appid_t));
+
+    _capacity = capacity;
+    _agents = new AgentRecord[capacity];
+    _nAgents = 0;
+    pthread_mutex_init(&_agentsMutex, NULL);
+    pthread_mutex_init(&_tablesMutex, NULL);
+
+    _isRunning = false;
+    pthread_mutex_init(&_quitMutex, NULL);
+    pthread_cond_init(&_quitCond, NULL);
+
+    registerType(KType::TRUTH);
+    registerType(KType::OCTET);
+    registerType(KType::INTEGER);
+    registerType(KType::LONGINT);
+    registerType(KType::REAL);
+    registerType(KType::GUID);
+    registerType(KType::STRING);
+    registerType(KType::RAW);
+    registerType(KType::ANY);
+    registerType(KType::NOTHING);
+
+    AgentMetrics::init(*this);
+  }
+
+
+  /**
+   * Deconstructor. Deletes all agents.
+   */
+
+  LocalRuntime::~LocalRuntime() {
+    deleteAgents();
+    delete[] _agents;
+    pthread_cond_destroy(&_quitCond);
+    pthread_mutex_destroy(&_quitMutex);
+    pthread_mutex_destroy(&_tablesMutex);
+    pthread_mutex_destroy(&_agentsMutex);
+  }
+
+
+// --- METHODS --- //
+
+  Agent* LocalRuntime::getAgentByGuid(const k_guid_t& guid) const {
+    int index = guid.lid - 1;
+    if(index < 0 || index >= __atomic_load_n(&_nAgents, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+
+    const AgentRecord& rec = _agents[index];
+    if(!(rec.guid == guid)) {
+      return NULL;
+    }
+
+    return __atomic_load_n(&rec.agent, __ATOMIC_ACQUIRE);
+  }
+
+
+  const LocalRuntime::AgentRecord* LocalRuntime::getRecordForAgent(
+      const Agent* agent) const
+  {
+    int index = agent->getGuid().lid - 1;
+    if(index < 0 || index >= __atomic_load_n(&_nAgents, __ATOMIC_ACQUIRE)) {
+      return NULL;
+    }
+    return &_agents[index];
+  }
+
+
+  bool LocalRuntime::hasLiveAgents(bool passive) {
+    int n = __atomic_load_n(&_nAgents, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < n; i++) {
+      Agent* agent = _agents[i].agent;
+      if(_agents[i].isStarted && agent->isPassive() == passive
+          && agent->isAlive())
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+
+  /**
+   * Messages are normally taken from the ARE's pool. This runtime has none,
+   * so they are allocated on the heap, and freed when the receiver releases
+   * them.
+   */
+
+  Ptr<Message> LocalRuntime::newMessage() const {
+    return new Message(0, 0);
+  }
+
+
+  void LocalRuntime::unicast(const k_guid_t& sender, const k_guid_t& receiver,
+      const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid,
+      bool isMove)
+  {
+    Agent* agent = getAgentByGuid(receiver);
+    if(agent == NULL) {
+      LOG_WRN << "Message to unknown agent " << receiver << " dropped." << EL;
+      return;
+    }
+
+    if(receiver.nodeRank != sender.nodeRank) {
+      Ptr<Frame> frame = new Frame();
+      frame->sender = sender;
+      frame->opcode = opcode;
+      frame->tid = tid;
+      frame->nodeRank = receiver.nodeRank;
+      frame->payload = content->copy();
+      frame->payload->freeze();
+      frame->receivers.push_back(agent);
+      forward(frame);
+      return;
+    }
+
+    Ptr<Message> msg = newMessage();
+    if(!msg->setInline(tid, opcode, sender, content)) {
+      if(isMove || content->isFrozen()) {
+        msg->set(tid, opcode, sender, content);
+      } else {
+        msg->set(tid, opcode, sender, content->copy());
+      }
+    }
+
+    deliver(agent, msg);
+  }
+
+
+  /**
+   * Sends a message to the receivers in the given plan, which should be
+   * built. Receivers on the sender's node share a single frozen payload.
+   * Each other node is sent one Frame with a copy of the payload made for
+   * it, so the payload is copied once per node rather than once per
+   * receiver.
+   */
+
+  void LocalRuntime::multicast(const k_guid_t& sender, MulticastPlan& plan,
+      const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+  {
+    Ptr<KValue> localPayload;
+    bool isInline = true;
+
+    for(int i = 0; i < plan.getNumberOfPartitions(); i++) {
+      k_integer_t node = plan.getNodeRank(i);
+      const k_guid_t* guids = plan.getReceivers(i);
+      int n = plan.getNumberOfReceivers(i);
+
+      Ptr<Frame> frame;
+      if(node != sender.nodeRank) {
+        frame = new Frame();
+        frame->receivers.reserve(n);
+      }
+
+      for(int j = 0; j < n; j++) {
+        Agent* agent = getAgentByGuid(guids[j]);
+        if(agent == NULL) {
+          LOG_WRN << "Message to unknown agent " << guids[j] << " dropped."
+              << EL;
+          continue;
+        }
+
+        if(!frame.isNull()) {
+          frame->receivers.push_back(agent);
+          continue;
+        }
+
+        Ptr<Message> msg = newMessage();
+        if(!isInline || !msg->setInline(tid, opcode, sender, content)) {
+          isInline = false;
+          if(content->isFrozen()) {
+            msg->set(tid, opcode, sender, content);
+          } else {
+            if(localPayload.isNull()) {
+              localPayload = content->copy();
+              localPayload->freeze();
+            }
+            msg->set(tid, opcode, sender, localPayload);
+          }
+        }
+
+        deliver(agent, msg);
+      }
+
+      if(frame.isNull() || frame->receivers.empty()) {
+        continue;
+      }
+
+      frame->sender = sender;
+      frame->opcode = opcode;
+      frame->tid = tid;
+      frame->nodeRank = node;
+      frame->payload = content->copy();
+      frame->payload->freeze();
+      forward(frame);
+    }
+  }
+
+
+  /**
+   * Hands the given message over to the given agent. If the agent throttles
+   * its senders, waits for room in its queue for as long as its overflow
+   * timeout, and drops the message if there is still none.
+   */
+
+  void LocalRuntime::deliver(Agent* receiver, PPtr<Message> msg) {
+    PPtr<Message> ref = msg.retain();
+    if(!receiver->processMessage(ref) && !receiver->retryMessage(ref)) {
+      ref.release();
+    }
+  }
+
+
+  /**
+   * Deletes all agents. Called by the deconstructor; subclasses that hand
+   * their own runtimes to the agents should call it before deleting them.
+   */
+
+  void LocalRuntime::deleteAgents() {
+    pthread_mutex_lock(&_agentsMutex);
+    for(int i = _nAgents - 1; i >= 0; i--) {
+      delete _agents[i].agent;
+    }
+    _aliases.clear();
+    __atomic_store_n(&_nAgents, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_agentsMutex);
+  }
+
+
+  /**
+   * Returns the runtime to be given to the agents created on the given node.
+   * This implementation returns the LocalRuntime itself.
+   */
+
+  Runtime& LocalRuntime::getRuntimeForNode(k_integer_t node) {
+    return *this;
+  }
+
+
+  /**
+   * Delivers the given frame to each of its receivers. Called by forward()
+   * once the frame reaches its node.
+   */
+
+  void LocalRuntime::fanOut(PPtr<Frame> frame) {
+    int n = (int)frame->receivers.size();
+    for(int i = 0; i < n; i++) {
+      Ptr<Message> msg = newMessage();
+      if(!msg->setInline(frame->tid, frame->opcode, frame->sender,
+          frame->payload))
+      {
+        msg->set(frame->tid, frame->opcode, frame->sender, frame->payload);
+      }
+      deliver(frame->receivers[i], msg);
+    }
+  }
+
+
+  /**
+   * Called for each frame bound for a node other than the sender's. This
+   * implementation fans it out right away.
+   *
+   * @param frame The frame to carry to node `frame->nodeRank`.
+   */
+
+  void LocalRuntime::forward(PPtr<Frame> frame) {
+    fanOut(frame);
+  }
+
+
+  /**
+   * Reserves a GUID for an agent to be created. The agent should be passed
+   * to addAgent() once constructed.
+   *
+   * @param alias The alias for the agent.
+   * @param node The rank of the node the agent lives on.
+   * @param className The name to be returned by getClassNameForAgent().
+   *        Alias is used if empty.
+   */
+
+  k_guid_t LocalRuntime::createGuid(const string& alias, k_integer_t node,
+      const string& className)
+  {
+    if(node < 0 || node >= _nNodes) {
+      throw KFException("Node rank should be between 0 and "
+          + Int::toString(_nNodes - 1) + ". Given: " + Int::toString(node));
+    }
+
+    pthread_mutex_lock(&_agentsMutex);
+
+    if(_nAgents == _capacity) {
+      pthread_mutex_unlock(&_agentsMutex);
+      throw KFException("Too many agents. Capacity: "
+          + Int::toString(_capacity));
+    }
+
+    if(_aliases.find(alias) != _aliases.end()) {
+      pthread_mutex_unlock(&_agentsMutex);
+      throw KFException("Duplicate alias \"" + alias + "\".");
+    }
+
+    int index = _nAgents;
+    AgentRecord& rec = _agents[index];
+    rec.agent = NULL;
+    rec.guid = _guid;
+    rec.guid.nodeRank = (kf_int16_t)node;
+    rec.guid.lid = index + 1;
+    rec.alias = alias;
+    rec.className = className.empty() ? alias : className;
+    rec.isStarted = false;
+    _aliases[alias] = index;
+
+    __atomic_store_n(&_nAgents, index + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_agentsMutex);
+
+    return rec.guid;
+  }
+
+
+  /**
+   * Adds the given agent, constructed with a GUID obtained from
+   * createGuid(). The runtime takes its ownership. If the runtime is
+   * already running, the agent is started too.
+   */
+
+  void LocalRuntime::addAgent(Agent* agent) {
+    int index = agent->getGuid().lid - 1;
+    if(index < 0 || index >= _nAgents
+        || !(_agents[index].guid == agent->getGuid()))
+    {
+      throw KFException("The given agent is constructed with a GUID not "
+          "created by this runtime.");
+    }
+
+    __atomic_store_n(&_agents[index].agent, agent, __ATOMIC_RELEASE);
+    
+    if(_isRunning) {
+      _agents[index].isStarted = true;
+      agent->run();
+    }
+  }
+
+
+  /**
+   * Returns the number of agents created so far.
+   */
+
+  int LocalRuntime::getNumberOfAgents() const {
+    return __atomic_load_n(&_nAgents, __ATOMIC_ACQUIRE);
+  }
+
+
+  /**
+   * Starts all agents, and blocks until they all quit.
+   */
+
+  void LocalRuntime::run() {
+    int n = getNumberOfAgents();
+    for(int i = 0; i < n; i++) {
+      if(_agents[i].agent == NULL) {
+        throw KFException("No agent is added for \"" + _agents[i].alias
+            + "\".");
+      }
+    }
+
+    _isRunning = true;
+    
+    for(int i = 0; i < n; i++) {
+      if(!_agents[i].isStarted) {
+        _agents[i].isStarted = true;
+        _agents[i].agent->run();
+      }
+    }
+
+    pthread_mutex_lock(&_quitMutex);
+    while(hasLiveAgents(false)) {
+      pthread_cond_wait(&_quitCond, &_quitMutex);
+    }
+    pthread_mutex_unlock(&_quitMutex);
+
+    for(int i = 0; i < n; i++) {
+      if(_agents[i].agent->isPassive()) {
+        _agents[i].agent->quit();
+      }
+    }
+
+    pthread_mutex_lock(&_quitMutex);
+    while(hasLiveAgents(true)) {
+      pthread_cond_wait(&_quitCond, &_quitMutex);
+    }
+    pthread_mutex_unlock(&_quitMutex);
+    
+    _isRunning = false;
+  }
+
+
+  // Inherited from Runtime //
+
+  const k_guid_t& LocalRuntime::getGuid() const {
+    return _guid;
+  }
+
+
+  void LocalRuntime::registerType(PPtr<KType> type) {
+    pthread_mutex_lock(&_tablesMutex);
+    _types[type->getTypeNameHash()] = type;
+    pthread_mutex_unlock(&_tablesMutex);
+  }
+
+
+  PPtr<KType> LocalRuntime::getTypeByHash(const k_longint_t hash) const {
+    PPtr<KType> type;
+    pthread_mutex_lock(&_tablesMutex);
+    TypeMap_t::const_iterator it = _types.find(hash);
+    if(it != _types.end()) {
+      type = it->second;
+    }
+    pthread_mutex_unlock(&_tablesMutex);
+    return type;
+  }
+
+
+  /** There is no console agent; returns the GUID of the runtime. */
+  const k_guid_t& LocalRuntime::getConsoleGuid() const {
+    return _guid;
+  }
+
+
+  const string& LocalRuntime::getAppName() const {
+    return _appName;
+  }
+
+
+  k_integer_t LocalRuntime::getNodeCount() const {
+    return _nNodes;
+  }
+
+
+  bool LocalRuntime::isHead() const {
+    return true;
+  }
+
+
+  void LocalRuntime::signalQuit() {
+    pthread_mutex_lock(&_quitMutex);
+    pthread_cond_broadcast(&_quitCond);
+    pthread_mutex_unlock(&_quitMutex);
+  }
+
+
+  PPtr<Path> LocalRuntime::getResourcePathForAgent(const Agent* itself) const {
+    return PPtr<Path>();
+  }
+
+
+  PPtr<Path> LocalRuntime::getDataPathForAgent(const Agent* itself) const {
+    return PPtr<Path>();
+  }
+
+
+  const string& LocalRuntime::getClassNameForAgent(const Agent* itself) const {
+    const AgentRecord* rec = getRecordForAgent(itself);
+    return rec == NULL ? _appName : rec->className;
+  }
+
+
+  const string& LocalRuntime::getAliasForAgent(const Agent* itself) const {
+    const AgentRecord* rec = getRecordForAgent(itself);
+    return rec == NULL ? _appName : rec->alias;
+  }
+
+
+  const k_guid_t& LocalRuntime::getAgentGuidByAlias(const string& alias)
+      const
+  {
+    const k_guid_t* guid = &KGuid::zero();
+    pthread_mutex_lock(&_agentsMutex);
+    AliasMap_t::const_iterator it = _aliases.find(alias);
+    if(it != _aliases.end()) {
+      guid = &_agents[it->second].guid;
+    }
+    pthread_mutex_unlock(&_agentsMutex);
+    return *guid;
+  }
+
+
+  void LocalRuntime::registerMessageFormat(PPtr<KString> opcode,
+      PPtr<KType> payloadType)
+  {
+    MessageFormat format;
+    format.opcode = opcode;
+    format.type = payloadType;
+
+    pthread_mutex_lock(&_tablesMutex);
+    _formats[opcode->getHashCode()] = format;
+    pthread_mutex_unlock(&_tablesMutex);
+  }
+
+
+  PPtr<KType> LocalRuntime::getMessageFormatByHash(const k_longint_t hash)
+      const
+  {
+    PPtr<KType> type;
+    pthread_mutex_lock(&_tablesMutex);
+    FormatMap_t::const_iterator it = _formats.find(hash);
+    if(it != _formats.end()) {
+      type = it->second.type;
+    }
+    pthread_mutex_unlock(&_tablesMutex);
+    return type;
+  }
+
+
+  PPtr<KString> LocalRuntime::getMessageOpCodeForHash(const k_longint_t hash)
+      const
+  {
+    PPtr<KString> opcode;
+    pthread_mutex_lock(&_tablesMutex);
+    FormatMap_t::const_iterator it = _formats.find(hash);
+    if(it != _formats.end()) {
+      opcode = it->second.opcode;
+    }
+    pthread_mutex_unlock(&_tablesMutex);
+    return opcode;
+  }
+
+
+  void LocalRuntime::send(const k_guid_t& sender, const k_guid_t& receiver,
+      const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+  {
+    unicast(sender, receiver, opcode, content, tid, false);
+  }
+
+
+  void LocalRuntime::send(const k_guid_t& sender, PPtr<Group> receivers,
+      const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+  {
+    MulticastPlan plan;
+    plan.add(*receivers);
+    plan.build();
+    multicast(sender, plan, opcode, content, tid);
+  }
+
+
+  void LocalRuntime::sendToAll(const k_guid_t& sender,
+      const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+  {
+    int n = getNumberOfAgents();
+    MulticastPlan plan;
+    plan.reserve(n);
+
+    for(int i = 0; i < n; i++) {
+      Agent* agent = __atomic_load_n(&_agents[i].agent, __ATOMIC_ACQUIRE);
+      if(agent != NULL && !(_agents[i].guid == sender)) {
+        plan.add(_agents[i].guid);
+      }
+    }
+
+    plan.build();
+    multicast(sender, plan, opcode, content, tid);
+  }
+
+
+  void LocalRuntime::sendToLocals(const k_guid_t& sender,
+      const k_longint_t opcode, PPtr<KValue> content, const k_integer_t tid)
+  {
+    int n = getNumberOfAgents();
+    MulticastPlan plan;
+    plan.reserve(n);
+
+    for(int i = 0; i < n; i++) {
+      Agent* agent = __atomic_load_n(&_agents[i].agent, __ATOMIC_ACQUIRE);
+      if(agent != NULL && _agents[i].guid.nodeRank == sender.nodeRank
+          && !(_agents[i].guid == sender))
+      {
+        plan.add(_agents[i].guid);
+      }
+    }
+
+    plan.build();
+    multicast(sender, plan, opcode, content, tid);
+  }
+
+
+  void LocalRuntime::sendMove(const k_guid_t& sender,
+      const k_guid_t& receiver, const k_longint_t opcode,
+      PPtr<KValue> content, const k_integer_t tid)
+  {
+    unicast(sender, receiver, opcode, content, tid, true);
+  }
+
+} // namespace knorba
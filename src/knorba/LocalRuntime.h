@@ -0,0 +1,260 @@
+/*---[LocalRuntime.h]------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::LocalRuntime::*
+ |  Implements: knorba::LocalRuntime::createAgent()
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_LOCALRUNTIME_H
+#define KNORBA_LOCALRUNTIME_H
+
+// Std
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/ManagedObject.h>
+
+// Internal
+#include "Runtime.h"
+
+namespace knorba {
+
+  class Message;
+  class MulticastPlan;
+
+  using namespace std;
+  using namespace kfoundation;
+  using namespace knorba::type;
+
+
+  /**
+   * Runtime that runs all agents inside the current process. Use it to run
+   * agents without the ARE, e.g. for testing and benchmarking.
+   *
+   * Agents are created with createAgent(), which assigns them a GUID and an
+   * alias, and takes their ownership:
+   *
+   *     LocalRuntime rt(2);
+   *     PingAgent* ping = rt.createAgent<PingAgent>("ping", 0);
+   *     PongAgent* pong = rt.createAgent<PongAgent>("pong", 1);
+   *     rt.run();
+   *
+   * run() starts all agents and returns when all of them have quit. Passive
+   * agents are asked to quit once all nonpassive ones have.
+   *
+   * The runtime simulates a cluster with the given number of nodes. Each
+   * agent lives on one node, which is recorded in the `nodeRank` part of its
+   * GUID. sendToLocals() reaches the agents on the sender's node only.
+   *
+   * Messages are delivered by calling Agent::processMessage() on the
+   * sending thread. Payloads of constant size that fit in a message are
+   * stored inline. Other payloads are handled the way Runtime describes: a
+   * frozen payload is shared between the receivers on the sender's node,
+   * otherwise one frozen copy is made for them. Receivers on other nodes get
+   * a copy made for their node, the same as if the payload had been through
+   * the network. Payloads sent with sendMove() reach a receiver on the same
+   * node without any copy.
+   *
+   * Messages to other nodes travel in frames. The receivers of a multicast
+   * message are partitioned by node with a MulticastPlan, and each node
+   * gets a single Frame carrying one copy of the payload and the list of
+   * its receivers, which is fanned out to them on arrival.
+   *
+   * Subclasses can change how the nodes are seen by the agents by overriding
+   * getRuntimeForNode(), and how frames travel between nodes by overriding
+   * forward(). See ClusterEmulator.
+   *
+   * Agents cannot be removed. The capacity of the agent table is set in
+   * the constructor.
+   *
+   * @note getResourcePathForAgent() and getDataPathForAgent() return null.
+   * @headerfile LocalRuntime.h <knorba/LocalRuntime.h>
+   */
+
+  class LocalRuntime : public Runtime {
+
+  // --- NESTED TYPES --- //
+
+    /**
+     * A message on its way to one or more agents on another node. The
+     * payload is a frozen copy made for that node, shared by all receivers
+     * there. See forward().
+     */
+
+    protected: class Frame : public ManagedObject {
+      public: k_guid_t sender;
+      public: k_longint_t opcode;
+      public: k_integer_t tid;
+      public: k_integer_t nodeRank;
+      public: Ptr<KValue> payload;
+      public: vector<Agent*> receivers;
+    };
+
+
+    private: struct AgentRecord {
+      Agent* volatile agent;
+      k_guid_t guid;
+      string   alias;
+      string   className;
+      bool     isStarted;
+    };
+
+
+    private: struct MessageFormat {
+      Ptr<KString> opcode;
+      Ptr<KType>   type;
+    };
+
+
+    private: typedef map<k_longint_t, Ptr<KType> > TypeMap_t;
+    private: typedef map<k_longint_t, MessageFormat> FormatMap_t;
+    private: typedef map<string, int> AliasMap_t;
+
+
+  // --- STATIC FIELDS --- //
+
+    public: static const int DEFAULT_CAPACITY = 4096;
+
+
+  // --- FIELDS --- //
+
+    private: k_guid_t _guid;
+    private: string _appName;
+    private: k_integer_t _nNodes;
+
+    // Agents //
+    private: AgentRecord* _agents;
+    private: int _capacity;
+    private: volatile int _nAgents;
+    private: AliasMap_t _aliases;
+    private: mutable pthread_mutex_t _agentsMutex;
+
+    // Tables //
+    private: TypeMap_t _types;
+    private: FormatMap_t _formats;
+    private: mutable pthread_mutex_t _tablesMutex;
+
+    // Lifecycle //
+    private: volatile bool _isRunning;
+    private: pthread_mutex_t _quitMutex;
+    private: pthread_cond_t _quitCond;
+
+
+  // --- (DE)CONSTRUCTORS --- //
+
+    public: LocalRuntime(k_integer_t nNodes = 1,
+        const string& appName = "local", int capacity = DEFAULT_CAPACITY);
+
+    private: LocalRuntime(const LocalRuntime&);
+    public: ~LocalRuntime();
+
+
+  // --- METHODS --- //
+
+    private: LocalRuntime& operator=(const LocalRuntime&);
+    private: Agent* getAgentByGuid(const k_guid_t& guid) const;
+    private: const AgentRecord* getRecordForAgent(const Agent* agent) const;
+    private: bool hasLiveAgents(bool passive);
+    private: Ptr<Message> newMessage() const;
+    private: void multicast(const k_guid_t& sender, MulticastPlan& plan,
+        const k_longint_t opcode, PPtr<KValue> content,
+        const k_integer_t tid);
+
+    private: void unicast(const k_guid_t& sender, const k_guid_t& receiver,
+        const k_longint_t opcode, PPtr<KValue> content,
+        const k_integer_t tid, bool isMove);
+
+    protected: void deliver(Agent* receiver, PPtr<Message> msg);
+    protected: void fanOut(PPtr<Frame> frame);
+    protected: void deleteAgents();
+    protected: virtual Runtime& getRuntimeForNode(k_integer_t node);
+    protected: virtual void forward(PPtr<Frame> frame);
+
+    public: k_guid_t createGuid(const string& alias, k_integer_t node = 0,
+        const string& className = "");
+
+    public: void addAgent(Agent* agent);
+    public: int  getNumberOfAgents() const;
+    public: void run();
+
+    // Template Members //
+    public: template<typename T>
+      T* createAgent(const string& alias, k_integer_t node = 0);
+
+    // Inherited from Runtime //
+    public: const k_guid_t& getGuid() const;
+    public: void registerType(PPtr<KType> type);
+    public: PPtr<KType> getTypeByHash(const k_longint_t hash) const;
+    public: const k_guid_t& getConsoleGuid() const;
+    public: const string& getAppName() const;
+    public: k_integer_t getNodeCount() const;
+    public: bool isHead() const;
+    public: void signalQuit();
+    public: PPtr<Path> getResourcePathForAgent(const Agent* itself) const;
+    public: PPtr<Path> getDataPathForAgent(const Agent* itself) const;
+    public: const string& getClassNameForAgent(const Agent* itself) const;
+    public: const string& getAliasForAgent(const Agent* itself) const;
+    public: const k_guid_t& getAgentGuidByAlias(const string& alias) const;
+
+    public: void registerMessageFormat(PPtr<KString> opcode,
+        PPtr<KType> payloadType);
+
+    public: PPtr<KType> getMessageFormatByHash(const k_longint_t hash) const;
+
+    public: PPtr<KString> getMessageOpCodeForHash(const k_longint_t hash)
+        const;
+
+    public: void send(const k_guid_t& sender, const k_guid_t& receiver,
+        const k_longint_t opcode, PPtr<KValue> content,
+        const k_integer_t tid);
+
+    public: void send(const k_guid_t& sender, PPtr<Group> receivers,
+        const k_longint_t opcode, PPtr<KValue> content,
+        const k_integer_t tid);
+
+    public: void sendToAll(const k_guid_t& sender, const k_longint_t opcode,
+        PPtr<KValue> content, const k_integer_t tid);
+
+    public: void sendToLocals(const k_guid_t& sender,
+        const k_longint_t opcode, PPtr<KValue> content,
+        const k_integer_t tid);
+
+    public: void sendMove(const k_guid_t& sender, const k_guid_t& receiver,
+        const k_longint_t opcode, PPtr<KValue> content,
+        const k_integer_t tid);
+
+  };
+
+
+  /**
+   * Creates an agent of the given class on the given node. The class should
+   * have a constructor with `(Runtime&, const k_guid_t&)` signature. The
+   * runtime takes the ownership of the created agent.
+   *
+   * @param alias The alias for the new agent.
+   * @param node The rank of the node to put the new agent on.
+   */
+
+  template<typename T>
+  T* LocalRuntime::createAgent(const string& alias, k_integer_t node) {
+    k_guid_t guid = createGuid(alias, node);
+    T* agent = new T(getRuntimeForNode(node), guid);
+    addAgent(agent);
+    return agent;
+  }
+
+} // namespace knorba
+
+#endif /* defined(KNORBA_LOCALRUNTIME_H) */
@@ -0,0 +1,1148 @@
+/*---[Mailbox.cpp]---------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::Mailbox::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <errno.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/time.h>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+
+// Internal
+#include "Message.h"
+#include "type/KGuid.h"
+
+// Self
+#include "Mailbox.h"
+
+#define SEALED_BIT ((kf_int64_t)1 << 62)
+
+namespace knorba {
+
+  /** Segment cache of the current thread, if any. */
+  static __thread void* currentCache = NULL;
+
+
+//\/ Mailbox::SegmentCache /\//////////////////////////////////////////////////
+
+  struct Mailbox::SegmentCache {
+    Segment* lists[N_SIZE_CLASSES];
+    int      counts[N_SIZE_CLASSES];
+  };
+
+
+//\/ Mailbox::Segment /\///////////////////////////////////////////////////////
+
+  Mailbox::Segment::Segment(int size, kf_int64_t base) {
+    void* memory = NULL;
+    if(posix_memalign(&memory, KNORBA_CACHE_LINE_SIZE, size * sizeof(Cell))
+        != 0)
+    {
+      throw std::bad_alloc();
+    }
+
+    cells = (Cell*)memory;
+    for(int i = 0; i < size; i++) {
+      new(&cells[i]) Cell();
+    }
+
+    mask = size - 1;
+    reset(base);
+  }
+
+
+  Mailbox::Segment::~Segment() {
+    for(int i = (int)mask; i >= 0; i--) {
+      cells[i].~Cell();
+    }
+    free(cells);
+  }
+
+
+  /**
+   * Makes this segment as good as new, starting at the given position.
+   * Should only be called on an empty segment nobody else can reach.
+   */
+
+  void Mailbox::Segment::reset(kf_int64_t base) {
+    for(int i = (int)mask; i >= 0; i--) {
+      cells[i].sequence = i;
+    }
+
+    this->base = base;
+    next = NULL;
+    nextRetired = NULL;
+    head = 0;
+    tail = 0;
+  }
+
+
+  Mailbox::Segment::push_result_t Mailbox::Segment::push(PPtr<Message> msg) {
+    kf_int64_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    Cell* cell;
+
+    while(true) {
+      if(pos & SEALED_BIT) {
+        return SEALED;
+      }
+
+      cell = &cells[pos & mask];
+      kf_int64_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+      kf_int64_t diff = seq - pos;
+
+      if(diff == 0) {
+        if(__atomic_compare_exchange_n(&head, &pos, pos + 1, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+          break;
+        }
+      } else if(diff < 0) {
+        return FULL;
+      } else {
+        pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+      }
+    }
+
+    cell->message = msg;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    return PUSHED;
+  }
+
+
+  PPtr<Message> Mailbox::Segment::take() {
+    kf_int64_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    Cell* cell;
+
+    while(true) {
+      cell = &cells[pos & mask];
+      kf_int64_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+      kf_int64_t diff = seq - (pos + 1);
+
+      if(diff == 0) {
+        if(__atomic_compare_exchange_n(&tail, &pos, pos + 1, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+          break;
+        }
+      } else if(diff < 0) {
+        return NULL;
+      } else {
+        pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+      }
+    }
+
+    PPtr<Message> msg = cell->message;
+    cell->message = NULL;
+    __atomic_store_n(&cell->sequence, pos + mask + 1, __ATOMIC_RELEASE);
+
+    return msg;
+  }
+
+
+  /**
+   * Closes this segment for producers. Returns the previous value of head.
+   */
+
+  kf_int64_t Mailbox::Segment::seal() {
+    return __atomic_fetch_or(&head, SEALED_BIT, __ATOMIC_SEQ_CST);
+  }
+
+
+  bool Mailbox::Segment::isSealed() const {
+    return (__atomic_load_n(&head, __ATOMIC_ACQUIRE) & SEALED_BIT) != 0;
+  }
+
+
+  /**
+   * Checks if this segment is sealed and every message pushed into it is
+   * taken out.
+   */
+
+  bool Mailbox::Segment::isDrained() const {
+    kf_int64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    return (h & SEALED_BIT) != 0
+        && __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == (h & ~SEALED_BIT);
+  }
+
+
+  int Mailbox::Segment::getSize() const {
+    return (int)(mask + 1);
+  }
+
+
+  int Mailbox::Segment::getCount() const {
+    kf_int64_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    kf_int64_t h = __atomic_load_n(&head, __ATOMIC_RELAXED) & ~SEALED_BIT;
+    return h > t ? (int)(h - t) : 0;
+  }
+
+
+  kf_int64_t Mailbox::Segment::getHeadPosition() const {
+    return base + (__atomic_load_n(&head, __ATOMIC_RELAXED) & ~SEALED_BIT);
+  }
+
+
+  kf_int64_t Mailbox::Segment::getTailPosition() const {
+    return base + __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  }
+
+
+//\/ Mailbox /\////////////////////////////////////////////////////////////////
+
+// --- STATIC FIELDS --- //
+
+  const int Mailbox::DEFAULT_BLOCK_TIMEOUT;
+  const int Mailbox::N_PRIORITIES;
+
+  /** Maximum number of messages taken from each lane in a row. */
+  const int Mailbox::LANE_WEIGHTS[N_PRIORITIES] = {16, 4, 1};
+
+  const int Mailbox::N_SIZE_CLASSES;
+  const int Mailbox::SEGMENT_CACHE_SIZE;
+  const int Mailbox::SEGMENT_BATCH_SIZE;
+  const int Mailbox::SEGMENT_DEPOT_SIZE;
+  Mailbox::Segment* Mailbox::_depot[N_SIZE_CLASSES];
+  volatile int Mailbox::_depotCounts[N_SIZE_CLASSES];
+  pthread_mutex_t Mailbox::_depotMutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_key_t Mailbox::_cacheKey;
+  pthread_once_t Mailbox::_cacheKeyOnce = PTHREAD_ONCE_INIT;
+  Mailbox::PoolCounters Mailbox::_poolCounters;
+
+
+// --- STATIC METHODS --- //
+
+  void Mailbox::getDeadline(int msecs, struct timespec& then) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    kf_int64_t nsecs = (kf_int64_t)now.tv_usec * 1000
+        + (kf_int64_t)msecs * 1000000;
+
+    then.tv_sec = now.tv_sec + (time_t)(nsecs / 1000000000);
+    then.tv_nsec = (long)(nsecs % 1000000000);
+  }
+
+
+  /**
+   * Returns the base 2 logarithm of the given segment size, which is always
+   * a power of two.
+   */
+
+  int Mailbox::getSizeClass(int size) {
+    int c = 0;
+    while((1 << c) < size) {
+      c++;
+    }
+    return c;
+  }
+
+
+  void Mailbox::createCacheKey() {
+    pthread_key_create(&_cacheKey, &destroyCache);
+  }
+
+
+  /**
+   * Called when a thread with a segment cache exits. Moves what fits of the
+   * cache to the depot and frees the rest.
+   */
+
+  void Mailbox::destroyCache(void* p) {
+    SegmentCache* cache = (SegmentCache*)p;
+
+    pthread_mutex_lock(&_depotMutex);
+    for(int c = 0; c < N_SIZE_CLASSES; c++) {
+      while(cache->lists[c] != NULL) {
+        Segment* s = cache->lists[c];
+        cache->lists[c] = s->nextRetired;
+        if(_depotCounts[c] < SEGMENT_DEPOT_SIZE) {
+          s->nextRetired = _depot[c];
+          _depot[c] = s;
+          __atomic_add_fetch(&_depotCounts[c], 1, __ATOMIC_RELAXED);
+        } else {
+          delete s;
+          __atomic_add_fetch(&_poolCounters.nFreed, 1, __ATOMIC_RELAXED);
+        }
+      }
+    }
+    pthread_mutex_unlock(&_depotMutex);
+
+    delete cache;
+  }
+
+
+  /**
+   * Returns the segment cache of the calling thread, creating it on first
+   * use.
+   */
+
+  Mailbox::SegmentCache* Mailbox::getCache() {
+    if(currentCache == NULL) {
+      pthread_once(&_cacheKeyOnce, &createCacheKey);
+      SegmentCache* cache = new SegmentCache();
+      memset(cache, 0, sizeof(SegmentCache));
+      pthread_setspecific(_cacheKey, cache);
+      currentCache = cache;
+    }
+    return (SegmentCache*)currentCache;
+  }
+
+
+  /**
+   * Takes a segment of the given size from the pool, or allocates a new one
+   * if there is none. When the cache of the calling thread is empty, it is
+   * first refilled with a batch from the depot.
+   */
+
+  Mailbox::Segment* Mailbox::newSegment(int size, kf_int64_t base) {
+    int c = getSizeClass(size);
+    SegmentCache* cache = getCache();
+
+    if(cache->lists[c] == NULL
+        && __atomic_load_n(&_depotCounts[c], __ATOMIC_RELAXED) > 0)
+    {
+      pthread_mutex_lock(&_depotMutex);
+      for(int i = 0; i < SEGMENT_BATCH_SIZE && _depot[c] != NULL; i++) {
+        Segment* s = _depot[c];
+        _depot[c] = s->nextRetired;
+        __atomic_sub_fetch(&_depotCounts[c], 1, __ATOMIC_RELAXED);
+        s->nextRetired = cache->lists[c];
+        cache->lists[c] = s;
+        cache->counts[c]++;
+      }
+      pthread_mutex_unlock(&_depotMutex);
+      __atomic_add_fetch(&_poolCounters.nRefills, 1, __ATOMIC_RELAXED);
+    }
+
+    Segment* s = cache->lists[c];
+    if(s == NULL) {
+      __atomic_add_fetch(&_poolCounters.nMisses, 1, __ATOMIC_RELAXED);
+      return new Segment(size, base);
+    }
+
+    cache->lists[c] = s->nextRetired;
+    cache->counts[c]--;
+    __atomic_add_fetch(&_poolCounters.nHits, 1, __ATOMIC_RELAXED);
+
+    s->reset(base);
+    return s;
+  }
+
+
+  /**
+   * Returns the given segment to the cache of the calling thread. When the
+   * cache is full, a batch is moved to the depot first, and those that do
+   * not fit in the depot either are freed.
+   */
+
+  void Mailbox::deleteSegment(Segment* segment) {
+    int c = getSizeClass(segment->getSize());
+    SegmentCache* cache = getCache();
+
+    if(cache->counts[c] == SEGMENT_CACHE_SIZE) {
+      Segment* batch = NULL;
+      for(int i = 0; i < SEGMENT_BATCH_SIZE; i++) {
+        Segment* s = cache->lists[c];
+        cache->lists[c] = s->nextRetired;
+        cache->counts[c]--;
+        s->nextRetired = batch;
+        batch = s;
+      }
+
+      pthread_mutex_lock(&_depotMutex);
+      while(batch != NULL && _depotCounts[c] < SEGMENT_DEPOT_SIZE) {
+        Segment* s = batch;
+        batch = s->nextRetired;
+        s->nextRetired = _depot[c];
+        _depot[c] = s;
+        __atomic_add_fetch(&_depotCounts[c], 1, __ATOMIC_RELAXED);
+      }
+      pthread_mutex_unlock(&_depotMutex);
+      __atomic_add_fetch(&_poolCounters.nDrains, 1, __ATOMIC_RELAXED);
+
+      while(batch != NULL) {
+        Segment* s = batch;
+        batch = s->nextRetired;
+        delete s;
+        __atomic_add_fetch(&_poolCounters.nFreed, 1, __ATOMIC_RELAXED);
+      }
+    }
+
+    segment->nextRetired = cache->lists[c];
+    cache->lists[c] = segment;
+    cache->counts[c]++;
+  }
+
+
+  /**
+   * Returns the segment pool counters. Shared by all mailboxes in the
+   * process.
+   */
+
+  const Mailbox::PoolCounters& Mailbox::getPoolCounters() {
+    return _poolCounters;
+  }
+
+
+// --- (DE)CONSTRUCTORS --- //
+
+  /**
+   * Constructor.
+   *
+   * @param capacity Initial capacity of each lane. Rounded up to the
+   *        nearest power of two.
+   * @param maxCapacity Maximum number of messages that can be kept in all
+   *        lanes of the queue together. Set to `capacity` if smaller.
+   */
+
+  Mailbox::Mailbox(int capacity, int maxCapacity) {
+    _minCapacity = 2;
+    while(_minCapacity < capacity) {
+      _minCapacity <<= 1;
+    }
+
+    _maxCapacity = maxCapacity < _minCapacity ? _minCapacity : maxCapacity;
+    _policy = BLOCK;
+    _blockTimeout = DEFAULT_BLOCK_TIMEOUT;
+    memset((void*)&_counters, 0, sizeof(Counters));
+
+    for(int i = 0; i < N_PRIORITIES; i++) {
+      _lanes[i].head = newSegment(_minCapacity, 0);
+      _lanes[i].tail = _lanes[i].head;
+      _lanes[i].capacity = _minCapacity;
+    }
+    _capacity = N_PRIORITIES * _minCapacity;
+
+    _retiredSegments = NULL;
+    _nActiveProducers = 0;
+    _lane = 0;
+    _quantum = LANE_WEIGHTS[0];
+
+    _nBlockedProducers = 0;
+
+    _pendingCapacity = _minCapacity;
+    _pending = new PendingRecord[_pendingCapacity];
+    _nPending = 0;
+
+    pthread_mutex_init(&_spaceMutex, NULL);
+    pthread_cond_init(&_spaceCond, NULL);
+  }
+
+
+  /**
+   * Deconstructor. Releases all messages remaining in the queue.
+   */
+
+  Mailbox::~Mailbox() {
+    for(PPtr<Message> msg = pop(); !msg.isNull(); msg = pop()) {
+      msg.release();
+    }
+
+    for(int i = 0; i < N_PRIORITIES; i++) {
+      for(Segment* s = _lanes[i].tail; s != NULL;) {
+        Segment* next = s->next;
+        deleteSegment(s);
+        s = next;
+      }
+    }
+
+    for(Segment* s = _retiredSegments; s != NULL;) {
+      Segment* next = s->nextRetired;
+      deleteSegment(s);
+      s = next;
+    }
+
+    delete[] _pending;
+    pthread_cond_destroy(&_spaceCond);
+    pthread_mutex_destroy(&_spaceMutex);
+  }
+
+
+// --- METHODS --- //
+
+  /**
+   * Marks the calling thread as accessing the segment chain. Segments
+   * removed from the chain are not deleted while any thread is marked.
+   */
+
+  void Mailbox::enter() const {
+    __atomic_add_fetch(&_nActiveProducers, 1, __ATOMIC_SEQ_CST);
+  }
+
+
+  void Mailbox::leave() const {
+    __atomic_sub_fetch(&_nActiveProducers, 1, __ATOMIC_SEQ_CST);
+  }
+
+
+  /**
+   * Called when the given segment is full. Appends a new segment to the
+   * given lane if the maximum capacity allows. The capacity of the new
+   * segment is reserved out of the total of all lanes before it is made, so
+   * that lanes growing at the same time cannot overshoot the maximum
+   * together.
+   *
+   * @return `false` if the queue is at its maximum capacity.
+   */
+
+  bool Mailbox::grow(Lane& lane, Segment* segment) {
+    if(segment->isSealed()) {
+      return true;
+    }
+
+    int capacity = __atomic_load_n(&_capacity, __ATOMIC_RELAXED);
+    int size;
+    do {
+      size = segment->getSize() * 2;
+      while(size > _minCapacity && capacity + size > _maxCapacity) {
+        size >>= 1;
+      }
+
+      if(capacity + size > _maxCapacity) {
+        return false;
+      }
+    } while(!__atomic_compare_exchange_n(&_capacity, &capacity,
+        capacity + size, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if(replace(lane, segment, size)) {
+      count(_counters.nGrown);
+    } else {
+      __atomic_sub_fetch(&_capacity, size, __ATOMIC_RELAXED);
+    }
+
+    return true;
+  }
+
+
+  /**
+   * Seals the given segment and links a new one of the given size after it.
+   * If the segment is already sealed by another thread, does nothing. The
+   * total capacity is left for the caller to update.
+   *
+   * @return `false` if the segment was already sealed.
+   */
+
+  bool Mailbox::replace(Lane& lane, Segment* segment, int size) {
+    kf_int64_t h = segment->seal();
+    if(h & SEALED_BIT) {
+      return false;
+    }
+
+    Segment* s = newSegment(size, segment->base + h);
+    __atomic_add_fetch(&lane.capacity, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&segment->next, s, __ATOMIC_RELEASE);
+    return true;
+  }
+
+
+  /**
+   * Moves the head of the given lane past the given segment, if it is sealed
+   * and linked.
+   */
+
+  void Mailbox::advance(Lane& lane, Segment* segment) {
+    Segment* next = __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE);
+    if(next != NULL) {
+      __atomic_compare_exchange_n(&lane.head, &segment, next, false,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+  }
+
+
+  void Mailbox::retire(Lane& lane, Segment* segment) {
+    __atomic_sub_fetch(&lane.capacity, segment->getSize(), __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&_capacity, segment->getSize(), __ATOMIC_RELAXED);
+
+    Segment* top = __atomic_load_n(&_retiredSegments, __ATOMIC_RELAXED);
+    do {
+      segment->nextRetired = top;
+    } while(!__atomic_compare_exchange_n(&_retiredSegments, &top, segment,
+        true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+
+  /**
+   * Deletes retired segments if no other thread is accessing the chain.
+   * Called by the consumer only.
+   */
+
+  void Mailbox::reclaim() {
+    if(__atomic_load_n(&_retiredSegments, __ATOMIC_RELAXED) == NULL) {
+      return;
+    }
+
+    // Detach first, check after. Threads entering after the detach cannot
+    // reach any of the detached segments.
+    Segment* list = __atomic_exchange_n(&_retiredSegments, (Segment*)NULL,
+        __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&_nActiveProducers, __ATOMIC_SEQ_CST) == 0) {
+      while(list != NULL) {
+        Segment* next = list->nextRetired;
+        deleteSegment(list);
+        list = next;
+      }
+      return;
+    }
+
+    Segment* last = list;
+    while(last->nextRetired != NULL) {
+      last = last->nextRetired;
+    }
+
+    Segment* top = __atomic_load_n(&_retiredSegments, __ATOMIC_RELAXED);
+    do {
+      last->nextRetired = top;
+    } while(!__atomic_compare_exchange_n(&_retiredSegments, &top, list,
+        true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+
+
+  /**
+   * Replaces an empty oversized segment with one of the initial capacity.
+   * Called by the consumer only.
+   */
+
+  void Mailbox::shrink(Lane& lane) {
+    skip(lane);
+
+    Segment* segment = __atomic_load_n(&lane.tail, __ATOMIC_ACQUIRE);
+    if(segment->getSize() > _minCapacity
+        && __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE) == NULL
+        && segment->getCount() == 0)
+    {
+      if(replace(lane, segment, _minCapacity)) {
+        __atomic_add_fetch(&_capacity, _minCapacity, __ATOMIC_RELAXED);
+      }
+      advance(lane, segment);
+      count(_counters.nShrunk);
+
+      // Give the capacity of the old segment back to the other lanes now,
+      // rather than on the next take().
+      skip(lane);
+    }
+  }
+
+
+  /**
+   * Moves the tail of the given lane past the drained segments at its end,
+   * and retires them. Called by the consumer only.
+   */
+
+  void Mailbox::skip(Lane& lane) {
+    Segment* segment = __atomic_load_n(&lane.tail, __ATOMIC_ACQUIRE);
+    while(segment->isDrained()) {
+      Segment* next = __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE);
+      if(next == NULL || !__atomic_compare_exchange_n(&lane.tail, &segment,
+          next, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      {
+        return;
+      }
+      retire(lane, segment);
+      segment = next;
+    }
+  }
+
+
+  PPtr<Message> Mailbox::take(Lane& lane) {
+    PPtr<Message> msg;
+
+    while(true) {
+      Segment* segment = __atomic_load_n(&lane.tail, __ATOMIC_ACQUIRE);
+      msg = segment->take();
+
+      if(!msg.isNull()) {
+        break;
+      }
+
+      if(!segment->isDrained()) {
+        return NULL;
+      }
+
+      Segment* next = __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE);
+      if(next == NULL) {
+        return NULL;
+      }
+
+      if(__atomic_compare_exchange_n(&lane.tail, &segment, next, false,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      {
+        retire(lane, segment);
+      }
+    }
+
+    // Pairs with the increment in push(msg, msecs).
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&_nBlockedProducers, __ATOMIC_RELAXED) > 0) {
+      pthread_mutex_lock(&_spaceMutex);
+      pthread_cond_signal(&_spaceCond);
+      pthread_mutex_unlock(&_spaceMutex);
+    }
+
+    return msg;
+  }
+
+
+  /**
+   * Removes and returns the first message in the side buffer whose turn has
+   * come in its lane.
+   */
+
+  PPtr<Message> Mailbox::takePending() {
+    PPtr<Message> msg;
+
+    _pendingMutex.lock();
+    for(int i = 0; i < _nPending; i++) {
+      const Lane& lane = _lanes[_pending[i].priority];
+      if(_pending[i].position > __atomic_load_n(&lane.tail,
+          __ATOMIC_ACQUIRE)->getTailPosition())
+      {
+        continue;
+      }
+
+      msg = _pending[i].message;
+      for(int j = i + 1; j < _nPending; j++) {
+        _pending[j - 1] = _pending[j];
+      }
+      _pending[_nPending - 1].message = NULL;
+      __atomic_sub_fetch(&_nPending, 1, __ATOMIC_SEQ_CST);
+      break;
+    }
+    _pendingMutex.unlock();
+
+    return msg;
+  }
+
+
+  bool Mailbox::coalesce(PPtr<Message> msg, priority_t priority) {
+    PPtr<Message> replaced;
+    bool isAccepted = false;
+
+    _pendingMutex.lock();
+
+    // Replaced message loses its place, so that the buffer remains sorted
+    // by position within each lane.
+    for(int i = 0; i < _nPending; i++) {
+      if(_pending[i].message->getOpcodeHash() == msg->getOpcodeHash()
+          && _pending[i].message->getSender() == msg->getSender())
+      {
+        replaced = _pending[i].message;
+        for(int j = i + 1; j < _nPending; j++) {
+          _pending[j - 1] = _pending[j];
+        }
+        __atomic_sub_fetch(&_nPending, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+    }
+
+    if(_nPending < _pendingCapacity) {
+      _pending[_nPending].position = __atomic_load_n(&_lanes[priority].head,
+          __ATOMIC_ACQUIRE)->getHeadPosition();
+      _pending[_nPending].priority = priority;
+      _pending[_nPending].message = msg;
+      __atomic_add_fetch(&_nPending, 1, __ATOMIC_SEQ_CST);
+      isAccepted = true;
+    }
+
+    _pendingMutex.unlock();
+
+    if(!replaced.isNull()) {
+      replaced.release();
+      count(_counters.nCoalesced);
+    }
+
+    return isAccepted;
+  }
+
+
+  void Mailbox::count(volatile k_longint_t& counter) {
+    __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+  }
+
+
+  int Mailbox::getCount(const Lane& lane) const {
+    int n = 0;
+    for(Segment* s = __atomic_load_n(&lane.tail, __ATOMIC_ACQUIRE);
+        s != NULL; s = __atomic_load_n(&s->next, __ATOMIC_ACQUIRE))
+    {
+      n += s->getCount();
+    }
+    return n;
+  }
+
+
+  /**
+   * Appends the given message to the lane of the given priority, growing the
+   * lane if necessary. Safe to be called by multiple threads at the same
+   * time.
+   *
+   * @param msg The message to append.
+   * @param priority Priority class of the message.
+   * @return `false` if the lane is full, in which case the caller keeps the
+   *         ownership of the message.
+   */
+
+  bool Mailbox::push(PPtr<Message> msg, priority_t priority) {
+    Lane& lane = _lanes[priority];
+    bool isPushed = false;
+
+    enter();
+    while(true) {
+      Segment* segment = __atomic_load_n(&lane.head, __ATOMIC_ACQUIRE);
+      Segment::push_result_t result = segment->push(msg);
+
+      if(result == Segment::PUSHED) {
+        isPushed = true;
+        break;
+      }
+
+      if(result == Segment::FULL && !grow(lane, segment)) {
+        break;
+      }
+
+      advance(lane, segment);
+    }
+    leave();
+
+    return isPushed;
+  }
+
+
+  /**
+   * Appends the given message to the lane of the given priority, waiting up
+   * to the given time for a free slot if the lane is full.
+   *
+   * @param msg The message to append.
+   * @param priority Priority class of the message.
+   * @param msecs Maximum time to wait, in milliseconds.
+   * @return `false` if the lane is still full after the wait, in which case
+   *         the caller keeps the ownership of the message.
+   */
+
+  bool Mailbox::push(PPtr<Message> msg, priority_t priority, int msecs) {
+    if(push(msg, priority)) {
+      return true;
+    }
+
+    struct timespec then;
+    getDeadline(msecs, then);
+
+    __atomic_add_fetch(&_nBlockedProducers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&_spaceMutex);
+
+    bool isPushed = push(msg, priority);
+    while(!isPushed) {
+      if(pthread_cond_timedwait(&_spaceCond, &_spaceMutex, &then)
+          == ETIMEDOUT)
+      {
+        isPushed = push(msg, priority);
+        break;
+      }
+      isPushed = push(msg, priority);
+    }
+
+    pthread_mutex_unlock(&_spaceMutex);
+    __atomic_sub_fetch(&_nBlockedProducers, 1, __ATOMIC_SEQ_CST);
+
+    return isPushed;
+  }
+
+
+  /**
+   * Appends the given message to the lane of the given priority, applying
+   * the overflow policy if the lane is full. Except for THROTTLE policy, the
+   * queue takes the ownership of the message in any case, and releases it if
+   * it has to be dropped.
+   *
+   * @param msg The message to append.
+   * @param priority Priority class of the message.
+   * @return `false` if the message is rejected by THROTTLE policy, in which
+   *         case the caller keeps the ownership of the message.
+   * @see setOverflowPolicy()
+   */
+
+  bool Mailbox::offer(PPtr<Message> msg, priority_t priority) {
+    if(push(msg, priority)) {
+      return true;
+    }
+
+    count(_counters.nOverflows);
+
+    switch(_policy) {
+      case BLOCK:
+        count(_counters.nBlocked);
+        if(push(msg, priority, _blockTimeout)) {
+          return true;
+        }
+        msg.release();
+        count(_counters.nBlockTimeouts);
+        return true;
+
+      case DROP_OLDEST:
+        enter();
+        while(!push(msg, priority)) {
+          PPtr<Message> oldest = take(_lanes[priority]);
+          if(!oldest.isNull()) {
+            oldest.release();
+            count(_counters.nDroppedOldest);
+          }
+        }
+        leave();
+        return true;
+
+      case DROP_NEWEST:
+        msg.release();
+        count(_counters.nDroppedNewest);
+        return true;
+
+      case COALESCE:
+        enter();
+        if(coalesce(msg, priority)) {
+          leave();
+          return true;
+        }
+        leave();
+        msg.release();
+        count(_counters.nCoalesceDropped);
+        return true;
+
+      case THROTTLE:
+        count(_counters.nThrottled);
+        return false;
+    }
+
+    return true;
+  }
+
+
+  /**
+   * Appends a message rejected by offer() under THROTTLE policy, waiting for
+   * a free slot up to the timeout given to setOverflowPolicy(), the same way
+   * BLOCK policy does.
+   *
+   * @param msg The message to append.
+   * @param priority Priority class of the message.
+   * @return `false` if the lane is still full after the wait, in which case
+   *         the caller keeps the ownership of the message.
+   */
+
+  bool Mailbox::retry(PPtr<Message> msg, priority_t priority) {
+    if(push(msg, priority, _blockTimeout)) {
+      return true;
+    }
+    count(_counters.nThrottleTimeouts);
+    return false;
+  }
+
+
+  /**
+   * Removes and returns the next message in the queue, including the ones
+   * kept aside by COALESCE policy. Lanes are served in weighted round-robin.
+   * Ownership of the returned message is passed to the caller. Should only
+   * be called by the consumer.
+   *
+   * @return The next message, or null pointer if the queue is empty.
+   */
+
+  PPtr<Message> Mailbox::pop() {
+    if(__atomic_load_n(&_nPending, __ATOMIC_RELAXED) > 0) {
+      PPtr<Message> msg = takePending();
+      if(!msg.isNull()) {
+        return msg;
+      }
+    }
+
+    // The current lane is tried twice: before and after a full round.
+    for(int i = 0; i <= N_PRIORITIES; i++) {
+      if(_quantum > 0) {
+        PPtr<Message> msg = take(_lanes[_lane]);
+        if(!msg.isNull()) {
+          _quantum--;
+          return msg;
+        }
+      }
+
+      _lane = (_lane + 1) % N_PRIORITIES;
+      _quantum = LANE_WEIGHTS[_lane];
+    }
+
+    return NULL;
+  }
+
+
+  /**
+   * Shrinks the queue back to its initial capacity if it has grown, and frees
+   * memory no longer in use. Should only be called by the consumer, when it
+   * finds the queue empty.
+   */
+
+  void Mailbox::trim() {
+    for(int i = 0; i < N_PRIORITIES; i++) {
+      shrink(_lanes[i]);
+    }
+    reclaim();
+  }
+
+
+  /**
+   * Checks if the queue is empty. Messages being pushed concurrently are
+   * counted as present.
+   */
+
+  bool Mailbox::isEmpty() const {
+    return getCount() == 0;
+  }
+
+
+  /**
+   * Returns the number of messages in the queue. The result is approximate
+   * when called concurrently with push() or pop().
+   */
+
+  int Mailbox::getCount() const {
+    int n = __atomic_load_n(&_nPending, __ATOMIC_RELAXED);
+
+    enter();
+    for(int i = 0; i < N_PRIORITIES; i++) {
+      n += getCount(_lanes[i]);
+    }
+    leave();
+
+    return n;
+  }
+
+
+  /**
+   * Returns the number of messages that can be kept in all lanes of the
+   * queue without growing them.
+   */
+
+  int Mailbox::getCapacity() const {
+    return __atomic_load_n(&_capacity, __ATOMIC_RELAXED);
+  }
+
+
+  /**
+   * Returns the maximum number of messages that can be kept in all lanes of
+   * the queue together.
+   */
+
+  int Mailbox::getMaxCapacity() const {
+    return _maxCapacity;
+  }
+
+
+  /**
+   * Changes the initial and maximum capacity of the queue. Messages already
+   * in the queue are kept.
+   *
+   * @param capacity Initial capacity of each lane. Rounded up to the
+   *        nearest power of two.
+   * @param maxCapacity Maximum number of messages that can be kept in all
+   *        lanes of the queue together. Set to `capacity` if smaller.
+   */
+
+  void Mailbox::setCapacity(int capacity, int maxCapacity) {
+    int size = 2;
+    while(size < capacity) {
+      size <<= 1;
+    }
+
+    _minCapacity = size;
+    _maxCapacity = maxCapacity < size ? size : maxCapacity;
+
+    _pendingMutex.lock();
+    if(_pendingCapacity < size) {
+      PendingRecord* pending = new PendingRecord[size];
+      for(int i = 0; i < _nPending; i++) {
+        pending[i] = _pending[i];
+      }
+      delete[] _pending;
+      _pending = pending;
+      _pendingCapacity = size;
+    }
+    _pendingMutex.unlock();
+
+    enter();
+    for(int i = 0; i < N_PRIORITIES; i++) {
+      Segment* segment = __atomic_load_n(&_lanes[i].head, __ATOMIC_ACQUIRE);
+      if(segment->getSize() != size) {
+        if(replace(_lanes[i], segment, size)) {
+          __atomic_add_fetch(&_capacity, size, __ATOMIC_RELAXED);
+        }
+        advance(_lanes[i], segment);
+      }
+    }
+    leave();
+  }
+
+
+  /**
+   * Returns the number of messages that can be pushed before the queue is
+   * full. Used for credit-based throttling of senders.
+   *
+   * @see THROTTLE
+   */
+
+  int Mailbox::getCredits() const {
+    int n = 0;
+
+    enter();
+    for(int i = 0; i < N_PRIORITIES; i++) {
+      n += getCount(_lanes[i]);
+    }
+    leave();
+
+    n = _maxCapacity - n;
+    return n > 0 ? n : 0;
+  }
+
+
+  /**
+   * Sets the action to take when a message is offered to a full queue.
+   *
+   * @param policy The overflow policy.
+   * @param msecs Maximum time to wait for a free slot under BLOCK policy,
+   *        or in retry() under THROTTLE policy, in milliseconds.
+   */
+
+  void Mailbox::setOverflowPolicy(overflow_policy_t policy, int msecs) {
+    _policy = policy;
+    _blockTimeout = msecs;
+  }
+
+
+  /**
+   * Returns the current overflow policy.
+   */
+
+  Mailbox::overflow_policy_t Mailbox::getOverflowPolicy() const {
+    return _policy;
+  }
+
+
+  /**
+   * Returns overflow event counters.
+   */
+
+  const Mailbox::Counters& Mailbox::getCounters() const {
+    return _counters;
+  }
+
+} // namespace knorba
@@ -0,0 +1,333 @@
+/*---[Mailbox.h]-----------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::Mailbox::*
+ |  Implements: -
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_MAILBOX_H
+#define KNORBA_MAILBOX_H
+
+// Std
+#include <pthread.h>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Mutex.h>
+
+// Internal
+#include "type/definitions.h"
+
+#define KNORBA_CACHE_LINE_SIZE 64
+
+namespace knorba {
+
+  using namespace kfoundation;
+  using namespace knorba::type;
+
+  class Message;
+
+
+  /**
+   * Lock-free message queue with multiple producers and a single consumer.
+   * Used by Agent to hand over messages from runtime delivery threads to the
+   * Scheduler worker that runs the agent.
+   *
+   * Producers never take a lock, and the consumer never blocks: pop()
+   * returns null when the queue is empty. Waking the consumer is left to the
+   * caller; Agent submits itself to the Scheduler after each push.
+   *
+   * Each lane of the queue is made of a chain of fixed-size segments. It
+   * starts with a single segment of the initial capacity. When the last
+   * segment is full, a new one twice as large is appended, as long as the
+   * total capacity of all lanes stays within the maximum capacity. Drained
+   * segments are removed from the chain, and when the consumer finds the
+   * queue empty, an oversized segment is replaced with one of the initial
+   * capacity. A lane is full only when the maximum capacity is reached, and
+   * always has room for its initial capacity.
+   *
+   * The queue does not change the reference count of the messages it holds.
+   * The reference passed to push() is owned by the queue until it is
+   * returned by pop().
+   *
+   * Overflow Policies
+   * =================
+   *
+   * offer() applies the configured overflow policy when the queue is full:
+   *
+   * - BLOCK: The calling thread waits up to the given timeout for a free
+   *   slot. If the timeout expires, the message is dropped.
+   * - DROP_OLDEST: The oldest message in the queue is dropped to make room.
+   * - DROP_NEWEST: The incoming message is dropped.
+   * - COALESCE: The incoming message is kept in a side buffer, replacing any
+   *   message already there with the same sender and opcode. Messages in the
+   *   queue itself are never replaced. A message in the side buffer is
+   *   delivered right after the messages that were in the queue when it
+   *   arrived. If the side buffer is full, the incoming message is dropped.
+   * - THROTTLE: The message is rejected and the caller keeps its ownership.
+   *   Senders are expected to check getCredits() before delivering. A sender
+   *   holding a rejected message can hand it over again with retry(), which
+   *   waits for a free slot up to the same timeout as BLOCK.
+   *
+   * Each of these events is counted in Counters, see getCounters().
+   *
+   * Segment Pool
+   * ============
+   *
+   * Segments are recycled rather than freed. Each thread keeps a few free
+   * segments of each size in a cache of its own, and exchanges them with a
+   * shared depot a batch at a time when its cache runs empty or full, so
+   * that a burst growing a lane, and agents being created, rarely touch the
+   * heap or a lock. Each cell of a segment takes a whole cache line, so that
+   * producers writing neighbouring cells do not contend for the same line.
+   * See getPoolCounters() for hit and miss statistics.
+   *
+   * Priority Lanes
+   * ==============
+   *
+   * Each message is pushed with a priority class, and each class has a lane
+   * of its own, with its own segment chain, growing out of the maximum
+   * capacity shared by all lanes. Messages of the same
+   * class are delivered in order. The consumer serves the lanes in weighted
+   * round-robin: up to 16 messages from PRIORITY_HIGH, then up to 4 from
+   * PRIORITY_NORMAL, then 1 from PRIORITY_LOW, skipping empty lanes. So a
+   * high priority message waits behind at most 5 others, and no lane is
+   * starved while others are busy.
+   *
+   * @headerfile Mailbox.h <knorba/Mailbox.h>
+   */
+
+  class Mailbox {
+
+  // --- NESTED TYPES --- //
+
+    /** Action to take when a message is offered to a full queue. */
+    public: typedef enum {
+      BLOCK,
+      DROP_OLDEST,
+      DROP_NEWEST,
+      COALESCE,
+      THROTTLE
+    } overflow_policy_t;
+
+
+    /** Priority class of a message. Each class has its own lane. */
+    public: typedef enum {
+      PRIORITY_HIGH,
+      PRIORITY_NORMAL,
+      PRIORITY_LOW
+    } priority_t;
+
+
+    /**
+     * Overflow event counters. Each message that finds the queue full is
+     * counted in `nOverflows`, then in the counters of the policy in effect
+     * only: a message dropped after a BLOCK timeout is counted in
+     * `nBlockTimeouts`, and one dropped because the COALESCE side buffer is
+     * full in `nCoalesceDropped`, not in `nDroppedNewest`. A rejected
+     * THROTTLE message is counted in `nThrottled`, and a retry() of it that
+     * times out in `nThrottleTimeouts`.
+     */
+
+    public: struct Counters {
+      public: volatile k_longint_t nOverflows;
+      public: volatile k_longint_t nBlocked;
+      public: volatile k_longint_t nBlockTimeouts;
+      public: volatile k_longint_t nDroppedOldest;
+      public: volatile k_longint_t nDroppedNewest;
+      public: volatile k_longint_t nCoalesced;
+      public: volatile k_longint_t nCoalesceDropped;
+      public: volatile k_longint_t nThrottled;
+      public: volatile k_longint_t nThrottleTimeouts;
+      public: volatile k_longint_t nGrown;
+      public: volatile k_longint_t nShrunk;
+    };
+
+
+    /** Segment pool counters, shared by all mailboxes. */
+    public: struct PoolCounters {
+      public: volatile k_longint_t nHits;
+      public: volatile k_longint_t nMisses;
+      public: volatile k_longint_t nRefills;
+      public: volatile k_longint_t nDrains;
+      public: volatile k_longint_t nFreed;
+    };
+
+
+    private: struct Cell {
+      volatile kf_int64_t sequence;
+      PPtr<Message> message;
+      char _pad[KNORBA_CACHE_LINE_SIZE - sizeof(kf_int64_t)
+          - sizeof(PPtr<Message>)];
+    };
+
+
+    private: struct Segment {
+      typedef enum {
+        PUSHED,
+        FULL,
+        SEALED
+      } push_result_t;
+
+      Cell*              cells;
+      kf_int64_t         mask;
+      kf_int64_t         base;
+      Segment* volatile  next;
+      Segment*           nextRetired;
+      char _pad0[KNORBA_CACHE_LINE_SIZE];
+      volatile kf_int64_t head;
+      char _pad1[KNORBA_CACHE_LINE_SIZE - sizeof(kf_int64_t)];
+      volatile kf_int64_t tail;
+      char _pad2[KNORBA_CACHE_LINE_SIZE - sizeof(kf_int64_t)];
+
+      Segment(int size, kf_int64_t base);
+      ~Segment();
+      void reset(kf_int64_t base);
+      push_result_t push(PPtr<Message> msg);
+      PPtr<Message> take();
+      kf_int64_t seal();
+      bool isSealed() const;
+      bool isDrained() const;
+      int getSize() const;
+      int getCount() const;
+      kf_int64_t getHeadPosition() const;
+      kf_int64_t getTailPosition() const;
+    };
+
+
+    private: struct Lane {
+      Segment* volatile head;
+      volatile int      capacity;
+      char _pad0[KNORBA_CACHE_LINE_SIZE - sizeof(void*) - sizeof(int)];
+      Segment* volatile tail;
+      char _pad1[KNORBA_CACHE_LINE_SIZE - sizeof(void*)];
+    };
+
+
+    private: struct SegmentCache;
+
+
+    private: struct PendingRecord {
+      kf_int64_t    position;
+      priority_t    priority;
+      PPtr<Message> message;
+    };
+
+
+  // --- STATIC FIELDS --- //
+
+    public: static const int DEFAULT_BLOCK_TIMEOUT = 1000;
+    public: static const int N_PRIORITIES = 3;
+    private: static const int LANE_WEIGHTS[N_PRIORITIES];
+    private: static const int N_SIZE_CLASSES = 32;
+    private: static const int SEGMENT_CACHE_SIZE = 4;
+    private: static const int SEGMENT_BATCH_SIZE = 2;
+    private: static const int SEGMENT_DEPOT_SIZE = 64;
+    private: static Segment* _depot[N_SIZE_CLASSES];
+    private: static volatile int _depotCounts[N_SIZE_CLASSES];
+    private: static pthread_mutex_t _depotMutex;
+    private: static pthread_key_t _cacheKey;
+    private: static pthread_once_t _cacheKeyOnce;
+    private: static PoolCounters _poolCounters;
+
+
+  // --- FIELDS --- //
+
+    private: int          _minCapacity;
+    private: int          _maxCapacity;
+    private: overflow_policy_t _policy;
+    private: int          _blockTimeout;
+    private: Counters     _counters;
+    private: char _pad0[KNORBA_CACHE_LINE_SIZE];
+
+    // Lanes //
+    private: Lane _lanes[N_PRIORITIES];
+    private: volatile int _capacity;
+    private: mutable volatile int _nActiveProducers;
+    private: char _pad1[KNORBA_CACHE_LINE_SIZE - 2 * sizeof(int)];
+
+    // Consumer //
+    private: Segment* volatile _retiredSegments;
+    private: int _lane;
+    private: int _quantum;
+    private: char _pad2[KNORBA_CACHE_LINE_SIZE - sizeof(void*) - 2 * sizeof(int)];
+
+    // Blocked producers //
+    private: volatile int   _nBlockedProducers;
+    private: pthread_mutex_t _spaceMutex;
+    private: pthread_cond_t  _spaceCond;
+
+    // Coalescing //
+    private: PendingRecord* _pending;
+    private: volatile int   _nPending;
+    private: int            _pendingCapacity;
+    private: Mutex          _pendingMutex;
+
+
+  // --- STATIC METHODS --- //
+
+    private: static void getDeadline(int msecs, struct timespec& then);
+    private: static int getSizeClass(int size);
+    private: static void createCacheKey();
+    private: static void destroyCache(void* cache);
+    private: static SegmentCache* getCache();
+    private: static Segment* newSegment(int size, kf_int64_t base);
+    private: static void deleteSegment(Segment* segment);
+    public: static const PoolCounters& getPoolCounters();
+
+
+  // --- (DE)CONSTRUCTORS --- //
+
+    public: Mailbox(int capacity, int maxCapacity);
+    private: Mailbox(const Mailbox&);
+    public: ~Mailbox();
+
+
+  // --- METHODS --- //
+
+    private: Mailbox& operator=(const Mailbox&);
+    private: void enter() const;
+    private: void leave() const;
+    private: bool grow(Lane& lane, Segment* segment);
+    private: bool replace(Lane& lane, Segment* segment, int size);
+    private: void advance(Lane& lane, Segment* segment);
+    private: void retire(Lane& lane, Segment* segment);
+    private: void reclaim();
+    private: void shrink(Lane& lane);
+    private: void skip(Lane& lane);
+    private: PPtr<Message> take(Lane& lane);
+    private: PPtr<Message> takePending();
+    private: bool coalesce(PPtr<Message> msg, priority_t priority);
+    private: void count(volatile k_longint_t& counter);
+    private: int  getCount(const Lane& lane) const;
+    public: bool push(PPtr<Message> msg, priority_t priority = PRIORITY_NORMAL);
+    public: bool push(PPtr<Message> msg, priority_t priority, int msecs);
+    public: bool offer(PPtr<Message> msg,
+        priority_t priority = PRIORITY_NORMAL);
+    public: bool retry(PPtr<Message> msg, priority_t priority);
+    public: PPtr<Message> pop();
+    public: void trim();
+    public: bool isEmpty() const;
+    public: int  getCount() const;
+    public: int  getCapacity() const;
+    public: int  getMaxCapacity() const;
+    public: void setCapacity(int capacity, int maxCapacity);
+    public: int  getCredits() const;
+    public: void setOverflowPolicy(overflow_policy_t policy, int msecs);
+    public: overflow_policy_t getOverflowPolicy() const;
+    public: const Counters& getCounters() const;
+
+  };
+
+} // namespace knorba
+
+#endif /* defined(KNORBA_MAILBOX_H) */
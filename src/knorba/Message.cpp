@@ -14,37 +14,86 @@
  |
  *//////////////////////////////////////////////////////////////////////////////
 
+// Std
+#include <cstring>
+#include <sched.h>
+
 // KFoundation
 #include <kfoundation/Ptr.h>
 #include <kfoundation/Logger.h>
+#include <kfoundation/System.h>
 #include <kfoundation/SerializingStreamer.h>
+#include <kfoundation/BufferInputStream.h>
 
 #include "type/KInteger.h"
 #include "type/KLongint.h"
+#include "type/KReal.h"
 #include "type/KRecord.h"
+#include "type/KRecordType.h"
 #include "type/KString.h"
 #include "Runtime.h"
 
 // Internal
 #include "type/KGuid.h"
+#include "type/KTypeMismatchException.h"
 
 // Self
 #include "Message.h"
 
+#define PAYLOAD_READY    0
+#define PAYLOAD_INLINE   1
+#define PAYLOAD_BUILDING 2
+
 namespace knorba {
   
+// --- STATIC FIELDS --- //
+  
+  const int Message::INLINE_PAYLOAD_SIZE;
+  
+  
 // --- (DE)CONSTRUCTORS --- //
 
   Message::Message(const kf_octet_t manager, const int index)
   : PoolObject(manager, index)
   {
-    // Nothing;
+    _inlineSize = -1;
+    _payloadState = PAYLOAD_READY;
+    _enqueueTime = 0;
   }
   
   
   
 // --- METHODS --- //
 
+  /**
+   * Creates the KValue for the inline payload. If another thread is already
+   * at it, waits for it to finish instead.
+   */
+
+  void Message::materializePayload() const {
+    int state = PAYLOAD_INLINE;
+    if(!__atomic_compare_exchange_n(&_payloadState, &state, PAYLOAD_BUILDING,
+        false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+      while(__atomic_load_n(&_payloadState, __ATOMIC_ACQUIRE)
+          != PAYLOAD_READY)
+      {
+        sched_yield();
+      }
+      return;
+    }
+
+    Ptr<KValue> value = _payloadType->instantiate();
+    if(_inlineSize > 0) {
+      value->readFromBinaryStream(new BufferInputStream(_inlinePayload,
+          _inlineSize, false));
+    }
+    _payload = value;
+
+    __atomic_store_n(&_payloadState, PAYLOAD_READY, __ATOMIC_RELEASE);
+  }
+
+
   /**
    * Setter. Replaces all values of this object with the ones given in
    * arguments.
@@ -62,6 +111,108 @@ namespace knorba {
     _opcodeHash = opcodeHash;
     _sender = sender;
     _payload = payload;
+    _payloadType = NULL;
+    _inlineSize = -1;
+    _payloadState = PAYLOAD_READY;
+    _enqueueTime = 0;
+  }
+
+
+  /**
+   * Setter. Stores the payload inside this message, given its type and its
+   * value in KnoRBA binary format, e.g. as received from the wire, without
+   * creating a KValue for it.
+   *
+   * @param tid Transaction ID.
+   * @param opcodeHash Opcode Hash (64-bit CityHash).
+   * @param sender GUID of the sender agent.
+   * @param type Payload type. Should have constant size. The message keeps
+   *        a reference to it.
+   * @param data Payload in KnoRBA binary format.
+   * @param size Size of the payload in octets.
+   * @return `false` if the payload does not fit, in which case this message
+   *         is not changed.
+   */
+
+  bool Message::setInline(const k_integer_t tid, const k_longint_t opcodeHash,
+      const k_guid_t& sender, PPtr<KType> type, const k_octet_t* data,
+      const int size)
+  {
+    if(size > INLINE_PAYLOAD_SIZE || !type->hasConstantSize()) {
+      return false;
+    }
+
+    _transactionId = tid;
+    _opcodeHash = opcodeHash;
+    _sender = sender;
+    _payload = NULL;
+    _payloadType = type;
+    _inlineSize = size;
+    if(size > 0) {
+      memcpy(_inlinePayload, data, size);
+    }
+    _payloadState = PAYLOAD_INLINE;
+    _enqueueTime = 0;
+
+    return true;
+  }
+
+
+  /**
+   * Setter. Copies the given payload inside this message, if it is
+   * `nothing`, a longint, an integer, a real, a GUID, or a record without
+   * dynamic fields, and fits. Unlike set(), the message does not keep a
+   * reference to the given KValue, so the caller is free to change it
+   * afterwards.
+   *
+   * @param tid Transaction ID.
+   * @param opcodeHash Opcode Hash (64-bit CityHash).
+   * @param sender GUID of the sender agent.
+   * @param payload Payload.
+   * @return `false` if the payload cannot be stored inline, in which case
+   *         this message is not changed.
+   */
+
+  bool Message::setInline(const k_integer_t tid, const k_longint_t opcodeHash,
+      const k_guid_t& sender, PPtr<KValue> payload)
+  {
+    PPtr<KType> type = payload->getType();
+    k_octet_t buffer[INLINE_PAYLOAD_SIZE];
+    int size;
+
+    if(type->equals(KType::NOTHING)) {
+      size = 0;
+    } else if(type->equals(KType::LONGINT)) {
+      k_longint_t v = payload.AS(KLongint)->get();
+      size = sizeof(k_longint_t);
+      memcpy(buffer, &v, size);
+    } else if(type->equals(KType::INTEGER)) {
+      k_integer_t v = payload.AS(KInteger)->get();
+      size = sizeof(k_integer_t);
+      memcpy(buffer, &v, size);
+    } else if(type->equals(KType::REAL)) {
+      k_real_t v = payload.AS(KReal)->get();
+      size = sizeof(k_real_t);
+      memcpy(buffer, &v, size);
+    } else if(type->equals(KType::GUID)) {
+      size = 16;
+      KGuid::encode(payload.AS(KGuid)->get(), buffer);
+    } else if(type.ISA(KRecordType)) {
+      // Records without dynamic fields are laid out in memory as they are on
+      // the wire, as long as the host is little-endian.
+      size = type->getSizeInOctets();
+      if(size > INLINE_PAYLOAD_SIZE
+          || type.AS(KRecordType)->hasDynamicFields()
+          || System::isBigEndian())
+      {
+        return false;
+      }
+      memcpy(buffer, payload.AS(KRecord)->getBaseAddress(), size);
+    } else {
+      return false;
+    }
+
+    return setInline(tid, opcodeHash, sender, type, buffer, size);
   }
 
 
@@ -86,13 +237,89 @@ namespace knorba {
   }
   
 
-  /** Returns the message payload */
+  /**
+   * Returns the message payload. If the payload is stored inline, a KValue
+   * is created for it on the first call.
+   */
 
   PPtr<KValue> Message::getPayload() const {
+    if(__atomic_load_n(&_payloadState, __ATOMIC_ACQUIRE) != PAYLOAD_READY) {
+      materializePayload();
+    }
     return _payload;
   }
 
 
+  /** Returns the type of the payload. */
+
+  PPtr<KType> Message::getPayloadType() const {
+    if(_inlineSize >= 0) {
+      return _payloadType;
+    }
+    return _payload->getType();
+  }
+
+
+  /** Checks if the payload is stored inside this message. */
+
+  bool Message::hasInlinePayload() const {
+    return _inlineSize >= 0;
+  }
+
+
+  /**
+   * Returns the inline payload in KnoRBA binary format, or NULL if the
+   * payload is not stored inline.
+   */
+
+  const k_octet_t* Message::getInlinePayload() const {
+    if(_inlineSize < 0) {
+      return NULL;
+    }
+    return _inlinePayload;
+  }
+
+
+  /**
+   * Returns the payload, which should be a longint, without creating a
+   * KValue for it.
+   */
+
+  k_longint_t Message::getLongintPayload() const {
+    if(_inlineSize < 0) {
+      return _payload.AS(KLongint)->get();
+    }
+
+    if(!_payloadType->equals(KType::LONGINT)) {
+      throw KTypeMismatchException(KType::LONGINT, _payloadType);
+    }
+
+    k_longint_t v;
+    memcpy(&v, _inlinePayload, sizeof(k_longint_t));
+    return v;
+  }
+
+
+  /**
+   * Returns the payload, which should be a GUID, without creating a KValue
+   * for it.
+   */
+
+  k_guid_t Message::getGuidPayload() const {
+    if(_inlineSize < 0) {
+      return _payload.AS(KGuid)->get();
+    }
+
+    if(!_payloadType->equals(KType::GUID)) {
+      throw KTypeMismatchException(KType::GUID, _payloadType);
+    }
+
+    k_guid_t v;
+    KGuid::decode(_inlinePayload, v);
+    return v;
+  }
+
+
   /** Checks if the opcode of this message matches the given string */
   
   bool Message::is(PPtr<KString> opcode) const {
@@ -109,7 +336,29 @@ namespace knorba {
   bool Message::needsResponse() const {
     return _transactionId >= 0;
   }
-  
+
+
+  /**
+   * FOR INTERNAL USE. Called by the receiving agent when this message is
+   * put in its queue.
+   *
+   * @param nanos Time of the monotonic clock, see AgentMetrics::getTime().
+   */
+
+  void Message::setEnqueueTime(const kf_int64_t nanos) {
+    _enqueueTime = nanos;
+  }
+
+
+  /**
+   * Returns the time this message was put in the queue of its receiver, or
+   * 0 if it never was.
+   */
+
+  kf_int64_t Message::getEnqueueTime() const {
+    return _enqueueTime;
+  }
+
 
   /**
    * Converts header information to string.
@@ -128,7 +377,7 @@ namespace knorba {
       ->attribute("opcode", opcodeStr)
       ->attribute("sender", KGuid::toString(_sender))
       ->attribute("transactionId", _transactionId)
-      ->attribute("payloadType",_payload->getType()->getTypeName())
+      ->attribute("payloadType", getPayloadType()->getTypeName())
       ->endObject();
     return sstream.str();    
   }
@@ -139,7 +388,7 @@ namespace knorba {
       ->attribute("sender", KGuid::toString(_sender))
       ->attribute("opcodeHash", _opcodeHash)
       ->attribute("transactionId", _transactionId)
-      ->member("payload")->object<KValue>(_payload)
+      ->member("payload")->object<KValue>(getPayload())
       ->endObject();
   }
   
@@ -150,6 +399,10 @@ namespace knorba {
     if(!_payload.isNull()) {
       _payload = NULL;
     }
+    _payloadType = NULL;
+    _inlineSize = -1;
+    _payloadState = PAYLOAD_READY;
+    _enqueueTime = 0;
   }
   
 } // namespace knorba
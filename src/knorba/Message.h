@@ -44,17 +44,35 @@ namespace knorba {
    * @note This is a pool-allocated object and should not be instanitated
    *       directly.
    *
+   * Payloads of constant size that fit in INLINE_PAYLOAD_SIZE octets, e.g.
+   * `nothing`, longints, GUIDs and small records, can be stored inside the
+   * message itself in KnoRBA binary format, using setInline(), instead of
+   * in a KValue allocated on the heap. getPayload() creates the KValue for
+   * an inline payload on first call. Handlers that only need a primitive
+   * can use getLongintPayload() or getGuidPayload() instead, which never
+   * allocate.
+   *
    * @headerfile Message.h <knorba/Message.h>
    */
 
   class Message : public PoolObject, public SerializingStreamer {
     
+  // --- STATIC FIELDS --- //
+    
+    public: static const int INLINE_PAYLOAD_SIZE = 48;
+    
+    
   // --- FIELDS --- //
     
     private: k_integer_t _transactionId;
     private: k_longint_t _opcodeHash;
     private: k_guid_t    _sender;
-    private: Ptr<KValue> _payload;
+    private: mutable Ptr<KValue> _payload;
+    private: Ptr<KType>  _payloadType;
+    private: int         _inlineSize;
+    private: mutable volatile int _payloadState;
+    private: kf_int64_t  _enqueueTime;
+    private: k_octet_t   _inlinePayload[INLINE_PAYLOAD_SIZE];
     
     
   // --- (DE)CONSTRUCTORS --- //
@@ -64,15 +82,32 @@ namespace knorba {
     
   // --- METHODS --- //
     
+    private: void materializePayload() const;
+    
     public: void set(const k_integer_t tid, const k_longint_t opcodeHash,
         const k_guid_t& sender, PPtr<KValue> _payload);
     
+    public: bool setInline(const k_integer_t tid,
+        const k_longint_t opcodeHash, const k_guid_t& sender,
+        PPtr<KType> type, const k_octet_t* data, const int size);
+    
+    public: bool setInline(const k_integer_t tid,
+        const k_longint_t opcodeHash, const k_guid_t& sender,
+        PPtr<KValue> payload);
+    
     public: k_integer_t getTransactionId() const;
     public: k_longint_t getOpcodeHash() const;
     public: const k_guid_t& getSender() const;
     public: PPtr<KValue> getPayload() const;
+    public: PPtr<KType> getPayloadType() const;
+    public: bool hasInlinePayload() const;
+    public: const k_octet_t* getInlinePayload() const;
+    public: k_longint_t getLongintPayload() const;
+    public: k_guid_t getGuidPayload() const;
     public: bool is(PPtr<KString> opcode) const;
     public: bool needsResponse() const;
+    public: void setEnqueueTime(const kf_int64_t nanos);
+    public: kf_int64_t getEnqueueTime() const;
     public: string headerToString(Runtime& rt) const;
     
     // Inherited from PoolObject //
@@ -0,0 +1,172 @@
+/*---[MulticastPlan.cpp]---------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::MulticastPlan::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Internal
+#include "Group.h"
+
+// Self
+#include "MulticastPlan.h"
+
+namespace knorba {
+
+// --- (DE)CONSTRUCTORS --- //
+
+  MulticastPlan::MulticastPlan() {
+    // Nothing;
+  }
+
+
+// --- METHODS --- //
+
+  /**
+   * Makes room for the given number of receivers, to avoid reallocation
+   * while adding them.
+   */
+
+  void MulticastPlan::reserve(int nReceivers) {
+    _pending.reserve(nReceivers);
+    _receivers.reserve(nReceivers);
+  }
+
+
+  /**
+   * Adds a receiver. Call build() once all receivers are added.
+   */
+
+  void MulticastPlan::add(const k_guid_t& receiver) {
+    _pending.push_back(receiver);
+  }
+
+
+  /**
+   * Adds all members of the given group, as they are at the time of the
+   * call.
+   */
+
+  void MulticastPlan::add(const Group& receivers) {
+    Group::Snapshot members(receivers);
+    int n = members.getCount();
+    _pending.reserve(_pending.size() + n);
+    for(int i = 0; i < n; i++) {
+      _pending.push_back(members.get(i));
+    }
+  }
+
+
+  /**
+   * Partitions the receivers added so far by node rank, with a counting
+   * sort. Receivers added after this call go into the next build().
+   */
+
+  void MulticastPlan::build() {
+    int n = (int)_pending.size();
+
+    int maxRank = -1;
+    for(int i = 0; i < n; i++) {
+      int rank = _pending[i].nodeRank & 0xFFFF;
+      if(rank > maxRank) {
+        maxRank = rank;
+      }
+    }
+
+    _offsets.assign(maxRank + 1, 0);
+    for(int i = 0; i < n; i++) {
+      _offsets[_pending[i].nodeRank & 0xFFFF]++;
+    }
+
+    _partitions.clear();
+    int offset = 0;
+    for(int rank = 0; rank <= maxRank; rank++) {
+      int count = _offsets[rank];
+      _offsets[rank] = offset;
+      if(count > 0) {
+        Partition p;
+        p.nodeRank = rank;
+        p.offset = offset;
+        p.count = count;
+        _partitions.push_back(p);
+        offset += count;
+      }
+    }
+
+    _receivers.resize(n);
+    for(int i = 0; i < n; i++) {
+      int rank = _pending[i].nodeRank & 0xFFFF;
+      _receivers[_offsets[rank]++] = _pending[i];
+    }
+
+    _pending.clear();
+  }
+
+
+  /**
+   * Removes all receivers and partitions, keeping the memory for reuse.
+   */
+
+  void MulticastPlan::clear() {
+    _pending.clear();
+    _receivers.clear();
+    _partitions.clear();
+  }
+
+
+  /**
+   * Returns the total number of receivers in all partitions.
+   */
+
+  int MulticastPlan::getNumberOfReceivers() const {
+    return (int)_receivers.size();
+  }
+
+
+  /**
+   * Returns the number of partitions, which is the number of distinct nodes
+   * among the receivers.
+   */
+
+  int MulticastPlan::getNumberOfPartitions() const {
+    return (int)_partitions.size();
+  }
+
+
+  /**
+   * Returns the rank of the node of the receivers in the given partition.
+   */
+
+  k_integer_t MulticastPlan::getNodeRank(int partition) const {
+    return _partitions[partition].nodeRank;
+  }
+
+
+  /**
+   * Returns the number of receivers in the given partition.
+   */
+
+  int MulticastPlan::getNumberOfReceivers(int partition) const {
+    return _partitions[partition].count;
+  }
+
+
+  /**
+   * Returns the receivers in the given partition, getNumberOfReceivers()
+   * of them in a row.
+   */
+
+  const k_guid_t* MulticastPlan::getReceivers(int partition) const {
+    return &_receivers[_partitions[partition].offset];
+  }
+
+} // namespace knorba
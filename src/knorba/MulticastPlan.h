@@ -0,0 +1,98 @@
+/*---[MulticastPlan.h]-----------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::MulticastPlan::*
+ |  Implements: -
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_MULTICASTPLAN_H
+#define KNORBA_MULTICASTPLAN_H
+
+// Std
+#include <vector>
+
+// Internal
+#include "type/definitions.h"
+
+namespace knorba {
+
+  class Group;
+
+  using namespace std;
+  using namespace knorba::type;
+
+
+  /**
+   * Partitions the receivers of a multicast message by node, so that a
+   * runtime can encode the payload once for each node and ship it there in
+   * a single frame together with the list of receivers on that node, to be
+   * fanned out locally by the receiving runtime. A message to 1000 agents on
+   * 16 nodes then costs 16 encodings rather than 1000.
+   *
+   *     MulticastPlan plan;
+   *     plan.add(receivers);
+   *     plan.build();
+   *
+   *     for(int i = 0; i < plan.getNumberOfPartitions(); i++) {
+   *       sendFrame(plan.getNodeRank(i), plan.getReceivers(i),
+   *           plan.getNumberOfReceivers(i), payload);
+   *     }
+   *
+   * build() takes time proportional to the number of receivers plus the
+   * highest node rank among them. Partitions are ordered by node rank, and
+   * receivers within a partition keep the order in which they were added.
+   *
+   * @headerfile MulticastPlan.h <knorba/MulticastPlan.h>
+   */
+
+  class MulticastPlan {
+
+  // --- NESTED TYPES --- //
+
+    private: struct Partition {
+      k_integer_t nodeRank;
+      int offset;
+      int count;
+    };
+
+
+  // --- FIELDS --- //
+
+    private: vector<k_guid_t> _pending;
+    private: vector<k_guid_t> _receivers;
+    private: vector<Partition> _partitions;
+    private: vector<int> _offsets;
+
+
+  // --- (DE)CONSTRUCTORS --- //
+
+    public: MulticastPlan();
+
+
+  // --- METHODS --- //
+
+    public: void reserve(int nReceivers);
+    public: void add(const k_guid_t& receiver);
+    public: void add(const Group& receivers);
+    public: void build();
+    public: void clear();
+    public: int getNumberOfReceivers() const;
+    public: int getNumberOfPartitions() const;
+    public: k_integer_t getNodeRank(int partition) const;
+    public: int getNumberOfReceivers(int partition) const;
+    public: const k_guid_t* getReceivers(int partition) const;
+
+  };
+
+} // namespace knorba
+
+#endif /* defined(KNORBA_MULTICASTPLAN_H) */
@@ -0,0 +1,300 @@
+/*---[PeerRegistry.cpp]----------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::PeerRegistry::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <cstring>
+#include <algorithm>
+
+// Self
+#include "PeerRegistry.h"
+
+namespace knorba {
+
+//\/ PeerRegistry::GuidLess /\/////////////////////////////////////////////////
+
+  bool PeerRegistry::GuidLess::operator()(const k_guid_t& a,
+      const k_guid_t& b) const
+  {
+    return memcmp(&a, &b, sizeof(k_guid_t)) < 0;
+  }
+
+
+//\/ PeerRegistry::NodeLess /\/////////////////////////////////////////////////
+
+  bool PeerRegistry::NodeLess::operator()(const k_guid_t& a,
+      const k_guid_t& b) const
+  {
+    int c = memcmp(&a.appId, &b.appId, sizeof(k_appid_t));
+    if(c != 0) {
+      return c < 0;
+    }
+    return a.nodeRank < b.nodeRank;
+  }
+
+
+//\/ PeerRegistry /\///////////////////////////////////////////////////////////
+
+// --- (DE)CONSTRUCTORS --- //
+
+  PeerRegistry::PeerRegistry() {
+    _all = new Group();
+  }
+
+
+// --- METHODS --- //
+
+  /**
+   * Takes the given role off the list of roles of the given peer. If it was
+   * the last one, the peer is dropped from the GUID and node indexes. The
+   * caller is to drop it from getAll().
+   *
+   * @return `true` if the peer is no longer a peer.
+   */
+
+  bool PeerRegistry::unlink(k_longint_t roleHash, const k_guid_t& guid) {
+    PeerMap_t::iterator p = _peers.find(guid);
+    if(p == _peers.end()) {
+      return false;
+    }
+
+    RoleList_t& roles = p->second;
+    roles.erase(std::remove(roles.begin(), roles.end(), roleHash),
+        roles.end());
+
+    if(!roles.empty()) {
+      return false;
+    }
+
+    _peers.erase(p);
+
+    NodeMap_t::iterator n = _nodes.find(guid);
+    if(n != _nodes.end()) {
+      n->second.erase(guid);
+      if(n->second.empty()) {
+        _nodes.erase(n);
+      }
+    }
+
+    return true;
+  }
+
+
+  /**
+   * Adds the given peer to the given role, creating the role if it does not
+   * exist.
+   *
+   * @param role The role to add to.
+   * @param guid The GUID of the peer.
+   * @return `false` if the peer already had the given role.
+   */
+
+  bool PeerRegistry::add(PPtr<KString> role, const k_guid_t& guid) {
+    k_longint_t hash = role->getHashCode();
+
+    RoleMap_t::iterator r = _roles.find(hash);
+    if(r == _roles.end()) {
+      Ptr<Role> newRole = new Role();
+      newRole->name = role;
+      newRole->members = new Group();
+      r = _roles.insert(RoleMap_t::value_type(hash, newRole)).first;
+    } else if(r->second->members->containts(guid)) {
+      return false;
+    }
+
+    r->second->members->add(guid);
+
+    RoleList_t& roles = _peers[guid];
+    roles.push_back(hash);
+    if(roles.size() == 1) {
+      _nodes[guid].insert(guid);
+      _all->add(guid);
+    }
+
+    return true;
+  }
+
+
+  /**
+   * Removes the given peer from the given role. The role is kept even if it
+   * becomes empty.
+   *
+   * @param role The role to remove from.
+   * @param guid The GUID of the peer.
+   * @return `false` if the peer did not have the given role.
+   */
+
+  bool PeerRegistry::remove(PPtr<KString> role, const k_guid_t& guid) {
+    k_longint_t hash = role->getHashCode();
+
+    RoleMap_t::iterator r = _roles.find(hash);
+    if(r == _roles.end() || !r->second->members->containts(guid)) {
+      return false;
+    }
+
+    r->second->members->remove(guid);
+    if(unlink(hash, guid)) {
+      _all->remove(guid);
+    }
+    return true;
+  }
+
+
+  /**
+   * Removes the given role along with all its members.
+   *
+   * @return The members the role had, or NULL if it did not exist.
+   */
+
+  Ptr<Group> PeerRegistry::removeRole(PPtr<KString> role) {
+    k_longint_t hash = role->getHashCode();
+
+    RoleMap_t::iterator r = _roles.find(hash);
+    if(r == _roles.end()) {
+      return NULL;
+    }
+
+    Ptr<Group> members = r->second->members;
+    _roles.erase(r);
+
+    vector<k_guid_t> dropped;
+    {
+      Group::Snapshot snapshot(*members);
+      for(int i = snapshot.getCount() - 1; i >= 0; i--) {
+        if(unlink(hash, snapshot.get(i))) {
+          dropped.push_back(snapshot.get(i));
+        }
+      }
+    }
+    _all->remove(dropped);
+
+    return members;
+  }
+
+
+  /**
+   * Removes all peers with the same AppID and node rank as the given GUID,
+   * from all their roles. Each group touched is rebuilt once, however many
+   * of its members are removed.
+   *
+   * @param guid The GUID whose node is to be matched.
+   * @param removed Appended with one entry for each role of each peer
+   *        removed.
+   */
+
+  void PeerRegistry::removeNode(const k_guid_t& guid,
+      vector<Removal>& removed)
+  {
+    NodeMap_t::iterator n = _nodes.find(guid);
+    if(n == _nodes.end()) {
+      return;
+    }
+
+    PeerSet_t peers;
+    peers.swap(n->second);
+    _nodes.erase(n);
+
+    map<k_longint_t, vector<k_guid_t> > byRole;
+    vector<k_guid_t> dropped;
+    dropped.reserve(peers.size());
+
+    for(PeerSet_t::iterator i = peers.begin(); i != peers.end(); i++) {
+      PeerMap_t::iterator p = _peers.find(*i);
+      if(p == _peers.end()) {
+        continue;
+      }
+
+      const RoleList_t& roles = p->second;
+      for(RoleList_t::const_iterator h = roles.begin(); h != roles.end(); h++)
+      {
+        RoleMap_t::iterator r = _roles.find(*h);
+        if(r == _roles.end()) {
+          continue;
+        }
+
+        byRole[*h].push_back(*i);
+
+        Removal entry;
+        entry.role = r->second->name;
+        entry.guid = *i;
+        removed.push_back(entry);
+      }
+
+      _peers.erase(p);
+      dropped.push_back(*i);
+    }
+
+    for(map<k_longint_t, vector<k_guid_t> >::iterator i = byRole.begin();
+        i != byRole.end(); i++)
+    {
+      _roles[i->first]->members->remove(i->second);
+    }
+    _all->remove(dropped);
+  }
+
+
+  /**
+   * Returns the members of the given role, or NULL if the role does not
+   * exist. The group returned is the one kept by this registry, and reflects
+   * later changes.
+   */
+
+  PPtr<Group> PeerRegistry::getMembers(PPtr<KString> role) const {
+    RoleMap_t::const_iterator r = _roles.find(role->getHashCode());
+    if(r == _roles.end()) {
+      return NULL;
+    }
+    return r->second->members;
+  }
+
+
+  /**
+   * Returns the role of the given peer, or NULL if it is not a peer. If the
+   * peer has more than one role, returns the one it was given first.
+   */
+
+  PPtr<KString> PeerRegistry::getRole(const k_guid_t& guid) const {
+    PeerMap_t::const_iterator p = _peers.find(guid);
+    if(p == _peers.end()) {
+      return NULL;
+    }
+
+    RoleMap_t::const_iterator r = _roles.find(p->second.front());
+    if(r == _roles.end()) {
+      return NULL;
+    }
+    return r->second->name;
+  }
+
+
+  /**
+   * Checks if the given GUID has at least one role.
+   */
+
+  bool PeerRegistry::contains(const k_guid_t& guid) const {
+    return _peers.find(guid) != _peers.end();
+  }
+
+
+  /**
+   * Returns a group of all peers, each appearing once regardless of the
+   * number of its roles.
+   */
+
+  PPtr<Group> PeerRegistry::getAll() const {
+    return _all;
+  }
+
+} // namespace knorba
@@ -0,0 +1,134 @@
+/*---[PeerRegistry.h]------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::PeerRegistry::*
+ |  Implements: -
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_PEERREGISTRY_H
+#define KNORBA_PEERREGISTRY_H
+
+// Std
+#include <map>
+#include <set>
+#include <vector>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/ManagedObject.h>
+
+// Internal
+#include "type/definitions.h"
+#include "type/KString.h"
+#include "Group.h"
+
+namespace knorba {
+
+  using namespace std;
+  using namespace kfoundation;
+  using namespace knorba::type;
+
+
+  /**
+   * Keeps the peers of an agent, see Agent::addPeer(). Three indexes are
+   * kept in step:
+   *
+   * - role → members, keyed by the hash of the role name. Since KString
+   *   compares by hash, this finds the same role a scan with equals() would,
+   *   in logarithmic time.
+   * - GUID → roles of that peer. A peer may fulfill more than one role, and
+   *   stays in getAll() until it is removed from the last of them.
+   * - (AppID, node rank) → peers on that node, so that removeNode() touches
+   *   only the peers it removes.
+   *
+   * Each role holds its members in a Group, which is handed out as is by
+   * getMembers(), so that senders can iterate it without copying.
+   *
+   * PeerRegistry does no locking of its own. Agent changes it only from its
+   * message context.
+   *
+   * @headerfile PeerRegistry.h <knorba/PeerRegistry.h>
+   */
+
+  class PeerRegistry {
+
+  // --- NESTED TYPES --- //
+
+    /**
+     * A peer removed by removeNode(), paired with one of its roles.
+     */
+
+    public: struct Removal {
+      Ptr<KString> role;
+      k_guid_t guid;
+    };
+
+
+    private: class Role : public ManagedObject {
+      public: Ptr<KString> name;
+      public: Ptr<Group> members;
+    };
+
+
+    /** Orders GUIDs by all their fields. */
+
+    private: struct GuidLess {
+      bool operator()(const k_guid_t& a, const k_guid_t& b) const;
+    };
+
+
+    /** Orders GUIDs by AppID and node rank, ignoring the rest. */
+
+    private: struct NodeLess {
+      bool operator()(const k_guid_t& a, const k_guid_t& b) const;
+    };
+
+
+    private: typedef map<k_longint_t, Ptr<Role> > RoleMap_t;
+    private: typedef vector<k_longint_t> RoleList_t;
+    private: typedef map<k_guid_t, RoleList_t, GuidLess> PeerMap_t;
+    private: typedef set<k_guid_t, GuidLess> PeerSet_t;
+    private: typedef map<k_guid_t, PeerSet_t, NodeLess> NodeMap_t;
+
+
+  // --- FIELDS --- //
+
+    private: RoleMap_t _roles;
+    private: PeerMap_t _peers;
+    private: NodeMap_t _nodes;
+    private: Ptr<Group> _all;
+
+
+  // --- (DE)CONSTRUCTORS --- //
+
+    public: PeerRegistry();
+    private: PeerRegistry(const PeerRegistry&);
+
+
+  // --- METHODS --- //
+
+    private: PeerRegistry& operator=(const PeerRegistry&);
+    private: bool unlink(k_longint_t roleHash, const k_guid_t& guid);
+    public: bool add(PPtr<KString> role, const k_guid_t& guid);
+    public: bool remove(PPtr<KString> role, const k_guid_t& guid);
+    public: Ptr<Group> removeRole(PPtr<KString> role);
+    public: void removeNode(const k_guid_t& guid, vector<Removal>& removed);
+    public: PPtr<Group> getMembers(PPtr<KString> role) const;
+    public: PPtr<KString> getRole(const k_guid_t& guid) const;
+    public: bool contains(const k_guid_t& guid) const;
+    public: PPtr<Group> getAll() const;
+
+  };
+
+} // namespace knorba
+
+#endif /* defined(KNORBA_PEERREGISTRY_H) */
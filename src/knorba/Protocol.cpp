@@ -57,11 +57,39 @@ namespace knorba {
    *
    * @param handler Pointer to handler method
    * @param opcode The opcode that activates the given handler
+   * @param priority Priority class of messages with the given opcode
    */
 
-  void Protocol::registerHandler(phandler_t handler, PPtr<KString> opcode) {
+  void Protocol::registerHandler(phandler_t handler, PPtr<KString> opcode,
+      Mailbox::priority_t priority)
+  {
     k_longint_t hash = opcode->getHashCode();
+    _batchHandlerMap.erase(hash);
     _handlerMap[hash] = handler;
+    _agent->setOpcodePriority(opcode, priority);
+    _agent->invalidateDispatchTable();
+  }
+  
+  
+  /**
+   * Registers a batch handler for the given opcode. Batch handlers receive
+   * all queued messages with the given opcode at once, if batching is
+   * enabled for the agent.
+   *
+   * @param handler Pointer to handler method
+   * @param opcode The opcode that activates the given handler
+   * @param priority Priority class of messages with the given opcode
+   * @see Agent::setBatchSize()
+   */
+  
+  void Protocol::registerBatchHandler(pbatch_handler_t handler,
+      PPtr<KString> opcode, Mailbox::priority_t priority)
+  {
+    k_longint_t hash = opcode->getHashCode();
+    _handlerMap.erase(hash);
+    _batchHandlerMap[hash] = handler;
+    _agent->setOpcodePriority(opcode, priority);
+    _agent->invalidateDispatchTable();
   }
   
   
@@ -77,6 +105,19 @@ namespace knorba {
   }
   
   
+  Protocol::pbatch_handler_t Protocol::getBatchHandlerForOpcodeHash(
+      const k_longint_t hash)
+  {
+    batch_map_t::iterator it = _batchHandlerMap.find(hash);
+    
+    if(it == _batchHandlerMap.end()) {
+      return NULL;
+    }
+    
+    return it->second;
+  }
+  
+  
   /** 
    * @fn Protocol::handlePeerConnectionReuqest
    * Override to handle peer connection request.
@@ -26,6 +26,7 @@
 
 // Internal
 #include "Message.h"
+#include "Mailbox.h"
 
 #define PLOG _agent->log()
 #define PLOG_ERR _agent->log(::kfoundation::Logger::ERR)
@@ -37,6 +38,7 @@ namespace knorba {
   using namespace kfoundation;
   
   class Agent;
+  class MessageSet;
 
 
   /**
@@ -66,30 +68,43 @@ namespace knorba {
    */
 
   class Protocol {
+    friend class Agent;
     
   // --- NESTED TYPES --- //
 
     /** Pointer to protocol message handler */
     public: typedef void (Protocol::*phandler_t)(PPtr<Message>);
+    
+    /** Pointer to protocol batch handler */
+    public: typedef void (Protocol::*pbatch_handler_t)(PPtr<MessageSet>);
+    
     private: typedef map<k_longint_t, phandler_t> map_t;
+    private: typedef map<k_longint_t, pbatch_handler_t> batch_map_t;
 
     
   // --- FIELDS --- //
     
     private:   map_t _handlerMap;
+    private:   batch_map_t _batchHandlerMap;
     protected: Agent* const _agent;
 
   
   // --- (DE)CONSTRUCTORS --- //
     
     public: Protocol(Agent* _owner);
-    public: ~Protocol();
+    public: virtual ~Protocol();
     
     
   // --- METHODS --- //
   
-    protected: void registerHandler(phandler_t handler, PPtr<KString> opcode);
+    protected: void registerHandler(phandler_t handler, PPtr<KString> opcode,
+        Mailbox::priority_t priority = Mailbox::PRIORITY_NORMAL);
+    protected: void registerBatchHandler(pbatch_handler_t handler,
+        PPtr<KString> opcode,
+        Mailbox::priority_t priority = Mailbox::PRIORITY_NORMAL);
     public: phandler_t getHandlerForOpcodeHash(const k_longint_t hash);
+    public: pbatch_handler_t getBatchHandlerForOpcodeHash(
+        const k_longint_t hash);
     public: virtual void handlePeerConnectionReuqest(PPtr<KString> role, const k_guid_t& guid);
     public: virtual void handlePeerDisconnected(PPtr<KString> role, const k_guid_t& guid);
     public: virtual void finalize();
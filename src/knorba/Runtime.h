@@ -145,6 +145,16 @@ namespace knorba {
         const k_longint_t opcode, PPtr<KValue> content,
         const k_integer_t tid) = 0;
       
+    /**
+     * Sends a multicast message. Local receivers share a single instance of
+     * the payload. If `content` is already frozen, that instance is used
+     * as-is; otherwise it is copied once and the copy is frozen, so that the
+     * sender remains free to change its own object after the call. The same
+     * applies to sendToAll() and sendToLocals().
+     *
+     * @see KValue::freeze()
+     */
+
     public: virtual void send(const k_guid_t& sender, PPtr<Group> receivers,
         const k_longint_t opcode, PPtr<KValue> content,
         const k_integer_t tid) = 0;
@@ -157,8 +167,29 @@ namespace knorba {
         const k_longint_t opcode, PPtr<KValue> content,
         const k_integer_t tid) = 0;
     
+    /**
+     * Sends a unicast message whose content the sender gives up. If the
+     * receiver is local, the runtime may hand `content` over as-is, without
+     * copying, serializing or freezing it, and the receiver becomes its sole
+     * owner. The default implementation falls back to send().
+     *
+     * @note The caller should hold no other reference to `content`.
+     */
+
+    public: virtual void sendMove(const k_guid_t& sender,
+        const k_guid_t& receiver, const k_longint_t opcode,
+        PPtr<KValue> content, const k_integer_t tid);
+    
   };
   
+  
+  inline void Runtime::sendMove(const k_guid_t& sender,
+      const k_guid_t& receiver, const k_longint_t opcode,
+      PPtr<KValue> content, const k_integer_t tid)
+  {
+    send(sender, receiver, opcode, content, tid);
+  }
+  
 } // namespace knorba
 
 #endif /* defined(__KnoRBA__Runtime__) */
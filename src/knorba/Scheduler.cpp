@@ -0,0 +1,1292 @@
+/*---[Scheduler.cpp]-------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::Scheduler::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Int.h>
+#include <kfoundation/Logger.h>
+#include <kfoundation/System.h>
+
+// Self
+#include "Scheduler.h"
+
+#define TASK_SCHEDULED 1
+#define TASK_RUNNING   2
+
+// How often a worker checks the shared queue before its local one.
+#define SHARED_QUEUE_INTERVAL 61
+
+namespace knorba {
+
+  /** The worker running on the current thread, if any. */
+  static __thread void* currentWorker = NULL;
+
+
+  /** Tells the CPU the calling thread is busy-waiting. */
+  static inline void relax() {
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+  }
+
+
+//\/ Scheduler::Task /\////////////////////////////////////////////////////////
+
+  Scheduler::Task::Task() {
+    _state = 0;
+    _nRefs = 0;
+    _nResuming = 0;
+    _runner = NULL;
+  }
+
+
+  Scheduler::Task::~Task() {
+    // Nothing;
+  }
+
+
+//\/ Scheduler::Deque /\///////////////////////////////////////////////////////
+
+  // Chase-Lev deque. The owner pushes and pops at the bottom, thieves steal
+  // from the top.
+
+  Scheduler::Deque::Deque(int size) {
+    _items = new Task*[size];
+    _mask = size - 1;
+    _top = 0;
+    _bottom = 0;
+  }
+
+
+  Scheduler::Deque::~Deque() {
+    delete[] _items;
+  }
+
+
+  /**
+   * Pushes the given task at the bottom. Called by the owner only.
+   *
+   * @return `false` if the deque is full.
+   */
+
+  bool Scheduler::Deque::push(Task* task) {
+    kf_int64_t b = __atomic_load_n(&_bottom, __ATOMIC_RELAXED);
+    kf_int64_t t = __atomic_load_n(&_top, __ATOMIC_ACQUIRE);
+
+    if(b - t > _mask) {
+      return false;
+    }
+
+    __atomic_store_n(&_items[b & _mask], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&_bottom, b + 1, __ATOMIC_RELEASE);
+
+    return true;
+  }
+
+
+  /**
+   * Pops a task from the bottom. Called by the owner only.
+   */
+
+  Scheduler::Task* Scheduler::Deque::pop() {
+    kf_int64_t b = __atomic_load_n(&_bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&_bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    kf_int64_t t = __atomic_load_n(&_top, __ATOMIC_RELAXED);
+
+    if(t > b) {
+      __atomic_store_n(&_bottom, b + 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+
+    Task* task = __atomic_load_n(&_items[b & _mask], __ATOMIC_RELAXED);
+
+    if(t == b) {
+      // Last one. Race against thieves.
+      if(!__atomic_compare_exchange_n(&_top, &t, t + 1, false,
+          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      {
+        task = NULL;
+      }
+      __atomic_store_n(&_bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return task;
+  }
+
+
+  /**
+   * Steals a task from the top. Safe to be called by any thread.
+   *
+   * @return The stolen task, or `NULL` if the deque is empty or another
+   *         thread won the race.
+   */
+
+  Scheduler::Task* Scheduler::Deque::steal() {
+    kf_int64_t t = __atomic_load_n(&_top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    kf_int64_t b = __atomic_load_n(&_bottom, __ATOMIC_ACQUIRE);
+
+    if(t >= b) {
+      return NULL;
+    }
+
+    Task* task = __atomic_load_n(&_items[t & _mask], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&_top, &t, t + 1, false,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+      return NULL;
+    }
+
+    return task;
+  }
+
+
+  bool Scheduler::Deque::isEmpty() const {
+    return __atomic_load_n(&_bottom, __ATOMIC_ACQUIRE)
+        <= __atomic_load_n(&_top, __ATOMIC_ACQUIRE);
+  }
+
+
+//\/ Scheduler::Timer /\///////////////////////////////////////////////////////
+
+  Scheduler::Timer::Timer(Scheduler* owner)
+  : Thread("knorba timer"),
+    _owner(owner)
+  {
+    // Nothing;
+  }
+
+
+  void Scheduler::Timer::run() {
+    _owner->runTimer();
+  }
+
+
+//\/ Scheduler::Worker /\//////////////////////////////////////////////////////
+
+  Scheduler::Worker::Worker(Scheduler* owner, int index, int cpu,
+      bool isSpare, Deque* deque)
+  : Thread("knorba worker " + Int::toString(index)),
+    owner(owner),
+    index(index),
+    cpu(cpu),
+    isSpare(isSpare),
+    deque(deque)
+  {
+    tick = 0;
+    spinLimit = MIN_SPINS;
+    isRetired = false;
+  }
+
+
+  void Scheduler::Worker::run() {
+    currentWorker = this;
+
+#if defined(__linux__)
+    if(cpu >= 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    while(!__atomic_load_n(&owner->_stopFlag, __ATOMIC_ACQUIRE)) {
+      if(owner->isOversubscribed()) {
+        if(!isSpare) {
+          owner->park();
+          continue;
+        } else if(owner->retire(this, true)) {
+          break;
+        }
+      }
+
+      Task* task = owner->find(this);
+      if(task != NULL) {
+        owner->execute(task);
+      } else if(!owner->idle(this) && owner->retire(this, false)) {
+        break;
+      }
+    }
+
+    currentWorker = NULL;
+    __atomic_sub_fetch(&owner->_nRunningWorkers, 1, __ATOMIC_SEQ_CST);
+  }
+
+
+//\/ Scheduler /\//////////////////////////////////////////////////////////////
+
+// --- STATIC FIELDS --- //
+
+  const int Scheduler::MAX_WORKERS;
+  const int Scheduler::DEQUE_SIZE;
+  Scheduler* Scheduler::_default = NULL;
+  pthread_once_t Scheduler::_defaultOnce = PTHREAD_ONCE_INIT;
+
+
+// --- STATIC METHODS --- //
+
+  void Scheduler::createDefault() {
+    _default = new Scheduler();
+  }
+
+
+  /**
+   * Returns the scheduler shared by all agents in the current process. It is
+   * created on first use, with one worker per core.
+   */
+
+  Scheduler& Scheduler::getDefault() {
+    pthread_once(&_defaultOnce, &Scheduler::createDefault);
+    return *_default;
+  }
+
+
+  /**
+   * Lists the cores the current process is allowed to run on. Where
+   * sched_getaffinity() is not supported, all online cores are listed.
+   *
+   * @param cores Filled with the numbers of the allowed cores, if not NULL.
+   * @param size The number of entries `cores` has room for.
+   * @return The number of allowed cores, which may be more than `size`.
+   */
+
+  int Scheduler::getAllowedCores(int* cores, int size) {
+    int n = 0;
+
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for(int i = 0; i < CPU_SETSIZE; i++) {
+        if(CPU_ISSET(i, &set)) {
+          if(cores != NULL && n < size) {
+            cores[n] = i;
+          }
+          n++;
+        }
+      }
+      if(n > 0) {
+        return n;
+      }
+    }
+#endif
+
+    long nOnline = sysconf(_SC_NPROCESSORS_ONLN);
+    n = nOnline > 0 ? (int)nOnline : 1;
+    for(int i = 0; cores != NULL && i < n && i < size; i++) {
+      cores[i] = i;
+    }
+    return n;
+  }
+
+
+  /**
+   * Returns the number of processor cores the current process is allowed to
+   * run on.
+   */
+
+  int Scheduler::getNumberOfCores() {
+    return getAllowedCores(NULL, 0);
+  }
+
+
+// --- (DE)CONSTRUCTORS --- //
+
+  /**
+   * Constructor. Starts the workers.
+   *
+   * @param nWorkers Number of workers. If zero or less, the number of cores
+   *        is used.
+   * @param affinity If `true`, each worker is pinned to one of the cores the
+   *        process is allowed to run on, in turn.
+   */
+
+  Scheduler::Scheduler(int nWorkers, bool affinity) {
+    _nCores = getNumberOfCores();
+    _cores = new int[_nCores];
+    int nAllowed = getAllowedCores(_cores, _nCores);
+    if(nAllowed < _nCores) {
+      _nCores = nAllowed;
+    }
+    _nTarget = nWorkers > 0 ? nWorkers : _nCores;
+    if(_nTarget > MAX_WORKERS) {
+      _nTarget = MAX_WORKERS;
+    }
+
+    _isAffinityEnabled = affinity;
+    _stopFlag = false;
+
+    _workers = new Ptr<Worker>[MAX_WORKERS];
+    _deques = new Deque*[MAX_WORKERS];
+    _nSlots = 0;
+    _nWorkers = 0;
+    _nRunningWorkers = 0;
+    _nBlockedWorkers = 0;
+    _isFullReported = false;
+
+    _queueSize = 64;
+    _queue = new Task*[_queueSize];
+    _queueHead = 0;
+    _queueCount = 0;
+
+    _nIdle = 0;
+    _nWakeups = 0;
+    _nJoining = 0;
+    _nIdleWaiters = 0;
+
+    _timers = NULL;
+    _nTimers = 0;
+    _timersCapacity = 0;
+    _isTimerRunning = false;
+
+    pthread_mutex_init(&_workersMutex, NULL);
+    pthread_mutex_init(&_queueMutex, NULL);
+    pthread_mutex_init(&_idleMutex, NULL);
+    pthread_cond_init(&_idleCond, NULL);
+    pthread_mutex_init(&_resumeMutex, NULL);
+    pthread_cond_init(&_resumeCond, NULL);
+    pthread_mutex_init(&_joinMutex, NULL);
+    pthread_cond_init(&_joinCond, NULL);
+    pthread_mutex_init(&_quietMutex, NULL);
+    pthread_cond_init(&_quietCond, NULL);
+    pthread_mutex_init(&_timerMutex, NULL);
+    pthread_cond_init(&_timerCond, NULL);
+
+    for(int i = 0; i < _nTarget; i++) {
+      addWorker(false);
+    }
+  }
+
+
+  /**
+   * Deconstructor. Stops all workers. Tasks still in the queues are not run.
+   */
+
+  Scheduler::~Scheduler() {
+    stop();
+
+    for(int i = 0; i < _nSlots; i++) {
+      delete _deques[i];
+    }
+
+    delete[] _workers;
+    delete[] _deques;
+    delete[] _cores;
+    delete[] _queue;
+    delete[] _timers;
+
+    pthread_mutex_destroy(&_workersMutex);
+    pthread_mutex_destroy(&_queueMutex);
+    pthread_cond_destroy(&_idleCond);
+    pthread_mutex_destroy(&_idleMutex);
+    pthread_cond_destroy(&_resumeCond);
+    pthread_mutex_destroy(&_resumeMutex);
+    pthread_cond_destroy(&_joinCond);
+    pthread_mutex_destroy(&_joinMutex);
+    pthread_cond_destroy(&_quietCond);
+    pthread_mutex_destroy(&_quietMutex);
+    pthread_cond_destroy(&_timerCond);
+    pthread_mutex_destroy(&_timerMutex);
+  }
+
+
+// --- METHODS --- //
+
+  Scheduler::Worker* Scheduler::getCurrentWorker() const {
+    Worker* w = (Worker*)currentWorker;
+    if(w == NULL || w->owner != this) {
+      return NULL;
+    }
+    return w;
+  }
+
+
+  /**
+   * Starts a new worker. Only the initial workers are pinned to cores, spare
+   * ones started to compensate for blocked workers are not. A spare worker
+   * takes the slot of one that has retired, if any, so that the number of
+   * slots stays at the highest number of workers running at the same time.
+   * Each slot keeps its deque for good, so that other workers can steal
+   * from it without synchronizing with the workers that come and go.
+   */
+
+  void Scheduler::addWorker(bool isSpare) {
+    Ptr<Worker> worker;
+    bool isFull = false;
+
+    pthread_mutex_lock(&_workersMutex);
+    if(!__atomic_load_n(&_stopFlag, __ATOMIC_ACQUIRE)) {
+      int slot = -1;
+
+      for(int i = _nTarget; isSpare && i < _nSlots; i++) {
+        if(_workers[i]->isRetired && !_workers[i]->isRunning()) {
+          slot = i;
+          break;
+        }
+      }
+
+      if(slot < 0 && _nSlots < MAX_WORKERS) {
+        slot = _nSlots;
+        _deques[slot] = new Deque(DEQUE_SIZE);
+      }
+
+      if(slot >= 0) {
+        int cpu = (!isSpare && _isAffinityEnabled)
+            ? _cores[slot % _nCores] : -1;
+        worker = new Worker(this, slot, cpu, isSpare, _deques[slot]);
+        _workers[slot] = worker;
+        __atomic_add_fetch(&_nRunningWorkers, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&_nWorkers, 1, __ATOMIC_SEQ_CST);
+        if(slot == _nSlots) {
+          __atomic_store_n(&_nSlots, slot + 1, __ATOMIC_RELEASE);
+        }
+      } else if(!_isFullReported) {
+        _isFullReported = true;
+        isFull = true;
+      }
+    }
+    pthread_mutex_unlock(&_workersMutex);
+
+    if(isFull) {
+      LOG_WRN << "Scheduler has reached maximum number of workers: "
+          << MAX_WORKERS << ". Tasks wait while all of them are blocked."
+          << EL;
+    }
+
+    if(!worker.isNull()) {
+      worker->start();
+    }
+  }
+
+
+  /**
+   * Called by a spare worker to exit. Refused if the worker has tasks in its
+   * local queue.
+   *
+   * @param worker The calling worker.
+   * @param isSurplus If `true`, the worker retires only if more workers are
+   *        running than needed. Otherwise it has been idle for long.
+   * @return `true` if the worker is to exit.
+   */
+
+  bool Scheduler::retire(Worker* worker, bool isSurplus) {
+    if(!worker->deque->isEmpty()) {
+      return false;
+    }
+
+    bool isRetiring = false;
+
+    pthread_mutex_lock(&_workersMutex);
+    if(!isSurplus || isOversubscribed()) {
+      __atomic_sub_fetch(&_nWorkers, 1, __ATOMIC_SEQ_CST);
+      worker->isRetired = true;
+      isRetiring = true;
+    }
+    pthread_mutex_unlock(&_workersMutex);
+
+    if(isRetiring) {
+      notifyIdle();
+    }
+
+    return isRetiring;
+  }
+
+
+  void Scheduler::enqueue(Task* task) {
+    pthread_mutex_lock(&_queueMutex);
+
+    if(_queueCount == _queueSize) {
+      Task** queue = new Task*[_queueSize * 2];
+      for(int i = 0; i < _queueCount; i++) {
+        queue[i] = _queue[(_queueHead + i) % _queueSize];
+      }
+      delete[] _queue;
+      _queue = queue;
+      _queueHead = 0;
+      _queueSize *= 2;
+    }
+
+    _queue[(_queueHead + _queueCount) % _queueSize] = task;
+    __atomic_add_fetch(&_queueCount, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&_queueMutex);
+  }
+
+
+  Scheduler::Task* Scheduler::dequeue() {
+    if(__atomic_load_n(&_queueCount, __ATOMIC_ACQUIRE) == 0) {
+      return NULL;
+    }
+
+    Task* task = NULL;
+
+    pthread_mutex_lock(&_queueMutex);
+    if(_queueCount > 0) {
+      task = _queue[_queueHead];
+      _queueHead = (_queueHead + 1) % _queueSize;
+      __atomic_sub_fetch(&_queueCount, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&_queueMutex);
+
+    return task;
+  }
+
+
+  /**
+   * Puts the given task in a queue, and wakes up an idle worker to take it.
+   *
+   * @param task The task to push.
+   * @param isLocal If `true` and called by a worker, the task is pushed to
+   *        the local queue of the worker. Otherwise to the shared queue.
+   */
+
+  void Scheduler::push(Task* task, bool isLocal) {
+    __atomic_add_fetch(&task->_nRefs, 1, __ATOMIC_SEQ_CST);
+
+    Worker* worker = isLocal ? getCurrentWorker() : NULL;
+    if(worker == NULL || !worker->deque->push(task)) {
+      enqueue(task);
+    }
+
+    // Pairs with the increment in idle(). Either the idle worker sees the
+    // task, or we see the idle worker.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&_nIdle, __ATOMIC_RELAXED) > 0) {
+      wakeOne();
+    }
+  }
+
+
+  /**
+   * Finds the next task for the given worker: from its local queue, the
+   * shared queue, or the local queue of another worker, in that order. Every
+   * once in a while the shared queue is checked first, so that it is not
+   * starved by tasks that keep submitting each other locally.
+   */
+
+  Scheduler::Task* Scheduler::find(Worker* worker) {
+    Task* task = NULL;
+
+    worker->tick++;
+    if(worker->tick % SHARED_QUEUE_INTERVAL == 0) {
+      task = dequeue();
+    }
+
+    if(task == NULL) {
+      task = worker->deque->pop();
+    }
+
+    if(task == NULL) {
+      task = dequeue();
+    }
+
+    if(task == NULL) {
+      int n = __atomic_load_n(&_nSlots, __ATOMIC_ACQUIRE);
+      for(int i = 1; i < n && task == NULL; i++) {
+        task = _deques[(worker->index + i) % n]->steal();
+      }
+    }
+
+    return task;
+  }
+
+
+  /**
+   * Called when the given worker runs out of tasks. Spins looking for one
+   * for up to `spinLimit` rounds, then parks until a task is pushed. Spinning
+   * workers are not counted as idle, so pushing a task does not bother to
+   * wake anyone while one of them is around to steal it.
+   *
+   * @return `false` if the given worker is a spare one, and has found nothing
+   *         to do for SPARE_TIMEOUT milliseconds.
+   */
+
+  bool Scheduler::idle(Worker* worker) {
+    for(int i = 0; i < worker->spinLimit; i++) {
+      relax();
+      if(__atomic_load_n(&_stopFlag, __ATOMIC_ACQUIRE)) {
+        return true;
+      }
+
+      Task* task = find(worker);
+      if(task != NULL) {
+        if(worker->spinLimit < MAX_SPINS) {
+          worker->spinLimit *= 2;
+        }
+        execute(task);
+        return true;
+      }
+    }
+
+    if(worker->spinLimit > MIN_SPINS) {
+      worker->spinLimit /= 2;
+    }
+
+    __atomic_add_fetch(&_nIdle, 1, __ATOMIC_SEQ_CST);
+
+    Task* task = find(worker);
+    if(task != NULL) {
+      __atomic_sub_fetch(&_nIdle, 1, __ATOMIC_SEQ_CST);
+      execute(task);
+      return true;
+    }
+
+    if(wait(worker->isSpare ? SPARE_TIMEOUT : -1)) {
+      return true;
+    }
+
+    // A task pushed while leaving wait() does not wake anyone.
+    task = find(worker);
+    if(task != NULL) {
+      execute(task);
+      return true;
+    }
+
+    return false;
+  }
+
+
+  /**
+   * Parks the calling worker without looking for a task. Used when there are
+   * more running workers than cores, which happens when blocked workers
+   * resume while spare ones are running.
+   */
+
+  void Scheduler::park() {
+    int nIdle = __atomic_add_fetch(&_nIdle, 1, __ATOMIC_SEQ_CST);
+
+    // A worker may have blocked in the meantime, without waking anyone as
+    // this one was not idle yet.
+    if(__atomic_load_n(&_nWorkers, __ATOMIC_ACQUIRE)
+        - __atomic_load_n(&_nBlockedWorkers, __ATOMIC_SEQ_CST)
+        - (nIdle - 1) <= _nTarget)
+    {
+      __atomic_sub_fetch(&_nIdle, 1, __ATOMIC_SEQ_CST);
+      return;
+    }
+
+    wait();
+  }
+
+
+  /**
+   * Waits for wakeOne(), with the calling worker counted as idle.
+   *
+   * @param msecs Maximum time to wait in milliseconds, or -1 to wait as long
+   *        as it takes.
+   * @return `false` if the time is up without a wakeup.
+   */
+
+  bool Scheduler::wait(int msecs) {
+    notifyIdle();
+
+    struct timespec ts;
+    if(msecs >= 0) {
+      kf_int64_t then = System::getCurrentTimeInMiliseconds() + msecs;
+      ts.tv_sec = (time_t)(then / 1000);
+      ts.tv_nsec = (long)(then % 1000) * 1000000;
+    }
+
+    bool isWoken = true;
+
+    pthread_mutex_lock(&_idleMutex);
+    while(_nWakeups == 0 && !__atomic_load_n(&_stopFlag, __ATOMIC_ACQUIRE)) {
+      if(msecs < 0) {
+        pthread_cond_wait(&_idleCond, &_idleMutex);
+      } else if(pthread_cond_timedwait(&_idleCond, &_idleMutex, &ts)
+          == ETIMEDOUT)
+      {
+        isWoken = _nWakeups > 0;
+        break;
+      }
+    }
+    if(_nWakeups > 0) {
+      _nWakeups--;
+    }
+
+    // Under the mutex, so that wakeOne() does not count a worker that leaves
+    // without taking a wakeup.
+    __atomic_sub_fetch(&_nIdle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&_idleMutex);
+
+    return isWoken;
+  }
+
+
+  /**
+   * Checks if more workers are running than the number of workers the
+   * scheduler is created with.
+   */
+
+  bool Scheduler::isOversubscribed() const {
+    return __atomic_load_n(&_nWorkers, __ATOMIC_ACQUIRE)
+        - __atomic_load_n(&_nBlockedWorkers, __ATOMIC_SEQ_CST)
+        - __atomic_load_n(&_nIdle, __ATOMIC_SEQ_CST) > _nTarget;
+  }
+
+
+  void Scheduler::wakeOne() {
+    pthread_mutex_lock(&_idleMutex);
+    if(_nWakeups < __atomic_load_n(&_nIdle, __ATOMIC_SEQ_CST)) {
+      _nWakeups++;
+      pthread_cond_signal(&_idleCond);
+    }
+    pthread_mutex_unlock(&_idleMutex);
+  }
+
+
+  /**
+   * Wakes up threads in waitForIdle(), if any. Called whenever a worker
+   * stops doing work: when it parks, blocks or retires.
+   */
+
+  void Scheduler::notifyIdle() {
+    if(__atomic_load_n(&_nIdleWaiters, __ATOMIC_SEQ_CST) > 0) {
+      pthread_mutex_lock(&_quietMutex);
+      pthread_cond_broadcast(&_quietCond);
+      pthread_mutex_unlock(&_quietMutex);
+    }
+  }
+
+
+  /**
+   * Takes the run token of the given task, if it is scheduled and no other
+   * thread is running it, or waiting to resume it.
+   */
+
+  bool Scheduler::acquire(Task* task) {
+    if(__atomic_load_n(&task->_nResuming, __ATOMIC_SEQ_CST) > 0) {
+      return false;
+    }
+
+    int s = __atomic_load_n(&task->_state, __ATOMIC_RELAXED);
+    do {
+      if((s & TASK_SCHEDULED) == 0 || (s & TASK_RUNNING) != 0) {
+        return false;
+      }
+    } while(!__atomic_compare_exchange_n(&task->_state, &s, TASK_RUNNING,
+        true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    task->_runner = getCurrentWorker();
+    return true;
+  }
+
+
+  /**
+   * Gives up the run token of the given task. Pushes the task back to a queue
+   * if it has more work to do, or has been submitted while running.
+   */
+
+  void Scheduler::release(Task* task, bool hasMore) {
+    task->_runner = NULL;
+
+    int s = __atomic_fetch_and(&task->_state, ~TASK_RUNNING, __ATOMIC_SEQ_CST);
+
+    if(s & TASK_SCHEDULED) {
+      push(task, true);
+    } else if(hasMore) {
+      // To the shared queue, so that other tasks get their turn.
+      if(__atomic_fetch_or(&task->_state, TASK_SCHEDULED, __ATOMIC_SEQ_CST)
+          == 0)
+      {
+        push(task, false);
+      }
+    }
+
+    if(__atomic_load_n(&task->_nResuming, __ATOMIC_SEQ_CST) > 0) {
+      pthread_mutex_lock(&_resumeMutex);
+      pthread_cond_broadcast(&_resumeCond);
+      pthread_mutex_unlock(&_resumeMutex);
+    }
+  }
+
+
+  /**
+   * Drops `n` references to the given task, waking threads in join() when
+   * the last one goes.
+   */
+
+  void Scheduler::unref(Task* task, int n) {
+    if(__atomic_sub_fetch(&task->_nRefs, n, __ATOMIC_SEQ_CST) == 0
+        && __atomic_load_n(&_nJoining, __ATOMIC_SEQ_CST) > 0)
+    {
+      pthread_mutex_lock(&_joinMutex);
+      pthread_cond_broadcast(&_joinCond);
+      pthread_mutex_unlock(&_joinMutex);
+    }
+  }
+
+
+  void Scheduler::execute(Task* task) {
+    if(acquire(task)) {
+      release(task, task->run());
+    }
+
+    // Stale copies of a task are dropped by acquire().
+    unref(task, 1);
+  }
+
+
+  /**
+   * Body of the timer thread. Keeps the timers in a binary heap ordered by
+   * time, and submits each task when its time comes.
+   */
+
+  void Scheduler::runTimer() {
+    pthread_mutex_lock(&_timerMutex);
+
+    while(!__atomic_load_n(&_stopFlag, __ATOMIC_ACQUIRE)) {
+      if(_nTimers == 0) {
+        pthread_cond_wait(&_timerCond, &_timerMutex);
+        continue;
+      }
+
+      kf_int64_t now = System::getCurrentTimeInMiliseconds();
+      kf_int64_t then = _timers[0].time;
+
+      if(then > now) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(then / 1000);
+        ts.tv_nsec = (long)(then % 1000) * 1000000;
+        pthread_cond_timedwait(&_timerCond, &_timerMutex, &ts);
+        continue;
+      }
+
+      Task* task = _timers[0].task;
+
+      // Pop the root.
+      _nTimers--;
+      TimerRecord last = _timers[_nTimers];
+      int i = 0;
+      while(true) {
+        int child = 2 * i + 1;
+        if(child >= _nTimers) {
+          break;
+        }
+        if(child + 1 < _nTimers
+            && _timers[child + 1].time < _timers[child].time)
+        {
+          child++;
+        }
+        if(last.time <= _timers[child].time) {
+          break;
+        }
+        _timers[i] = _timers[child];
+        i = child;
+      }
+      _timers[i] = last;
+
+      // Under the mutex, so that once cancel() returns the task is either
+      // submitted, and join() waits for it, or not touched at all.
+      submit(task);
+    }
+
+    _isTimerRunning = false;
+    pthread_mutex_unlock(&_timerMutex);
+  }
+
+
+  /**
+   * Marks the given task as having work to do. The task will be run by one
+   * of the workers as soon as possible. If it is already running, it will be
+   * run again after the current run. Safe to be called by any thread.
+   *
+   * @param task The task to submit.
+   */
+
+  void Scheduler::submit(Task* task) {
+    if(__atomic_fetch_or(&task->_state, TASK_SCHEDULED, __ATOMIC_SEQ_CST)
+        == 0)
+    {
+      push(task, true);
+    }
+  }
+
+
+  /**
+   * Submits the given task at the given time. Safe to be called by any
+   * thread. A task can have any number of pending timers. Pending timers do
+   * not keep the task active, see isActive(), so cancel() them before
+   * destructing the task.
+   *
+   * @param task The task to submit.
+   * @param time Absolute time, in milliseconds, as returned by
+   *        System::getCurrentTimeInMiliseconds().
+   */
+
+  void Scheduler::submitAt(Task* task, kf_int64_t time) {
+    pthread_mutex_lock(&_timerMutex);
+
+    if(_nTimers == _timersCapacity) {
+      _timersCapacity = _timersCapacity == 0 ? 16 : _timersCapacity * 2;
+      TimerRecord* timers = new TimerRecord[_timersCapacity];
+      for(int i = 0; i < _nTimers; i++) {
+        timers[i] = _timers[i];
+      }
+      delete[] _timers;
+      _timers = timers;
+    }
+
+    // Sift up.
+    int i = _nTimers++;
+    while(i > 0 && _timers[(i - 1) / 2].time > time) {
+      _timers[i] = _timers[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    _timers[i].time = time;
+    _timers[i].task = task;
+
+    bool isStarting = !_isTimerRunning;
+    if(isStarting) {
+      _isTimerRunning = true;
+      _timer = new Timer(this);
+    } else if(i == 0) {
+      pthread_cond_signal(&_timerCond);
+    }
+
+    pthread_mutex_unlock(&_timerMutex);
+
+    if(isStarting) {
+      _timer->start();
+    }
+  }
+
+
+  /**
+   * Discards all pending timers of the given task. Once this returns, no
+   * timer set before submits the task.
+   */
+
+  void Scheduler::cancel(Task* task) {
+    int nRemoved = 0;
+
+    pthread_mutex_lock(&_timerMutex);
+
+    int n = 0;
+    for(int i = 0; i < _nTimers; i++) {
+      if(_timers[i].task == task) {
+        nRemoved++;
+      } else {
+        _timers[n++] = _timers[i];
+      }
+    }
+
+    if(nRemoved > 0) {
+      // Rebuild the heap.
+      _nTimers = 0;
+      for(int j = 0; j < n; j++) {
+        TimerRecord r = _timers[j];
+        int i = _nTimers++;
+        while(i > 0 && _timers[(i - 1) / 2].time > r.time) {
+          _timers[i] = _timers[(i - 1) / 2];
+          i = (i - 1) / 2;
+        }
+        _timers[i] = r;
+      }
+      pthread_cond_signal(&_timerCond);
+    }
+
+    pthread_mutex_unlock(&_timerMutex);
+  }
+
+
+  /**
+   * Called by the thread running the given task before it blocks. Gives up
+   * the run token so that the task can be run by other workers while this
+   * one is blocked, and starts a spare worker if there is no idle one.
+   * Every successful call should be followed by resume() on the same thread.
+   *
+   * @param task The task being run by the current thread.
+   * @return `false` if the current thread is not running the given task, in
+   *         which case resume() should not be called.
+   */
+
+  bool Scheduler::block(Task* task) {
+    Worker* worker = getCurrentWorker();
+    if(worker == NULL || task->_runner != worker) {
+      return false;
+    }
+
+    int nBlocked = __atomic_add_fetch(&_nBlockedWorkers, 1, __ATOMIC_SEQ_CST);
+    release(task, true);
+    notifyIdle();
+
+    if(__atomic_load_n(&_nIdle, __ATOMIC_SEQ_CST) == 0
+        && __atomic_load_n(&_nWorkers, __ATOMIC_ACQUIRE) - nBlocked < _nTarget)
+    {
+      addWorker(true);
+    }
+
+    return true;
+  }
+
+
+  /**
+   * Takes back the run token of the given task after block(). Waits until
+   * the task is not run by any other thread.
+   *
+   * @param task The task given to block().
+   */
+
+  void Scheduler::resume(Task* task) {
+    __atomic_sub_fetch(&_nBlockedWorkers, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&task->_nResuming, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&_resumeMutex);
+    int s = __atomic_load_n(&task->_state, __ATOMIC_SEQ_CST);
+    while(true) {
+      if(s & TASK_RUNNING) {
+        pthread_cond_wait(&_resumeCond, &_resumeMutex);
+        s = __atomic_load_n(&task->_state, __ATOMIC_SEQ_CST);
+      } else if(__atomic_compare_exchange_n(&task->_state, &s,
+          s | TASK_RUNNING, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      {
+        break;
+      }
+    }
+    pthread_mutex_unlock(&_resumeMutex);
+
+    __atomic_sub_fetch(&task->_nResuming, 1, __ATOMIC_SEQ_CST);
+    task->_runner = getCurrentWorker();
+  }
+
+
+  /**
+   * Called by a worker before it waits for something other than a task it
+   * runs, e.g. for room in a full queue. Starts a spare worker if there is
+   * no idle one, so that the work being waited for can progress. Every
+   * successful call should be followed by endWait() on the same thread.
+   *
+   * @return `false` if the current thread is not a worker of this
+   *         scheduler, in which case endWait() should not be called.
+   */
+
+  bool Scheduler::beginWait() {
+    if(getCurrentWorker() == NULL) {
+      return false;
+    }
+
+    int nBlocked = __atomic_add_fetch(&_nBlockedWorkers, 1, __ATOMIC_SEQ_CST);
+    notifyIdle();
+
+    // Tasks in the local deque of this worker need another one to run them.
+    if(__atomic_load_n(&_nIdle, __ATOMIC_SEQ_CST) > 0) {
+      wakeOne();
+    } else if(__atomic_load_n(&_nWorkers, __ATOMIC_ACQUIRE) - nBlocked
+        < _nTarget)
+    {
+      addWorker(true);
+    }
+
+    return true;
+  }
+
+
+  /**
+   * Called by a worker after the wait started by beginWait() is over.
+   */
+
+  void Scheduler::endWait() {
+    __atomic_sub_fetch(&_nBlockedWorkers, 1, __ATOMIC_SEQ_CST);
+  }
+
+
+  /**
+   * Checks if the given task is queued or running. Pending timers are not
+   * taken into account, so that a task waiting only for a timeout does not
+   * count as busy.
+   */
+
+  bool Scheduler::isActive(const Task* task) const {
+    return __atomic_load_n(&task->_state, __ATOMIC_SEQ_CST) != 0
+        || __atomic_load_n(&task->_nRefs, __ATOMIC_SEQ_CST) != 0;
+  }
+
+
+  /**
+   * Blocks until the given task is neither queued nor running. Call before
+   * destructing a task, after cancel().
+   *
+   * @param task The task to wait for.
+   * @param msecs Maximum time to wait in milliseconds, or -1 to wait as long
+   *        as it takes.
+   * @return `false` if the task is still active when the time is up.
+   */
+
+  bool Scheduler::join(const Task* task, int msecs) {
+    if(!isActive(task)) {
+      return true;
+    }
+
+    struct timespec ts;
+    if(msecs >= 0) {
+      kf_int64_t then = System::getCurrentTimeInMiliseconds() + msecs;
+      ts.tv_sec = (time_t)(then / 1000);
+      ts.tv_nsec = (long)(then % 1000) * 1000000;
+    }
+
+    // The last reference to a task always goes after its state is cleared,
+    // and unref() checks _nJoining after dropping it, so registering before
+    // checking again under the mutex leaves no window for a lost wakeup.
+    __atomic_add_fetch(&_nJoining, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&_joinMutex);
+    bool isDone = true;
+    while(isActive(task)) {
+      if(msecs < 0) {
+        pthread_cond_wait(&_joinCond, &_joinMutex);
+      } else if(pthread_cond_timedwait(&_joinCond, &_joinMutex, &ts)
+          == ETIMEDOUT)
+      {
+        isDone = !isActive(task);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&_joinMutex);
+    __atomic_sub_fetch(&_nJoining, 1, __ATOMIC_SEQ_CST);
+
+    return isDone;
+  }
+
+
+  /**
+   * Stops all workers. Blocks until every worker finishes its current task.
+   */
+
+  void Scheduler::stop() {
+    __atomic_store_n(&_stopFlag, true, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&_idleMutex);
+    pthread_cond_broadcast(&_idleCond);
+    pthread_mutex_unlock(&_idleMutex);
+
+    pthread_mutex_lock(&_timerMutex);
+    pthread_cond_signal(&_timerCond);
+    pthread_mutex_unlock(&_timerMutex);
+
+    pthread_mutex_lock(&_quietMutex);
+    pthread_cond_broadcast(&_quietCond);
+    pthread_mutex_unlock(&_quietMutex);
+
+    while(__atomic_load_n(&_nRunningWorkers, __ATOMIC_SEQ_CST) > 0) {
+      System::sleep(10);
+    }
+
+    while(true) {
+      pthread_mutex_lock(&_timerMutex);
+      bool isTimerRunning = _isTimerRunning;
+      pthread_mutex_unlock(&_timerMutex);
+      if(!isTimerRunning) {
+        break;
+      }
+      System::sleep(10);
+    }
+  }
+
+
+  /**
+   * Checks if there is no work left, that is, no task is queued and every
+   * worker is either idle or blocked. The result is a snapshot, and may be
+   * stale as soon as it returns. Tasks scheduled with submitAt() are not
+   * taken into account.
+   */
+
+  bool Scheduler::isIdle() const {
+    if(__atomic_load_n(&_queueCount, __ATOMIC_SEQ_CST) > 0) {
+      return false;
+    }
+
+    if(__atomic_load_n(&_nWorkers, __ATOMIC_SEQ_CST)
+        - __atomic_load_n(&_nBlockedWorkers, __ATOMIC_SEQ_CST)
+        - __atomic_load_n(&_nIdle, __ATOMIC_SEQ_CST) > 0)
+    {
+      return false;
+    }
+
+    int n = __atomic_load_n(&_nSlots, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < n; i++) {
+      if(!_deques[i]->isEmpty()) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+
+  /**
+   * Blocks until isIdle() returns `true`, without polling: workers wake up
+   * the waiting threads whenever they park, block or retire.
+   *
+   * @param msecs Maximum time to wait in milliseconds, or -1 to wait as long
+   *        as it takes.
+   * @return `false` if the scheduler is still busy when the time is up, or
+   *         has been stopped.
+   */
+
+  bool Scheduler::waitForIdle(int msecs) {
+    struct timespec ts;
+    if(msecs >= 0) {
+      kf_int64_t then = System::getCurrentTimeInMiliseconds() + msecs;
+      ts.tv_sec = (time_t)(then / 1000);
+      ts.tv_nsec = (long)(then % 1000) * 1000000;
+    }
+
+    // Registering before checking under the mutex pairs with notifyIdle(),
+    // which checks for waiters after the worker has counted itself out.
+    __atomic_add_fetch(&_nIdleWaiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&_quietMutex);
+    bool isDone = true;
+    while(!isIdle()) {
+      if(__atomic_load_n(&_stopFlag, __ATOMIC_ACQUIRE)) {
+        isDone = false;
+        break;
+      }
+      if(msecs < 0) {
+        pthread_cond_wait(&_quietCond, &_quietMutex);
+      } else if(pthread_cond_timedwait(&_quietCond, &_quietMutex, &ts)
+          == ETIMEDOUT)
+      {
+        isDone = isIdle();
+        break;
+      }
+    }
+    pthread_mutex_unlock(&_quietMutex);
+    __atomic_sub_fetch(&_nIdleWaiters, 1, __ATOMIC_SEQ_CST);
+
+    return isDone;
+  }
+
+
+  /**
+   * Returns the number of running workers, including spare ones.
+   */
+
+  int Scheduler::getNumberOfWorkers() const {
+    return __atomic_load_n(&_nWorkers, __ATOMIC_ACQUIRE);
+  }
+
+} // namespace knorba
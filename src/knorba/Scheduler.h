@@ -0,0 +1,271 @@
+/*---[Scheduler.h]---------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::Scheduler::*
+ |  Implements: -
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_SCHEDULER_H
+#define KNORBA_SCHEDULER_H
+
+// Std
+#include <pthread.h>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Thread.h>
+
+// Internal
+#include "Mailbox.h"
+
+namespace knorba {
+
+  using namespace kfoundation;
+
+
+  /**
+   * Work-stealing thread pool that runs agents. Instead of each agent having
+   * threads of its own, agents are submitted to the scheduler whenever they
+   * have messages to process, and are picked up by a fixed number of worker
+   * threads, by default one per core.
+   *
+   * Each worker has a local queue. Tasks submitted by a worker, e.g. when an
+   * agent sends a message to another agent in the same process, go to its
+   * local queue, so that agents talking to each other stay on the same core.
+   * Tasks submitted by other threads go to a shared queue. A worker with
+   * nothing to do steals from the others before parking. Where supported,
+   * workers are pinned round-robin to the cores the process is allowed to run
+   * on, as given by sched_getaffinity().
+   *
+   * An idle worker spins for a while before it parks, so that a worker
+   * serving a busy agent picks up the next message without a round trip
+   * through the kernel. How long it spins adapts to how often spinning pays
+   * off: the limit doubles each time a spinning worker finds a task and
+   * halves each time it gives up.
+   *
+   * A task is never run by two threads at the same time. Whichever thread
+   * runs a task holds its run token. A task that blocks, e.g. an agent
+   * waiting for a transaction to complete, gives up the token with block(),
+   * so the task can be run on another worker in the mean time, and takes it
+   * back with resume() before continuing. While a worker is blocked, a spare
+   * worker is started if no other one is idle, so that the pool keeps all
+   * cores busy. Spare workers exit once they are surplus, or have been idle
+   * for SPARE_TIMEOUT milliseconds, and their slots are reused by later
+   * ones. There can be at most MAX_WORKERS workers; once all of them are
+   * blocked, no task can run until one of them resumes.
+   *
+   * Tasks can also be submitted to run at a given time with submitAt(). These
+   * are kept by a timer thread, started on first use, and submitted when
+   * their time comes.
+   *
+   * @headerfile Scheduler.h <knorba/Scheduler.h>
+   */
+
+  class Scheduler {
+
+  // --- NESTED TYPES --- //
+
+    private: class Worker;
+
+
+    /**
+     * Unit of work run by Scheduler. Extend and implement run().
+     */
+
+    public: class Task {
+      friend class Scheduler;
+
+      private: volatile int _state;
+      private: volatile int _nRefs;
+      private: volatile int _nResuming;
+      private: Worker*      _runner;
+
+      public: Task();
+      public: virtual ~Task();
+
+      /**
+       * Does a bounded amount of work. Called with the run token held.
+       *
+       * @return `true` if there is more work to do.
+       */
+
+      public: virtual bool run() = 0;
+    };
+
+
+    private: class Deque {
+      private: Task**          _items;
+      private: kf_int64_t      _mask;
+      private: char _pad0[KNORBA_CACHE_LINE_SIZE];
+      private: volatile kf_int64_t _top;
+      private: char _pad1[KNORBA_CACHE_LINE_SIZE - sizeof(kf_int64_t)];
+      private: volatile kf_int64_t _bottom;
+      private: char _pad2[KNORBA_CACHE_LINE_SIZE - sizeof(kf_int64_t)];
+
+      public: Deque(int size);
+      public: ~Deque();
+      public: bool push(Task* task);
+      public: Task* pop();
+      public: Task* steal();
+      public: bool isEmpty() const;
+    };
+
+
+    private: struct TimerRecord {
+      kf_int64_t time;
+      Task*      task;
+    };
+
+
+    private: class Timer : public Thread {
+      private: Scheduler* _owner;
+      public: Timer(Scheduler* owner);
+      public: void run();
+    };
+
+
+    private: class Worker : public Thread {
+      public: Scheduler* const owner;
+      public: const int index;
+      public: const int cpu;
+      public: const bool isSpare;
+      public: Deque* const deque;
+      public: int tick;
+      public: int spinLimit;
+      public: volatile bool isRetired;
+      public: Worker(Scheduler* owner, int index, int cpu, bool isSpare,
+          Deque* deque);
+      public: void run();
+    };
+
+
+  // --- STATIC FIELDS --- //
+
+    public: static const int MAX_WORKERS = 1024;
+    private: static const int DEQUE_SIZE = 256;
+    private: static const int MIN_SPINS = 64;
+    private: static const int MAX_SPINS = 8192;
+    private: static const int SPARE_TIMEOUT = 1000;
+    private: static Scheduler* _default;
+    private: static pthread_once_t _defaultOnce;
+
+
+  // --- FIELDS --- //
+
+    private: int _nCores;
+    private: int* _cores;
+    private: bool _isAffinityEnabled;
+    private: volatile bool _stopFlag;
+
+    // Workers //
+    private: Ptr<Worker>* _workers;
+    private: Deque** _deques;
+    private: int _nTarget;
+    private: volatile int _nSlots;
+    private: volatile int _nWorkers;
+    private: volatile int _nRunningWorkers;
+    private: volatile int _nBlockedWorkers;
+    private: bool _isFullReported;
+    private: pthread_mutex_t _workersMutex;
+
+    // Shared queue //
+    private: Task** _queue;
+    private: int _queueSize;
+    private: int _queueHead;
+    private: volatile int _queueCount;
+    private: pthread_mutex_t _queueMutex;
+
+    // Idle workers //
+    private: volatile int _nIdle;
+    private: int _nWakeups;
+    private: pthread_mutex_t _idleMutex;
+    private: pthread_cond_t _idleCond;
+
+    // Resuming tasks //
+    private: pthread_mutex_t _resumeMutex;
+    private: pthread_cond_t _resumeCond;
+
+    // Joining threads //
+    private: volatile int _nJoining;
+    private: pthread_mutex_t _joinMutex;
+    private: pthread_cond_t _joinCond;
+
+    // Threads waiting for idle //
+    private: volatile int _nIdleWaiters;
+    private: pthread_mutex_t _quietMutex;
+    private: pthread_cond_t _quietCond;
+
+    // Timer //
+    private: Ptr<Timer> _timer;
+    private: TimerRecord* _timers;
+    private: int _nTimers;
+    private: int _timersCapacity;
+    private: volatile bool _isTimerRunning;
+    private: pthread_mutex_t _timerMutex;
+    private: pthread_cond_t _timerCond;
+
+
+  // --- STATIC METHODS --- //
+
+    private: static void createDefault();
+    private: static int getAllowedCores(int* cores, int size);
+    public: static Scheduler& getDefault();
+    public: static int getNumberOfCores();
+
+
+  // --- (DE)CONSTRUCTORS --- //
+
+    public: Scheduler(int nWorkers = 0, bool affinity = true);
+    private: Scheduler(const Scheduler&);
+    public: ~Scheduler();
+
+
+  // --- METHODS --- //
+
+    private: Scheduler& operator=(const Scheduler&);
+    private: Worker* getCurrentWorker() const;
+    private: void addWorker(bool isSpare);
+    private: bool retire(Worker* worker, bool isSurplus);
+    private: void enqueue(Task* task);
+    private: Task* dequeue();
+    private: void push(Task* task, bool isLocal);
+    private: Task* find(Worker* worker);
+    private: bool idle(Worker* worker);
+    private: void park();
+    private: bool wait(int msecs = -1);
+    private: bool isOversubscribed() const;
+    private: void wakeOne();
+    private: void notifyIdle();
+    private: bool acquire(Task* task);
+    private: void release(Task* task, bool hasMore);
+    private: void unref(Task* task, int n);
+    private: void execute(Task* task);
+    private: void runTimer();
+    public: void submit(Task* task);
+    public: void submitAt(Task* task, kf_int64_t time);
+    public: void cancel(Task* task);
+    public: bool block(Task* task);
+    public: void resume(Task* task);
+    public: bool beginWait();
+    public: void endWait();
+    public: bool isActive(const Task* task) const;
+    public: bool join(const Task* task, int msecs = -1);
+    public: void stop();
+    public: bool isIdle() const;
+    public: bool waitForIdle(int msecs = -1);
+    public: int  getNumberOfWorkers() const;
+
+  };
+
+} // namespace knorba
+
+#endif /* defined(KNORBA_SCHEDULER_H) */
@@ -0,0 +1,401 @@
+/*---[Tracer.cpp]----------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : -
+ |  Implements: knorba::Tracer::*
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+// Std
+#include <cstdio>
+#include <algorithm>
+#include <map>
+#include <set>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+
+// Internal
+#include "Runtime.h"
+#include "type/KGuid.h"
+#include "type/KString.h"
+
+// Self
+#include "Tracer.h"
+
+namespace knorba {
+
+  /** Trace buffer of the current thread, if any. */
+  static __thread void* currentBuffer = NULL;
+
+  /** Index of the current thread in traces. */
+  static __thread int currentThread = 0;
+
+
+  /** Orders events by time. */
+  static bool isEarlier(const Tracer::Event& a, const Tracer::Event& b) {
+    return a.time < b.time;
+  }
+
+
+  /** Formats nanoseconds as microseconds, the time unit of Chrome traces. */
+  static string toMicroseconds(kf_int64_t nanos) {
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%lld.%03lld", (long long)(nanos / 1000),
+        (long long)(nanos % 1000));
+    return string(buffer);
+  }
+
+
+  static string toHex(kf_int64_t value) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "0x%llx", (unsigned long long)value);
+    return string(buffer);
+  }
+
+
+  /** Escapes the given string to be put in JSON quotes. */
+  static string escape(const string& str) {
+    string result;
+    for(string::size_type i = 0; i < str.size(); i++) {
+      char c = str[i];
+      if(c == '"' || c == '\\') {
+        result += '\\';
+        result += c;
+      } else if((unsigned char)c < 0x20) {
+        char buffer[8];
+        snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+        result += buffer;
+      } else {
+        result += c;
+      }
+    }
+    return result;
+  }
+
+
+//\/ Tracer /\/////////////////////////////////////////////////////////////////
+
+// --- STATIC FIELDS --- //
+
+  const int Tracer::DEFAULT_BUFFER_SIZE;
+  volatile bool Tracer::_isEnabled = false;
+  int Tracer::_bufferSize = Tracer::DEFAULT_BUFFER_SIZE;
+  Tracer::Buffer* volatile Tracer::_buffers = NULL;
+  volatile int Tracer::_nThreads = 0;
+  pthread_key_t Tracer::_bufferKey;
+  pthread_once_t Tracer::_bufferKeyOnce = PTHREAD_ONCE_INIT;
+
+
+// --- STATIC METHODS --- //
+
+  void Tracer::createBufferKey() {
+    pthread_key_create(&_bufferKey, &releaseBuffer);
+  }
+
+
+  /**
+   * Called when a thread with a buffer exits. Leaves the buffer with its
+   * events to be taken over by the next thread that needs one.
+   */
+
+  void Tracer::releaseBuffer(void* p) {
+    __atomic_store_n(&((Buffer*)p)->isOrphan, 1, __ATOMIC_RELEASE);
+  }
+
+
+  /**
+   * Returns the buffer of the calling thread, taking over the buffer of an
+   * exited thread, or creating one on first use.
+   */
+
+  Tracer::Buffer* Tracer::getBuffer() {
+    if(currentBuffer != NULL) {
+      return (Buffer*)currentBuffer;
+    }
+
+    pthread_once(&_bufferKeyOnce, &createBufferKey);
+
+    Buffer* buffer = NULL;
+    for(Buffer* b = __atomic_load_n(&_buffers, __ATOMIC_ACQUIRE); b != NULL;
+        b = b->next)
+    {
+      int isOrphan = 1;
+      if(__atomic_compare_exchange_n(&b->isOrphan, &isOrphan, 0, false,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      {
+        buffer = b;
+        break;
+      }
+    }
+
+    if(buffer == NULL) {
+      int size = _bufferSize;
+      buffer = new Buffer();
+      buffer->events = new Event[size];
+      buffer->mask = size - 1;
+      buffer->head = 0;
+      buffer->start = 0;
+      buffer->isOrphan = 0;
+      buffer->next = __atomic_load_n(&_buffers, __ATOMIC_RELAXED);
+      while(!__atomic_compare_exchange_n(&_buffers, &buffer->next, buffer,
+          true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      {
+        // Retry with the new head
+      }
+    }
+
+    pthread_setspecific(_bufferKey, buffer);
+    currentBuffer = buffer;
+    currentThread = __atomic_add_fetch(&_nThreads, 1, __ATOMIC_RELAXED);
+
+    return buffer;
+  }
+
+
+  void Tracer::record(event_type_t type, kf_int64_t time,
+      const k_guid_t& agent, const k_guid_t& peer, k_longint_t opcodeHash,
+      k_integer_t tid, kf_int64_t arg)
+  {
+    Buffer* buffer = getBuffer();
+    kf_int64_t head = buffer->head;
+
+    Event& e = buffer->events[head & buffer->mask];
+    e.time = time;
+    e.opcodeHash = opcodeHash;
+    e.arg = arg;
+    e.agent = agent;
+    e.peer = peer;
+    e.transactionId = tid;
+    e.thread = (kf_int16_t)currentThread;
+    e.type = (k_octet_t)type;
+
+    __atomic_store_n(&buffer->head, head + 1, __ATOMIC_RELEASE);
+  }
+
+
+  /**
+   * Turns tracing on.
+   *
+   * @param bufferSize The number of events each thread can keep. Rounded up
+   *        to the nearest power of two. Applies to buffers created from now
+   *        on.
+   */
+
+  void Tracer::start(int bufferSize) {
+    int size = 1;
+    while(size < bufferSize) {
+      size *= 2;
+    }
+    _bufferSize = size;
+    __atomic_store_n(&_isEnabled, true, __ATOMIC_RELEASE);
+  }
+
+
+  /**
+   * Turns tracing off. Recorded events are kept.
+   */
+
+  void Tracer::stop() {
+    __atomic_store_n(&_isEnabled, false, __ATOMIC_RELEASE);
+  }
+
+
+  /**
+   * Discards all recorded events.
+   */
+
+  void Tracer::clear() {
+    for(Buffer* b = __atomic_load_n(&_buffers, __ATOMIC_ACQUIRE); b != NULL;
+        b = b->next)
+    {
+      __atomic_store_n(&b->start, __atomic_load_n(&b->head, __ATOMIC_ACQUIRE),
+          __ATOMIC_RELEASE);
+    }
+  }
+
+
+  /**
+   * Copies recorded events of all threads to the given vector, in the order
+   * of time. Can be called while tracing is on, in which case events being
+   * written at the same time are left out.
+   */
+
+  void Tracer::collect(vector<Event>& events) {
+    events.clear();
+
+    for(Buffer* b = __atomic_load_n(&_buffers, __ATOMIC_ACQUIRE); b != NULL;
+        b = b->next)
+    {
+      kf_int64_t size = b->mask + 1;
+      kf_int64_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+      kf_int64_t first = __atomic_load_n(&b->start, __ATOMIC_ACQUIRE);
+      if(first < head - size) {
+        first = head - size;
+      }
+
+      vector<Event>::size_type base = events.size();
+      for(kf_int64_t i = first; i < head; i++) {
+        events.push_back(b->events[i & b->mask]);
+      }
+
+      // Slots the writer has moved on to since may have been overwritten
+      // while being copied.
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      kf_int64_t valid = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE) - size
+          + 1;
+      if(valid > first) {
+        kf_int64_t n = valid - first;
+        if(n > head - first) {
+          n = head - first;
+        }
+        events.erase(events.begin() + base, events.begin() + base + n);
+      }
+    }
+
+    stable_sort(events.begin(), events.end(), isEarlier);
+  }
+
+
+  /**
+   * Writes all recorded events in Chrome trace format. See
+   * writeChromeTrace(ostream&, const vector<Event>&, const Runtime*).
+   */
+
+  void Tracer::writeChromeTrace(ostream& os, const Runtime* rt) {
+    vector<Event> events;
+    collect(events);
+    writeChromeTrace(os, events, rt);
+  }
+
+
+  /**
+   * Writes the given events in the JSON format of Chrome's trace viewer,
+   * also understood by Perfetto. Each node is a process and each thread
+   * that recorded an event is a thread of every node it ran agents of.
+   * Handlers are slices named after their opcode, transactions are async
+   * slices, and each message is a flow from the thread that enqueued it to
+   * the handler that received it.
+   *
+   * @param os The stream to write to.
+   * @param events The events to write, in the order of time.
+   * @param rt If given, used to look up the names of opcodes. Opcodes that
+   *        are not registered with the runtime are named after their hash.
+   */
+
+  void Tracer::writeChromeTrace(ostream& os, const vector<Event>& events,
+      const Runtime* rt)
+  {
+    map<k_longint_t, string> names;
+    set< pair<int, int> > threads;
+    set<int> nodes;
+    kf_int64_t origin = events.empty() ? 0 : events[0].time;
+
+    os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+    bool isFirst = true;
+    for(vector<Event>::size_type i = 0; i < events.size(); i++) {
+      const Event& e = events[i];
+
+      map<k_longint_t, string>::iterator it = names.find(e.opcodeHash);
+      if(it == names.end()) {
+        string name = toHex(e.opcodeHash);
+        if(rt != NULL) {
+          PPtr<KString> opcode = rt->getMessageOpCodeForHash(e.opcodeHash);
+          if(!opcode.isNull()) {
+            name = opcode->toUtf8String();
+          }
+        }
+        it = names.insert(make_pair(e.opcodeHash, escape(name))).first;
+      }
+
+      // Flows start where the sender is.
+      int pid = (unsigned short)(e.type == ENQUEUE ? e.peer : e.agent)
+          .nodeRank;
+      int tid = e.thread;
+      nodes.insert(pid);
+      threads.insert(make_pair(pid, tid));
+
+      os << (isFirst ? "\n" : ",\n") << "{\"pid\":" << pid << ",\"tid\":"
+          << tid << ",\"ts\":" << toMicroseconds(e.time - origin);
+      isFirst = false;
+
+      kf_int64_t flowId = e.arg
+          ^ ((kf_int64_t)(unsigned int)e.agent.lid << 24)
+          ^ ((kf_int64_t)(unsigned short)e.agent.nodeRank << 56);
+
+      kf_int64_t transactionId = (kf_int64_t)(unsigned int)e.transactionId
+          ^ ((kf_int64_t)(unsigned int)e.agent.lid << 32)
+          ^ ((kf_int64_t)(unsigned short)e.agent.nodeRank << 48);
+
+      switch(e.type) {
+        case ENQUEUE:
+          os << ",\"ph\":\"s\",\"cat\":\"message\",\"name\":\"message\""
+              << ",\"id\":\"" << toHex(flowId) << "\"}";
+          break;
+
+        case DEQUEUE:
+          os << ",\"ph\":\"f\",\"bp\":\"e\",\"cat\":\"message\""
+              << ",\"name\":\"message\",\"id\":\"" << toHex(flowId) << "\"}";
+          break;
+
+        case HANDLER_BEGIN:
+          os << ",\"ph\":\"B\",\"cat\":\"handler\",\"name\":\"" << it->second
+              << "\",\"args\":{\"agent\":\""
+              << KGuid::toShortString(e.agent) << "\",\"sender\":\""
+              << KGuid::toShortString(e.peer) << "\",\"tid\":"
+              << e.transactionId << ",\"n\":" << e.arg << "}}";
+          break;
+
+        case HANDLER_END:
+          os << ",\"ph\":\"E\"}";
+          break;
+
+        case TRANSACTION_OPEN:
+          os << ",\"ph\":\"b\",\"cat\":\"transaction\""
+              << ",\"name\":\"transaction\",\"id\":\""
+              << toHex(transactionId) << "\",\"args\":{\"agent\":\""
+              << KGuid::toShortString(e.agent) << "\",\"tid\":"
+              << e.transactionId << ",\"expected\":" << e.arg << "}}";
+          break;
+
+        case TRANSACTION_CLOSE:
+          os << ",\"ph\":\"e\",\"cat\":\"transaction\""
+              << ",\"name\":\"transaction\",\"id\":\""
+              << toHex(transactionId) << "\",\"args\":{\"received\":"
+              << e.arg << "}}";
+          break;
+
+        default:
+          os << ",\"ph\":\"i\",\"name\":\"unknown\"}";
+          break;
+      }
+    }
+
+    for(set<int>::iterator it = nodes.begin(); it != nodes.end(); it++) {
+      os << (isFirst ? "\n" : ",\n") << "{\"pid\":" << *it
+          << ",\"ph\":\"M\",\"name\":\"process_name\",\"args\":{\"name\":"
+          << "\"node " << *it << "\"}}";
+      isFirst = false;
+    }
+
+    for(set< pair<int, int> >::iterator it = threads.begin();
+        it != threads.end(); it++)
+    {
+      os << ",\n{\"pid\":" << it->first << ",\"tid\":" << it->second
+          << ",\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":"
+          << "\"thread " << it->second << "\"}}";
+    }
+
+    os << "\n]}\n";
+  }
+
+} // namespace knorba
@@ -0,0 +1,193 @@
+/*---[Tracer.h]------------------------------------------------m(._.)m--------*\
+ |
+ |  Project   : KnoRBA C++ Library
+ |  Declares  : knorba::Tracer::*
+ |  Implements: knorba::Tracer::isEnabled(), knorba::Tracer::trace()
+ |
+ |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
+ |  Chemial Research) All rights reserved.
+ |
+ |  Author: Hamed KHANDAN (hamed.khandan@port.kobe-u.ac.jp)
+ |
+ |  This file is distributed under the KnoRBA Free Public License. See
+ |  LICENSE.TXT for details.
+ |
+ *//////////////////////////////////////////////////////////////////////////////
+
+#ifndef KNORBA_TRACER_H
+#define KNORBA_TRACER_H
+
+// Std
+#include <ostream>
+#include <vector>
+#include <pthread.h>
+
+// KFoundation
+#include <kfoundation/Ptr.h>
+
+// Internal
+#include "type/definitions.h"
+
+namespace knorba {
+
+  class Runtime;
+
+  using namespace std;
+  using namespace kfoundation;
+  using namespace knorba::type;
+
+
+  /**
+   * Records the flow of messages between agents with little overhead, for
+   * offline analysis. Tracing is off by default; while it is off, each
+   * trace point costs one load and a branch.
+   *
+   * The following events are recorded:
+   *
+   * - ENQUEUE when a message is put in the queue of its receiver, on the
+   *   delivering thread, which for local messages is the sender's.
+   * - DEQUEUE when a message is taken from the queue to be dispatched.
+   * - HANDLER_BEGIN and HANDLER_END around each call to a handler.
+   * - TRANSACTION_OPEN and TRANSACTION_CLOSE when a transaction is opened
+   *   by tsendXXX, and when it is closed after all responses arrive or the
+   *   timeout expires.
+   *
+   * Each thread writes to a ring buffer of its own, without locking. When a
+   * buffer is full, the oldest events are overwritten. Buffers outlive their
+   * threads, and are reused by new threads, so events of a thread that has
+   * exited are kept until they are overwritten or clear() is called.
+   *
+   * To capture a run:
+   *
+   *     Tracer::start();
+   *     rt.run();
+   *     Tracer::stop();
+   *
+   *     ofstream out("trace.json");
+   *     Tracer::writeChromeTrace(out, &rt);
+   *
+   * The output can be opened with chrome://tracing or Perfetto UI. Handlers
+   * are shown as slices on the thread that ran them, grouped by node, and
+   * each message is drawn as an arrow from the point it was sent to the
+   * start of the handler that received it.
+   *
+   * @headerfile Tracer.h <knorba/Tracer.h>
+   */
+
+  class Tracer {
+
+  // --- NESTED TYPES --- //
+
+    public: typedef enum {
+      ENQUEUE,
+      DEQUEUE,
+      HANDLER_BEGIN,
+      HANDLER_END,
+      TRANSACTION_OPEN,
+      TRANSACTION_CLOSE
+    } event_type_t;
+
+
+    /**
+     * A trace event. The meaning of `peer` and `arg` depends on the type:
+     *
+     * Type              | peer     | arg
+     * ------------------|----------|-------------------------------------
+     * ENQUEUE, DEQUEUE  | sender   | time the message was enqueued
+     * HANDLER_BEGIN/END | sender   | number of messages, for batches
+     * TRANSACTION_OPEN  | -        | number of expected responses
+     * TRANSACTION_CLOSE | -        | number of responses received
+     */
+
+    public: struct Event {
+      public: kf_int64_t  time;
+      public: k_longint_t opcodeHash;
+      public: kf_int64_t  arg;
+      public: k_guid_t    agent;
+      public: k_guid_t    peer;
+      public: k_integer_t transactionId;
+      public: kf_int16_t  thread;
+      public: k_octet_t   type;
+    };
+
+
+    private: struct Buffer {
+      Event*      events;
+      kf_int64_t  mask;
+      volatile kf_int64_t head;
+      volatile kf_int64_t start;
+      volatile int isOrphan;
+      Buffer*     next;
+    };
+
+
+  // --- STATIC FIELDS --- //
+
+    public: static const int DEFAULT_BUFFER_SIZE = 16384;
+    private: static volatile bool _isEnabled;
+    private: static int _bufferSize;
+    private: static Buffer* volatile _buffers;
+    private: static volatile int _nThreads;
+    private: static pthread_key_t _bufferKey;
+    private: static pthread_once_t _bufferKeyOnce;
+
+
+  // --- STATIC METHODS --- //
+
+    private: static void createBufferKey();
+    private: static void releaseBuffer(void* p);
+    private: static Buffer* getBuffer();
+    private: static void record(event_type_t type, kf_int64_t time,
+        const k_guid_t& agent, const k_guid_t& peer,
+        k_longint_t opcodeHash, k_integer_t tid, kf_int64_t arg);
+
+    public: static inline bool isEnabled();
+    public: static inline void trace(event_type_t type, kf_int64_t time,
+        const k_guid_t& agent, const k_guid_t& peer,
+        k_longint_t opcodeHash, k_integer_t tid, kf_int64_t arg);
+
+    public: static void start(int bufferSize = DEFAULT_BUFFER_SIZE);
+    public: static void stop();
+    public: static void clear();
+    public: static void collect(vector<Event>& events);
+    public: static void writeChromeTrace(ostream& os,
+        const Runtime* rt = NULL);
+    public: static void writeChromeTrace(ostream& os,
+        const vector<Event>& events, const Runtime* rt = NULL);
+
+  };
+
+
+  /**
+   * Checks if tracing is on.
+   */
+
+  inline bool Tracer::isEnabled() {
+    return __builtin_expect(_isEnabled, false);
+  }
+
+
+  /**
+   * Records an event on the buffer of the calling thread, if tracing is on.
+   *
+   * @param type The type of the event.
+   * @param time Monotonic time in nanoseconds, see AgentMetrics::getTime().
+   * @param agent The agent the event occurred on.
+   * @param peer See Event.
+   * @param opcodeHash The opcode of the message involved, if any.
+   * @param tid The transaction ID involved, if any, or -1.
+   * @param arg See Event.
+   */
+
+  inline void Tracer::trace(event_type_t type, kf_int64_t time,
+      const k_guid_t& agent, const k_guid_t& peer, k_longint_t opcodeHash,
+      k_integer_t tid, kf_int64_t arg)
+  {
+    if(isEnabled()) {
+      record(type, time, agent, peer, opcodeHash, tid, arg);
+    }
+  }
+
+} // namespace knorba
+
+#endif /* defined(KNORBA_TRACER_H) */
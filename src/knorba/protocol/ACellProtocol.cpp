@@ -104,8 +104,10 @@ namespace protocol {
   {
     _cellType = cellType;
     _role = role;
-    registerHandler((phandler_t)&ACellProtocol::handleOpIndexQ, OP_INDEX_Q);
-    registerHandler((phandler_t)&ACellProtocol::handleOpIndexA, OP_INDEX_A);
+    registerHandler((phandler_t)&ACellProtocol::handleOpIndexQ, OP_INDEX_Q,
+        Mailbox::PRIORITY_HIGH);
+    registerHandler((phandler_t)&ACellProtocol::handleOpIndexA, OP_INDEX_A,
+        Mailbox::PRIORITY_HIGH);
     registerHandler((phandler_t)&ACellProtocol::handleOpPartition, OP_PARTITION_MAP);
   }
   
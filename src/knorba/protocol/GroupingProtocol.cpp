@@ -79,7 +79,7 @@ namespace protocol {
   // Handlers //
   
   void GroupingProtocol::handleOpHello(PPtr<Message> msg) {
-    k_longint_t groupId = msg->getPayload().AS(KLongint)->get();
+    k_longint_t groupId = msg->getLongintPayload();
     
     if(groupId == _groupId->get()) {
       const k_guid_t& sender = msg->getSender();
@@ -51,8 +51,10 @@ namespace protocol {
     _hasLeader = false;
     _stopFlag = false;
     
-    registerHandler((phandler_t)&PhaserProtocol::handleOpPhase, OP_PHASE);
-    registerHandler((phandler_t)&PhaserProtocol::handleOpRelease, OP_RELEASE);
+    registerHandler((phandler_t)&PhaserProtocol::handleOpPhase, OP_PHASE,
+        Mailbox::PRIORITY_HIGH);
+    registerHandler((phandler_t)&PhaserProtocol::handleOpRelease, OP_RELEASE,
+        Mailbox::PRIORITY_HIGH);
   }
   
   
@@ -209,7 +209,7 @@ namespace protocol {
   
   
   void TunnelingClient::handleOpRemoveRoute(PPtr<Message> msg) {
-    k_guid_t rt = msg->getPayload().AS(KGuid)->get();
+    k_guid_t rt = msg->getGuidPayload();
     
     bool found = false;
     
@@ -0,0 +1,168 @@
+//
+//  test_frozen_payload.cpp
+//  KnoRBA
+//
+//  Tests for frozen values: mutators of a frozen value throw, and a
+//  multicast payload is frozen without touching the sender's own object.
+//
+
+#include <cassert>
+
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Logger.h>
+#include <kfoundation/KFException.h>
+#include <knorba/type/all.h>
+#include <knorba/Agent.h>
+#include <knorba/Group.h>
+#include <knorba/LocalRuntime.h>
+
+using namespace std;
+using namespace knorba;
+using namespace knorba::type;
+
+static const SPtr<KString> OP_START = KS("test.frozen.start");
+static const SPtr<KString> OP_DATA = KS("test.frozen.data");
+
+
+#define ASSERT_REJECTED(X) {\
+  bool isRejected = false;\
+  try {\
+    X;\
+  } catch(KFException& e) {\
+    isRejected = true;\
+  }\
+  assert(isRejected);\
+}
+
+
+void testFrozenPrimitives() {
+  LOG << "Testing frozen primitive values" << EL;
+
+  Ptr<KLongint> l = new KLongint(1);
+  Ptr<KInteger> i = new KInteger(2);
+  Ptr<KReal> r = new KReal(3.5);
+  Ptr<KTruth> t = new KTruth(T);
+  Ptr<KOctet> o = new KOctet(5);
+
+  l->freeze();
+  i->freeze();
+  r->freeze();
+  t->freeze();
+  o->freeze();
+
+  ASSERT_REJECTED(l->set(10));
+  ASSERT_REJECTED(i->set(20));
+  ASSERT_REJECTED(r->set(30.5));
+  ASSERT_REJECTED(t->set(F));
+  ASSERT_REJECTED(o->set(50));
+  ASSERT_REJECTED(l->set(new KLongint(10)));
+
+  assert(l->get() == 1);
+  assert(i->get() == 2);
+  assert(r->get() == 3.5);
+  assert(t->get() == T);
+  assert(o->get() == 5);
+
+  // A copy can be changed.
+  Ptr<KLongint> c = l->copy().AS(KLongint);
+  c->set(10);
+  assert(c->get() == 10);
+  assert(l->get() == 1);
+}
+
+
+/**
+ * Keeps the payload of the last message it received.
+ */
+
+class Receiver : public Agent {
+  public: Ptr<KValue> payload;
+  public: Receiver(Runtime& rt, const k_guid_t& guid);
+  public: void onData(PPtr<Message> msg);
+};
+
+
+Receiver::Receiver(Runtime& rt, const k_guid_t& guid)
+: Agent(rt, guid)
+{
+  registerHandler((handler_t)&Receiver::onData, OP_DATA);
+  setPassive();
+}
+
+
+void Receiver::onData(PPtr<Message> msg) {
+  payload = msg->getPayload();
+}
+
+
+/**
+ * Multicasts a KAny holding a string, then changes the string.
+ */
+
+class Sender : public Agent {
+  public: Ptr<Group> receivers;
+  public: Ptr<KAny> original;
+  public: Sender(Runtime& rt, const k_guid_t& guid);
+  public: void onStart(PPtr<Message> msg);
+};
+
+
+Sender::Sender(Runtime& rt, const k_guid_t& guid)
+: Agent(rt, guid)
+{
+  registerHandler((handler_t)&Sender::onStart, OP_START);
+}
+
+
+void Sender::onStart(PPtr<Message> msg) {
+  original = new KAny(KS("before").AS(KValue));
+  send(receivers, OP_DATA, original.AS(KValue));
+
+  // The runtime froze its own copy, not the object given to it.
+  assert(!original->isFrozen());
+  assert(!original->getValue()->isFrozen());
+  original->getValue().AS(KString)->set("after");
+
+  quit();
+}
+
+
+void testMulticastAny() {
+  LOG << "Testing multicast of an any value" << EL;
+
+  LocalRuntime rt;
+  Receiver* a = rt.createAgent<Receiver>("a");
+  Receiver* b = rt.createAgent<Receiver>("b");
+  Sender* s = rt.createAgent<Sender>("s");
+
+  s->receivers = new Group();
+  s->receivers->add(a->getGuid());
+  s->receivers->add(b->getGuid());
+
+  rt.send(rt.getGuid(), s->getGuid(), OP_START->getHashCode(),
+      KValue::NOTHING, -1);
+  rt.run();
+
+  assert(s->original->getValue().AS(KString)->equals("after"));
+
+  // Receivers get a frozen payload, holding the value as sent.
+  assert(!a->payload.isNull() && !b->payload.isNull());
+  assert(a->payload->isFrozen());
+
+  PPtr<KAny> shared = a->payload.AS(KAny);
+  assert(shared->getValue()->isFrozen());
+  assert(shared->getValue().AS(KString)->equals("before"));
+
+  // A receiver's copy holds a value of its own, which it can change.
+  Ptr<KAny> mine = shared->copy().AS(KAny);
+  assert(!mine->getValue()->isFrozen());
+  mine->getValue().AS(KString)->set("mine");
+  assert(shared->getValue().AS(KString)->equals("before"));
+}
+
+
+int main(int argc, char** argv) {
+  testFrozenPrimitives();
+  testMulticastAny();
+  return 0;
+}
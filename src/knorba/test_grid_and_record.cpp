@@ -193,6 +193,61 @@ void testKRecordWithDynamicFields() {
 }
 
 
+/**
+ * Fills a grid of records with string and raw fields, after a field stored
+ * in place, through one wrapper, copies it with copyFrom(), and reads it back
+ * through another. Every wrapper must find the fields already made for the
+ * cell it points to.
+ */
+
+void testKGridCopyWithDynamicFields() {
+  LOG << "Testing grid copy with dynamic fields" << EL;
+  
+  Ptr<KRecordType> rt = new KRecordType("Labeled");
+  rt->addField("intField", KType::INTEGER)
+    ->addField("stringField", KType::STRING)
+    ->addField("rawField", KType::RAW);
+  
+  Ptr<KGridType> gt = new KGridType(rt, 2);
+  Tuple2D dims(5, 4);
+  Tuple2D origin(0, 0);
+  
+  Ptr<KGridBasic> src = new KGridBasic(gt, dims);
+  Ptr<KRecord> record = new KRecord(src.AS(KGrid));
+  
+  k_octet_t data[4];
+  for(RangeIterator c(src->getSize()); c.hasMore(); c.next()) {
+    int n = c.at(0) * 10 + c.at(1);
+    for(int i = 0; i < 4; i++) {
+      data[i] = (k_octet_t)(n + i);
+    }
+    
+    src->at(c, record);
+    record->setInteger(0, n);
+    record->field<KString>(1)->set("cell " + Int::toString(n));
+    record->field<KRaw>(2)->set(data, 4);
+  }
+  
+  Ptr<KGridBasic> target = new KGridBasic(gt, dims, true);
+  target->copyFrom(src.AS(KGrid), origin, origin, dims);
+  
+  Ptr<KRecord> reader = new KRecord(target.AS(KGrid));
+  for(RangeIterator c(target->getSize()); c.hasMore(); c.next()) {
+    int n = c.at(0) * 10 + c.at(1);
+    
+    target->at(c, reader);
+    assert(reader->getInteger(0) == n);
+    assert(reader->field<KString>(1)->equals("cell " + Int::toString(n)));
+    
+    PPtr<KRaw> raw = reader->field<KRaw>(2);
+    assert(raw->getNOctets() == 4);
+    for(int i = 0; i < 4; i++) {
+      assert(raw->getData()[i] == (k_octet_t)(n + i));
+    }
+  }
+}
+
+
 void testKGrid() {
   Ptr<KEnumerationType> enumType = new KEnumerationType("EnumType");
   enumType->addMember(0, "carrot")
@@ -292,6 +347,7 @@ int main(int argc, char** argv) {
     testKRecordWithSubrecord();
     testKRecordWithDynamicFields();
     testKGrid();
+    testKGridCopyWithDynamicFields();
     System::getLogger().unmute();
   }
   
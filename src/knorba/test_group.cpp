@@ -0,0 +1,191 @@
+//
+//  test_group.cpp
+//  KnoRBA
+//
+//  Tests for Group: snapshot readers racing writers, deletion of the
+//  versions those writers retire, and removal of many members at once.
+//
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include <pthread.h>
+
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Logger.h>
+#include <kfoundation/System.h>
+#include <knorba/type/all.h>
+#include <knorba/Group.h>
+
+#define N_READERS 4
+#define N_PERMANENT 100
+#define N_TRANSIENT 300
+#define N_ROUNDS 20000
+
+using namespace std;
+using namespace knorba;
+using namespace knorba::type;
+
+struct Reader {
+  PPtr<Group> group;
+  volatile bool* isDone;
+  long nSnapshots;
+  pthread_t thread;
+};
+
+
+k_guid_t makeGuid(k_integer_t lid) {
+  k_guid_t guid;
+  memset(&guid, 0, sizeof(k_guid_t));
+  guid.appId[0] = 7;
+  guid.lid = lid;
+  return guid;
+}
+
+
+/**
+ * Takes snapshots until told to stop, checking that each is consistent:
+ * every member is found, and once the members that are never removed are
+ * back after a clear(), they are all there.
+ */
+
+void* readSnapshots(void* arg) {
+  Reader* r = (Reader*)arg;
+
+  while(!__atomic_load_n(r->isDone, __ATOMIC_ACQUIRE)) {
+    Group::Snapshot members(*r->group);
+    for(int i = 0; i < members.getCount(); i++) {
+      const k_guid_t& guid = members.get(i);
+      assert(guid.appId[0] == 7);
+      assert(members.containts(guid));
+    }
+
+    if(members.getCount() >= N_PERMANENT) {
+      for(int i = 0; i < N_PERMANENT; i++) {
+        assert(members.containts(makeGuid(i)));
+      }
+    }
+
+    r->nSnapshots++;
+  }
+
+  return NULL;
+}
+
+
+void addPermanent(Group& group) {
+  for(int i = 0; i < N_PERMANENT; i++) {
+    group.add(makeGuid(i));
+  }
+}
+
+
+void testSnapshotsUnderWriters() {
+  LOG << "Testing group with " << N_READERS << " readers" << EL;
+
+  Ptr<Group> group = new Group();
+  addPermanent(*group);
+
+  volatile bool isDone = false;
+  Reader readers[N_READERS];
+  for(int i = 0; i < N_READERS; i++) {
+    readers[i].group = group;
+    readers[i].isDone = &isDone;
+    readers[i].nSnapshots = 0;
+    pthread_create(&readers[i].thread, NULL, &readSnapshots, &readers[i]);
+  }
+
+  for(int i = 0; i < N_ROUNDS; i++) {
+    group->add(makeGuid(N_PERMANENT + i % N_TRANSIENT));
+    if(i % 3 == 0) {
+      group->remove(makeGuid(N_PERMANENT + (i * 7) % N_TRANSIENT));
+    }
+    if(i % 5000 == 4999) {
+      group->clear();
+      addPermanent(*group);
+    }
+  }
+
+  __atomic_store_n(&isDone, true, __ATOMIC_RELEASE);
+  long nSnapshots = 0;
+  for(int i = 0; i < N_READERS; i++) {
+    pthread_join(readers[i].thread, NULL);
+    nSnapshots += readers[i].nSnapshots;
+  }
+
+  // The last reader to go deletes what the writer left behind.
+  {
+    Group::Snapshot members(*group);
+    assert(members.containts(makeGuid(0)));
+  }
+  assert(group->getNumberOfRetiredVersions() == 0);
+
+  LOG << "Took " << nSnapshots << " snapshots of " << group->getCount()
+      << " members" << EL;
+}
+
+
+void testReclaimWithoutWriters() {
+  LOG << "Testing group reclaims when the last reader leaves" << EL;
+
+  Ptr<Group> group = new Group();
+  addPermanent(*group);
+
+  {
+    Group::Snapshot members(*group);
+    group->remove(makeGuid(0));
+    group->clear();
+    assert(group->getNumberOfRetiredVersions() == 2);
+    assert(members.getCount() == N_PERMANENT);
+    assert(members.containts(makeGuid(0)));
+  }
+
+  assert(group->getNumberOfRetiredVersions() == 0);
+  assert(group->isEmpty());
+}
+
+
+void testRemoveMany() {
+  LOG << "Testing removal of many members at once" << EL;
+
+  Ptr<Group> group = new Group();
+  addPermanent(*group);
+
+  vector<k_guid_t> guids;
+  for(int i = 0; i < N_PERMANENT; i += 2) {
+    guids.push_back(makeGuid(i));
+  }
+  guids.push_back(makeGuid(0));
+  guids.push_back(makeGuid(N_PERMANENT));
+
+  {
+    Group::Snapshot before(*group);
+    group->remove(guids);
+    assert(group->getNumberOfRetiredVersions() == 1);
+    assert(before.getCount() == N_PERMANENT);
+  }
+
+  // The rest keep their order.
+  Group::Snapshot members(*group);
+  assert(members.getCount() == N_PERMANENT / 2);
+  for(int i = 0; i < members.getCount(); i++) {
+    assert(members.get(i).lid == 2 * i + 1);
+    assert(members.containts(makeGuid(2 * i + 1)));
+    assert(!members.containts(makeGuid(2 * i)));
+  }
+
+  guids.clear();
+  for(int i = 0; i < N_PERMANENT; i++) {
+    guids.push_back(makeGuid(i));
+  }
+  group->remove(guids);
+  assert(group->isEmpty());
+}
+
+
+int main(int argc, char** argv) {
+  testReclaimWithoutWriters();
+  testRemoveMany();
+  testSnapshotsUnderWriters();
+  return 0;
+}
@@ -0,0 +1,158 @@
+//
+//  test_mailbox.cpp
+//  KnoRBA
+//
+//  Stress tests for Mailbox: producers racing a consumer that grows and
+//  shrinks the queue, and the segment pool behind it.
+//
+
+#include <cassert>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <kfoundation/Ptr.h>
+#include <kfoundation/Logger.h>
+#include <kfoundation/System.h>
+#include <knorba/type/all.h>
+#include <knorba/Message.h>
+#include <knorba/Mailbox.h>
+
+#define N_PRODUCERS 4
+#define N_MESSAGES_PER_PRODUCER 100000
+
+using namespace std;
+using namespace knorba;
+using namespace knorba::type;
+
+struct Producer {
+  Mailbox* mailbox;
+  k_integer_t id;
+  pthread_t thread;
+};
+
+
+/**
+ * Pushes numbered messages, pausing now and then so that the consumer
+ * catches up and the queue shrinks before it grows again.
+ */
+
+void* produce(void* arg) {
+  Producer* p = (Producer*)arg;
+  k_guid_t sender = KGuid::zero();
+
+  for(k_longint_t i = 1; i <= N_MESSAGES_PER_PRODUCER; i++) {
+    Ptr<Message> msg = new Message(0, 0);
+    msg->set(p->id, i, sender, KValue::NOTHING);
+
+    PPtr<Message> ref = msg.retain();
+    while(!p->mailbox->push(ref)) {
+      sched_yield();
+    }
+
+    if(i % 20000 == 0) {
+      usleep(20000);
+    }
+  }
+
+  return NULL;
+}
+
+
+void testGrowAndShrinkUnderProducers() {
+  LOG << "Testing mailbox with " << N_PRODUCERS << " producers" << EL;
+
+  Mailbox mailbox(4, 512);
+  int initialCapacity = mailbox.getCapacity();
+  Producer producers[N_PRODUCERS];
+  k_longint_t last[N_PRODUCERS];
+
+  for(int i = 0; i < N_PRODUCERS; i++) {
+    producers[i].mailbox = &mailbox;
+    producers[i].id = i;
+    last[i] = 0;
+    pthread_create(&producers[i].thread, NULL, &produce, &producers[i]);
+  }
+
+  int nReceived = 0;
+  int maxCapacity = 0;
+  while(nReceived < N_PRODUCERS * N_MESSAGES_PER_PRODUCER) {
+    PPtr<Message> msg = mailbox.pop();
+    if(msg.isNull()) {
+      mailbox.trim();
+      sched_yield();
+      continue;
+    }
+
+    // Messages of each producer come out in the order they went in.
+    int id = msg->getTransactionId();
+    assert(id >= 0 && id < N_PRODUCERS);
+    assert(msg->getOpcodeHash() == last[id] + 1);
+    last[id] = msg->getOpcodeHash();
+    msg.release();
+    nReceived++;
+
+    if(mailbox.getCapacity() > maxCapacity) {
+      maxCapacity = mailbox.getCapacity();
+    }
+  }
+
+  for(int i = 0; i < N_PRODUCERS; i++) {
+    pthread_join(producers[i].thread, NULL);
+  }
+
+  assert(mailbox.isEmpty());
+  assert(maxCapacity <= mailbox.getMaxCapacity());
+
+  mailbox.trim();
+  assert(mailbox.getCapacity() == initialCapacity);
+
+  const Mailbox::Counters& c = mailbox.getCounters();
+  assert(c.nGrown > 0);
+  assert(c.nShrunk > 0);
+
+  const Mailbox::PoolCounters& pc = Mailbox::getPoolCounters();
+  LOG << "Received " << nReceived << " messages, max capacity: "
+      << maxCapacity << ", grown: " << c.nGrown << ", shrunk: " << c.nShrunk
+      << ", pool hits: " << pc.nHits << ", misses: " << pc.nMisses << EL;
+  assert(pc.nHits > pc.nMisses);
+}
+
+
+void testTotalCapacity() {
+  LOG << "Testing mailbox capacity across lanes" << EL;
+
+  Mailbox mailbox(4, 64);
+  k_guid_t sender = KGuid::zero();
+  int nPushed = 0;
+
+  for(int i = 0; i < 3 * 64; i++) {
+    Ptr<Message> msg = new Message(0, 0);
+    msg->set(0, i, sender, KValue::NOTHING);
+    PPtr<Message> ref = msg.retain();
+    if(mailbox.push(ref, (Mailbox::priority_t)(i % Mailbox::N_PRIORITIES))) {
+      nPushed++;
+    } else {
+      ref.release();
+    }
+  }
+
+  assert(nPushed == 64);
+  assert(mailbox.getCount() == 64);
+  assert(mailbox.getCredits() == 0);
+
+  for(PPtr<Message> msg = mailbox.pop(); !msg.isNull(); msg = mailbox.pop())
+  {
+    msg.release();
+  }
+
+  mailbox.trim();
+  assert(mailbox.getCredits() == 64);
+}
+
+
+int main(int argc, char** argv) {
+  testTotalCapacity();
+  testGrowAndShrinkUnderProducers();
+  return 0;
+}
@@ -75,6 +75,8 @@ namespace type {
    */
   
   void KAny::setValue(PPtr<KValue> v) {
+    checkMutable();
+    
     _value = v;
   }
 
@@ -94,11 +96,31 @@ namespace type {
 // Inherited from KValue //
 
   void KAny::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(KType::ANY)) {
       throw KTypeMismatchException(getType(), other->getType());
     }
     
-    _value = other.AS(KAny)->_value;
+    // The value held is copied too, so that freezing either one does not
+    // freeze the other.
+    PPtr<KValue> value = other.AS(KAny)->_value;
+    if(value->getType()->equals(KType::NOTHING)) {
+      _value = value;
+    } else {
+      _value = value->copy();
+    }
+  }
+  
+  
+  /**
+   * Freezes this object along with the value it holds. A value given to
+   * setValue() or the constructor is held as is, and is frozen too.
+   */
+  
+  void KAny::freeze() {
+    KValue::freeze();
+    _value->freeze();
   }
   
   
@@ -123,6 +145,8 @@ namespace type {
    */
 
   void KAny::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     if(IS_NULL(_rt)) {
       throw KFException("Cannot read binary stream. setRuntime() should be "
           "done before readFromBinaryStream().");
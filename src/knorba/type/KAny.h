@@ -64,6 +64,7 @@ namespace type {
     
     // Inherited from KValue //
     public: void set(PPtr<KValue> other);
+    public: void freeze();
     public: PPtr<KType> getType() const;
     public: k_longint_t getTotalSizeInOctets() const;
     public: void readFromBinaryStream(PPtr<InputStream> input);
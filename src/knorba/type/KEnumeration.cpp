@@ -104,6 +104,8 @@ namespace type {
    */
   
   void KEnumeration::set(const k_octet_t ordinal) {
+    checkMutable();
+    
     _value = ordinal;
   }
 
@@ -113,6 +115,8 @@ namespace type {
    */
   
   void KEnumeration::set(const string& label) {
+    checkMutable();
+    
     int v = _type->getOrdinalForLabel(label);
     if(v == -1) {
       throw KFException("\"" + label + "\" is not a valid label.");
@@ -122,6 +126,8 @@ namespace type {
 
   
   void KEnumeration::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(_type.AS(KType))) {
       throw KTypeMismatchException(getType(), other->getType());
     }
@@ -141,6 +147,8 @@ namespace type {
   
   
   void KEnumeration::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     int v = input->read();
     if(v == -1) {
       throw IOException("Not enough data to read");
@@ -155,6 +163,8 @@ namespace type {
 
   
   void KEnumeration::deserialize(PPtr<ObjectToken> headToken) {
+    checkMutable();
+    
     headToken->validateClass("KEnumeration");
     
     Ptr<Token> token = headToken->next();
@@ -49,6 +49,22 @@ namespace type {
       }
     }
   }
+
+  
+  /**
+   * Freezes this grid, along with the values of variable size stored in its
+   * cells.
+   */
+  
+  void KGrid::freeze() {
+    KValue::freeze();
+    if(getType().AS(KGridType)->getRecordType()->hasDynamicFields()) {
+      KRecord r(getPtr().AS(KGrid));
+      for(RangeIterator it(getRange()); it.hasMore(); it.next()) {
+        at(it, r).freezeDynamicFields();
+      }
+    }
+  }
   
 
   /**
@@ -95,6 +111,8 @@ namespace type {
   void KGrid::copyFrom(PPtr<KGrid> src, const Tuple& srcOffset,
     const Tuple& dstOffset, const Tuple& size)
   {
+    checkMutable();
+    
     Ptr<KRecord> srcRecord = new KRecord(src);
     Ptr<KRecord> dstRecord = new KRecord(getPtr().AS(KGrid));
     
@@ -108,6 +126,8 @@ namespace type {
 
 
   void KGrid::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(_type.AS(KType))) {
       throw KTypeMismatchException(_type.AS(KType), other->getType());
     }
@@ -151,6 +171,8 @@ namespace type {
   
   
   void KGrid::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     int nDims = input->read();
     
     if(nDims == -1) {
@@ -194,6 +216,8 @@ namespace type {
 
   
   void KGrid::deserialize(PPtr<ObjectToken> headToken) {
+    checkMutable();
+    
     headToken->validateClass("KGrid");
     
     Ptr<Token> token = headToken->next();
@@ -323,6 +347,8 @@ namespace type {
   
   
   void KGridBasic::resetWithSize(const Tuple& size, bool clear) {
+    checkMutable();
+    
     _range = Range(size);
     _nElements = _range.getVolume();
     k_longint_t nBytes = _nElements * _elementSize;
@@ -368,6 +394,10 @@ namespace type {
    */
 
   void KGridWindow::setSource(PPtr<KGrid> physical) {
+    if(KValue::isFrozen()) {
+      throw KFException("Attempt to move a frozen grid window.");
+    }
+    
     _physical = physical;
   }
 
@@ -377,6 +407,10 @@ namespace type {
    */
   
   void KGridWindow::setWindow(const Range& physicalRange) {
+    if(KValue::isFrozen()) {
+      throw KFException("Attempt to move a frozen grid window.");
+    }
+    
     if(!_physical->getRange().contains(physicalRange)) {
       throw IndexOutOfBoundException("Provided range " + physicalRange
           + " exceeds size of the physical grid " + _physical->getRange());
@@ -394,6 +428,10 @@ namespace type {
   void KGridWindow::setWindow(const Range& physicalRange,
                               const Tuple& virtualOffset)
   {
+    if(KValue::isFrozen()) {
+      throw KFException("Attempt to move a frozen grid window.");
+    }
+    
     if(!_physical->getRange().contains(physicalRange)) {
       throw IndexOutOfBoundException("Provided range " + physicalRange
           + " exceeds size of the physical grid " + _physical->getRange());
@@ -449,6 +487,22 @@ namespace type {
   }
   
   
+  /**
+   * Freezes this window along with the physical grid it looks into, since
+   * the latter is where the values are stored.
+   */
+  
+  void KGridWindow::freeze() {
+    KValue::freeze();
+    _physical->freeze();
+  }
+  
+  
+  bool KGridWindow::isFrozen() const {
+    return KValue::isFrozen() || _physical->isFrozen();
+  }
+  
+  
   const Range& KGridWindow::getRange() const {
     return _range;
   }
@@ -541,6 +595,8 @@ namespace type {
      */
 
     PPtr<KRecord> KGridVector::add(PPtr<KRecord> wrapper) {
+      checkMutable();
+      
       return at(Tuple1D(basicAdd()), wrapper);
     }
     
@@ -582,6 +638,8 @@ namespace type {
     PPtr<KRecord> KGridVector::insert(PPtr<KRecord> wrapper,
         const k_integer_t index)
     {
+      checkMutable();
+      
       basicInsert(index);
       return at(Tuple1D(index), wrapper);
     }
@@ -593,6 +651,8 @@ namespace type {
      */
 
     void KGridVector::remove(const k_integer_t index) {
+      checkMutable();
+      
       k_integer_t s = _size.get();
       
       if(index >= s) {
@@ -647,6 +707,8 @@ namespace type {
      */
 
     void KGridVector::clear() {
+      checkMutable();
+      
       cleanupDynamicFields();
       _size.set(0);
       _range = Range(_size);
@@ -656,6 +718,8 @@ namespace type {
     // Inherited from KGrid //
     
     void KGridVector::resetWithSize(const Tuple& size, bool clear) {
+      checkMutable();
+      
       if(size.getSize() != 1) {
         throw KFException("The supplied size should have one dimensions. The "
             "supplied size has " + Int::toString(size.getSize()));
@@ -107,6 +107,7 @@ namespace type {
         const Tuple& dstOffset, const Tuple& size);
     
     // Inherited from KDynamicValue::KValue
+    public: void freeze();
     public: void set(PPtr<KValue> other);
     public: PPtr<KType> getType() const;
     public: k_longint_t getTotalSizeInOctets() const;
@@ -213,6 +214,10 @@ namespace type {
     public: PPtr<KRecord> atVirtual(const Tuple& index, PPtr<KRecord> wrapper) const;
     public: KRecord& atVirtual(const Tuple& index, KRecord& wrapper) const;
     
+    // Inherited from KGrid::KValue //
+    public: void freeze();
+    public: bool isFrozen() const;
+    
     // Inherited from KGrid //
     public: const Range& getRange() const;
     public: void resetWithSize(const Tuple& size, bool clear = false);
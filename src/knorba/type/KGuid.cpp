@@ -151,6 +151,71 @@ namespace type {
     p = printBytes(p, value.appId, 8);
     return string(buffer);
   }
+
+
+  /**
+   * Writes the given value in KnoRBA binary format to the given memory
+   * location, which should have room for 16 octets.
+   */
+
+  void KGuid::encode(const k_guid_t& value, k_octet_t* target) {
+    memcpy(target, &value.appId, 8);
+
+    k_octet_t* bytes = target + 8;
+    *(kf_int16_t*)bytes = value.nodeRank;
+    *(kf_int16_t*)(bytes + 2) = value.key;
+    *(k_integer_t*)(bytes + 4) = value.lid;
+
+    if(System::isBigEndian()) {
+      k_octet_t tmp = bytes[0];
+      bytes[0] = bytes[1];
+      bytes[1] = tmp;
+
+      tmp = bytes[2];
+      bytes[2] = bytes[3];
+      bytes[3] = tmp;
+
+      tmp = bytes[4];
+      bytes[4] = bytes[7];
+      bytes[7] = bytes[5];
+      bytes[5] = bytes[6];
+      bytes[6] = bytes[7];
+      bytes[7] = tmp;
+    }
+  }
+
+
+  /**
+   * Reads a value in KnoRBA binary format from the given memory location.
+   */
+
+  void KGuid::decode(const k_octet_t* source, k_guid_t& target) {
+    memcpy(&target.appId, source, 8);
+
+    k_octet_t bytes[8];
+    memcpy(bytes, source + 8, 8);
+
+    if(System::isBigEndian()) {
+      k_octet_t tmp = bytes[0];
+      bytes[0] = bytes[1];
+      bytes[1] = tmp;
+
+      tmp = bytes[2];
+      bytes[2] = bytes[3];
+      bytes[3] = tmp;
+
+      tmp = bytes[4];
+      bytes[4] = bytes[7];
+      bytes[7] = bytes[5];
+      bytes[5] = bytes[6];
+      bytes[6] = bytes[7];
+      bytes[7] = tmp;
+    }
+
+    target.nodeRank = *(kf_int16_t*)bytes;
+    target.key = *(kf_int16_t*)(bytes + 2);
+    target.lid = *(k_integer_t*)(bytes + 4);
+  }
   
   
 // --- (DE)CONSTRUCTORS --- //
@@ -189,11 +254,15 @@ namespace type {
    */
   
   void KGuid::set(const k_guid_t& v) {
+    checkMutable();
+    
     _value = v;
   }
   
   
   void KGuid::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(KType::GUID)) {
       throw KTypeMismatchException(getType(), other->getType());
     }
@@ -212,75 +281,30 @@ namespace type {
 
   
   void KGuid::readFromBinaryStream(PPtr<InputStream> input) {
-    k_guid_t v;
+    checkMutable();
     
-    if(input->read((kf_octet_t*)&v.appId, 8) < 8) {
-      throw IOException("Not enough data to read");
-    }
-    
-    k_octet_t bytes[8];
+    k_octet_t bytes[K_GUID_SIZE];
     
-    if(input->read(bytes, 8) < 8) {
+    if(input->read(bytes, K_GUID_SIZE) < K_GUID_SIZE) {
       throw IOException("Not enough data to read");
     }
     
-    if(System::isBigEndian()) {
-      k_octet_t tmp = bytes[0];
-      bytes[0] = bytes[1];
-      bytes[1] = tmp;
-      
-      tmp = bytes[2];
-      bytes[2] = bytes[3];
-      bytes[3] = tmp;
-      
-      tmp = bytes[4];
-      bytes[4] = bytes[7];
-      bytes[7] = bytes[5];
-      bytes[5] = bytes[6];
-      bytes[6] = bytes[7];
-      bytes[7] = tmp;
-    }
-    
-    v.nodeRank = *(kf_int16_t*)bytes;
-    v.key = *(kf_int16_t*)(bytes + 2);
-    v.lid = *(k_integer_t*)(bytes + 4);
-    
+    k_guid_t v;
+    decode(bytes, v);
     set(v);
   }
   
   
   void KGuid::writeToBinaryStream(PPtr<OutputStream> output) const {
-    k_guid_t v = get();
-    
-    output->write((kf_octet_t*)&v.appId, 8);
-    
-    k_octet_t bytes[8];
-    *(kf_int16_t*)bytes = v.nodeRank;
-    *(kf_int16_t*)(bytes + 2) = v.key;
-    *(k_integer_t*)(bytes + 4) = v.lid;
-    
-    if(System::isBigEndian()) {
-      k_octet_t tmp = bytes[0];
-      bytes[0] = bytes[1];
-      bytes[1] = tmp;
-      
-      tmp = bytes[2];
-      bytes[2] = bytes[3];
-      bytes[3] = tmp;
-      
-      tmp = bytes[4];
-      bytes[4] = bytes[7];
-      bytes[7] = bytes[5];
-      bytes[5] = bytes[6];
-      bytes[6] = bytes[7];
-      bytes[7] = tmp;
-    }
-    
-    output->write(bytes, 8);
+    k_octet_t bytes[K_GUID_SIZE];
+    encode(get(), bytes);
+    output->write(bytes, K_GUID_SIZE);
   }
   
   
   void KGuid::deserialize(PPtr<ObjectToken> headToken) {
+    checkMutable();
+    
     headToken->validateClass("KGUID");
     
     Ptr<Token> token = headToken->next();
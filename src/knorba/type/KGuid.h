@@ -2,7 +2,7 @@
  |
  |  Project   : KnoRBA C++ Library
  |  Declares  : knorba::type::KGuid::*
- |  Implements: -
+ |  Implements: knorba::type::KGuid::generateHashFor()
  |
  |  Copyright (c) 2013, 2014, 2015, RIKEN (The Institute of Physical and
  |  Chemial Research) All rights reserved.
@@ -17,6 +17,9 @@
 #ifndef KNORBA_TYPE_KGUID
 #define KNORBA_TYPE_KGUID
 
+// Std
+#include <cstring>
+
 // KFoundation
 #include <kfoundation/Logger.h>
 
@@ -58,6 +61,9 @@ namespace type {
     public: static string toString(const k_guid_t& value);
     public: static string toShortString(const k_guid_t& value);
     public: static string appIdToString(const k_guid_t& value);
+    public: static void encode(const k_guid_t& value, k_octet_t* target);
+    public: static void decode(const k_octet_t* source, k_guid_t& target);
+    public: static inline k_longint_t generateHashFor(const k_guid_t& value);
     
     
   // --- (DE)CONSTRUCTORS --- //
@@ -93,6 +99,25 @@ namespace type {
   Logger::Stream& operator<<(Logger::Stream& stream, const k_guid_t& guid);
   ostream& operator<<(ostream& os, const k_guid_t& guid);
   bool operator==(const k_guid_t& a, const k_guid_t& b);
+
+
+  /**
+   * Generates a 64-bit hashcode for the given GUID, for use in hash tables.
+   * All 128 bits are mixed, so GUIDs that differ only in their local ID are
+   * spread as well as ones from different apps.
+   */
+
+  inline k_longint_t KGuid::generateHashFor(const k_guid_t& value) {
+    unsigned long long a;
+    unsigned long long b;
+    memcpy(&a, &value, sizeof(a));
+    memcpy(&b, (const k_octet_t*)&value + sizeof(a), sizeof(b));
+
+    unsigned long long h = (a * 0x9E3779B97F4A7C15ULL) ^ b;
+    h = (h ^ (h >> 32)) * 0xD6E8FEB86659FD93ULL;
+    h = (h ^ (h >> 32)) * 0xD6E8FEB86659FD93ULL;
+    return (k_longint_t)(h ^ (h >> 32));
+  }
   
 } // namespace type
 } // namespace knorba
@@ -87,11 +87,15 @@ namespace type {
    */
   
   void KInteger::set(const k_integer_t v) {
+    checkMutable();
+    
     _value = v;
   }
   
   
   void KInteger::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(KType::INTEGER)) {
       throw KTypeMismatchException(getType(), other->getType());
     }
@@ -111,6 +115,8 @@ namespace type {
   
   
   void KInteger::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     k_integer_t v;
     if(input->read((kf_octet_t*)&v, 4) < 4) {
       throw IOException("Not enough bytes to read");
@@ -126,6 +132,8 @@ namespace type {
   
 
   void KInteger::deserialize(PPtr<ObjectToken> headToken) {
+    checkMutable();
+    
     headToken->validateClass("KInteger");
     
     Ptr<Token> token = headToken->next();
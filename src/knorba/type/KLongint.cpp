@@ -76,6 +76,8 @@ namespace type {
    */
 
   void KLongint::set(const k_longint_t v) {
+    checkMutable();
+    
     _value = v;
   }
 
@@ -90,6 +92,8 @@ namespace type {
 
 
   void KLongint::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(KType::LONGINT)) {
       throw KTypeMismatchException(getType(), other->getType());
     }
@@ -109,6 +113,8 @@ namespace type {
   
   
   void KLongint::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     k_longint_t v;
     if(input->read((kf_octet_t*)&v, K_LONGINT_SIZE) < K_LONGINT_SIZE) {
       throw IOException("Read failed.");
@@ -124,6 +130,8 @@ namespace type {
   
 
   void KLongint::deserialize(PPtr<ObjectToken> headToken) {
+    checkMutable();
+    
     headToken->validateClass("KLongint");
     
     Ptr<Token> token = headToken->next();
@@ -100,11 +100,15 @@ namespace type {
    */
   
   void KOctet::set(const k_octet_t v) {
+    checkMutable();
+    
     _value = v;
   }
   
 
   void KOctet::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(KType::OCTET)) {
       throw KTypeMismatchException(getType(), other->getType());
     }
@@ -124,6 +128,8 @@ namespace type {
   
   
   void KOctet::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     k_integer_t v = input->read();
     if(v < 0) {
       throw IOException("Not enough bytes to read");
@@ -138,6 +144,8 @@ namespace type {
   
   
   void KOctet::deserialize(PPtr<ObjectToken> headToken) {
+    checkMutable();
+    
     headToken->validateClass("KOctet");
     
     Ptr<Token> token = headToken->next();
@@ -80,6 +80,8 @@ namespace type {
    */
   
   void KRaw::set(const k_octet_t* data, const k_longint_t size) {
+    checkMutable();
+    
     reallocateBuffer(size);
     memcpy(getBuffer() + K_RAW_HEADER_SIZE, data, size);
   }
@@ -168,6 +170,8 @@ namespace type {
    */
   
   void KRaw::readDataFromFile(PPtr<Path> path) {
+    checkMutable();
+    
     ifstream ifs(path->getString().c_str(), ios_base::in | ios_base::binary);
     ifs.seekg(0, ios_base::end);
     
@@ -189,6 +193,8 @@ namespace type {
 
   
   void KRaw::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     Ptr<KLongint> size = new KLongint();
     size->readFromBinaryStream(input);
     k_longint_t nOctets = size->get();
@@ -81,6 +81,8 @@ namespace type {
    */
 
   void KReal::set(const k_real_t v) {
+    checkMutable();
+    
     _value = v;
   }
   
@@ -117,6 +119,8 @@ namespace type {
   
   
   void KReal::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(KType::REAL)) {
       throw KTypeMismatchException(getType(), other->getType());
     }
@@ -137,6 +141,8 @@ namespace type {
   
   
   void KReal::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     k_real_t v;
     if(input->read((kf_octet_t*)&v, K_REAL_SIZE) < K_REAL_SIZE) {
       throw IOException("Not enough data to read.");
@@ -152,6 +158,8 @@ namespace type {
   
   
   void KReal::deserialize(PPtr<ObjectToken> headToken) {
+    checkMutable();
+    
     headToken->validateClass("KReal");
     
     Ptr<Token> token = headToken->next();
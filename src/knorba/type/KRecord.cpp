@@ -82,6 +82,7 @@ namespace type {
   
   
   void KTruthField::set(const k_truth_t v) {
+    _owner->checkMutable();
     *((k_truth_t*)(_owner->getBaseAddress() + _offset)) = v;
   }
   
@@ -129,6 +130,7 @@ namespace type {
   
   
   void KIntegerField::set(const k_integer_t v) {
+    _owner->checkMutable();
     *((k_integer_t*)(_owner->getBaseAddress() + _offset)) = v;
   }
   
@@ -170,6 +172,7 @@ namespace type {
   
   
   void KOctetField::set(const k_octet_t v) {
+    _owner->checkMutable();
     *(_owner->getBaseAddress() + _offset) = v;
   }
   
@@ -217,6 +220,7 @@ namespace type {
   
   
   void KLongintField::set(const k_longint_t v) {
+    _owner->checkMutable();
     *((k_longint_t*)(_owner->getBaseAddress() + _offset)) = v;
   }
   
@@ -263,6 +267,7 @@ namespace type {
   
   
   void KRealField::set(const k_real_t v) {
+    _owner->checkMutable();
     *(k_real_t*)(_owner->getBaseAddress() + _offset) = v;
   }
   
@@ -309,6 +314,7 @@ namespace type {
   
   
   void KGlobalUidField::set(const k_guid_t &v) {
+    _owner->checkMutable();
     *((k_guid_t*)(_owner->getBaseAddress() + _offset)) = v;
   }
   
@@ -364,6 +370,7 @@ namespace type {
   
   
   void KEnumerationField::set(const k_octet_t ordinal) {
+    _owner->checkMutable();
     *(_owner->getBaseAddress() + _offset) = ordinal;
   }
   
@@ -461,13 +468,20 @@ namespace type {
   
 // --- METHODS --- //
   
-  bool KRecord::isInitialized() {
-    return *(k_octet_t*)KRECORD_DATA == 1;
-  }
-  
-  
-  void KRecord::setInitialized() {
-    *(k_octet_t*)KRECORD_DATA = 1;
+  /**
+   * Checks if the slot of the dynamic field at the given index already holds
+   * a value. Memory of records with dynamic fields is zeroed on allocation,
+   * and a slot that holds a value is never all zeros.
+   */
+
+  bool KRecord::isInitialized(k_octet_t index) {
+    const k_octet_t* slot = KRECORD_DATA + _offsetTable[index];
+    for(int i = sizeof(Ptr<KValue>) - 1; i >= 0; i--) {
+      if(slot[i] != 0) {
+        return true;
+      }
+    }
+    return false;
   }
   
   
@@ -509,8 +523,6 @@ namespace type {
     for(int i = _nFields - 1; i >= 0; i--) {
       makeDynamicField(i);
     }
-    
-    setInitialized();
   }
   
   
@@ -561,7 +573,7 @@ namespace type {
 
     if(t->equals(KType::RAW)) { // ........................................ raw
       
-      if(isInitialized()) {
+      if(isInitialized(i)) {
         memcpy((void*)&_fields[i], KRECORD_DATA + _offsetTable[i],
             sizeof(Ptr<KRaw>));
         
@@ -575,7 +587,7 @@ namespace type {
       
     } else if(t->equals(KType::STRING)) { // ........................... string
       
-      if(isInitialized()) {
+      if(isInitialized(i)) {
         memcpy((void*)&_fields[i], KRECORD_DATA + _offsetTable[i],
             sizeof(Ptr<KString>));
         
@@ -593,7 +605,7 @@ namespace type {
       
     } else if(t->equals(KType::ANY)) { // ................................. any
       
-      if(isInitialized()) {
+      if(isInitialized(i)) {
         memcpy((void*)&_fields[i], KRECORD_DATA + _offsetTable[i],
             sizeof(Ptr<KAny>));
         
@@ -611,7 +623,7 @@ namespace type {
       
     } else if(t.ISA(KGridType)) { // ..................................... grid
       
-      if(isInitialized()) {
+      if(isInitialized(i)) {
         memcpy((void*)&_fields[i], KRECORD_DATA + _offsetTable[i],
             sizeof(Ptr<KGrid>));
         
@@ -672,6 +684,7 @@ namespace type {
   }\
   /** Sets the field at the given index with the value stored in the given wrapper object. */\
   void KRecord::set ## X(const k_octet_t index, PPtr<K ## X> value) {\
+    checkMutable();\
     if(index > _nFields) {\
       throw IndexOutOfBoundException("Expected a number between 0 and " \
           + Int::toString(_nFields) + ". Given: " + Int::toString(index));\
@@ -683,6 +696,7 @@ namespace type {
   }\
   /** Sets the field with the given name with the value stored in the given wrapper object. */\
   void KRecord::set ## X(const string& name, PPtr<K ## X> value) {\
+    checkMutable();\
     k_octet_t index = _type->getIndexForFieldWithName(name);\
     if(index < 0) {\
       throw KFException("Field \"" + name + "\" does not exist.");\
@@ -692,6 +706,7 @@ namespace type {
   }\
   /** Sets the first field with the value stored in the given wrapper object. */\
   void KRecord::set ## X(PPtr<K ## X> value) {\
+    checkMutable();\
     _fields[0] = value.AS(KValue);\
     memcpy(KRECORD_DATA + _offsetTable[0], (void*)&_fields[0], sizeof(Ptr<KValue>));\
   }
@@ -718,6 +733,7 @@ namespace type {
   }\
   /** Sets the field at the given index with the given value. */\
   void KRecord::set ## X(const k_octet_t index, const Y value) {\
+    checkMutable();\
     if(index > _nFields) {\
       throw IndexOutOfBoundException("Expected a number between 0 and " \
         + Int::toString(_nFields) + ". Given: " + Int::toString(index));\
@@ -746,6 +762,8 @@ namespace type {
    */
 
   void KRecord::setEnumeration(const k_octet_t index, const k_octet_t ordinal) {
+    checkMutable();
+    
     if(index > _nFields) {
       throw IndexOutOfBoundException("Expected a number between 0 and "
           + Int::toString(_nFields) + ". Given: " + Int::toString(index));
@@ -763,6 +781,8 @@ namespace type {
    */
   
   void KRecord::setEnumeration(const k_octet_t index, const string& label) {
+    checkMutable();
+    
     if(index > _nFields) {
       throw IndexOutOfBoundException("Expected a number between 0 and "
           + Int::toString(_nFields) + ". Given: " + Int::toString(index));
@@ -892,6 +912,28 @@ namespace type {
     }
   }
 
+  
+  /**
+   * Freezes the values of fields of variable size, including those of inner
+   * records. Values of fixed size are stored in the memory of this record
+   * and need no freezing of their own.
+   */
+  
+  void KRecord::freezeDynamicFields() {
+    if(!_type->hasDynamicFields()) {
+      return;
+    }
+    
+    for(int i = _type->getNumberOfFields() - 1; i >= 0; i--) {
+      PPtr<KType> t = _type->getTypeOfFieldAtIndex(i);
+      if(!t->hasConstantSize()) {
+        _fields[i]->freeze();
+      } else if(t.ISA(KRecordType)) {
+        _fields[i].AS(KRecord)->freezeDynamicFields();
+      }
+    }
+  }
+
 
   /**
    * If this record has a field of `any` type, this method should be called
@@ -921,6 +963,8 @@ namespace type {
   
   
   void KRecord::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(_type.AS(KType))) {
       throw KTypeMismatchException(_type.AS(KType), other->getType());
     }
@@ -932,6 +976,23 @@ namespace type {
   }
   
   
+  void KRecord::freeze() {
+    KValue::freeze();
+    freezeDynamicFields();
+  }
+  
+  
+  /**
+   * A record that wraps around memory owned by another record or grid is
+   * frozen if its owner is.
+   */
+  
+  bool KRecord::isFrozen() const {
+    return KValue::isFrozen()
+        || (IS_NULL(_data) && !_owner.isNull() && _owner->isFrozen());
+  }
+  
+  
   PPtr<KType> KRecord::getType() const {
     return _type.AS(KType);
   }
@@ -954,6 +1015,8 @@ namespace type {
   
   
   void KRecord::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     int n = _type->getNumberOfFields();
     for(int i = 0; i < n; i++) {
       _fields[i]->readFromBinaryStream(input);
@@ -978,6 +1041,7 @@ namespace type {
 
 
   void KRecord::deserialize(PPtr<ObjectToken> head) {
+    checkMutable();
     head->checkClass("KRecord");
     
     Ptr<Token> token = head->next();
@@ -156,8 +156,7 @@ namespace type {
     
   // --- METHODS --- //
     
-    private: bool isInitialized();
-    private: void setInitialized();
+    private: bool isInitialized(k_octet_t index);
     private: void bindToRecord(PPtr<KRecord> record, const k_octet_t fieldIndex);
     private: void makeFields();
     private: void makeDynamicFields();
@@ -200,6 +199,7 @@ namespace type {
     public: void wrap(PPtr<KDynamicValue> target, k_longint_t offset);
     public: void initDynamicFields();
     public: void cleanupDynamicFields();
+    public: void freezeDynamicFields();
     public: void setRuntime(Runtime& rt);
     
     // Inline Members //
@@ -216,6 +216,8 @@ namespace type {
     public: k_octet_t* getBaseAddress() const;
     
     // Inherited from KDynamicValue::KValue
+    public: void freeze();
+    public: bool isFrozen() const;
     public: void set(PPtr<KValue> other);
     public: PPtr<KType> getType() const;
     public: k_longint_t getTotalSizeInOctets() const;
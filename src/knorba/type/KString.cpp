@@ -176,6 +176,8 @@ namespace type {
    */
   
   void KString::set(const string& str) {
+    checkMutable();
+    
     k_longint_t nOctets = 0;
     k_longint_t nCodePoints = str.length();
     
@@ -202,6 +204,8 @@ namespace type {
    */
   
   void KString::set(const wstring& str) {
+    checkMutable();
+    
     k_longint_t nOctets = 0;
     k_longint_t nCodePoints = str.length();
     
@@ -374,6 +378,8 @@ namespace type {
 
 
   void KString::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(KType::STRING)) {
       throw KTypeMismatchException(getType(), other->getType());
     }
@@ -396,6 +402,8 @@ namespace type {
   
 
   void KString::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     Ptr<KLongint> value = new KLongint();
     value->readFromBinaryStream(input);
     k_longint_t nOctets = value->get();
@@ -418,6 +426,8 @@ namespace type {
   
   
   void KString::deserialize(PPtr<ObjectToken> headToken) {
+    checkMutable();
+    
     headToken->validateClass("KString");
     
     Ptr<Token> token = headToken->next();
@@ -134,6 +134,8 @@ namespace type {
    */
 
   void KTruth::set(const k_truth_t v) {
+    checkMutable();
+    
     _value = v;
   }
 
@@ -148,6 +150,8 @@ namespace type {
 
 
   void KTruth::set(PPtr<KValue> other) {
+    checkMutable();
+    
     if(!other->getType()->equals(KType::TRUTH)) {
       throw KFException("Incompatible types. Expected: " + getType()->toString()
                         + ". Provided: " + other->getType()->toString());
@@ -167,6 +171,8 @@ namespace type {
   
   
   void KTruth::readFromBinaryStream(PPtr<InputStream> input) {
+    checkMutable();
+    
     int v = input->read();
     if(v == -1) {
       throw IOException("Read failed");
@@ -181,6 +187,8 @@ namespace type {
   
   
   void KTruth::deserialize(PPtr<ObjectToken> headToken) {
+    checkMutable();
+    
     headToken->validateClass("KTruth");
     
     Ptr<Token> token = headToken->next();
@@ -113,5 +113,59 @@ namespace type {
   const SPtr<KValue> KValue::NOTHING(new KNothing());
   
   
+// --- (DE)CONSTRUCTORS --- //
+  
+  KValue::KValue() {
+    _isFrozen = false;
+  }
+  
+  
+// --- METHODS --- //
+  
+  /**
+   * Throws KFException if this value is frozen. Called by every method that
+   * changes the stored value.
+   */
+  
+  void KValue::checkMutable() const {
+    if(isFrozen()) {
+      throw KFException("Attempt to change a frozen value of type "
+          + getType()->getTypeName() + ".");
+    }
+  }
+  
+  
+  /**
+   * Makes this value immutable. There is no way back; use copy() to obtain
+   * a value that can be changed. Subclasses that contain other values
+   * override this method to freeze those too.
+   */
+  
+  void KValue::freeze() {
+    __atomic_store_n(&_isFrozen, true, __ATOMIC_RELEASE);
+  }
+  
+  
+  /**
+   * Checks if this value is frozen.
+   */
+  
+  bool KValue::isFrozen() const {
+    return __atomic_load_n(&_isFrozen, __ATOMIC_ACQUIRE);
+  }
+  
+  
+  /**
+   * Returns a new, mutable value of the same type, holding a copy of this
+   * one.
+   */
+  
+  Ptr<KValue> KValue::copy() {
+    Ptr<KValue> value = getType()->instantiate();
+    value->set(getPtr().AS(KValue));
+    return value;
+  }
+  
+  
 } // namespace type
 } // namespace knorba
\ No newline at end of file
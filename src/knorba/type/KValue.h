@@ -44,6 +44,14 @@ namespace type {
    * Wrapper classes are responsible for storing, managing, serializing,
    * and deseralizaing KnoRBA binary data format.
    *
+   * A value can be frozen with freeze(), after which it can no longer be
+   * changed; every method that would change it throws KFException instead.
+   * Freezing a record, grid or `any` value freezes the values it contains as
+   * well. Frozen values are how a runtime shares one payload between all
+   * local receivers of a multicast message without copying it. A receiver
+   * that needs to change such a payload should work on a copy(); that is
+   * the only copy ever made.
+   *
    * @headerfile KValue.h <knorba/type/KValue.h>
    */
 
@@ -56,6 +64,24 @@ namespace type {
     /** Wrapper for KnoRBA `nothing` literal */
     public: static const SPtr<KValue> NOTHING;
     
+    
+  // --- FIELDS --- //
+    
+    private: volatile bool _isFrozen;
+    
+    
+  // --- (DE)CONSTRUCTORS --- //
+    
+    public: KValue();
+    
+    
+  // --- METHODS --- //
+    
+    public: void checkMutable() const;
+    public: virtual void freeze();
+    public: virtual bool isFrozen() const;
+    public: Ptr<KValue> copy();
+    
   
   // --- PURE VIRTUAL METHODS --- //
 